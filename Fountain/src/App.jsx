@@ -36,7 +36,12 @@ const darkTheme = createTheme({
 
 const loadHomiesFromLocalStorage = () => {
   const storedHomies = localStorage.getItem('homies');
-  return storedHomies ? JSON.parse(storedHomies) : [];
+  const homies = storedHomies ? JSON.parse(storedHomies) : [];
+  // Served by a HydroHomie (npm run build:device): that one is same-origin and always listed
+  if (import.meta.env.VITE_SERVED_BY_HOMIE && !homies.includes(window.location.host)) {
+    homies.unshift(window.location.host);
+  }
+  return homies;
 }
 
 function App() {
@@ -0,0 +1,333 @@
+#ifndef FLEET_DEVICE_H
+#define FLEET_DEVICE_H
+
+#include <Arduino.h>
+#include <chrono>
+#include <random>
+#include "HomieManager.h"
+#include "historystream.h"
+#include "responsecache.h"
+#include "homiemetrics.h"
+#include "statusjson.h"
+#include "httpserver.h"
+
+#define DEVICE_MAX_ROUTES 12
+
+// Makes a device's pins and NVS the ones the firmware code sees. Being the first
+// base of VirtualDevice it is set before the firmware members are constructed.
+struct DeviceContext {
+    native::Device board;
+
+    DeviceContext() {
+        native::device = &board;
+    }
+
+    void select() {
+        native::device = &board;
+    }
+};
+
+// One simulated HydroHomie: the firmware's HomieConfig, SensorManager and
+// HomieManager on its own pins and NVS, behind the same routes as HomieServer
+// (except /events and /heap). A small model of the tank and the plants drives
+// the sensor inputs, and the pump relays drive the model.
+class VirtualDevice : private DeviceContext {
+public:
+    VirtualDevice(const char* name, uint32_t seed, int wateringInterval, int wateringDuration)
+    : sensorManager(true), homieManager(sensorManager, config), random(seed) {
+        config.begin();
+        config.beginUpdate();
+        config.setName(name);
+        if (wateringInterval > 0) config.setWateringInterval(wateringInterval);
+        if (wateringDuration > 0) config.setWateringDuration(wateringDuration);
+        config.commit();
+        config.end();
+
+        bootId = random();
+        tank = std::uniform_real_distribution<double>(500, LEVEL_FULL)(random);
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            plants[p] = std::uniform_real_distribution<double>(200, 800)(random);
+            dryingPerSecond[p] = std::uniform_real_distribution<double>(0.05, 0.3)(random);
+        }
+        routeCount = 0;
+        for (const char* route : {"OPTIONS /config", "GET /config", "POST /config", "PATCH /config", "GET /status",
+                                  "GET /history", "GET /stats", "GET /tasks", "GET /schedule", "GET /metrics",
+                                  "POST /water", "POST /stop"}) {
+            const char* space = strchr(route, ' ');
+            RouteMetrics& metrics = routes[routeCount++];
+            metrics.method = strndup(route, space - route);
+            metrics.path = space + 1;
+        }
+    }
+
+    // One loop() iteration: move the model on by elapsedMillis, then run the firmware
+    void step(unsigned long elapsedMillis) {
+        select();
+        auto start = std::chrono::steady_clock::now();
+        simulate(elapsedMillis / 1000.0);
+        homieManager.handle();
+        loopLatency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - start).count());
+    }
+
+    void handle(const HttpRequest& request, HttpResponse& response) {
+        select();
+        auto start = std::chrono::steady_clock::now();
+        RouteMetrics* metrics = nullptr;
+        for (size_t i = 0; i < routeCount; i++) {
+            if (request.path == routes[i].path && request.method == routes[i].method) {
+                metrics = &routes[i];
+            }
+        }
+        if (!metrics) {
+            reply(response, 404, "application/json", "{\"error\":\"Not found\"}");
+            return;
+        }
+        dispatch(request, response);
+        metrics->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start).count(),
+                        response.body.size());
+    }
+
+private:
+    HomieConfig config;
+    SensorManager sensorManager;
+    HomieManager homieManager;
+    std::mt19937 random;
+    uint32_t bootId = 0;
+    LatencyHistogram loopLatency;
+    RouteMetrics routes[DEVICE_MAX_ROUTES];
+    size_t routeCount = 0;
+
+    // Model levels, 0..LEVEL_FULL
+    double tank = LEVEL_FULL;
+    double plants[SensorManager::PLANTS];
+    double dryingPerSecond[SensorManager::PLANTS];
+    double tankEmptySeconds = 0;
+
+    static constexpr double PUMP_TANK_PER_SECOND = 2.0;  // Tank level a running pump takes
+    static constexpr double PUMP_PLANT_PER_SECOND = 8.0; // Plant level it adds
+    static constexpr double REFILL_AFTER_SECONDS = 600;  // Someone refills an empty tank
+
+    void simulate(double seconds) {
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            const int pumpPin = Board::plants[p].pumpPin;
+            bool pumping = pumpPin >= 0 && digitalRead(pumpPin) == HIGH && tank > 0;
+            if (pumping) {
+                tank -= PUMP_TANK_PER_SECOND * seconds;
+                plants[p] += PUMP_PLANT_PER_SECOND * seconds;
+            }
+            plants[p] -= dryingPerSecond[p] * seconds;
+            plants[p] = std::min(std::max(plants[p], 0.0), static_cast<double>(LEVEL_FULL));
+            setLevel(SensorManager::channel(p + 1), plants[p]);
+        }
+        tank = std::max(tank, 0.0);
+        tankEmptySeconds = tank < 100 ? tankEmptySeconds + seconds : 0;
+        if (tankEmptySeconds > REFILL_AFTER_SECONDS) {
+            tank = LEVEL_FULL;
+        }
+        setLevel(SensorManager::channel(0), tank);
+    }
+
+    // Inverse of the channel calibration plus a few counts of noise
+    void setLevel(const SensorChannel& channel, double level) {
+        int raw = channel.rawEmpty + static_cast<int>(level * (channel.rawFull - channel.rawEmpty) / LEVEL_FULL);
+        native::device->analogValues[channel.sensorPin] = raw + std::uniform_int_distribution<int>(-3, 3)(random);
+    }
+
+    static void reply(HttpResponse& response, int code, const char* contentType, const char* body) {
+        response.code = code;
+        response.contentType = contentType ? contentType : "";
+        response.body = body ? body : "";
+    }
+
+    bool notModified(const HttpRequest& request, HttpResponse& response, const char* etag) {
+        response.etag = etag;
+        if (request.ifNoneMatch == etag) {
+            response.code = 304;
+            return true;
+        }
+        return false;
+    }
+
+    // The handlers of HomieServer, on the shared document writers
+    void dispatch(const HttpRequest& request, HttpResponse& response) {
+        if (request.method == "OPTIONS") {
+            reply(response, 204, nullptr, nullptr);
+        } else if (request.path == "/config" && request.method == "GET") {
+            char body[CONFIG_CACHE_SIZE];
+            size_t length = config.writeConfigJson(body, sizeof(body));
+            response.contentType = "application/json";
+            response.body.assign(body, length < sizeof(body) ? length : 0);
+        } else if (request.path == "/config") {
+            updateConfig(request, response);
+        } else if (request.path == "/status") {
+            getStatus(request, response);
+        } else if (request.path == "/history") {
+            getHistory(request, response);
+        } else if (request.path == "/stats") {
+            getStats(request, response);
+        } else if (request.path == "/tasks") {
+            DynamicJsonDocument doc(1024);
+            fillTasksJson(doc.to<JsonArray>(), homieManager);
+            response.contentType = "application/json";
+            serializeJson(doc, response.body);
+        } else if (request.path == "/schedule") {
+            const ScheduleSnapshot schedule = homieManager.getScheduleSnapshot();
+            DynamicJsonDocument doc(256 + schedule.count * 256);
+            fillScheduleJson(doc, schedule, WallClock::now());
+            response.contentType = "application/json";
+            serializeJson(doc, response.body);
+        } else if (request.path == "/metrics") {
+            StringPrint out(response.body);
+            response.contentType = "text/plain; version=0.0.4";
+            writeHomieMetrics(out, homieManager, &loopLatency, routes, routeCount);
+        } else if (request.path == "/water") {
+            homieManager.forceStartWatering();
+            reply(response, 200, "application/json", "{\"message\":\"Watering started\"}");
+        } else if (request.path == "/stop") {
+            homieManager.forceStopWatering();
+            reply(response, 200, "application/json", "{\"message\":\"Watering started\"}");
+        }
+    }
+
+    void updateConfig(const HttpRequest& request, HttpResponse& response) {
+        if (request.body.empty()) {
+            reply(response, 400, "application/json", "{\"error\":\"No JSON payload\"}");
+            return;
+        }
+        char error[96];
+        switch (config.applyJson(request.body.c_str(), request.body.size(), error, sizeof(error))) {
+            case CONFIG_UPDATED:
+                reply(response, 200, "application/json", "{\"message\":\"Configuration updated successfully\"}");
+                break;
+            case CONFIG_UNCHANGED:
+                reply(response, 200, "application/json", "{\"message\":\"Configuration unchanged\"}");
+                break;
+            case CONFIG_WRITE_FAILED:
+                reply(response, 500, "application/json", "{\"error\":\"Failed to update configuration\"}");
+                break;
+            default: {
+                char message[128];
+                snprintf(message, sizeof(message), "{\"error\":\"%s\"}", error);
+                reply(response, 400, "application/json", message);
+            }
+        }
+    }
+
+    void getStatus(const HttpRequest& request, HttpResponse& response) {
+        const SensorSnapshot sensors = sensorManager.getSnapshot();
+        const WateringSnapshot watering = homieManager.getWateringSnapshot();
+        char etag[40];
+        snprintf(etag, sizeof(etag), "\"%08x-%x-%x\"", (unsigned)bootId, (unsigned)sensors.version, (unsigned)watering.version);
+        if (notModified(request, response, etag)) {
+            return;
+        }
+        DynamicJsonDocument doc(256);
+        fillStatusJson(doc, sensors, watering);
+        if (request.accept.find("application/msgpack") != std::string::npos) {
+            char packed[STATUS_CACHE_SIZE];
+            response.contentType = "application/msgpack";
+            response.body.assign(packed, serializeMsgPack(doc, packed, sizeof(packed)));
+            return;
+        }
+        response.contentType = "application/json";
+        serializeJson(doc, response.body);
+    }
+
+    // ?plant=n, plant 0 by default; false past the board's plants
+    static bool requestedPlant(const HttpRequest& request, size_t& plant) {
+        plant = 0;
+        if (request.hasParam("plant")) {
+            char* end;
+            const char* value = request.param("plant");
+            plant = strtoul(value, &end, 10);
+            return end != value && *end == '\0' && plant < SensorManager::PLANTS;
+        }
+        return true;
+    }
+
+    void getStats(const HttpRequest& request, HttpResponse& response) {
+        size_t plant;
+        if (!requestedPlant(request, plant)) {
+            reply(response, 400, "application/json", "{\"error\":\"Unknown plant\"}");
+            return;
+        }
+        const RollingStats& stats = sensorManager.getStats(plant);
+        char etag[40];
+        snprintf(etag, sizeof(etag), "\"%08x-%u-%x-%x\"", (unsigned)bootId, (unsigned)plant,
+                 (unsigned)stats.getVersion(), (unsigned)config.getVersion());
+        if (notModified(request, response, etag)) {
+            return;
+        }
+        DynamicJsonDocument doc(1536);
+        fillStatsJson(doc, plant, stats, sensorManager.getTankStats(), config.getPlantTargetLevel(), WallClock::now());
+        response.contentType = "application/json";
+        serializeJson(doc, response.body);
+    }
+
+    void getHistory(const HttpRequest& request, HttpResponse& response) {
+        size_t plant;
+        if (!requestedPlant(request, plant)) {
+            reply(response, 400, "application/json", "{\"error\":\"Unknown plant\"}");
+            return;
+        }
+        const SensorHistory& history = sensorManager.getHistory(plant);
+        const HistoryTiers& tiers = sensorManager.getTiers(plant);
+        StringPrint out(response.body);
+        response.contentType = "application/json";
+
+        if (request.hasParam("resolution")) {
+            const std::string resolution = request.param("resolution");
+            size_t limit = request.hasParam("limit") ? strtoul(request.param("limit"), nullptr, 10) : SIZE_MAX;
+            uint32_t firstSeq, version;
+            history.range(firstSeq, version);
+            if (resolution == "15m") version = tiers.quarterHour.getWriteCount();
+            else if (resolution == "1h") version = tiers.hourly.getWriteCount();
+            else if (resolution != "1m") {
+                reply(response, 400, "application/json", "{\"error\":\"Unknown resolution\"}");
+                return;
+            }
+            char etag[48];
+            snprintf(etag, sizeof(etag), "\"%08x-%u-%s-%x\"", (unsigned)bootId, (unsigned)plant, resolution.c_str(), (unsigned)version);
+            if (notModified(request, response, etag)) {
+                return;
+            }
+            if (resolution == "1m") writeRollupJson(out, "1m", history, limit);
+            else if (resolution == "15m") writeRollupJson(out, "15m", tiers.quarterHour, limit);
+            else writeRollupJson(out, "1h", tiers.hourly, limit);
+            return;
+        }
+
+        const bool binary = request.accept.find("application/octet-stream") != std::string::npos;
+        const bool incremental = request.hasParam("since") || request.hasParam("limit");
+        uint32_t firstSeq, nextSeq;
+        history.range(firstSeq, nextSeq);
+        uint32_t since = firstSeq;
+        if (request.hasParam("since")) {
+            since = strtoul(request.param("since"), nullptr, 10);
+            if (since > nextSeq) {
+                since = firstSeq;
+            }
+        }
+        size_t limit = history.capacity();
+        if (request.hasParam("limit")) {
+            limit = strtoul(request.param("limit"), nullptr, 10);
+        }
+        char etag[40];
+        snprintf(etag, sizeof(etag), "\"%08x-%u-%x%s\"", (unsigned)bootId, (unsigned)plant, (unsigned)nextSeq, binary ? "b" : "j");
+        if (notModified(request, response, etag)) {
+            return;
+        }
+        if (binary) {
+            response.contentType = "application/octet-stream";
+            writeHistoryBinary(out, history, since, limit);
+        } else if (!incremental) {
+            writeHistoryJson(out, history);
+        } else {
+            writeHistoryJson(out, history, since, limit);
+        }
+    }
+};
+
+#endif // FLEET_DEVICE_H
@@ -0,0 +1,178 @@
+// Fleet simulator and HTTP load generator for testing Fountain and the device
+// routes at fleet scale. Replaces sim.py/launch_dummies.py: one process, one
+// thread, any number of devices running the firmware's own sensor, watering
+// and config code.
+//
+//   fleet serve --devices 200 --port 8080 [--speed 60] [--interval S] [--duration S]
+//   fleet load  --host H --port 8080 --devices 200 --connections 64 --seconds 30
+//               [--routes /status,/history?since=0] [--out load.json]
+//   fleet bench [serve and load options]   both in one process, load on a second thread
+
+#include <Arduino.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include "device.h"
+#include "httpserver.h"
+#include "loadgen.h"
+
+struct FleetOptions {
+    size_t devices = 10;
+    uint16_t port = 8080;
+    double speed = 1;           // Virtual seconds per real second
+    int wateringInterval = 0;   // Seconds, 0 keeps the firmware default
+    int wateringDuration = 0;
+    uint32_t seed = 1;
+    LoadOptions load;
+    const char* out = nullptr;  // JSON report of the load run
+};
+
+static std::atomic<bool> running(true);
+
+static void stop(int) {
+    running = false;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: fleet serve|load|bench [--devices N] [--port P] [--speed X] [--interval S] [--duration S]\n"
+            "                              [--seed N] [--host H] [--connections N] [--seconds S]\n"
+            "                              [--routes a,b,c] [--unconditional] [--out FILE]\n");
+}
+
+static bool parseOptions(int argc, char** argv, FleetOptions& options) {
+    for (int i = 2; i < argc; i++) {
+        std::string flag = argv[i];
+        if (flag == "--unconditional") {
+            options.load.conditional = false;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (flag == "--devices") options.devices = strtoul(value, nullptr, 10);
+        else if (flag == "--port") options.port = strtoul(value, nullptr, 10);
+        else if (flag == "--speed") options.speed = atof(value);
+        else if (flag == "--interval") options.wateringInterval = atoi(value);
+        else if (flag == "--duration") options.wateringDuration = atoi(value);
+        else if (flag == "--seed") options.seed = strtoul(value, nullptr, 10);
+        else if (flag == "--host") options.load.host = value;
+        else if (flag == "--connections") options.load.connections = strtoul(value, nullptr, 10);
+        else if (flag == "--seconds") options.load.durationSeconds = atof(value);
+        else if (flag == "--out") options.out = value;
+        else if (flag == "--routes") {
+            options.load.routes.clear();
+            std::stringstream routes(value);
+            std::string route;
+            while (std::getline(routes, route, ',')) {
+                options.load.routes.push_back(route);
+            }
+        } else {
+            return false;
+        }
+    }
+    options.load.port = options.port;
+    options.load.devices = options.devices;
+    return options.devices > 0 && !options.load.routes.empty() && options.load.connections > 0;
+}
+
+// Every device and every connection is a descriptor
+static void raiseFileLimit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static int serve(const FleetOptions& options) {
+    std::vector<std::unique_ptr<VirtualDevice>> devices;
+    HttpServer server;
+    for (size_t i = 0; i < options.devices; i++) {
+        char name[CONFIG_NAME_LENGTH];
+        snprintf(name, sizeof(name), "HydroHomie-%u", static_cast<unsigned>(options.port + i));
+        devices.emplace_back(new VirtualDevice(name, options.seed + i, options.wateringInterval, options.wateringDuration));
+        VirtualDevice* device = devices.back().get();
+        if (!server.listen(options.port + i, [device](const HttpRequest& request, HttpResponse& response) {
+                device->handle(request, response);
+            })) {
+            fprintf(stderr, "fleet: can't listen on port %u\n", static_cast<unsigned>(options.port + i));
+            return 1;
+        }
+    }
+    fprintf(stderr, "fleet: %zu devices on ports %u-%u\n", options.devices, static_cast<unsigned>(options.port),
+            static_cast<unsigned>(options.port + options.devices - 1));
+
+    // The devices share one virtual clock, starting at the real time; between
+    // polls every device runs one loop()
+    native::clock.epoch = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    const auto start = std::chrono::steady_clock::now();
+    while (running) {
+        server.poll(1);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t now = static_cast<uint64_t>(elapsed * options.speed * 1000000);
+        unsigned long stepMillis = (now - native::clock.micros) / 1000;
+        native::clock.micros = now;
+        for (auto& device : devices) {
+            device->step(stepMillis);
+        }
+    }
+    return 0;
+}
+
+static int load(const FleetOptions& options) {
+    LoadGenerator generator(options.load);
+    if (!generator.run()) {
+        fprintf(stderr, "fleet: can't resolve %s\n", options.load.host.c_str());
+        return 1;
+    }
+    generator.printReport(stdout);
+    if (options.out) {
+        FILE* out = fopen(options.out, "w");
+        if (!out) {
+            fprintf(stderr, "fleet: can't write %s\n", options.out);
+            return 1;
+        }
+        generator.writeJson(out);
+        fclose(out);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    FleetOptions options;
+    if (argc < 2 || !parseOptions(argc, argv, options)) {
+        usage();
+        return 2;
+    }
+    raiseFileLimit();
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string mode = argv[1];
+    if (mode == "serve") {
+        return serve(options);
+    }
+    if (mode == "load") {
+        return load(options);
+    }
+    if (mode == "bench") {
+        int result = 0;
+        std::thread generator([&options, &result] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200)); // Let the ports open
+            result = load(options);
+            running = false;
+        });
+        int served = serve(options);
+        running = false;
+        generator.join();
+        return served ? served : result;
+    }
+    usage();
+    return 2;
+}
@@ -0,0 +1,325 @@
+#ifndef FLEET_HTTPSERVER_H
+#define FLEET_HTTPSERVER_H
+
+#include <Arduino.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#define HTTP_MAX_REQUEST 16384 // Headers plus body; larger requests get the connection closed
+
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> params;
+    std::string accept;
+    std::string ifNoneMatch;
+    std::string body;
+    bool keepAlive = true;
+
+    bool hasParam(const char* name) const {
+        return params.count(name) > 0;
+    }
+
+    const char* param(const char* name) const {
+        auto found = params.find(name);
+        return found == params.end() ? "" : found->second.c_str();
+    }
+};
+
+struct HttpResponse {
+    int code = 200;
+    std::string contentType;
+    std::string etag;
+    std::string body;
+};
+
+// Print that appends to a response body, for the firmware's stream writers
+class StringPrint : public Print {
+public:
+    explicit StringPrint(std::string& out) : out(out) {}
+
+    size_t write(uint8_t c) override {
+        out.push_back(static_cast<char>(c));
+        return 1;
+    }
+
+    size_t write(const uint8_t* data, size_t length) override {
+        out.append(reinterpret_cast<const char*>(data), length);
+        return length;
+    }
+
+private:
+    std::string& out;
+};
+
+// Single-threaded HTTP/1.1 server on epoll, any number of listening ports, each
+// with its own handler. Requests are handled to completion on the calling
+// thread, keep-alive and pipelining included; bodies need a Content-Length.
+class HttpServer {
+public:
+    typedef std::function<void(const HttpRequest& request, HttpResponse& response)> Handler;
+
+    HttpServer() : epoll(epoll_create1(0)) {}
+
+    ~HttpServer() {
+        for (auto& entry : sockets) {
+            close(entry.first);
+        }
+        close(epoll);
+    }
+
+    // Returns false if the port can't be bound
+    bool listen(uint16_t port, Handler handler) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            return false;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(fd, 128) < 0) {
+            close(fd);
+            return false;
+        }
+        std::unique_ptr<Socket> listener(new Socket());
+        listener->listening = true;
+        listener->handler = std::make_shared<Handler>(handler);
+        add(fd, std::move(listener), EPOLLIN);
+        return true;
+    }
+
+    // Waits up to timeoutMs for socket activity and serves whatever is ready
+    void poll(int timeoutMs) {
+        epoll_event events[64];
+        int count = epoll_wait(epoll, events, 64, timeoutMs);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            auto found = sockets.find(fd);
+            if (found == sockets.end()) {
+                continue;
+            }
+            Socket& socket = *found->second;
+            if (socket.listening) {
+                accept(socket);
+            } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                drop(fd);
+            } else {
+                serve(fd, socket, events[i].events);
+            }
+        }
+    }
+
+    uint64_t getRequests() const {
+        return requests;
+    }
+
+private:
+    struct Socket {
+        int fd = -1;
+        bool listening = false;
+        std::shared_ptr<Handler> handler;
+        std::string input;
+        std::string output;
+        size_t sent = 0;
+        bool closeAfterSend = false;
+    };
+
+    const int epoll;
+    std::map<int, std::unique_ptr<Socket>> sockets;
+    uint64_t requests = 0;
+
+    void add(int fd, std::unique_ptr<Socket> socket, uint32_t events) {
+        socket->fd = fd;
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+        sockets[fd] = std::move(socket);
+    }
+
+    void drop(int fd) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        sockets.erase(fd);
+    }
+
+    void accept(Socket& listener) {
+        for (;;) {
+            int fd = accept4(listener.fd, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0) {
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::unique_ptr<Socket> connection(new Socket());
+            connection->handler = listener.handler;
+            add(fd, std::move(connection), EPOLLIN);
+        }
+    }
+
+    void serve(int fd, Socket& socket, uint32_t events) {
+        if (events & EPOLLIN) {
+            char buffer[4096];
+            for (;;) {
+                ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+                if (length > 0) {
+                    socket.input.append(buffer, length);
+                    continue;
+                }
+                if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    drop(fd);
+                    return;
+                }
+                break;
+            }
+            HttpRequest request;
+            while (!socket.closeAfterSend && parse(socket.input, request)) {
+                HttpResponse response;
+                (*socket.handler)(request, response);
+                requests++;
+                appendResponse(socket.output, request, response);
+                socket.closeAfterSend = !request.keepAlive;
+                request = HttpRequest();
+            }
+            if (socket.input.size() > HTTP_MAX_REQUEST) {
+                drop(fd);
+                return;
+            }
+        }
+        flush(fd, socket);
+    }
+
+    void flush(int fd, Socket& socket) {
+        while (socket.sent < socket.output.size()) {
+            ssize_t length = send(fd, socket.output.data() + socket.sent, socket.output.size() - socket.sent, MSG_NOSIGNAL);
+            if (length < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                drop(fd);
+                return;
+            }
+            socket.sent += length;
+        }
+        bool pending = socket.sent < socket.output.size();
+        if (!pending) {
+            socket.output.clear();
+            socket.sent = 0;
+            if (socket.closeAfterSend) {
+                drop(fd);
+                return;
+            }
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN | (pending ? EPOLLOUT : 0);
+        event.data.fd = fd;
+        epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    // Takes one complete request off the front of input
+    static bool parse(std::string& input, HttpRequest& request) {
+        size_t headerEnd = input.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) {
+            return false;
+        }
+        size_t lineEnd = input.find("\r\n");
+        size_t methodEnd = input.find(' ');
+        size_t targetEnd = input.find(' ', methodEnd + 1);
+        if (methodEnd == std::string::npos || targetEnd == std::string::npos || targetEnd > lineEnd) {
+            input.clear();
+            return false;
+        }
+        request.method = input.substr(0, methodEnd);
+        std::string target = input.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+        request.keepAlive = input.compare(targetEnd + 1, 8, "HTTP/1.0") != 0;
+
+        size_t contentLength = 0;
+        for (size_t line = lineEnd + 2; line < headerEnd;) {
+            size_t next = input.find("\r\n", line);
+            size_t colon = input.find(':', line);
+            if (colon != std::string::npos && colon < next) {
+                std::string name = input.substr(line, colon - line);
+                size_t valueStart = input.find_first_not_of(' ', colon + 1);
+                std::string value = input.substr(valueStart, next - valueStart);
+                if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+                    contentLength = strtoul(value.c_str(), nullptr, 10);
+                } else if (strcasecmp(name.c_str(), "Accept") == 0) {
+                    request.accept = value;
+                } else if (strcasecmp(name.c_str(), "If-None-Match") == 0) {
+                    request.ifNoneMatch = value;
+                } else if (strcasecmp(name.c_str(), "Connection") == 0) {
+                    request.keepAlive = strcasecmp(value.c_str(), "close") != 0;
+                }
+            }
+            line = next + 2;
+        }
+        if (input.size() < headerEnd + 4 + contentLength) {
+            return false;
+        }
+        request.body = input.substr(headerEnd + 4, contentLength);
+        input.erase(0, headerEnd + 4 + contentLength);
+
+        size_t query = target.find('?');
+        request.path = target.substr(0, query);
+        while (query != std::string::npos) {
+            size_t next = target.find('&', query + 1);
+            std::string pair = target.substr(query + 1, next == std::string::npos ? std::string::npos : next - query - 1);
+            size_t equals = pair.find('=');
+            request.params[pair.substr(0, equals)] = equals == std::string::npos ? "" : pair.substr(equals + 1);
+            query = next;
+        }
+        return true;
+    }
+
+    static const char* reason(int code) {
+        switch (code) {
+            case 200: return "OK";
+            case 204: return "No Content";
+            case 304: return "Not Modified";
+            case 400: return "Bad Request";
+            case 404: return "Not Found";
+            case 500: return "Internal Server Error";
+            default: return "Unknown";
+        }
+    }
+
+    // Same default headers as HomieServer
+    static void appendResponse(std::string& output, const HttpRequest& request, const HttpResponse& response) {
+        char head[512];
+        int length = snprintf(head, sizeof(head),
+                              "HTTP/1.1 %d %s\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Access-Control-Allow-Origin: *\r\n"
+                              "Access-Control-Allow-Methods: GET, POST, PATCH, OPTIONS\r\n"
+                              "Access-Control-Allow-Headers: Origin, X-Requested-With, Content-Type, Accept, If-None-Match\r\n"
+                              "Access-Control-Expose-Headers: ETag\r\n"
+                              "Connection: %s\r\n",
+                              response.code, reason(response.code), response.body.size(),
+                              request.keepAlive ? "keep-alive" : "close");
+        output.append(head, length);
+        if (!response.contentType.empty()) {
+            output += "Content-Type: " + response.contentType + "\r\n";
+        }
+        if (!response.etag.empty()) {
+            output += "ETag: " + response.etag + "\r\nVary: Accept\r\n";
+        }
+        output += "\r\n";
+        output += response.body;
+    }
+};
+
+#endif // FLEET_HTTPSERVER_H
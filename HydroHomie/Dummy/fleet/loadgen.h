@@ -0,0 +1,338 @@
+#ifndef FLEET_LOADGEN_H
+#define FLEET_LOADGEN_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Latencies and outcome counts of one route
+struct RouteLoad {
+    std::string route;
+    std::vector<uint32_t> micros;
+    uint64_t bytes = 0;
+    uint64_t notModified = 0;
+    uint64_t errors = 0; // Status >= 400, reset or malformed replies
+
+    // q in 0..1, nearest rank
+    uint32_t percentile(double q) const {
+        if (micros.empty()) {
+            return 0;
+        }
+        size_t rank = static_cast<size_t>(q * (micros.size() - 1) + 0.5);
+        return micros[std::min(rank, micros.size() - 1)];
+    }
+};
+
+struct LoadOptions {
+    std::string host = "127.0.0.1";
+    uint16_t port = 8080;        // First device port
+    size_t devices = 1;          // Devices on port .. port + devices - 1
+    size_t connections = 16;     // Keep-alive connections, spread over the devices
+    double durationSeconds = 10;
+    std::vector<std::string> routes = {"/status", "/history?since=0&limit=32", "/metrics"};
+    bool conditional = true;     // Send If-None-Match with the last ETag, like the dashboard
+};
+
+// Closed-loop HTTP load: every connection has one request in flight and sends
+// the next route round-robin as soon as the reply is in. Single-threaded epoll.
+class LoadGenerator {
+public:
+    explicit LoadGenerator(const LoadOptions& options) : options(options), epoll(epoll_create1(0)) {
+        for (const std::string& route : options.routes) {
+            RouteLoad load;
+            load.route = route;
+            results.push_back(load);
+        }
+    }
+
+    ~LoadGenerator() {
+        for (Connection& connection : connections) {
+            if (connection.fd >= 0) close(connection.fd);
+        }
+        close(epoll);
+    }
+
+    // Runs for options.durationSeconds; false if the host can't be resolved
+    bool run() {
+        sockaddr_in address = {};
+        if (!resolve(address)) {
+            return false;
+        }
+        connections.resize(options.connections);
+        for (size_t i = 0; i < connections.size(); i++) {
+            connections[i].port = options.port + i % std::max<size_t>(options.devices, 1);
+            connections[i].next = i % results.size();
+            connections[i].etags.resize(results.size());
+            open(i, address);
+        }
+
+        const auto start = Clock::now();
+        const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.durationSeconds));
+        epoll_event events[256];
+        while (Clock::now() < end) {
+            int count = epoll_wait(epoll, events, 256, 10);
+            for (int i = 0; i < count; i++) {
+                size_t index = events[i].data.u64;
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    fail(index, address);
+                } else if (events[i].events & EPOLLOUT) {
+                    send(index, address);
+                } else {
+                    receive(index, address);
+                }
+            }
+        }
+        elapsedSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        for (RouteLoad& load : results) {
+            std::sort(load.micros.begin(), load.micros.end());
+        }
+        return true;
+    }
+
+    const std::vector<RouteLoad>& getResults() const {
+        return results;
+    }
+
+    void printReport(FILE* out) const {
+        fprintf(out, "%-32s %9s %9s %8s %8s %8s %8s %8s %7s\n",
+                "route", "requests", "req/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "errors");
+        for (const RouteLoad& load : results) {
+            fprintf(out, "%-32s %9zu %9.0f %8u %8u %8u %8u %8u %7llu\n", load.route.c_str(), load.micros.size(),
+                    load.micros.size() / elapsedSeconds, load.percentile(0.5), load.percentile(0.9),
+                    load.percentile(0.99), load.percentile(0.999), load.micros.empty() ? 0 : load.micros.back(),
+                    static_cast<unsigned long long>(load.errors));
+        }
+    }
+
+    void writeJson(FILE* out) const {
+        fprintf(out, "{\n  \"duration_s\": %.3f,\n  \"connections\": %zu,\n  \"devices\": %zu,\n  \"routes\": [",
+                elapsedSeconds, options.connections, options.devices);
+        for (size_t i = 0; i < results.size(); i++) {
+            const RouteLoad& load = results[i];
+            fprintf(out, "%s\n    {\"route\": \"%s\", \"requests\": %zu, \"rps\": %.1f, \"not_modified\": %llu, "
+                         "\"errors\": %llu, \"bytes\": %llu, \"p50_us\": %u, \"p90_us\": %u, \"p99_us\": %u, "
+                         "\"p999_us\": %u, \"max_us\": %u}",
+                    i ? "," : "", load.route.c_str(), load.micros.size(), load.micros.size() / elapsedSeconds,
+                    static_cast<unsigned long long>(load.notModified), static_cast<unsigned long long>(load.errors),
+                    static_cast<unsigned long long>(load.bytes), load.percentile(0.5), load.percentile(0.9),
+                    load.percentile(0.99), load.percentile(0.999), load.micros.empty() ? 0 : load.micros.back());
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Connection {
+        int fd = -1;
+        uint16_t port = 0;
+        size_t next = 0;      // Route of the next request
+        size_t inFlight = 0;  // Route of the request waiting for its reply
+        std::vector<std::string> etags;
+        std::string output;
+        size_t sent = 0;
+        std::string input;
+        Clock::time_point sentAt;
+    };
+
+    const LoadOptions options;
+    const int epoll;
+    std::vector<Connection> connections;
+    std::vector<RouteLoad> results;
+    double elapsedSeconds = 0;
+
+    bool resolve(sockaddr_in& address) {
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(options.host.c_str(), nullptr, &hints, &found) != 0 || !found) {
+            return false;
+        }
+        address = *reinterpret_cast<sockaddr_in*>(found->ai_addr);
+        freeaddrinfo(found);
+        return true;
+    }
+
+    void open(size_t index, sockaddr_in address) {
+        Connection& connection = connections[index];
+        connection.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        address.sin_port = htons(connection.port);
+        connect(connection.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        connection.input.clear();
+        request(connection);
+
+        epoll_event event = {};
+        event.events = EPOLLOUT;
+        event.data.u64 = index;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, connection.fd, &event);
+    }
+
+    // Counts the request in flight as an error and reconnects
+    void fail(size_t index, const sockaddr_in& address) {
+        Connection& connection = connections[index];
+        results[connection.inFlight].errors++;
+        epoll_ctl(epoll, EPOLL_CTL_DEL, connection.fd, nullptr);
+        close(connection.fd);
+        open(index, address);
+    }
+
+    void request(Connection& connection) {
+        connection.inFlight = connection.next;
+        connection.next = (connection.next + 1) % results.size();
+        const std::string& etag = connection.etags[connection.inFlight];
+        connection.output = "GET " + results[connection.inFlight].route + " HTTP/1.1\r\nHost: " + options.host + "\r\n";
+        if (options.conditional && !etag.empty()) {
+            connection.output += "If-None-Match: " + etag + "\r\n";
+        }
+        connection.output += "\r\n";
+        connection.sent = 0;
+        connection.sentAt = Clock::now();
+    }
+
+    void send(size_t index, const sockaddr_in& address) {
+        Connection& connection = connections[index];
+        while (connection.sent < connection.output.size()) {
+            ssize_t length = ::send(connection.fd, connection.output.data() + connection.sent,
+                                    connection.output.size() - connection.sent, MSG_NOSIGNAL);
+            if (length < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fail(index, address);
+                }
+                return;
+            }
+            connection.sent += length;
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = index;
+        epoll_ctl(epoll, EPOLL_CTL_MOD, connection.fd, &event);
+    }
+
+    void receive(size_t index, const sockaddr_in& address) {
+        Connection& connection = connections[index];
+        char buffer[16384];
+        for (;;) {
+            ssize_t length = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (length > 0) {
+                connection.input.append(buffer, length);
+                continue;
+            }
+            if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                fail(index, address);
+                return;
+            }
+            break;
+        }
+        int status;
+        bool keepAlive;
+        switch (parse(connection, status, keepAlive)) {
+            case INCOMPLETE:
+                return;
+            case MALFORMED:
+                fail(index, address);
+                return;
+            case COMPLETE:
+                break;
+        }
+        RouteLoad& load = results[connection.inFlight];
+        load.micros.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - connection.sentAt).count());
+        if (status == 304) load.notModified++;
+        if (status >= 400) load.errors++;
+
+        if (!keepAlive) {
+            epoll_ctl(epoll, EPOLL_CTL_DEL, connection.fd, nullptr);
+            close(connection.fd);
+            open(index, address);
+            return;
+        }
+        request(connection);
+        send(index, address);
+    }
+
+    enum ParseResult { INCOMPLETE, COMPLETE, MALFORMED };
+
+    // Takes one reply off the front of the input, Content-Length or chunked
+    ParseResult parse(Connection& connection, int& status, bool& keepAlive) {
+        std::string& input = connection.input;
+        size_t headerEnd = input.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) {
+            return INCOMPLETE;
+        }
+        if (input.compare(0, 5, "HTTP/") != 0 || input.find(' ') == std::string::npos) {
+            return MALFORMED;
+        }
+        status = atoi(input.c_str() + input.find(' ') + 1);
+        keepAlive = true;
+        size_t contentLength = 0;
+        bool chunked = false;
+        std::string etag;
+        for (size_t line = input.find("\r\n") + 2; line < headerEnd;) {
+            size_t next = input.find("\r\n", line);
+            size_t colon = input.find(':', line);
+            if (colon != std::string::npos && colon < next) {
+                std::string name = input.substr(line, colon - line);
+                size_t valueStart = input.find_first_not_of(' ', colon + 1);
+                std::string value = input.substr(valueStart, next - valueStart);
+                if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+                    contentLength = strtoul(value.c_str(), nullptr, 10);
+                } else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+                    chunked = strcasecmp(value.c_str(), "chunked") == 0;
+                } else if (strcasecmp(name.c_str(), "Connection") == 0) {
+                    keepAlive = strcasecmp(value.c_str(), "close") != 0;
+                } else if (strcasecmp(name.c_str(), "ETag") == 0) {
+                    etag = value;
+                }
+            }
+            line = next + 2;
+        }
+
+        size_t bodyStart = headerEnd + 4;
+        size_t bodyEnd = bodyStart + contentLength;
+        size_t bodyLength = contentLength;
+        if (chunked) {
+            bodyLength = 0;
+            for (size_t chunk = bodyStart;;) {
+                size_t sizeEnd = input.find("\r\n", chunk);
+                if (sizeEnd == std::string::npos) {
+                    return INCOMPLETE;
+                }
+                size_t size = strtoul(input.c_str() + chunk, nullptr, 16);
+                chunk = sizeEnd + 2 + size + 2;
+                if (input.size() < chunk) {
+                    return INCOMPLETE;
+                }
+                bodyLength += size;
+                if (size == 0) {
+                    bodyEnd = chunk;
+                    break;
+                }
+            }
+        }
+        if (input.size() < bodyEnd) {
+            return INCOMPLETE;
+        }
+        results[connection.inFlight].bytes += bodyLength;
+        if (!etag.empty()) {
+            connection.etags[connection.inFlight] = etag;
+        }
+        input.erase(0, bodyEnd);
+        return COMPLETE;
+    }
+};
+
+#endif // FLEET_LOADGEN_H
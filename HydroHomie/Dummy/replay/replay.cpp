@@ -0,0 +1,218 @@
+// Accelerated replay of the watering policy: HomieManager on a virtual clock,
+// fed a recorded or synthetic trace, for every combination of the given
+// settings, spread over all cores. One CSV row per policy.
+//
+//   replay --synthetic 30 [--drying 12] [--swing 0.6] [--refill 7]
+//   replay --trace history.json|trace.csv
+//          [--interval 1800,3600] [--duration 300,600] [--threshold 250] [--target 350,400,450]
+//          [--moisture-target 300] [--pump-rate 8] [--tank-rate 2] [--ml-per-second 25]
+//          [--jobs N] [--out results.csv] [--events events.csv]
+//
+// A recorded trace is either the /history?since=0 JSON of a device or a CSV of
+// "timestamp,tank,plant[,plant...]" lines.
+
+#include <Arduino.h>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include "replay.h"
+
+struct ReplayOptions {
+    std::string tracePath;
+    double syntheticDays = 0;
+    double dryingPerHour = 12;
+    double dayNightSwing = 0.6;
+    double refillDays = 7;
+    std::vector<int> intervals = {60*60};
+    std::vector<int> durations = {10*60};
+    std::vector<int> thresholds = {250};
+    std::vector<int> targets = {400};
+    int moistureTarget = 300;
+    PumpModel pump;
+    unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    const char* out = nullptr;
+    const char* events = nullptr;
+};
+
+static void usage() {
+    fprintf(stderr,
+            "usage: replay --synthetic DAYS [--drying PER_HOUR] [--swing X] [--refill DAYS]\n"
+            "       replay --trace FILE\n"
+            "              [--interval S,..] [--duration S,..] [--threshold L,..] [--target L,..]\n"
+            "              [--moisture-target L] [--pump-rate L/s] [--tank-rate L/s] [--ml-per-second ML]\n"
+            "              [--jobs N] [--out FILE] [--events FILE]\n");
+}
+
+static std::vector<int> parseList(const char* value) {
+    std::vector<int> list;
+    std::stringstream items(value);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        list.push_back(atoi(item.c_str()));
+    }
+    return list;
+}
+
+static bool parseOptions(int argc, char** argv, ReplayOptions& options) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        const char* value = argv[i + 1];
+        if (flag == "--trace") options.tracePath = value;
+        else if (flag == "--synthetic") options.syntheticDays = atof(value);
+        else if (flag == "--drying") options.dryingPerHour = atof(value);
+        else if (flag == "--swing") options.dayNightSwing = atof(value);
+        else if (flag == "--refill") options.refillDays = atof(value);
+        else if (flag == "--interval") options.intervals = parseList(value);
+        else if (flag == "--duration") options.durations = parseList(value);
+        else if (flag == "--threshold") options.thresholds = parseList(value);
+        else if (flag == "--target") options.targets = parseList(value);
+        else if (flag == "--moisture-target") options.moistureTarget = atoi(value);
+        else if (flag == "--pump-rate") options.pump.plantPerSecond = atof(value);
+        else if (flag == "--tank-rate") options.pump.tankPerSecond = atof(value);
+        else if (flag == "--ml-per-second") options.pump.millilitersPerSecond = atof(value);
+        else if (flag == "--jobs") options.jobs = std::max(atoi(value), 1);
+        else if (flag == "--out") options.out = value;
+        else if (flag == "--events") options.events = value;
+        else return false;
+    }
+    return argc % 2 == 1 && (options.syntheticDays > 0) != !options.tracePath.empty()
+        && !options.intervals.empty() && !options.durations.empty()
+        && !options.thresholds.empty() && !options.targets.empty();
+}
+
+// Device history JSON ({"history":[[seq,ts,plant,tank],...]}, plant 0 only) or CSV
+static bool loadTrace(const std::string& path, Trace& trace) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    const std::string text = contents.str();
+    std::vector<TraceSample> samples;
+
+    size_t history = text.find("\"history\"");
+    if (history != std::string::npos) {
+        for (size_t entry = text.find("[[", history); entry != std::string::npos; entry = text.find('[', entry + 1)) {
+            if (text[entry + 1] == '[') {
+                entry++;
+            }
+            unsigned long seq;
+            long timestamp;
+            int plant, tank;
+            if (sscanf(text.c_str() + entry, "[%lu,%ld,%d,%d]", &seq, &timestamp, &plant, &tank) != 4) {
+                break;
+            }
+            TraceSample sample = {timestamp, tank, {}};
+            for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+                sample.plants[p] = plant;
+            }
+            samples.push_back(sample);
+        }
+    } else {
+        std::stringstream lines(text);
+        std::string line;
+        while (std::getline(lines, line)) {
+            std::vector<int> values;
+            std::stringstream fields(line);
+            std::string field;
+            long timestamp = 0;
+            for (size_t column = 0; std::getline(fields, field, ','); column++) {
+                if (column == 0) timestamp = atol(field.c_str());
+                else values.push_back(atoi(field.c_str()));
+            }
+            if (values.size() < 2 || timestamp == 0) {
+                continue; // Header or blank line
+            }
+            TraceSample sample = {timestamp, values[0], {}};
+            for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+                sample.plants[p] = values[std::min(p + 1, values.size() - 1)]; // Missing plants copy the last column
+            }
+            samples.push_back(sample);
+        }
+    }
+    trace = traceFromSamples(samples);
+    return !trace.steps.empty();
+}
+
+int main(int argc, char** argv) {
+    ReplayOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        usage();
+        return 2;
+    }
+    Trace trace;
+    if (options.syntheticDays > 0) {
+        trace = syntheticTrace(1700000000, options.syntheticDays, options.dryingPerHour, options.dayNightSwing, options.refillDays);
+    } else if (!loadTrace(options.tracePath, trace)) {
+        fprintf(stderr, "replay: no usable samples in %s\n", options.tracePath.c_str());
+        return 1;
+    }
+
+    std::vector<WateringPolicy> policies;
+    for (int interval : options.intervals)
+        for (int duration : options.durations)
+            for (int threshold : options.thresholds)
+                for (int target : options.targets)
+                    policies.push_back({interval, duration, threshold, target});
+
+    std::vector<ReplayResult> results(policies.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned j = 0; j < std::min<size_t>(options.jobs, policies.size()); j++) {
+        workers.emplace_back([&] {
+            for (size_t i = next++; i < policies.size(); i = next++) {
+                results[i] = runReplay(trace, policies[i], options.pump, options.moistureTarget, options.events != nullptr);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    FILE* out = options.out ? fopen(options.out, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "replay: can't write %s\n", options.out);
+        return 1;
+    }
+    fprintf(out, "watering_interval,watering_duration,water_tank_threshold,plant_target_level,"
+                 "pump_starts,pump_s,water_ml,below_target_s,below_target_pct,min_plant_level,tank_low_s,speedup\n");
+    for (size_t i = 0; i < policies.size(); i++) {
+        const WateringPolicy& policy = policies[i];
+        const ReplayResult& result = results[i];
+        double below = 0;
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            below += result.belowTargetSeconds[p];
+        }
+        fprintf(out, "%d,%d,%d,%d,%u,%.0f,%.0f,%.0f,%.2f,%d,%.0f,%.0f\n", policy.wateringInterval, policy.wateringDuration,
+                policy.waterTankThreshold, policy.plantTargetLevel, static_cast<unsigned>(result.pumpStarts),
+                result.pumpSeconds, result.waterMilliliters, below,
+                100 * below / (result.simulatedSeconds * SensorManager::PLANTS), result.minPlantLevel,
+                result.tankLowSeconds, result.simulatedSeconds / result.wallSeconds);
+    }
+    if (options.out) {
+        fclose(out);
+    }
+
+    if (options.events) {
+        FILE* events = fopen(options.events, "w");
+        if (!events) {
+            fprintf(stderr, "replay: can't write %s\n", options.events);
+            return 1;
+        }
+        fprintf(events, "policy,timestamp,plant,pump,plant_level,tank_level\n");
+        for (size_t i = 0; i < policies.size(); i++) {
+            for (const PumpEvent& event : results[i].events) {
+                fprintf(events, "%zu,%ld,%zu,%s,%d,%d\n", i, static_cast<long>(event.timestamp), event.plant,
+                        event.on ? "on" : "off", event.plantLevel, event.tankLevel);
+            }
+        }
+        fclose(events);
+    }
+    fprintf(stderr, "replay: %zu policies over %.1f days in %.2f s on %zu threads\n", policies.size(),
+            (trace.end - trace.start()) / 86400.0, wallSeconds, workers.size());
+    return 0;
+}
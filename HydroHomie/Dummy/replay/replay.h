@@ -0,0 +1,225 @@
+#ifndef REPLAY_REPLAY_H
+#define REPLAY_REPLAY_H
+
+#include <Arduino.h>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "HomieManager.h"
+
+// A sensor trace as the environment of a replay: how fast every plant dries and
+// when the tank is refilled. Watering is left out, the policy under test does
+// that. Recorded traces are differenced (falling stretches are drying, rises
+// are the old waterings and are dropped), synthetic ones are generated.
+struct TraceStep {
+    time_t timestamp;                          // Start; the step lasts until the next one
+    float drying[SensorManager::PLANTS];       // Level lost per second
+    int refill;                                // Tank level at the start of the step, -1 for none
+};
+
+struct Trace {
+    std::vector<TraceStep> steps;
+    int tank = LEVEL_FULL;                     // Levels at the first step
+    int plants[SensorManager::PLANTS] = {};
+    time_t end = 0;
+
+    time_t start() const {
+        return steps.empty() ? end : steps.front().timestamp;
+    }
+};
+
+#define TRACE_REFILL_JUMP 150 // A tank rise of this much between samples is a refill
+
+// Samples of (timestamp, tank, plant levels), oldest first
+struct TraceSample {
+    time_t timestamp;
+    int tank;
+    int plants[SensorManager::PLANTS];
+};
+
+inline Trace traceFromSamples(const std::vector<TraceSample>& samples) {
+    Trace trace;
+    if (samples.size() < 2) {
+        return trace;
+    }
+    trace.tank = samples.front().tank;
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        trace.plants[p] = samples.front().plants[p];
+    }
+    for (size_t i = 0; i + 1 < samples.size(); i++) {
+        const TraceSample& from = samples[i];
+        const TraceSample& to = samples[i + 1];
+        double seconds = std::max<double>(to.timestamp - from.timestamp, 1);
+        TraceStep step;
+        step.timestamp = from.timestamp;
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            step.drying[p] = std::max(0.0, (from.plants[p] - to.plants[p]) / seconds);
+        }
+        step.refill = i > 0 && from.tank - samples[i - 1].tank >= TRACE_REFILL_JUMP ? from.tank : -1;
+        trace.steps.push_back(step);
+    }
+    trace.end = samples.back().timestamp;
+    return trace;
+}
+
+// Drying of perHour level units around a day-night cycle (fastest mid-afternoon),
+// one step per minute, with the tank refilled every refillDays (0 never)
+inline Trace syntheticTrace(time_t start, double days, double perHour, double dayNightSwing, double refillDays) {
+    Trace trace;
+    trace.tank = LEVEL_FULL;
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        trace.plants[p] = 600;
+    }
+    const size_t minutes = static_cast<size_t>(days * 24 * 60);
+    for (size_t minute = 0; minute < minutes; minute++) {
+        TraceStep step;
+        step.timestamp = start + minute * 60;
+        double hourOfDay = fmod(minute / 60.0, 24.0);
+        double rate = perHour * (1 + dayNightSwing * sin(2 * M_PI * (hourOfDay - 9) / 24)) / 3600;
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            step.drying[p] = static_cast<float>(std::max(rate, 0.0));
+        }
+        bool refill = refillDays > 0 && minute > 0 && minute % static_cast<size_t>(refillDays * 24 * 60) == 0;
+        step.refill = refill ? LEVEL_FULL : -1;
+        trace.steps.push_back(step);
+    }
+    trace.end = start + minutes * 60;
+    return trace;
+}
+
+// The settings under test, applied through HomieConfig
+struct WateringPolicy {
+    int wateringInterval = 60*60;
+    int wateringDuration = 10*60;
+    int waterTankThreshold = 250;
+    int plantTargetLevel = 400;
+};
+
+// How the hardware responds to the pump
+struct PumpModel {
+    double plantPerSecond = 8;      // Plant level gained per second of pumping
+    double tankPerSecond = 2;       // Tank level used per second of pumping
+    double millilitersPerSecond = 25;
+};
+
+struct PumpEvent {
+    time_t timestamp;
+    size_t plant;
+    bool on;
+    int plantLevel;
+    int tankLevel;
+};
+
+struct ReplayResult {
+    uint32_t pumpStarts = 0;
+    double pumpSeconds = 0;
+    double waterMilliliters = 0;
+    double belowTargetSeconds[SensorManager::PLANTS] = {}; // Time under the moisture target
+    double tankLowSeconds = 0;                              // Time at or under the tank threshold
+    int minPlantLevel = LEVEL_FULL;
+    double simulatedSeconds = 0;
+    double wallSeconds = 0;
+    std::vector<PumpEvent> events;
+};
+
+// Runs the firmware's HomieManager over a trace on a virtual clock that jumps
+// from one scheduler deadline to the next, so only the work the device would do
+// is done. Everything firmware-side is per thread (see test/shim), so replays
+// can run on as many threads as there are cores.
+//
+// moistureTarget is the level the plants should stay above, the yardstick the
+// policies are compared by; it is not the policy's own plant_target_level.
+inline ReplayResult runReplay(const Trace& trace, const WateringPolicy& policy, const PumpModel& pump,
+                              int moistureTarget, bool recordEvents) {
+    const auto wallStart = std::chrono::steady_clock::now();
+    native::Device board;
+    native::device = &board;
+    native::clock = native::Clock();
+    native::clock.epoch = trace.start();
+
+    HomieConfig config;
+    config.begin();
+    config.beginUpdate();
+    config.setWateringInterval(policy.wateringInterval);
+    config.setWateringDuration(policy.wateringDuration);
+    config.setWaterTankThreshold(policy.waterTankThreshold);
+    config.setPlantTargetLevel(policy.plantTargetLevel);
+    config.commit();
+    SensorManager sensorManager(true);
+    HomieManager homieManager(sensorManager, config);
+
+    ReplayResult result;
+    double tank = trace.tank;
+    double plants[SensorManager::PLANTS];
+    bool pumping[SensorManager::PLANTS] = {};
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        plants[p] = trace.plants[p];
+    }
+    // Inverse of the channel calibration
+    auto setLevel = [](const SensorChannel& channel, double level) {
+        native::device->analogValues[channel.sensorPin] =
+            channel.rawEmpty + static_cast<int>(level * (channel.rawFull - channel.rawEmpty) / LEVEL_FULL);
+    };
+
+    const uint64_t endMicros = static_cast<uint64_t>(trace.end - trace.start()) * 1000000;
+    size_t step = 0;
+    while (native::clock.micros < endMicros) {
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            setLevel(SensorManager::channel(p + 1), plants[p]);
+        }
+        setLevel(SensorManager::channel(0), tank);
+        homieManager.handle();
+
+        const time_t now = native::now(nullptr);
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            const int pin = Board::plants[p].pumpPin;
+            bool on = pin >= 0 && digitalRead(pin) == HIGH;
+            if (on != pumping[p]) {
+                pumping[p] = on;
+                result.pumpStarts += on;
+                if (recordEvents) {
+                    result.events.push_back({now, p, on, static_cast<int>(plants[p]), static_cast<int>(tank)});
+                }
+            }
+        }
+
+        // Sleep to the next deadline; at least 1 ms, a loop() on the device is not free either
+        unsigned long wait = std::max(homieManager.getScheduler().timeUntilNext(), 1ul);
+        wait = std::min<uint64_t>(wait, (endMicros - native::clock.micros + 999) / 1000);
+        double seconds = wait / 1000.0;
+        while (step + 1 < trace.steps.size() && trace.steps[step + 1].timestamp <= now) {
+            step++;
+            if (trace.steps[step].refill >= 0) {
+                tank = trace.steps[step].refill;
+            }
+        }
+        const TraceStep& environment = trace.steps[step];
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            if (plants[p] < moistureTarget) {
+                result.belowTargetSeconds[p] += seconds;
+            }
+            if (pumping[p] && tank > 0) {
+                double used = std::min(pump.tankPerSecond * seconds, tank);
+                double pumpedSeconds = used / pump.tankPerSecond;
+                tank -= used;
+                plants[p] += pump.plantPerSecond * pumpedSeconds;
+                result.pumpSeconds += pumpedSeconds;
+            }
+            plants[p] = std::min(std::max(plants[p] - environment.drying[p] * seconds, 0.0), static_cast<double>(LEVEL_FULL));
+            result.minPlantLevel = std::min(result.minPlantLevel, static_cast<int>(plants[p]));
+        }
+        if (tank <= policy.waterTankThreshold) {
+            result.tankLowSeconds += seconds;
+        }
+        native::clock.advanceMillis(wait);
+    }
+    result.waterMilliliters = result.pumpSeconds * pump.millilitersPerSecond;
+    result.simulatedSeconds = native::clock.micros / 1e6;
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    config.end();
+    native::device = &native::defaultDevice; // board goes out of scope
+    return result;
+}
+
+#endif // REPLAY_REPLAY_H
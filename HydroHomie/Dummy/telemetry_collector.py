@@ -0,0 +1,77 @@
+# Collector for the devices' UDP telemetry (telemetry_mode 1): decodes every
+# batch, acknowledges it and prints one CSV line per record. Standard library only.
+#
+#   python telemetry_collector.py [port] > telemetry.csv
+#
+# Point a device at it with
+#   curl -X PATCH http://<device>/config -d '{"telemetry_mode":1,"telemetry_host":"<this host>"}'
+#
+# Wire format: see include/telemetry.h (batches) and include/telemetrypublisher.h
+# (acknowledgements).
+import socket
+import struct
+import sys
+
+VERSION = 1
+KINDS = ("sample", "watering", "pump")
+
+
+def varints(data, offset):
+    value = shift = 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return (value >> 1) ^ -(value & 1), offset
+
+
+def decode(data):
+    version, channels, boot_id, first_seq, count, id_length = struct.unpack_from("<BBIIBB", data)
+    if version != VERSION:
+        raise ValueError("version %d" % version)
+    offset = 12
+    device = data[offset:offset + id_length].decode()
+    offset += id_length
+    timestamp = 0
+    levels = [0] * channels
+    records = []
+    for i in range(count):
+        delta, offset = varints(data, offset)
+        timestamp += delta
+        flags = data[offset]
+        offset += 1
+        for c in range(channels):
+            delta, offset = varints(data, offset)
+            levels[c] += delta
+        records.append((first_seq + i, timestamp, KINDS[flags & 3], (flags >> 2) & 0x1F, flags >> 7, list(levels)))
+    return device, boot_id, records
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 4210
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", port))
+    print("device,boot,seq,timestamp,kind,plant,on,tank,plants", flush=True)
+    highest = {}  # (device, boot id) -> highest seq received
+    while True:
+        data, address = sock.recvfrom(2048)
+        try:
+            device, boot_id, records = decode(data)
+        except (ValueError, IndexError, struct.error) as error:
+            print("bad batch from %s: %s" % (address[0], error), file=sys.stderr)
+            continue
+        key = (device, boot_id)
+        for seq, timestamp, kind, plant, on, levels in records:
+            # Retried batches repeat what was received before the acknowledgement got lost
+            if seq > highest.get(key, 0):
+                print("%s,%08x,%d,%d,%s,%d,%d,%d,%s"
+                      % (device, boot_id, seq, timestamp, kind, plant, on, levels[0], " ".join(map(str, levels[1:]))))
+                highest[key] = seq
+        sys.stdout.flush()
+        sock.sendto(struct.pack("<II", boot_id, highest.get(key, 0)), address)
+
+
+if __name__ == "__main__":
+    main()
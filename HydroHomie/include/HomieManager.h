@@ -2,135 +2,532 @@
 #define HOMIEMANAGER_H
 
 #include <Arduino.h>
-#include "SensorManager.h"
-#include "HomieConfig.h"
+#include "sensormanager.h"
+#include "pumpinterlock.h"
+#include "samplingtask.h"
+#include "homieconfig.h"
+#include "scheduler.h"
+#include "seqlock.h"
+#include "metrics.h"
+#include "wallclock.h"
+#include "wateringschedule.h"
+#include <atomic>
 #include <time.h>
 
+// Watering state as published to other tasks
+struct WateringSnapshot {
+    bool watering;
+    time_t lastStart;
+    uint32_t version; // Bumped on every start/stop
+};
+
+// Pump relay on-time as published to other tasks
+struct PumpSnapshot {
+    bool on;
+    unsigned long onSince;  // millis() of the last switch-on
+    uint64_t onMillis;      // Total on-time of the completed runs
+    uint32_t starts;
+};
+
 class HomieManager {
 private:
     SensorManager& sensorManager;
     HomieConfig& config;
     unsigned long lastPollTime = 0;
     unsigned long lastHistoryUpdateTime = 0;
-    unsigned long lastWateringStartTime = 0;
     time_t lastWateringStartTimestamp = 0;
-    bool isWatering = false;
-    const unsigned int pumpPin;
+    bool isWatering = false;        // Any plant
+    uint32_t wateringPlants = 0;    // Bit per plant being watered
+    unsigned long wateringUntil[SensorManager::PLANTS] = {}; // millis() each plant's watering ends
+    uint32_t wateringVersion = 0; // Bumped on every watering start/stop
     const unsigned long historyUpdateInterval = 60000; // 1 minute in milliseconds
     const unsigned long pollInterval = 10000; // Regular polling interval in milliseconds
-    bool useDigitalSensor = false;
     unsigned int readCount = 0;
 
 public:
-    HomieManager(SensorManager& sensorMgr, HomieConfig& cfg, unsigned int pumpPin, bool useDigitalSensor = false)
-    : sensorManager(sensorMgr), config(cfg), pumpPin(pumpPin), useDigitalSensor(useDigitalSensor) {
-        pinMode(pumpPin, OUTPUT);
-        digitalWrite(pumpPin, LOW); // Ensure pump is off initially
+    static constexpr size_t PLANTS = SensorManager::PLANTS;
+
+    // Every plant of the board with a pumpPin gets a pump, watered by the entries
+    // of the schedules setting that name it
+    HomieManager(SensorManager& sensorMgr, HomieConfig& cfg)
+    : sensorManager(sensorMgr), config(cfg) {
+        for (size_t p = 0; p < PLANTS; p++) {
+            if (Board::plants[p].pumpPin >= 0) {
+                pinMode(Board::plants[p].pumpPin, OUTPUT);
+                digitalWrite(Board::plants[p].pumpPin, LOW); // Ensure pump is off initially
+            }
+        }
+        handleStats.name = "handle";
+        publishedHandleStats.publish(handleStats);
+        sampleTask = scheduler.add("sample", [this](unsigned long now) { return sampleStep(now); });
+        wateringTask = scheduler.add("watering", [this](unsigned long now) { return wateringStep(now); });
+        pumpTask = scheduler.add("pump", [this](unsigned long now) { return pumpStep(now); });
     }
 
     SensorManager* getSensorManager() {
         return &sensorManager;
     }
 
+    // Switches the pumps through interlock from now on, and keeps the probes
+    // powered while watering so it can watch the levels
+    void attachInterlock(PumpInterlock* pumpInterlock) {
+        interlock = pumpInterlock;
+    }
+
+    // Takes the polls from a sampling task from now on instead of sampling on
+    // the scheduler; handle() then only feeds its reads to the pipeline
+    void attachSampling(SamplingTask* task) {
+        sampling = task;
+        updateSampling();
+    }
+
+    // Queues the poll samples and the watering and pump switches for the
+    // telemetry publisher
+    void attachTelemetry(TelemetryQueue* queue) {
+        telemetry = queue;
+        sensorManager.attachTelemetry(queue);
+    }
+
+    // The getters read the published snapshot and are safe from any task
     bool isWateringActive() {
-        return isWatering;
+        return watering.load().watering;
     }
 
     unsigned long getLastWateringStartTime() {
-        return lastWateringStartTimestamp;
+        return WallClock::fix(watering.load().lastStart);
+    }
+
+    uint32_t getWateringVersion() {
+        return watering.load().version;
+    }
+
+    WateringSnapshot getWateringSnapshot() {
+        WateringSnapshot snapshot = watering.load();
+        snapshot.lastStart = WallClock::fix(snapshot.lastStart);
+        return snapshot;
+    }
+
+    // Upcoming and last fires of the schedule entries, safe from any task
+    ScheduleSnapshot getScheduleSnapshot() const {
+        return schedule.getSnapshot();
+    }
+
+    // Polls completed since boot, safe from any task
+    uint32_t getPollCount() const {
+        return polls.load();
     }
 
+    // Called from the httpd task, so these only post a request that the watering
+    // task carries out on the next handle()
     void forceStartWatering() {
-        Serial.println("Starting watering");
-        isWatering = true;
-        lastWateringStartTime = millis();
-        time(&lastWateringStartTimestamp);
+        wateringCommand.store(COMMAND_START);
+        notifyCommand();
     }
 
     void forceStopWatering() {
-        Serial.println("Stopping watering");
-        isWatering = false;
+        wateringCommand.store(COMMAND_STOP);
+        notifyCommand();
     }
 
+    // For the httpd task after a config update, so a new schedule applies at once
+    void configChanged() {
+        notifyCommand();
+    }
+
+    // Called on the posting task after every command, e.g. to end a sleep in loop()
+    void onCommand(std::function<void()> callback) {
+        commandCallback = callback;
+    }
+
+    // Runs whatever sampling/watering work is due and returns; never blocks
     void handle() {
-        unsigned long currentTime = millis();
-        unsigned long wateringInterval = static_cast<unsigned long>(config.getWateringInterval()) * 1000; // Convert seconds to milliseconds
-        unsigned long wateringDuration = static_cast<unsigned long>(config.getWateringDuration()) * 1000; // Convert seconds to milliseconds
-
-        bool updateHistory = (currentTime - lastHistoryUpdateTime) >= historyUpdateInterval;
-        unsigned long pollIntervalCurrent = isWatering ? 500 : pollInterval; // If watering, poll more frequently
-        // Check if it's time for regular sensor polling
-        if (currentTime - lastPollTime >= pollIntervalCurrent) { // Convert minutes to milliseconds
-            lastPollTime = currentTime;
+        uint32_t start = micros();
+        // Commands and config changes come from other tasks, and a step of the
+        // wall clock moves the cron times; act on them now rather than at the
+        // watering task's next deadline
+        if (wateringCommand.load() != COMMAND_NONE || config.getVersion() != seenConfigVersion
+            || schedule.clockStepped()) {
+            seenConfigVersion = config.getVersion();
+            scheduler.wake(wateringTask);
+        }
+        if (sampling && !sampling->isEmpty()) {
+            scheduler.wake(sampleTask);
+        }
+        scheduler.run();
+        uint32_t elapsed = micros() - start;
+        handleStats.runs++;
+        handleStats.lastMicros = elapsed;
+        handleStats.totalMicros += elapsed;
+        if (elapsed > handleStats.maxMicros) handleStats.maxMicros = elapsed;
+        publishedHandleStats.publish(handleStats);
+        handleLatency.record(elapsed);
+    }
+
+    const Scheduler& getScheduler() const {
+        return scheduler;
+    }
+
+    // Milliseconds until handle() has something to do, 0 if it has now
+    unsigned long timeUntilNext() const {
+        if (wateringCommand.load() != COMMAND_NONE || (sampling && !sampling->isEmpty())) {
+            return 0;
+        }
+        return scheduler.timeUntilNext();
+    }
+
+    // A copy from any task, like Scheduler::getStats()
+    TaskStats getHandleStats() const {
+        return publishedHandleStats.load();
+    }
+
+    // Distribution of handle() durations, readable from any task
+    const LatencyHistogram& getHandleLatency() const {
+        return handleLatency;
+    }
+
+    // Total on-time of a plant's pump including a run in progress, safe from any task
+    uint64_t getPumpOnMillis(unsigned long now, size_t plant = 0) {
+        const PumpSnapshot pump = getPumpSnapshot(plant);
+        return pump.onMillis + (pump.on ? now - pump.onSince : 0);
+    }
+
+    PumpSnapshot getPumpSnapshot(size_t plant = 0) {
+        return pumpStats[plant < PLANTS ? plant : 0].load();
+    }
 
+private:
+    enum SampleState { SAMPLE_IDLE, SAMPLE_READING };
+    enum PumpState { PUMP_OFF, PUMP_RAMPING, PUMP_ON };
+    enum WateringCommand { COMMAND_NONE, COMMAND_START, COMMAND_STOP };
+
+    const unsigned int readsPerPoll = SAMPLING_READS_PER_POLL;
+    const unsigned long readSpacing = SAMPLING_READ_SPACING_MS; // ms between reads of one poll
+    const unsigned long wateringPollInterval = 500;
+    const unsigned long pumpRampTime = 50; // Minimum on-time before the pump is re-evaluated
+    const unsigned long pumpCheckInterval = 50;
+    const unsigned long sensorSettleTime = SAMPLING_SETTLE_MS; // Probe output after power-up, before the first read
+    const unsigned long idleCheckInterval = 60000; // Safety net for tasks that wait to be woken
+
+    Scheduler scheduler;
+    int sampleTask = -1;
+    int wateringTask = -1;
+    int pumpTask = -1;
+    uint32_t seenConfigVersion = 0;
+    WateringSchedule schedule;
+    uint32_t scheduleConfigVersion = UINT32_MAX; // Config the schedule was built from
+    uint32_t scheduledPolls = 0;                 // Polls whose levels the schedule has seen
+    std::function<void()> commandCallback;
+    PumpInterlock* interlock = nullptr;
+    SamplingTask* sampling = nullptr;
+    TelemetryQueue* telemetry = nullptr;
+    TaskStats handleStats;
+    Snapshot<TaskStats> publishedHandleStats; // handleStats for other tasks
+    LatencyHistogram handleLatency;
+    struct Pump {
+        PumpState state = PUMP_OFF;
+        PumpSnapshot stats = {false, 0, 0, 0};
+    };
+    Pump pumps[PLANTS];
+    Snapshot<PumpSnapshot> pumpStats[PLANTS];
+    SampleState sampleState = SAMPLE_IDLE;
+    bool pollUpdatesHistory = false;
+    std::atomic<uint32_t> polls{0};
+    std::atomic<int> wateringCommand{COMMAND_NONE};
+    Snapshot<WateringSnapshot> watering;
+
+    void publishWatering() {
+        wateringVersion++;
+        watering.publish({isWatering, lastWateringStartTimestamp, wateringVersion});
+    }
+
+    // A watering or pump switch, with the levels it happened at
+    void pushEvent(TelemetryKind kind, size_t plant, bool on) {
+        if (!telemetry) {
+            return;
+        }
+        const SensorSnapshot sensors = sensorManager.getSnapshot();
+        int levels[SensorManager::CHANNELS];
+        levels[0] = sensors.tank;
+        for (size_t p = 0; p < PLANTS; p++) {
+            levels[p + 1] = sensors.plants[p];
+        }
+        telemetry->push(kind, plant, on, levels, WallClock::now());
+    }
+
+    void notifyCommand() {
+        if (commandCallback) {
+            commandCallback();
+        }
+    }
+
+    // One step of the poll: idle until the poll is due, then one read every
+    // readSpacing ms; the last read averages out and may update the history.
+    unsigned long sampleStep(unsigned long currentTime) {
+        if (sampling) {
+            return ingestStep();
+        }
+        unsigned long pollIntervalCurrent = isWatering ? wateringPollInterval : pollInterval; // If watering, poll more frequently
+        if (sampleState == SAMPLE_IDLE) {
+            if (polls.load() > 0 && currentTime - lastPollTime < pollIntervalCurrent) {
+                // A watering start wakes this task, so it can sleep until the poll is due.
+                // The first poll is due at once.
+                return pollIntervalCurrent - (currentTime - lastPollTime);
+            }
+            lastPollTime = currentTime;
+            pollUpdatesHistory = (currentTime - lastHistoryUpdateTime) >= historyUpdateInterval;
             // Activate sensors, read multiple times, then deactivate
+            sensorManager.setFilter(config.getAdcMedianWindow(), config.getAdcIirShift());
+            bool wasPowered = sensorManager.isPowered();
             sensorManager.activate();
-            // delay(25);
-            for (readCount = 0; readCount < 5; readCount++) {
-                sensorManager.readSensors(readCount == 4 && updateHistory, readCount == 4); // Average out on the final read
-                if(readCount < 4){
-                    delay(5); // Wait 10ms between reads
+            readCount = 0;
+            sampleState = SAMPLE_READING;
+            // Give the sensors, and the DMA sampler, one spacing to settle before the
+            // first read, or longer if they were just switched on
+            return wasPowered ? readSpacing : sensorSettleTime;
+        }
+
+        bool lastRead = readCount == readsPerPoll - 1;
+        sensorManager.readSensors(lastRead && pollUpdatesHistory, lastRead); // Average out on the final read
+        if (!lastRead) {
+            readCount++;
+            return readSpacing;
+        }
+        if (!(isWatering && interlock)) {
+            sensorManager.deactivate();
+        }
+        // Update history if the interval has elapsed
+        if (pollUpdatesHistory) {
+            lastHistoryUpdateTime = lastPollTime;
+        }
+        sampleState = SAMPLE_IDLE;
+        polls++;
+        pollDone();
+        return pollIntervalCurrent - (currentTime - lastPollTime);
+    }
+
+    // With a sampling task: takes in its reads in order, the last read of a
+    // poll averaging out and, once a historyUpdateInterval, updating the history
+    unsigned long ingestStep() {
+        SampleRecord record;
+        while (sampling->pop(record)) {
+            if (record.pollStart != lastPollTime) {
+                lastPollTime = record.pollStart;
+                pollUpdatesHistory = (record.pollStart - lastHistoryUpdateTime) >= historyUpdateInterval;
+                sensorManager.setFilter(config.getAdcMedianWindow(), config.getAdcIirShift());
+            }
+            int levels[SensorManager::CHANNELS];
+            for (size_t i = 0; i < SensorManager::CHANNELS; i++) {
+                levels[i] = record.levels[i];
+            }
+            const bool lastRead = record.read == readsPerPoll - 1;
+            sensorManager.ingest(record.failed ? nullptr : levels, lastRead && pollUpdatesHistory, lastRead);
+            if (lastRead) {
+                if (pollUpdatesHistory) {
+                    lastHistoryUpdateTime = lastPollTime;
                 }
+                polls++;
+                pollDone();
             }
-            sensorManager.deactivate();
+        }
+        // handle() wakes this task as soon as there are reads
+        return idleCheckInterval;
+    }
+
+    // Poll rate and probe power of the sampling task for the watering state
+    void updateSampling() {
+        if (sampling) {
+            sampling->setPeriod(isWatering ? wateringPollInterval : pollInterval);
+            sampling->setKeepPowered(isWatering && interlock);
+        }
+    }
+
+    // The dry rules of the schedule look at the levels of every poll
+    void pollDone() {
+        if (schedule.hasDryRules()) {
+            scheduler.wake(wateringTask);
+        }
+    }
+
+    // Starts watering the plants of manual starts and of the schedule entries
+    // that fire, and stops each plant once its watering time is up
+    unsigned long wateringStep(unsigned long currentTime) {
+        if (config.getVersion() != scheduleConfigVersion) {
+            scheduleConfigVersion = config.getVersion();
+            configureSchedule(currentTime);
+        }
+        if (lastWateringStartTimestamp == 0) {
+            lastWateringStartTimestamp = WallClock::now();
+            publishWatering();
+        }
+        const uint32_t before = wateringPlants;
+        bool started = false;
+        int command = wateringCommand.exchange(COMMAND_NONE);
+        if (command == COMMAND_START) {
+            started = startWatering(UINT32_MAX, static_cast<unsigned long>(config.getWateringDuration()) * 1000,
+                                    currentTime);
+            schedule.restart(currentTime);
+        } else if (command == COMMAND_STOP) {
+            wateringPlants = 0;
+        }
+
+        // The levels only once per poll, for the dry rules
+        int levels[PLANTS];
+        const uint32_t polled = polls.load();
+        if (polled != scheduledPolls) {
+            const SensorSnapshot sensors = sensorManager.getSnapshot();
+            for (size_t p = 0; p < PLANTS; p++) {
+                levels[p] = sensors.plants[p];
+            }
+        }
+        ScheduleFire fires[SCHEDULE_MAX_ENTRIES];
+        const size_t fired = schedule.due(currentTime, polled != scheduledPolls ? levels : nullptr, fires);
+        scheduledPolls = polled;
+        for (size_t i = 0; i < fired; i++) {
+            started |= startWatering(fires[i].plants, static_cast<unsigned long>(fires[i].duration) * 1000,
+                                     currentTime);
+        }
+
+        // Sleep until the next fire or stop; handle() wakes this task for
+        // forced starts/stops, config changes and clock steps
+        unsigned long next = schedule.timeUntilNext(currentTime);
+        for (size_t p = 0; p < PLANTS; p++) {
+            if (!(wateringPlants & (1u << p))) {
+                continue;
+            }
+            const long remaining = static_cast<long>(wateringUntil[p] - currentTime);
+            if (remaining <= 0) {
+                wateringPlants &= ~(1u << p);
+            } else {
+                next = min(next, static_cast<unsigned long>(remaining));
+            }
+        }
+        if (started || wateringPlants != before) {
+            Serial.println(wateringPlants ? "Starting watering" : "Stopping watering");
+            isWatering = wateringPlants != 0;
+            publishWatering();
+            for (size_t p = 0; p < PLANTS; p++) {
+                const uint32_t bit = 1u << p;
+                if ((before ^ wateringPlants) & bit) {
+                    pushEvent(TELEMETRY_WATERING, p, wateringPlants & bit);
+                }
+            }
+            wakeForWatering();
+        }
+        return next;
+    }
 
-            
-            // Update history if the interval has elapsed
-            if (updateHistory) {
-                lastHistoryUpdateTime = currentTime;
+    // Waters the plants of mask that have a pump for at least ms from now.
+    // Returns whether any started or got longer.
+    bool startWatering(uint32_t mask, unsigned long ms, unsigned long currentTime) {
+        bool started = false;
+        for (size_t p = 0; p < PLANTS; p++) {
+            const uint32_t bit = 1u << p;
+            if (!(mask & bit) || Board::plants[p].pumpPin < 0 || ms == 0) {
+                continue;
             }
+            const unsigned long until = currentTime + ms;
+            if (!(wateringPlants & bit) || static_cast<long>(until - wateringUntil[p]) > 0) {
+                wateringPlants |= bit;
+                wateringUntil[p] = until;
+                started = true;
+            }
+        }
+        if (started) {
+            lastWateringStartTimestamp = WallClock::now();
+        }
+        return started;
+    }
+
+    // The schedule from the schedules setting, with watering_interval and
+    // watering_duration for what its entries leave open
+    void configureSchedule(unsigned long currentTime) {
+#ifdef ESP_PLATFORM
+        // Cron times are local. On the host the TZ of the process applies.
+        const String timezone = config.getTimezone();
+        setenv("TZ", timezone.length() ? timezone.c_str() : "UTC0", 1);
+        tzset();
+#endif
+        const String schedules = config.getSchedules();
+        if (!schedule.configure(schedules.c_str(), PLANTS, config.getWateringInterval(), config.getWateringDuration(),
+                                currentTime)) {
+            Serial.println("Schedules do not parse, watering on the interval");
+        }
+    }
 
+    // The pumps react to a start or stop at once, and sampling switches to the watering rate
+    void wakeForWatering() {
+        scheduler.wake(pumpTask);
+        if (sampling) {
+            updateSampling();
+            if (isWatering) {
+                sampling->pollNow();
+            }
+        } else if (sampleState == SAMPLE_IDLE) {
+            scheduler.wake(sampleTask);
         }
-        // Manage watering based on interval and duration
-        if(lastWateringStartTime == 0 && lastWateringStartTimestamp == 0){
-            time(&lastWateringStartTimestamp);
+    }
+
+    // Drives the pump relays; once switched on a pump stays on for pumpRampTime
+    unsigned long pumpStep(unsigned long currentTime) {
+        const SensorSnapshot sensors = sensorManager.getSnapshot();
+        // Between waterings nothing can switch a pump on until wateringStep wakes this task
+        unsigned long next = isWatering ? pumpCheckInterval : idleCheckInterval;
+        if (interlock) {
+            const uint32_t longest = max(static_cast<uint32_t>(config.getWateringDuration()), schedule.getLongestDuration());
+            // Wider than shouldPump(), so only a loop() that failed to stop the pump trips it
+            interlock->setLimits(config.getWaterTankThreshold() - PUMP_INTERLOCK_LEVEL_MARGIN,
+                                 config.getPlantTargetLevel() + PUMP_INTERLOCK_LEVEL_MARGIN,
+                                 static_cast<unsigned long>(longest) * 1000 + PUMP_INTERLOCK_MAX_ON_MARGIN_MS);
         }
-        if (!isWatering && currentTime - lastWateringStartTime >= wateringInterval) {
-            // Start watering
-            Serial.println("Starting watering");
-            isWatering = true;
-            lastWateringStartTime = currentTime; // Reset the watering start time
-            time(&lastWateringStartTimestamp);
-        } else if (isWatering && currentTime - lastWateringStartTime >= wateringDuration) {
-            // Stop watering after the duration
-            
-            Serial.println("Stopping watering");
-            isWatering = false;
+        for (size_t p = 0; p < PLANTS; p++) {
+            const int pin = Board::plants[p].pumpPin;
+            if (pin < 0) {
+                continue;
+            }
+            Pump& pump = pumps[p];
+            unsigned long onFor = currentTime - pump.stats.onSince;
+            if (pump.state == PUMP_RAMPING && onFor < pumpRampTime) {
+                next = min(next, pumpRampTime - onFor); // Wait for pump to ramp up
+                continue;
+            }
+            if (switchPump(p, (wateringPlants & (1u << p)) && shouldPump(sensors, p))) {
+                if (pump.state == PUMP_OFF) {
+                    pump.stats.on = true;
+                    pump.stats.onSince = currentTime;
+                    pump.stats.starts++;
+                    pumpStats[p].publish(pump.stats);
+                    pushEvent(TELEMETRY_PUMP, p, true);
+                    pump.state = PUMP_RAMPING;
+                    next = min(next, pumpRampTime);
+                } else {
+                    pump.state = PUMP_ON;
+                }
+                continue;
+            }
+            // Stopped: the tank is low or the plant is wet enough, or the interlock tripped
+            if (pump.state != PUMP_OFF) {
+                pump.stats.on = false;
+                pump.stats.onMillis += onFor;
+                pumpStats[p].publish(pump.stats);
+                pushEvent(TELEMETRY_PUMP, p, false);
+            }
+            pump.state = PUMP_OFF;
         }
+        return next;
+    }
 
-        manageWatering();
+    // Returns whether the pump is now on
+    bool switchPump(size_t plant, bool on) {
+        if (interlock) {
+            return interlock->setPump(plant, on);
+        }
+        digitalWrite(Board::plants[plant].pumpPin, on ? HIGH : LOW);
+        return on;
     }
 
-private:
-    void manageWatering() {
-        // Retrieve sensor thresholds and current water level
+    bool shouldPump(const SensorSnapshot& sensors, size_t plant) {
         int waterTankThreshold = config.getWaterTankThreshold(); // For the water tank
-        auto currentValues = sensorManager.getLastValue(); // Get the last sensor values
-        const auto [currentTankLevel, currentPlantLevel, digitalSensorStatus] = currentValues;
-        // Serial.print("currentTankLevel: ");
-        // Serial.println(currentTankLevel);
-        // Serial.print("currentPlantLevel: ");
-        // Serial.println(currentPlantLevel);
-        // Serial.print("digitalSensorStatus: ");
-        // Serial.println(digitalSensorStatus);
-        // Serial.println(isWatering);
-        // int currentWaterLevel = currentValues.first; // Analog sensor value (0-1000)
-        // int digitalSensorStatus = currentValues.second; // Digital sensor status (0 or 1)
-        bool digitalSensorBool = useDigitalSensor ? digitalSensorStatus == 0 : true;
-        bool shouldPump = currentTankLevel > waterTankThreshold && digitalSensorBool && currentPlantLevel <= 400;
-        // Logic to control watering based on water level and digital sensor status
-        // Serial.print("shouldPump: ");
-        // Serial.println(shouldPump);
-        if (isWatering && shouldPump) {
-            // Start watering if below threshold and not already watering
-            digitalWrite(pumpPin, HIGH);
-            delay(50); // Wait for pump to ramp up
-        } 
-        if (!isWatering || !shouldPump ){//(currentTankLevel <= waterTankThreshold || (useDigitalSensor ? digitalSensorStatus == 1 : false)|| currentPlantLevel > 800)) {
-            // Stop watering if water level is sufficient or if digital sensor in the pot is triggered
-            digitalWrite(pumpPin, LOW);
-            // Serial.println("killing pump");
-        }
+        return sensors.tank > waterTankThreshold && sensors.plants[plant] <= config.getPlantTargetLevel();
     }
 };
 
@@ -0,0 +1,231 @@
+#ifndef ADCSAMPLER_H
+#define ADCSAMPLER_H
+
+#include <Arduino.h>
+#include "samplefilter.h"
+
+#define ADC_MEDIAN_WINDOW 5          // Default spike rejector window
+#define ADC_IIR_SHIFT 3              // Default low-pass, y += (x - y) / 8
+#define ADC_MAX_CHANNELS 8           // ADC1 has 8 channels, ADC2 is taken by Wi-Fi
+
+// Source of raw 12-bit readings of the capacitive sensors, one per channel in the
+// order of the pins it was constructed with
+class AdcSampler {
+public:
+    virtual ~AdcSampler() {}
+
+    // Called when a poll starts. powerCycled is set if the sensors were just
+    // switched on, so readings from before that are meaningless.
+    virtual void restart([[maybe_unused]] bool powerCycled) {}
+
+    // Called when the sensors are switched off; restart() resumes
+    virtual void suspend() {}
+
+    // Latest reading of the first count channels. Returns false if there is none yet.
+    virtual bool read(int* raw, size_t count) = 0;
+
+    // Median window and IIR shift of the digital filtering, if the backend has any
+    virtual void setFilter([[maybe_unused]] size_t medianWindow, [[maybe_unused]] uint8_t iirShift) {}
+
+    virtual const char* name() const = 0;
+};
+
+// One-shot analogRead() per channel, unfiltered. Used when the continuous driver
+// isn't available.
+class AnalogReadSampler : public AdcSampler {
+public:
+    AnalogReadSampler(const int* pins, size_t count) : count(min(count, static_cast<size_t>(ADC_MAX_CHANNELS))) {
+        for (size_t i = 0; i < this->count; i++) {
+            this->pins[i] = pins[i];
+        }
+    }
+
+    bool read(int* raw, size_t count) override {
+        if (count > this->count) {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            raw[i] = analogRead(pins[i]);
+        }
+        return true;
+    }
+
+    const char* name() const override {
+        return "analogRead";
+    }
+
+private:
+    int pins[ADC_MAX_CHANNELS];
+    const size_t count;
+};
+
+#ifdef ESP_PLATFORM
+#include <driver/adc.h>
+
+#define ADC_DMA_SAMPLE_RATE 20000    // Conversions per second over all channels, the ESP32 minimum
+#define ADC_DMA_FRAME_SIZE 128       // Bytes per DMA frame, 64 conversions / 3.2 ms
+#define ADC_DMA_BUFFER_SIZE 1024     // Driver ring buffer, 8 frames
+#define ADC_DMA_WAIT_MS 4            // Longest read() waits for a first frame after restart()
+
+// All channels converted back to back by the ADC1 digital controller and
+// written to memory by DMA, so the CPU only touches the results. Every
+// conversion goes through a median spike rejector and a fixed-point IIR;
+// read() drains what arrived since the last call and returns the filter output.
+//
+// While this runs ADC1 belongs to the DMA controller; analogRead() on ADC1 pins
+// must not be used at the same time.
+class ContinuousAdcSampler : public AdcSampler {
+public:
+    ContinuousAdcSampler(const int* pins, size_t count) : count(min(count, static_cast<size_t>(ADC_MAX_CHANNELS))) {
+        for (size_t i = 0; i < this->count; i++) {
+            this->pins[i] = pins[i];
+            medians[i].setWindow(ADC_MEDIAN_WINDOW);
+            iirs[i].setShift(ADC_IIR_SHIFT);
+            chains[i].add(&medians[i]);
+            chains[i].add(&iirs[i]);
+        }
+    }
+
+    // Starts continuous conversion. Returns false if the pins are not ADC1
+    // channels (ADC2 is taken by Wi-Fi) or the driver fails to start.
+    bool begin() {
+        uint32_t channelMask = 0;
+        for (size_t i = 0; i < count; i++) {
+            channels[i] = digitalPinToAnalogChannel(pins[i]);
+            if (channels[i] < 0 || channels[i] >= ADC1_CHANNEL_MAX) {
+                return false;
+            }
+            channelMask |= BIT(channels[i]);
+        }
+
+        adc_digi_init_config_t init = {};
+        init.max_store_buf_size = ADC_DMA_BUFFER_SIZE;
+        init.conv_num_each_intr = ADC_DMA_FRAME_SIZE;
+        init.adc1_chan_mask = channelMask;
+        init.adc2_chan_mask = 0;
+        if (adc_digi_initialize(&init) != ESP_OK) {
+            return false;
+        }
+
+        adc_digi_pattern_config_t patterns[ADC_MAX_CHANNELS] = {};
+        for (size_t i = 0; i < count; i++) {
+            patterns[i].atten = ADC_ATTEN_DB_11; // Same range as analogRead()
+            patterns[i].channel = channels[i];
+            patterns[i].unit = 0;                // ADC1
+            patterns[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+        }
+        adc_digi_configuration_t config = {};
+        config.conv_limit_en = 1; // Required on the ESP32
+        config.conv_limit_num = 250;
+        config.pattern_num = count;
+        config.adc_pattern = patterns;
+        config.sample_freq_hz = ADC_DMA_SAMPLE_RATE;
+        config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+        config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+        if (adc_digi_controller_configure(&config) != ESP_OK || adc_digi_start() != ESP_OK) {
+            adc_digi_deinitialize();
+            return false;
+        }
+        running = true;
+        return true;
+    }
+
+    bool isRunning() const {
+        return running;
+    }
+
+    // Discards everything converted before now. The driver drops new frames
+    // while its buffer is full, so between polls it holds the oldest data.
+    void restart(bool powerCycled) override {
+        if (!running) return;
+        if (suspended && adc_digi_start() == ESP_OK) {
+            suspended = false;
+        }
+        uint32_t length = 0;
+        for (size_t i = 0; i < ADC_DMA_BUFFER_SIZE / ADC_DMA_FRAME_SIZE + 1; i++) {
+            if (!readFrame(0, length)) {
+                break;
+            }
+        }
+        if (powerCycled) {
+            for (size_t i = 0; i < count; i++) {
+                chains[i].reset();
+            }
+        }
+        fresh = false;
+    }
+
+    // Stops conversion, which also releases the driver's power management lock
+    void suspend() override {
+        if (running && !suspended && adc_digi_stop() == ESP_OK) {
+            suspended = true;
+        }
+    }
+
+    bool read(int* raw, size_t count) override {
+        if (!running || suspended || count > this->count) return false;
+        uint32_t length = 0;
+        // Bounded so a read never drains more than the driver can hold
+        for (size_t i = 0; i < ADC_DMA_BUFFER_SIZE / ADC_DMA_FRAME_SIZE; i++) {
+            if (!readFrame(fresh ? 0 : ADC_DMA_WAIT_MS, length)) {
+                break;
+            }
+            filterFrame(length);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (chains[i].sampleCount() == 0) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            raw[i] = chains[i].value();
+        }
+        return true;
+    }
+
+    void setFilter(size_t medianWindow, uint8_t iirShift) override {
+        for (size_t i = 0; i < count; i++) {
+            medians[i].setWindow(medianWindow);
+            iirs[i].setShift(iirShift);
+        }
+    }
+
+    const char* name() const override {
+        return "dma";
+    }
+
+private:
+    int pins[ADC_MAX_CHANNELS];
+    const size_t count;
+    int8_t channels[ADC_MAX_CHANNELS];
+    bool running = false;
+    bool suspended = false; // Stopped by suspend() until the next restart()
+    bool fresh = false; // A frame arrived since restart()
+    uint8_t frame[ADC_DMA_FRAME_SIZE];
+    MedianFilter medians[ADC_MAX_CHANNELS];
+    IirFilter iirs[ADC_MAX_CHANNELS];
+    FilterChain chains[ADC_MAX_CHANNELS];
+
+    bool readFrame(uint32_t timeout, uint32_t& length) {
+        length = 0;
+        esp_err_t err = adc_digi_read_bytes(frame, sizeof(frame), &length, timeout);
+        // ESP_ERR_INVALID_STATE only reports that frames were dropped, the data is valid
+        return (err == ESP_OK || err == ESP_ERR_INVALID_STATE) && length > 0;
+    }
+
+    void filterFrame(uint32_t length) {
+        for (uint32_t offset = 0; offset + sizeof(adc_digi_output_data_t) <= length; offset += sizeof(adc_digi_output_data_t)) {
+            const adc_digi_output_data_t* result = reinterpret_cast<const adc_digi_output_data_t*>(frame + offset);
+            for (size_t i = 0; i < count; i++) {
+                if (result->type1.channel == channels[i]) {
+                    chains[i].apply(result->type1.data);
+                    break;
+                }
+            }
+        }
+        fresh = true;
+    }
+};
+#endif
+
+#endif // ADCSAMPLER_H
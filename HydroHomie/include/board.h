@@ -0,0 +1,24 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include "channels.h"
+
+// Channel table of the board the firmware is built for. The sensor, history and
+// watering pipeline is instantiated on it, so adding a plant adds one fixed-size
+// slice of state: a history (~12 KB), rollup tiers (~17 KB) and a pump.
+//
+// Levels are those of the original calibration: 1350 (wet) .. 2000 (dry) raw.
+struct HydroHomieBoard {
+    // Capacitive sensor on GPIO 35, powered from GPIO 19
+    static constexpr SensorChannel tank = {35, 19, 2000, 1350};
+
+    // Capacitive sensor on GPIO 34, powered from GPIO 19; pump relay on GPIO 23
+    static constexpr size_t PLANTS = 1;
+    static constexpr PlantChannel plants[PLANTS] = {
+        {{34, 19, 2000, 1350}, 23},
+    };
+};
+
+typedef HydroHomieBoard Board;
+
+#endif // BOARD_H
@@ -0,0 +1,53 @@
+#ifndef BOOTMETRICS_H
+#define BOOTMETRICS_H
+
+#include <Arduino.h>
+#include <atomic>
+
+enum BootMilestone {
+    BOOT_FIRST_SAMPLE,         // First poll of the sensors completed
+    BOOT_HTTP_LISTENING,       // HTTP server started
+    BOOT_FIRST_HTTP_RESPONSE,  // First request answered
+    BOOT_WIFI_CONNECTED,       // First IP address
+    BOOT_TIME_SYNCED,          // First NTP sync
+    BOOT_MILESTONES
+};
+
+inline const char* bootMilestoneName(uint8_t milestone) {
+    switch (milestone) {
+        case BOOT_FIRST_SAMPLE: return "first_sample";
+        case BOOT_HTTP_LISTENING: return "http_listening";
+        case BOOT_FIRST_HTTP_RESPONSE: return "first_http_response";
+        case BOOT_WIFI_CONNECTED: return "wifi_connected";
+        case BOOT_TIME_SYNCED: return "time_synced";
+        default: return "unknown";
+    }
+}
+
+// millis() at which each milestone of the boot was first reached. mark() and
+// the getters are safe from any task, e.g. the httpd or Wi-Fi event tasks.
+class BootMetrics {
+public:
+    void mark(BootMilestone milestone) {
+        if (reached(milestone)) {
+            return;
+        }
+        unsigned long expected = 0;
+        const unsigned long now = millis();
+        at[milestone].compare_exchange_strong(expected, now ? now : 1);
+    }
+
+    bool reached(BootMilestone milestone) const {
+        return at[milestone].load(std::memory_order_relaxed) != 0;
+    }
+
+    // millis() of the milestone, 0 until it is reached
+    unsigned long getMillis(BootMilestone milestone) const {
+        return at[milestone].load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<unsigned long> at[BOOT_MILESTONES] = {};
+};
+
+#endif // BOOTMETRICS_H
@@ -0,0 +1,40 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LEVEL_FULL 1000 // Calibrated levels run 0..LEVEL_FULL
+
+// One capacitive sensor: its pins and a linear calibration from raw 12-bit
+// counts to 0..LEVEL_FULL. The scale is a Q16 constant folded at compile time
+// for constexpr tables, so level() is a clamp, a multiply and a shift.
+struct SensorChannel {
+    int8_t sensorPin;
+    int8_t powerPin;
+    int16_t rawEmpty; // Raw reading at level 0
+    int16_t rawFull;  // Raw reading at LEVEL_FULL; capacitive probes read lower when wet
+
+    constexpr int32_t scaleQ16() const {
+        return (static_cast<int32_t>(LEVEL_FULL) << 16) / (rawFull - rawEmpty);
+    }
+
+    // Clamping first bounds |raw - rawEmpty| by the span, so the product fits 32 bits
+    // and is never negative; it is rounded to the nearest level
+    constexpr int level(int raw) const {
+        return static_cast<int>((((rawFull < rawEmpty ? clamp(raw, rawFull, rawEmpty) : clamp(raw, rawEmpty, rawFull))
+                                  - rawEmpty) * scaleQ16() + (1 << 15)) >> 16);
+    }
+
+    static constexpr int clamp(int value, int low, int high) {
+        return value < low ? low : (value > high ? high : value);
+    }
+};
+
+// A plant: its moisture sensor and the relay of the pump that waters it
+struct PlantChannel {
+    SensorChannel sensor;
+    int8_t pumpPin; // -1 for a plant that is only monitored
+};
+
+#endif // CHANNELS_H
@@ -0,0 +1,77 @@
+#ifndef CHUNKEDWRITER_H
+#define CHUNKEDWRITER_H
+
+#include <Arduino.h>
+#include <functional>
+
+// Print adapter that collects output in a caller-provided fixed buffer and hands
+// it to a sink (e.g. PsychicResponse::sendChunk) whenever the buffer fills up.
+// Memory use is the size of that buffer no matter how much is written.
+class ChunkedWriter : public Print {
+public:
+    typedef std::function<bool(const uint8_t* data, size_t len)> Sink;
+
+    ChunkedWriter(uint8_t* buffer, size_t capacity, Sink sink)
+    : buffer(buffer), capacity(capacity), sink(sink) {}
+
+    size_t write(uint8_t c) override {
+        if (length == capacity && !sendBuffered()) {
+            return 0;
+        }
+        buffer[length++] = c;
+        return 1;
+    }
+
+    size_t write(const uint8_t* data, size_t len) override {
+        size_t written = 0;
+        while (written < len) {
+            if (length == capacity && !sendBuffered()) {
+                break;
+            }
+            size_t n = min(len - written, capacity - length);
+            memcpy(buffer + length, data + written, n);
+            length += n;
+            written += n;
+        }
+        return written;
+    }
+
+    // Send whatever is buffered. Returns false once the sink has failed,
+    // after which further output is dropped.
+    bool sendBuffered() {
+        if (failed) {
+            return false;
+        }
+        if (length > 0 && !sink(buffer, length)) {
+            failed = true;
+        } else {
+            total += length;
+        }
+        length = 0;
+        return !failed;
+    }
+
+    // Print's flush(), for code that only knows a Print
+    void flush() override {
+        sendBuffered();
+    }
+
+    bool hasFailed() const {
+        return failed;
+    }
+
+    // Bytes the sink accepted so far
+    size_t bytesWritten() const {
+        return total;
+    }
+
+private:
+    uint8_t* buffer;
+    const size_t capacity;
+    Sink sink;
+    size_t length = 0;
+    size_t total = 0;
+    bool failed = false;
+};
+
+#endif // CHUNKEDWRITER_H
@@ -0,0 +1,221 @@
+#ifndef CONNECTIVITY_H
+#define CONNECTIVITY_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiManager.h> // https://github.com/tzapu/WiFiManager
+#include <esp_sntp.h>
+#include <time.h>
+#include <atomic>
+#include <functional>
+#include "bootmetrics.h"
+#include "wallclock.h"
+
+#define CONNECTIVITY_RETRY_MIN_MS 5000   // First reconnect after the link dropped
+#define CONNECTIVITY_RETRY_MAX_MS 60000  // Reconnect backoff limit
+#define CONNECTIVITY_PORTAL_POLL_MS 10   // process() cadence while the portal is open
+#define CONNECTIVITY_PORTAL_AFTER_MS 120000 // Saved network not joined since boot for this long: open the portal
+#define CONNECTIVITY_PORTAL_TIMEOUT_S 300   // A fallback portal left unused closes, and the saved network is retried
+#define CONNECTIVITY_NAME_LENGTH 32
+
+enum ConnectivityState {
+    CONNECTIVITY_PORTAL,     // No saved network, or it never joined: the WiFiManager portal is open
+    CONNECTIVITY_CONNECTING, // Joining the saved network, retried with backoff
+    CONNECTIVITY_ONLINE      // Has an IP address
+};
+
+// Brings up Wi-Fi, NTP and the network services without ever blocking loop(),
+// so sampling and watering run from the first iteration on:
+//
+//   no saved network -> PORTAL -> credentials saved -> CONNECTING/ONLINE
+//   saved network    -> CONNECTING <-> ONLINE, reconnects backing off to 60 s
+//   not joined within CONNECTIVITY_PORTAL_AFTER_MS of boot -> PORTAL, which
+//                       closes after CONNECTIVITY_PORTAL_TIMEOUT_S -> CONNECTING
+//
+// The Wi-Fi and SNTP callbacks run on the event task; they only record what
+// happened and call onChange(), e.g. to end a power-save wait. handle() moves
+// the state machine on the loop task. onReady() runs there once, with the first
+// address: from then on the HTTP server has port 80, so the portal can't open
+// again and a lost link is only ever reconnected. NTP starts with the first
+// address too; until it syncs, WallClock stamps samples and events with the
+// time since boot.
+class Connectivity {
+public:
+    // The loop task's work once the network stack is up, e.g. starting the servers
+    void onReady(std::function<void()> callback) {
+        readyCallback = callback;
+    }
+
+    // Called on the event task after every Wi-Fi or time change
+    void onChange(std::function<void()> callback) {
+        changeCallback = callback;
+    }
+
+    // From setup(); returns at once
+    void begin(const char* apName, BootMetrics* metrics) {
+        strncpy(name, apName, CONNECTIVITY_NAME_LENGTH);
+        name[CONNECTIVITY_NAME_LENGTH] = '\0';
+        bootMetrics = metrics;
+        active = this;
+        WiFi.onEvent([this](arduino_event_id_t event, arduino_event_info_t info) { wifiEvent(event); });
+        sntp_set_time_sync_notification_cb(timeSynced);
+
+        WiFi.mode(WIFI_STA); // Starts the driver, which holds the saved network
+        if (wifiManager.getWiFiIsSaved()) {
+            WiFi.setAutoReconnect(true);
+            WiFi.begin(); // The saved network; the address arrives as an event
+            state = CONNECTIVITY_CONNECTING;
+            lastAttempt = connectingSince = millis();
+        } else {
+            Serial.printf("No saved network, portal \"%s\" open\n", name);
+            openPortal(0);
+        }
+    }
+
+    // Call from loop(); never blocks
+    void handle() {
+        const unsigned long now = millis();
+        switch (state) {
+            case CONNECTIVITY_PORTAL:
+                if (wifiManager.process()) {
+                    // Saved and joined; the portal has closed and freed port 80
+                    WiFi.setAutoReconnect(true);
+                    state = CONNECTIVITY_CONNECTING;
+                    lastAttempt = connectingSince = now;
+                } else if (!wifiManager.getConfigPortalActive()) {
+                    // The fallback portal timed out unused; the saved network may be back
+                    Serial.println("Portal closed, retrying the saved network");
+                    WiFi.mode(WIFI_STA);
+                    WiFi.begin();
+                    state = CONNECTIVITY_CONNECTING;
+                    lastAttempt = connectingSince = now;
+                    retryMs = CONNECTIVITY_RETRY_MIN_MS;
+                }
+                break;
+            case CONNECTIVITY_CONNECTING:
+                if (linkUp.load()) {
+                    Serial.print("connected...let's hydrate! ");
+                    Serial.println(WiFi.localIP());
+                    state = CONNECTIVITY_ONLINE;
+                    retryMs = CONNECTIVITY_RETRY_MIN_MS;
+                } else if (!ready && now - connectingSince >= CONNECTIVITY_PORTAL_AFTER_MS) {
+                    // Moved, or the router's password changed: let the user enter another network
+                    Serial.printf("Saved network not joined, portal \"%s\" open\n", name);
+                    openPortal(CONNECTIVITY_PORTAL_TIMEOUT_S);
+                } else if (now - lastAttempt >= retryMs) {
+                    WiFi.reconnect();
+                    lastAttempt = now;
+                    retryMs = min(retryMs * 2, static_cast<unsigned long>(CONNECTIVITY_RETRY_MAX_MS));
+                }
+                break;
+            case CONNECTIVITY_ONLINE:
+                if (!linkUp.load()) {
+                    Serial.println("Wi-Fi lost, reconnecting");
+                    state = CONNECTIVITY_CONNECTING;
+                    lastAttempt = now;
+                }
+                break;
+        }
+        if (state == CONNECTIVITY_ONLINE && !ntpStarted) {
+            // UTC; the local time of the cron schedules is the timezone setting's TZ
+            configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+            ntpStarted = true;
+        }
+        if (state == CONNECTIVITY_ONLINE && !ready) {
+            ready = true;
+            if (readyCallback) {
+                readyCallback();
+            }
+        }
+    }
+
+    // Milliseconds until handle() has something to do without an event
+    unsigned long timeUntilNext() const {
+        if (state == CONNECTIVITY_PORTAL) {
+            return CONNECTIVITY_PORTAL_POLL_MS;
+        }
+        if (state == CONNECTIVITY_CONNECTING) {
+            const unsigned long now = millis();
+            const unsigned long waited = now - lastAttempt;
+            unsigned long next = waited < retryMs ? retryMs - waited : 0;
+            if (!ready) {
+                const unsigned long connecting = now - connectingSince;
+                const unsigned long untilPortal = connecting < CONNECTIVITY_PORTAL_AFTER_MS ? CONNECTIVITY_PORTAL_AFTER_MS - connecting : 0;
+                next = min(next, untilPortal);
+            }
+            return next;
+        }
+        return ULONG_MAX;
+    }
+
+    ConnectivityState getState() const {
+        return state;
+    }
+
+    // Whether onReady() has run
+    bool isReady() const {
+        return ready;
+    }
+
+private:
+    static inline Connectivity* active = nullptr; // For the SNTP callback, which takes no argument
+
+    WiFiManager wifiManager;
+    char name[CONNECTIVITY_NAME_LENGTH + 1] = "";
+    BootMetrics* bootMetrics = nullptr;
+    std::function<void()> readyCallback;
+    std::function<void()> changeCallback;
+    ConnectivityState state = CONNECTIVITY_CONNECTING;
+    std::atomic<bool> linkUp{false};
+    unsigned long lastAttempt = 0;
+    unsigned long connectingSince = 0; // Start of the current attempt at a first connection
+    unsigned long retryMs = CONNECTIVITY_RETRY_MIN_MS;
+    bool ntpStarted = false;
+    bool ready = false;
+
+    // Non-blocking portal; timeoutSeconds 0 keeps it open until credentials are saved
+    void openPortal(unsigned long timeoutSeconds) {
+        wifiManager.setConfigPortalBlocking(false);
+        wifiManager.setConfigPortalTimeout(timeoutSeconds);
+        wifiManager.startConfigPortal(name);
+        state = CONNECTIVITY_PORTAL;
+    }
+
+    void wifiEvent(arduino_event_id_t event) {
+        switch (event) {
+            case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+                linkUp.store(true);
+                if (bootMetrics) {
+                    bootMetrics->mark(BOOT_WIFI_CONNECTED);
+                }
+                break;
+            case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+            case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+                linkUp.store(false);
+                break;
+            default:
+                return;
+        }
+        notifyChange();
+    }
+
+    static void timeSynced(struct timeval* tv) {
+        WallClock::synced();
+        Connectivity* self = active;
+        if (!self) {
+            return;
+        }
+        if (self->bootMetrics) {
+            self->bootMetrics->mark(BOOT_TIME_SYNCED);
+        }
+        self->notifyChange();
+    }
+
+    void notifyChange() {
+        if (changeCallback) {
+            changeCallback();
+        }
+    }
+};
+
+#endif // CONNECTIVITY_H
@@ -0,0 +1,42 @@
+#ifndef HEAPSTATS_H
+#define HEAPSTATS_H
+
+#include <stdint.h>
+
+// Counts heap allocations (malloc, calloc, realloc) made by one task over a span of
+// code, e.g. one HTTP handler. The counting needs the linker to wrap the allocator,
+// see the esp32dev-heapstats environment in platformio.ini; in other builds
+// heapStatsEnabled() is false and every count is 0.
+//
+// One measurement at a time: the counter follows the task that created it.
+class HeapAllocationCounter {
+public:
+    HeapAllocationCounter();
+    ~HeapAllocationCounter();
+
+    // Allocations by the measuring task since construction
+    uint32_t count() const;
+
+private:
+    uint32_t start;
+};
+
+bool heapStatsEnabled();
+
+// Allocation statistics of one route
+struct HeapRouteStats {
+    const char* route = "";
+    uint32_t requests = 0;
+    uint32_t lastAllocations = 0;
+    uint32_t maxAllocations = 0;
+    uint32_t totalAllocations = 0;
+
+    void record(uint32_t allocations) {
+        requests++;
+        lastAllocations = allocations;
+        totalAllocations += allocations;
+        if (allocations > maxAllocations) maxAllocations = allocations;
+    }
+};
+
+#endif // HEAPSTATS_H
@@ -0,0 +1,587 @@
+#ifndef HISTORYLOG_H
+#define HISTORYLOG_H
+
+#include <Arduino.h>
+#include <time.h>
+#include <utility>
+#include "homieconfig.h"
+#include "historystore.h"
+#include "checksum.h"
+#include "wallclock.h"
+
+#define HISTORY_LOG_MAGIC 0x474C4848   // "HHLG"
+#define HISTORY_LOG_VERSION 2
+#define HISTORY_LOG_MAX_SECTORS 64     // Per plant: 64 x 4 KB, ~30k samples / ~21 days at one per minute
+#define HISTORY_LOG_PAGE_SIZE 256      // Flash program page, the write batch size
+#define HISTORY_LOG_PENDING_MAGIC 0x50474C48 // "HLGP"
+
+// Raw access to an erasable flash region. Addresses are relative to the region.
+class FlashBackend {
+public:
+    virtual ~FlashBackend() {}
+    virtual size_t sectorSize() const = 0;
+    virtual size_t sectorCount() const = 0;
+    virtual bool read(size_t address, void* data, size_t length) = 0;
+    virtual bool write(size_t address, const void* data, size_t length) = 0;
+    virtual bool erase(size_t sector) = 0;
+};
+
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+
+// FlashBackend on a data partition. Defaults to the "spiffs" partition of the stock
+// partition table, which the firmware does not otherwise use, so devices updated
+// over OTA get the log without reflashing the partition table. The whole partition
+// is exposed; PlantHistoryLogs splits it between the plants.
+class PartitionFlash : public FlashBackend {
+public:
+    bool begin(esp_partition_subtype_t subtype = ESP_PARTITION_SUBTYPE_DATA_SPIFFS, const char* label = nullptr) {
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, subtype, label);
+        return partition != nullptr;
+    }
+
+    size_t sectorSize() const override {
+        return SPI_FLASH_SEC_SIZE;
+    }
+
+    size_t sectorCount() const override {
+        return partition ? partition->size / SPI_FLASH_SEC_SIZE : 0;
+    }
+
+    bool read(size_t address, void* data, size_t length) override {
+        return esp_partition_read(partition, address, data, length) == ESP_OK;
+    }
+
+    bool write(size_t address, const void* data, size_t length) override {
+        return esp_partition_write(partition, address, data, length) == ESP_OK;
+    }
+
+    bool erase(size_t sector) override {
+        return esp_partition_erase_range(partition, sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE) == ESP_OK;
+    }
+
+private:
+    const esp_partition_t* partition = nullptr;
+};
+#endif
+
+// Part index of parts equal runs of sectors of another backend, e.g. one
+// plant's share of the log partition. Sizes follow the backend, so the split
+// can be set up before the partition is found.
+class FlashRegion : public FlashBackend {
+public:
+    FlashRegion(FlashBackend& flash, size_t part, size_t parts) : flash(flash), part(part), parts(parts) {}
+
+    size_t sectorSize() const override {
+        return flash.sectorSize();
+    }
+
+    size_t sectorCount() const override {
+        return flash.sectorCount() / parts;
+    }
+
+    bool read(size_t address, void* data, size_t length) override {
+        return contains(address, length) && flash.read(start() + address, data, length);
+    }
+
+    bool write(size_t address, const void* data, size_t length) override {
+        return contains(address, length) && flash.write(start() + address, data, length);
+    }
+
+    bool erase(size_t sector) override {
+        return sector < sectorCount() && flash.erase(part * sectorCount() + sector);
+    }
+
+private:
+    FlashBackend& flash;
+    const size_t part;
+    const size_t parts;
+
+    size_t start() const {
+        return part * sectorCount() * sectorSize();
+    }
+
+    bool contains(size_t address, size_t length) const {
+        return address + length <= sectorCount() * sectorSize();
+    }
+};
+
+// Append-only log of history samples on a ring of flash sectors.
+//
+// Every sector is one segment: a header page followed by pages of 8-byte records
+//   header  u32 magic, u16 version, u16 record size, u32 segment seq,
+//           u32 seq of the first record, u32 time of the first record,
+//           u32 plant, u32 reserved, u32 CRC-32 of the preceding 28 bytes
+//   record  u32 timestamp, u32 tank:10 | plant:10 | digital:1 | pad:3 | crc8:8
+// Records in a segment have consecutive history sequence numbers, so the number of
+// records in any segment but the newest follows from the next segment's header.
+// begin() therefore only reads the headers plus a binary search for the end of the
+// newest segment; restore() then reads just enough records to refill RAM.
+//
+// Samples are collected in RAM and written a flash page at a time, or earlier when
+// the configured flush interval elapses. No write crosses a page: an early flush
+// is split at the page boundary, and the next batch is written when it reaches
+// the end of that page, so batches line up with pages again. A record torn by
+// power loss fails its CRC, ends its segment, and the next flush starts a fresh
+// segment.
+//
+// The collected samples can live in RTC memory instead (retainPending()), where
+// they survive a watchdog or brownout reset; begin() then writes them out.
+//
+// One log holds the history of one plant. Its segments are stamped with the
+// plant index and a log skips segments of any other plant, so logs that were
+// moved to another region never restore the wrong plant's samples.
+class HistoryLog {
+public:
+    struct LogRecord {
+        uint32_t timestamp;
+        uint32_t levels;
+    };
+
+    static const size_t PENDING_LENGTH = HISTORY_LOG_PAGE_SIZE / sizeof(LogRecord); // Records per page
+
+    // Samples waiting for the next flush, CRC-sealed after every change
+    struct PendingPage {
+        uint32_t magic;
+        uint32_t firstSeq;
+        uint32_t count;
+        LogRecord records[PENDING_LENGTH];
+        uint32_t crc;
+    };
+
+    HistoryLog(FlashBackend& flash, HomieConfig& config, uint32_t plant = 0) : flash(flash), config(config), plant(plant) {}
+    HistoryLog(const HistoryLog&) = delete; // pending may point into it
+
+    // Keeps the pending samples in page, e.g. a RTC_NOINIT_ATTR variable. Call
+    // before begin(), which keeps the page's contents if its CRC holds.
+    void retainPending(PendingPage* page) {
+        pending = page ? page : &ownPending;
+    }
+
+    bool begin() {
+        if (!isSealed(*pending)) {
+            pending->count = 0;
+            sealPending();
+        }
+        sectors = min(flash.sectorCount(), static_cast<size_t>(HISTORY_LOG_MAX_SECTORS));
+        if (sectors == 0) {
+            Serial.println("History log: no flash region");
+            return false;
+        }
+        recordsPerSegment = (flash.sectorSize() - HISTORY_LOG_PAGE_SIZE) / sizeof(LogRecord);
+        active = -1;
+        for (size_t sector = 0; sector < sectors; sector++) {
+            SegmentHeader header;
+            index[sector].valid = flash.read(sector * flash.sectorSize(), &header, sizeof(header)) && isValid(header);
+            if (!index[sector].valid) {
+                continue;
+            }
+            index[sector].segmentSeq = header.segmentSeq;
+            index[sector].firstSeq = header.firstSeq;
+            index[sector].firstTime = header.firstTime;
+            if (active < 0 || static_cast<int32_t>(header.segmentSeq - index[active].segmentSeq) > 0) {
+                active = sector;
+            }
+        }
+        if (active >= 0) {
+            nextSegmentSeq = index[active].segmentSeq + 1;
+            activeCount = countRecords(active, activeTorn);
+            nextSeq = index[active].firstSeq + activeCount;
+        }
+        enabled = true;
+        if (pending->count > 0) {
+            Serial.printf("History log: %u samples kept over the reset\n", static_cast<unsigned>(pending->count));
+            flush();
+        }
+        return true;
+    }
+
+    // Refills the RAM history with the newest logged samples and continues its
+    // sequence numbers where the log left off.
+    template <typename Store>
+    size_t restore(Store& history) {
+        if (!enabled || active < 0) {
+            return 0;
+        }
+        uint32_t endSeq = nextSeq;
+        uint32_t startSeq = endSeq - min(static_cast<uint32_t>(Store::capacity()), endSeq);
+        // Walk back from the newest segment to the one holding startSeq
+        int sector = active;
+        size_t visited = 1;
+        while (visited < sectors && static_cast<int32_t>(index[sector].firstSeq - startSeq) > 0) {
+            int previous = findSegment(index[sector].segmentSeq - 1);
+            if (previous < 0 || segmentEnd(previous) != index[sector].firstSeq) {
+                break; // Older data is missing or not contiguous
+            }
+            sector = previous;
+            visited++;
+        }
+        if (static_cast<int32_t>(index[sector].firstSeq - startSeq) > 0) {
+            startSeq = index[sector].firstSeq;
+        }
+
+        history.restart(startSeq);
+        size_t restored = 0;
+        LogRecord batch[HISTORY_LOG_PAGE_SIZE / sizeof(LogRecord)];
+        while (sector >= 0) {
+            uint32_t first = index[sector].firstSeq;
+            if (static_cast<int32_t>(first - history.nextSeq()) > 0) {
+                // Gap left by a failed write, keep only the newer run
+                history.restart(first);
+                restored = 0;
+            }
+            uint32_t count = segmentEnd(sector) - first;
+            uint32_t slot = static_cast<int32_t>(history.nextSeq() - first) > 0 ? history.nextSeq() - first : 0;
+            while (slot < count) {
+                size_t n = min(static_cast<size_t>(count - slot), sizeof(batch) / sizeof(batch[0]));
+                if (!flash.read(recordAddress(sector, slot), batch, n * sizeof(LogRecord))) {
+                    break;
+                }
+                size_t valid = 0;
+                HistoryEntry entry;
+                while (valid < n && decode(batch[valid], entry)) {
+                    history.push(entry.tank, entry.plant, entry.digital, entry.timestamp);
+                    valid++;
+                }
+                restored += valid;
+                slot += valid;
+                if (valid < n) {
+                    break; // Torn or unwritten record ends this segment
+                }
+            }
+            if (sector == active) {
+                break;
+            }
+            sector = findSegment(index[sector].segmentSeq + 1);
+        }
+        Serial.printf("History log: restored %u samples\n", static_cast<unsigned>(restored));
+        return restored;
+    }
+
+    // Queues a sample that was just pushed to the RAM history
+    void append(const HistoryEntry& entry) {
+        if (!enabled) {
+            return;
+        }
+        if (pending->count > 0 && entry.seq != pending->firstSeq + pending->count) {
+            flush();
+        }
+        if (pending->count == 0) {
+            pending->firstSeq = entry.seq;
+        }
+        pending->records[pending->count++] = encode(entry);
+        sealPending();
+        if (pending->count == PENDING_LENGTH || fillsPage()) {
+            flush();
+        }
+    }
+
+    // Flushes on the configured cadence, call from loop(). Samples stamped
+    // before the clock was set wait for rebase(), unless they fill the page.
+    void handle() {
+        unsigned long interval = static_cast<unsigned long>(config.getHistoryFlushInterval()) * 1000;
+        if (pending->count > 0 && millis() - lastFlushTime >= interval
+            && !WallClock::isProvisional(pending->records[0].timestamp)) {
+            flush();
+        }
+    }
+
+    // Moves the queued samples stamped before `before` by offset, see HistoryStore::rebase()
+    void rebase(uint32_t before, uint32_t offset) {
+        for (size_t i = 0; i < pending->count; i++) {
+            HistoryEntry entry;
+            if (pending->records[i].timestamp < before && decode(pending->records[i], entry)) {
+                entry.timestamp += offset;
+                pending->records[i] = encode(entry);
+            }
+        }
+        sealPending();
+    }
+
+    // Writes all queued samples, e.g. before an OTA reboot
+    bool flush() {
+        lastFlushTime = millis();
+        size_t done = 0;
+        bool ok = true;
+        while (done < pending->count) {
+            uint32_t seq = pending->firstSeq + done;
+            if (active < 0 || activeTorn || activeCount >= recordsPerSegment || index[active].firstSeq + activeCount != seq) {
+                if (!openSegment(seq, pending->records[done].timestamp)) {
+                    ok = false;
+                    break;
+                }
+            }
+            size_t n = min(static_cast<size_t>(pending->count) - done, recordsPerSegment - activeCount);
+            n = min(n, PENDING_LENGTH - activeCount % PENDING_LENGTH); // Up to the end of the page
+            if (!flash.write(recordAddress(active, activeCount), &pending->records[done], n * sizeof(LogRecord))) {
+                // Don't append after a failed program, start a new segment next time
+                activeTorn = true;
+                ok = false;
+                break;
+            }
+            activeCount += n;
+            done += n;
+        }
+        nextSeq = pending->firstSeq + done;
+        pending->count = 0;
+        sealPending();
+        return ok;
+    }
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+private:
+    struct SegmentHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t recordSize;
+        uint32_t segmentSeq;
+        uint32_t firstSeq;
+        uint32_t firstTime;
+        uint32_t plant;     // Zero in logs written before there were several plants
+        uint32_t reserved;
+        uint32_t crc;
+    };
+
+    static_assert(sizeof(SegmentHeader) <= HISTORY_LOG_PAGE_SIZE, "The segment header has a page of its own");
+
+    struct Segment {
+        bool valid;
+        uint32_t segmentSeq;
+        uint32_t firstSeq;
+        uint32_t firstTime;
+    };
+
+    FlashBackend& flash;
+    HomieConfig& config;
+    const uint32_t plant;
+    bool enabled = false;
+    size_t sectors = 0;
+    size_t recordsPerSegment = 0;
+    Segment index[HISTORY_LOG_MAX_SECTORS];
+    int active = -1;           // Sector being appended to
+    size_t activeCount = 0;    // Records already in the active sector
+    bool activeTorn = false;
+    uint32_t nextSegmentSeq = 0;
+    uint32_t nextSeq = 0;      // History seq following the last logged record
+    PendingPage ownPending = {};
+    PendingPage* pending = &ownPending;
+    unsigned long lastFlushTime = 0;
+
+    void sealPending() {
+        pending->magic = HISTORY_LOG_PENDING_MAGIC;
+        pending->crc = crc32(reinterpret_cast<const uint8_t*>(pending), offsetof(PendingPage, crc));
+    }
+
+    static bool isSealed(const PendingPage& page) {
+        return page.magic == HISTORY_LOG_PENDING_MAGIC && page.count <= PENDING_LENGTH
+            && page.crc == crc32(reinterpret_cast<const uint8_t*>(&page), offsetof(PendingPage, crc));
+    }
+
+    static uint8_t recordCrc(uint32_t timestamp, uint32_t levels) {
+        uint8_t bytes[7] = {
+            static_cast<uint8_t>(timestamp), static_cast<uint8_t>(timestamp >> 8),
+            static_cast<uint8_t>(timestamp >> 16), static_cast<uint8_t>(timestamp >> 24),
+            static_cast<uint8_t>(levels), static_cast<uint8_t>(levels >> 8), static_cast<uint8_t>(levels >> 16)};
+        return crc8(bytes, sizeof(bytes));
+    }
+
+    static LogRecord encode(const HistoryEntry& entry) {
+        LogRecord record;
+        record.timestamp = entry.timestamp;
+        record.levels = (static_cast<uint32_t>(constrain(entry.tank, 0, 1023)))
+            | (static_cast<uint32_t>(constrain(entry.plant, 0, 1023)) << 10)
+            | ((entry.digital ? 1u : 0u) << 20);
+        record.levels |= static_cast<uint32_t>(recordCrc(record.timestamp, record.levels)) << 24;
+        return record;
+    }
+
+    static bool decode(const LogRecord& record, HistoryEntry& entry) {
+        uint32_t levels = record.levels & 0x00FFFFFF;
+        if ((record.levels >> 24) != recordCrc(record.timestamp, levels)) {
+            return false;
+        }
+        entry.timestamp = record.timestamp;
+        entry.tank = levels & 0x3FF;
+        entry.plant = (levels >> 10) & 0x3FF;
+        entry.digital = (levels >> 20) & 1;
+        return true;
+    }
+
+    bool isValid(const SegmentHeader& header) const {
+        return header.magic == HISTORY_LOG_MAGIC
+            && header.plant == plant
+            && header.version == HISTORY_LOG_VERSION
+            && header.recordSize == sizeof(LogRecord)
+            && header.crc == crc32(reinterpret_cast<const uint8_t*>(&header), offsetof(SegmentHeader, crc));
+    }
+
+    size_t recordAddress(size_t sector, size_t slot) const {
+        return sector * flash.sectorSize() + HISTORY_LOG_PAGE_SIZE + slot * sizeof(LogRecord);
+    }
+
+    // Whether the queued samples run to the end of a page of the active segment
+    bool fillsPage() const {
+        return active >= 0 && !activeTorn && index[active].firstSeq + activeCount == pending->firstSeq
+            && (activeCount + pending->count) % PENDING_LENGTH == 0;
+    }
+
+    bool isErased(size_t sector, size_t slot) {
+        LogRecord record;
+        if (!flash.read(recordAddress(sector, slot), &record, sizeof(record))) {
+            return false;
+        }
+        return record.timestamp == 0xFFFFFFFF && record.levels == 0xFFFFFFFF;
+    }
+
+    // Records are programmed in order, so the first erased slot is found by binary
+    // search. A torn last record is not counted and marks the segment as closed.
+    size_t countRecords(size_t sector, bool& torn) {
+        size_t low = 0;
+        size_t high = recordsPerSegment;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (isErased(sector, mid)) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        torn = false;
+        if (low > 0) {
+            LogRecord record;
+            HistoryEntry entry;
+            if (!flash.read(recordAddress(sector, low - 1), &record, sizeof(record)) || !decode(record, entry)) {
+                torn = true;
+                low--;
+            }
+        }
+        return low;
+    }
+
+    int findSegment(uint32_t segmentSeq) const {
+        for (size_t sector = 0; sector < sectors; sector++) {
+            if (index[sector].valid && index[sector].segmentSeq == segmentSeq) {
+                return sector;
+            }
+        }
+        return -1;
+    }
+
+    // Seq following the last record of a segment
+    uint32_t segmentEnd(int sector) const {
+        if (sector == active) {
+            return index[sector].firstSeq + activeCount;
+        }
+        int next = findSegment(index[sector].segmentSeq + 1);
+        if (next < 0) {
+            return index[sector].firstSeq;
+        }
+        uint32_t span = index[next].firstSeq - index[sector].firstSeq;
+        return index[sector].firstSeq + min(static_cast<size_t>(span), recordsPerSegment);
+    }
+
+    bool openSegment(uint32_t firstSeq, uint32_t firstTime) {
+        size_t sector = active < 0 ? 0 : (active + 1) % sectors;
+        index[sector].valid = false;
+        if (!flash.erase(sector)) {
+            Serial.println("History log: erase failed");
+            return false;
+        }
+        SegmentHeader header = {};
+        header.magic = HISTORY_LOG_MAGIC;
+        header.version = HISTORY_LOG_VERSION;
+        header.recordSize = sizeof(LogRecord);
+        header.segmentSeq = nextSegmentSeq;
+        header.firstSeq = firstSeq;
+        header.firstTime = firstTime;
+        header.plant = plant;
+        header.crc = crc32(reinterpret_cast<const uint8_t*>(&header), offsetof(SegmentHeader, crc));
+        if (!flash.write(sector * flash.sectorSize(), &header, sizeof(header))) {
+            Serial.println("History log: header write failed");
+            return false;
+        }
+        index[sector].valid = true;
+        index[sector].segmentSeq = nextSegmentSeq++;
+        index[sector].firstSeq = firstSeq;
+        index[sector].firstTime = firstTime;
+        active = sector;
+        activeCount = 0;
+        activeTorn = false;
+        expire(firstTime);
+        return true;
+    }
+
+    // Erases segments whose newest sample is older than the retention period
+    void expire(uint32_t now) {
+        uint32_t retention = static_cast<uint32_t>(config.getHistoryRetention()) * 24 * 60 * 60;
+        if (retention == 0 || now < retention) {
+            return;
+        }
+        for (size_t sector = 0; sector < sectors; sector++) {
+            if (!index[sector].valid || static_cast<int>(sector) == active) {
+                continue;
+            }
+            int next = findSegment(index[sector].segmentSeq + 1);
+            if (next >= 0 && index[next].firstTime < now - retention) {
+                flash.erase(sector);
+                index[sector].valid = false;
+            }
+        }
+    }
+};
+
+// A HistoryLog per plant, each on its own equal share of one flash backend.
+// Plant 0's share starts at the first sector, so with one plant the log sits
+// where it always has.
+template <size_t PLANTS>
+class PlantHistoryLogs {
+public:
+    PlantHistoryLogs(FlashBackend& flash, HomieConfig& config)
+    : PlantHistoryLogs(flash, config, std::make_index_sequence<PLANTS>()) {}
+
+    HistoryLog& operator[](size_t plant) {
+        return logs[plant];
+    }
+
+    // pages holds a PendingPage per plant, see HistoryLog::retainPending()
+    void retainPending(HistoryLog::PendingPage* pages) {
+        for (size_t p = 0; p < PLANTS; p++) {
+            logs[p].retainPending(pages ? &pages[p] : nullptr);
+        }
+    }
+
+    bool begin() {
+        bool ok = true;
+        for (HistoryLog& log : logs) {
+            ok = log.begin() && ok;
+        }
+        return ok;
+    }
+
+    void handle() {
+        for (HistoryLog& log : logs) {
+            log.handle();
+        }
+    }
+
+    bool flush() {
+        bool ok = true;
+        for (HistoryLog& log : logs) {
+            ok = log.flush() && ok;
+        }
+        return ok;
+    }
+
+private:
+    FlashRegion regions[PLANTS];
+    HistoryLog logs[PLANTS];
+
+    template <size_t... P>
+    PlantHistoryLogs(FlashBackend& flash, HomieConfig& config, std::index_sequence<P...>)
+    : regions{FlashRegion(flash, P, PLANTS)...}, logs{HistoryLog(regions[P], config, P)...} {}
+};
+
+#endif // HISTORYLOG_H
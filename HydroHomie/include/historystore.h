@@ -0,0 +1,478 @@
+#ifndef HISTORYSTORE_H
+#define HISTORYSTORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "seqlock.h"
+
+// One decoded history sample
+struct HistoryEntry {
+    uint32_t seq;       // Monotonic sequence number, counts every push since boot
+    uint32_t timestamp; // Epoch seconds
+    int tank;
+    int plant;
+    int digital;
+};
+
+// Fixed-size ring of delta-encoded history samples.
+//
+// Samples are grouped into blocks of BLOCK_BYTES. A block's header holds its
+// first sample in full: a 32-bit timestamp and 10-bit tank and plant levels
+// plus the digital bit. Every later sample is a bit code against the one
+// before it:
+//   0                     same time step as before, levels unchanged
+//   10 c s                same step, tank (c=0) or plant one count up (s=1) or down
+//   11 STEP TANK PLANT    otherwise, with
+//     STEP:  0 same step | 10 s: one second longer (s=1) or shorter | 11 + 16 bits
+//     level: 0 unchanged | 10 s: +1/-1 | 110 + 4 bits: -8..7 | 1110 + 7 bits: -64..63
+//            | 1111 + 10 bits: the level itself
+// A sample on the poll grid whose levels did not move costs one bit, one
+// where a level jittered by a count four bits. A new block is opened when the current
+// one is full, the clock went back or jumped by more than 16 bits of seconds,
+// or the digital sensor changed. When the ring is full the oldest whole block
+// is dropped. Sequence numbers are not stored; they are derived from the
+// total push count.
+//
+// The 12 KB of HISTORY_BLOCKS blocks of 128 bytes hold about 18 days of
+// one-minute samples of a drying plant whose levels jitter by a count on every
+// fourth sample (test/history measures this), more for steadier sensors. The
+// tuple CircularBuffer it replaced held 1000 samples, 16 hours.
+//
+// One task pushes; other tasks must only use range() and read(), which copy out
+// a consistent view under a SeqLock. The iterators are for the pushing task.
+template <size_t BLOCKS, size_t BLOCK_BYTES = 128>
+class HistoryStore {
+public:
+    static const uint32_t LEVEL_BITS = 10;
+    static const uint32_t LEVEL_MAX = (1u << LEVEL_BITS) - 1;
+    static const uint32_t STEP_BITS = 16;
+    static const uint32_t STEP_MAX = (1u << STEP_BITS) - 1;
+
+private:
+    static const size_t HEADER_BYTES = 12;
+    static const size_t DATA_BITS = (BLOCK_BYTES - HEADER_BYTES) * 8;
+    static const size_t MAX_PER_BLOCK = 1 + DATA_BITS; // All repeats of the first sample
+
+    static_assert(BLOCK_BYTES > HEADER_BYTES && MAX_PER_BLOCK <= UINT16_MAX, "Block size out of range");
+
+    struct Block {
+        uint32_t base;  // Timestamp of the first sample
+        uint32_t first; // Levels of the first sample: tank, plant << 10, digital << 20
+        uint16_t count;
+        uint16_t bits;  // Data bits used by the samples after the first
+        uint8_t data[BLOCK_BYTES - HEADER_BYTES];
+    };
+
+    // A decoded sample and where the next one starts in its block
+    struct Cursor {
+        uint16_t index;
+        uint16_t bit;
+        uint32_t step; // Seconds since the sample before, the base for the next STEP code
+        uint32_t timestamp;
+        int tank;
+        int plant;
+        int digital;
+    };
+
+    Block blocks[BLOCKS];
+    size_t head = 0;        // Index of the oldest block
+    size_t blockCount = 0;
+    size_t entryCount = 0;
+    uint32_t writeCount = 0; // Total samples ever pushed, the next sequence number
+    Cursor tail = {};        // The newest sample, which the next push is coded against
+    SeqLock lock;
+
+    static int clampLevel(int level) {
+        if (level < 0) return 0;
+        if (static_cast<uint32_t>(level) > LEVEL_MAX) return LEVEL_MAX;
+        return level;
+    }
+
+    // Bits past the used data read as 0, so a torn header cannot read out of bounds
+    static uint32_t readBits(const Block& block, uint16_t& bit, unsigned count) {
+        uint32_t value = 0;
+        for (unsigned i = 0; i < count; i++, bit++) {
+            if (bit < DATA_BITS && (block.data[bit >> 3] >> (bit & 7)) & 1u) {
+                value |= 1u << i;
+            }
+        }
+        return value;
+    }
+
+    static void writeBits(Block& block, uint32_t value, unsigned count) {
+        for (unsigned i = 0; i < count; i++, block.bits++) {
+            if ((value >> i) & 1u) {
+                block.data[block.bits >> 3] |= 1u << (block.bits & 7);
+            }
+        }
+    }
+
+    static unsigned stepBits(uint32_t step, uint32_t previous) {
+        if (step == previous) return 1;
+        if (step == previous + 1 || step + 1 == previous) return 3;
+        return 2 + STEP_BITS;
+    }
+
+    static unsigned levelBits(int level, int previous) {
+        const int delta = level - previous;
+        if (delta == 0) return 1;
+        if (delta == 1 || delta == -1) return 3;
+        if (delta >= -8 && delta <= 7) return 7;
+        if (delta >= -64 && delta <= 63) return 11;
+        return 4 + LEVEL_BITS;
+    }
+
+    // Bits push() takes for a sample coded against tail
+    unsigned sampleBits(uint32_t step, int tank, int plant) const {
+        const unsigned tankBits = levelBits(tank, tail.tank);
+        const unsigned plantBits = levelBits(plant, tail.plant);
+        if (step == tail.step && tankBits + plantBits <= 4) {
+            return tankBits + plantBits == 2 ? 1 : 4;
+        }
+        return 2 + stepBits(step, tail.step) + tankBits + plantBits;
+    }
+
+    static void writeLevel(Block& block, int level, int previous) {
+        const int delta = level - previous;
+        const unsigned bits = levelBits(level, previous);
+        if (bits == 1) {
+            writeBits(block, 0, 1);
+        } else if (bits == 3) {
+            writeBits(block, 0x1 | (delta > 0 ? 0x4 : 0), 3);
+        } else if (bits == 7) {
+            writeBits(block, 0x3 | (static_cast<uint32_t>(delta) & 0xF) << 3, 7);
+        } else if (bits == 11) {
+            writeBits(block, 0x7 | (static_cast<uint32_t>(delta) & 0x7F) << 4, 11);
+        } else {
+            writeBits(block, 0xF | static_cast<uint32_t>(level) << 4, 4 + LEVEL_BITS);
+        }
+    }
+
+    static int readLevel(const Block& block, uint16_t& bit, int previous) {
+        if (!readBits(block, bit, 1)) return previous;
+        if (!readBits(block, bit, 1)) return previous + (readBits(block, bit, 1) ? 1 : -1);
+        if (!readBits(block, bit, 1)) return previous + (static_cast<int>(readBits(block, bit, 4) << 28) >> 28);
+        if (!readBits(block, bit, 1)) return previous + (static_cast<int>(readBits(block, bit, 7) << 25) >> 25);
+        return readBits(block, bit, LEVEL_BITS);
+    }
+
+    // Positions cursor on the first sample of block
+    static void decodeFirst(const Block& block, Cursor& cursor) {
+        cursor.index = 0;
+        cursor.bit = 0;
+        cursor.step = 0;
+        cursor.timestamp = block.base;
+        cursor.tank = block.first & LEVEL_MAX;
+        cursor.plant = (block.first >> LEVEL_BITS) & LEVEL_MAX;
+        cursor.digital = (block.first >> (2 * LEVEL_BITS)) & 1u;
+    }
+
+    // Moves cursor from a sample of block to the next one
+    static void decodeNext(const Block& block, Cursor& cursor) {
+        cursor.index++;
+        if (!readBits(block, cursor.bit, 1)) {
+            // Repeat
+        } else if (!readBits(block, cursor.bit, 1)) {
+            int& level = readBits(block, cursor.bit, 1) ? cursor.plant : cursor.tank;
+            level += readBits(block, cursor.bit, 1) ? 1 : -1;
+        } else {
+            if (readBits(block, cursor.bit, 1)) {
+                if (!readBits(block, cursor.bit, 1)) {
+                    cursor.step = readBits(block, cursor.bit, 1) ? cursor.step + 1 : cursor.step - 1;
+                } else {
+                    cursor.step = readBits(block, cursor.bit, STEP_BITS);
+                }
+            }
+            cursor.tank = readLevel(block, cursor.bit, cursor.tank);
+            cursor.plant = readLevel(block, cursor.bit, cursor.plant);
+        }
+        cursor.timestamp += cursor.step;
+    }
+
+    static HistoryEntry entryAt(uint32_t seq, const Cursor& cursor) {
+        HistoryEntry entry;
+        entry.seq = seq;
+        entry.timestamp = cursor.timestamp;
+        entry.tank = cursor.tank;
+        entry.plant = cursor.plant;
+        entry.digital = cursor.digital;
+        return entry;
+    }
+
+    Block& blockAt(size_t ordinal) {
+        return blocks[(head + ordinal) % BLOCKS];
+    }
+
+    const Block& blockAt(size_t ordinal) const {
+        return blocks[(head + ordinal) % BLOCKS];
+    }
+
+    void openBlock(int tank, int plant, int digital, uint32_t timestamp) {
+        if (blockCount == BLOCKS) {
+            // Drop the oldest block to make room
+            entryCount -= blocks[head].count;
+            head = (head + 1) % BLOCKS;
+            blockCount--;
+        }
+        Block& block = blockAt(blockCount);
+        block.base = timestamp;
+        block.first = tank | plant << LEVEL_BITS | (digital ? 1u : 0u) << (2 * LEVEL_BITS);
+        block.count = 1;
+        block.bits = 0;
+        memset(block.data, 0, sizeof(block.data));
+        blockCount++;
+        decodeFirst(block, tail);
+    }
+
+public:
+    class const_iterator {
+    public:
+        const_iterator(const HistoryStore* store, size_t block, size_t index, uint32_t seq)
+        : store(store), block(block), seq(seq) {
+            cursor.index = 0;
+            if (block < store->blockCount) {
+                decodeFirst(store->blockAt(block), cursor);
+                while (cursor.index < index) {
+                    decodeNext(store->blockAt(block), cursor);
+                }
+            }
+        }
+
+        HistoryEntry operator*() const {
+            return entryAt(seq, cursor);
+        }
+
+        const_iterator& operator++() {
+            seq++;
+            const Block& current = store->blockAt(block);
+            if (cursor.index + 1u < current.count) {
+                decodeNext(current, cursor);
+            } else if (++block < store->blockCount) {
+                decodeFirst(store->blockAt(block), cursor);
+            } else {
+                cursor.index = 0;
+            }
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const {
+            return block == other.block && cursor.index == other.cursor.index;
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        const HistoryStore* store;
+        size_t block;
+        uint32_t seq;
+        Cursor cursor;
+    };
+
+    void push(int tank, int plant, int digital, uint32_t timestamp) {
+        tank = clampLevel(tank);
+        plant = clampLevel(plant);
+        digital = digital ? 1 : 0;
+        lock.writeBegin();
+        bool fits = false;
+        if (blockCount > 0 && digital == tail.digital && timestamp >= tail.timestamp
+            && timestamp - tail.timestamp <= STEP_MAX) {
+            const Block& current = blockAt(blockCount - 1);
+            const uint32_t step = timestamp - tail.timestamp;
+            fits = current.count < MAX_PER_BLOCK && current.bits + sampleBits(step, tank, plant) <= DATA_BITS;
+        }
+        if (fits) {
+            Block& block = blockAt(blockCount - 1);
+            const uint32_t step = timestamp - tail.timestamp;
+            const unsigned bits = sampleBits(step, tank, plant);
+            if (bits == 1) {
+                writeBits(block, 0, 1);
+            } else if (bits == 4) {
+                const bool plantMoved = plant != tail.plant;
+                const bool up = plantMoved ? plant > tail.plant : tank > tail.tank;
+                writeBits(block, 0x1 | (plantMoved ? 0x4 : 0) | (up ? 0x8 : 0), 4);
+            } else {
+                writeBits(block, 0x3, 2);
+                const unsigned bits = stepBits(step, tail.step);
+                if (bits == 1) {
+                    writeBits(block, 0, 1);
+                } else if (bits == 3) {
+                    writeBits(block, 0x1 | (step > tail.step ? 0x4 : 0), 3);
+                } else {
+                    writeBits(block, 0x3 | step << 2, 2 + STEP_BITS);
+                }
+                writeLevel(block, tank, tail.tank);
+                writeLevel(block, plant, tail.plant);
+            }
+            block.count++;
+            tail.index++;
+            tail.bit = block.bits;
+            tail.step = step;
+            tail.timestamp = timestamp;
+            tail.tank = tank;
+            tail.plant = plant;
+        } else {
+            openBlock(tank, plant, digital, timestamp);
+        }
+        entryCount++;
+        writeCount++;
+        lock.writeEnd();
+    }
+
+    // Moves the samples stamped before `before` by offset, e.g. the ones taken
+    // before the clock was set. Only a block's base has to change: a block never
+    // mixes samples from both sides of a clock step.
+    void rebase(uint32_t before, uint32_t offset) {
+        lock.writeBegin();
+        for (size_t i = 0; i < blockCount; i++) {
+            Block& block = blockAt(i);
+            if (block.base < before) {
+                block.base += offset;
+                if (i == blockCount - 1) {
+                    tail.timestamp += offset;
+                }
+            }
+        }
+        lock.writeEnd();
+    }
+
+    // Sequence numbers keep counting across clear() so clients never see one reused
+    void clear() {
+        lock.writeBegin();
+        head = 0;
+        blockCount = 0;
+        entryCount = 0;
+        lock.writeEnd();
+    }
+
+    // Empties the store and continues numbering at seq, e.g. after restoring from flash
+    void restart(uint32_t seq) {
+        lock.writeBegin();
+        head = 0;
+        blockCount = 0;
+        entryCount = 0;
+        writeCount = seq;
+        lock.writeEnd();
+    }
+
+    // firstSeq() and nextSeq() as one consistent pair, safe from any task
+    void range(uint32_t& first, uint32_t& next) const {
+        uint32_t seq;
+        do {
+            seq = lock.readBegin();
+            first = writeCount - entryCount;
+            next = writeCount;
+        } while (lock.readRetry(seq));
+    }
+
+    // Decodes up to max samples starting at seq (or the oldest one, if seq was
+    // already dropped) into out and returns how many. Safe from any task; a push
+    // that overlaps the copy makes it start over.
+    size_t read(uint32_t seq, HistoryEntry* out, size_t max) const {
+        size_t count;
+        uint32_t version;
+        do {
+            version = lock.readBegin();
+            count = readUnlocked(seq, out, max);
+        } while (lock.readRetry(version));
+        return count;
+    }
+
+    // Sequence number of the oldest stored sample
+    uint32_t firstSeq() const {
+        return writeCount - entryCount;
+    }
+
+    // Sequence number the next pushed sample will get
+    uint32_t nextSeq() const {
+        return writeCount;
+    }
+
+    size_t size() const {
+        return entryCount;
+    }
+
+    bool isEmpty() const {
+        return entryCount == 0;
+    }
+
+    // Most samples the store can hold, if every one repeats the one before.
+    // How many it does hold depends on how much the levels move.
+    static constexpr size_t capacity() {
+        return BLOCKS * MAX_PER_BLOCK;
+    }
+
+    HistoryEntry last() const {
+        return entryAt(writeCount - 1, tail);
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, 0, 0, firstSeq());
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, blockCount, 0, writeCount);
+    }
+
+    // Iterator to the first stored sample with a sequence number >= seq.
+    // Skips whole blocks, then decodes from the start of the one holding seq.
+    const_iterator from(uint32_t seq) const {
+        uint32_t first = firstSeq();
+        if (static_cast<int32_t>(seq - first) <= 0) {
+            return begin();
+        }
+        if (static_cast<int32_t>(seq - writeCount) >= 0) {
+            return end();
+        }
+        size_t skip = seq - first;
+        size_t block = 0;
+        while (skip >= blockAt(block).count) {
+            skip -= blockAt(block).count;
+            block++;
+        }
+        return const_iterator(this, block, skip, seq);
+    }
+
+private:
+    // Body of read(). The fields may be torn by a concurrent push, so every index
+    // is bounded before use; the result is discarded in that case anyway.
+    size_t readUnlocked(uint32_t seq, HistoryEntry* out, size_t max) const {
+        size_t blocksNow = blockCount < BLOCKS ? blockCount : BLOCKS;
+        size_t entriesNow = entryCount < capacity() ? entryCount : capacity();
+        uint32_t first = writeCount - entriesNow;
+        if (static_cast<int32_t>(seq - first) < 0) {
+            seq = first;
+        }
+        size_t skip = seq - first;
+        size_t block = 0;
+        for (; block < blocksNow; block++) {
+            const Block& b = blockAt(block);
+            size_t inBlock = b.count < MAX_PER_BLOCK ? b.count : MAX_PER_BLOCK;
+            if (skip < inBlock) {
+                break;
+            }
+            skip -= inBlock;
+        }
+        size_t count = 0;
+        for (; block < blocksNow && count < max; block++, skip = 0) {
+            const Block& b = blockAt(block);
+            size_t inBlock = b.count < MAX_PER_BLOCK ? b.count : MAX_PER_BLOCK;
+            Cursor cursor;
+            decodeFirst(b, cursor);
+            for (size_t index = 0; index < inBlock && count < max; index++) {
+                if (index > 0) {
+                    decodeNext(b, cursor);
+                }
+                if (index >= skip) {
+                    out[count] = entryAt(seq + count, cursor);
+                    count++;
+                }
+            }
+        }
+        return count;
+    }
+};
+
+#endif // HISTORYSTORE_H
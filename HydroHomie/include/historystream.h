@@ -0,0 +1,223 @@
+#ifndef HISTORYSTREAM_H
+#define HISTORYSTREAM_H
+
+#include <Arduino.h>
+#include "historystore.h"
+#include "historytiers.h"
+
+// JSON encoders that walk a HistoryStore in place and print straight to the output,
+// so nothing proportional to the history length is ever buffered.
+// They run on the httpd task while loop() pushes, so they copy samples out
+// HISTORY_READ_BATCH at a time through the store's SeqLock protected read().
+
+#define HISTORY_READ_BATCH 16
+
+// Calls fn(entry) for up to limit samples with seq >= since, oldest first
+template <typename Store, typename Fn>
+void forEachHistoryEntry(const Store& history, uint32_t since, size_t limit, Fn fn) {
+    HistoryEntry batch[HISTORY_READ_BATCH];
+    uint32_t seq = since;
+    size_t done = 0;
+    while (done < limit) {
+        size_t count = history.read(seq, batch, min(limit - done, static_cast<size_t>(HISTORY_READ_BATCH)));
+        if (count == 0) {
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            fn(batch[i]);
+        }
+        done += count;
+        seq = batch[count - 1].seq + 1;
+    }
+}
+
+// Legacy format: [[plant, tank], ...] for the whole store
+template <typename Store>
+void writeHistoryJson(Print& out, const Store& history) {
+    uint32_t firstSeq, nextSeq;
+    history.range(firstSeq, nextSeq);
+    out.print('[');
+    bool first = true;
+    forEachHistoryEntry(history, firstSeq, SIZE_MAX, [&](const HistoryEntry& entry) {
+        if (!first) {
+            out.print(',');
+        }
+        first = false;
+        out.print('[');
+        out.print(entry.plant);
+        out.print(',');
+        out.print(entry.tank);
+        out.print(']');
+    });
+    out.print(']');
+}
+
+// Incremental format:
+//   {"first":<oldest seq>,"history":[[seq,ts,plant,tank],...],"cursor":<next since>}
+// Writes at most limit entries with seq >= since and returns the cursor.
+template <typename Store>
+uint32_t writeHistoryJson(Print& out, const Store& history, uint32_t since, size_t limit) {
+    uint32_t firstSeq, nextSeq;
+    history.range(firstSeq, nextSeq);
+    out.print("{\"first\":");
+    out.print(firstSeq);
+    out.print(",\"history\":[");
+    uint32_t cursor = since;
+    size_t count = 0;
+    forEachHistoryEntry(history, since, limit, [&](const HistoryEntry& entry) {
+        if (count++ > 0) {
+            out.print(',');
+        }
+        out.print('[');
+        out.print(entry.seq);
+        out.print(',');
+        out.print(entry.timestamp);
+        out.print(',');
+        out.print(entry.plant);
+        out.print(',');
+        out.print(entry.tank);
+        out.print(']');
+        cursor = entry.seq + 1;
+    });
+    out.print("],\"cursor\":");
+    out.print(cursor);
+    out.print('}');
+    return cursor;
+}
+
+// Rollup format, newest limit buckets of one resolution:
+//   {"resolution":"15m","period":900,
+//    "history":[[ts,plantMin,plantAvg,plantMax,tankMin,tankAvg,tankMax],...]}
+inline void writeRollupEntry(Print& out, uint32_t timestamp, const RollupLevel& plant, const RollupLevel& tank) {
+    out.print('[');
+    out.print(timestamp);
+    const int values[6] = {plant.min, plant.avg, plant.max, tank.min, tank.avg, tank.max};
+    for (int value : values) {
+        out.print(',');
+        out.print(value);
+    }
+    out.print(']');
+}
+
+inline void writeRollupHeader(Print& out, const char* resolution, uint32_t period) {
+    out.print("{\"resolution\":\"");
+    out.print(resolution);
+    out.print("\",\"period\":");
+    out.print(period);
+    out.print(",\"history\":[");
+}
+
+template <size_t N>
+void writeRollupJson(Print& out, const char* resolution, const RollupTier<N>& tier, size_t limit) {
+    writeRollupHeader(out, resolution, tier.getPeriod());
+    uint32_t firstNumber, nextNumber;
+    tier.range(firstNumber, nextNumber);
+    uint32_t start = nextNumber - firstNumber > limit ? nextNumber - limit : firstNumber;
+    bool first = true;
+    for (uint32_t number = start; number != nextNumber; number++) {
+        RollupEntry entry;
+        if (!tier.read(number, entry)) {
+            continue; // Overwritten since range()
+        }
+        if (!first) {
+            out.print(',');
+        }
+        first = false;
+        writeRollupEntry(out, entry.timestamp, entry.plant, entry.tank);
+    }
+    out.print("]}");
+}
+
+// The 1 minute history in rollup shape; it only keeps averages, so min = avg = max
+template <typename Store>
+void writeRollupJson(Print& out, const char* resolution, const Store& history, size_t limit) {
+    writeRollupHeader(out, resolution, 60);
+    uint32_t firstSeq, nextSeq;
+    history.range(firstSeq, nextSeq);
+    uint32_t start = nextSeq - firstSeq > limit ? nextSeq - limit : firstSeq;
+    bool first = true;
+    forEachHistoryEntry(history, start, nextSeq - start, [&](const HistoryEntry& entry) {
+        if (!first) {
+            out.print(',');
+        }
+        first = false;
+        const RollupLevel plant = {entry.plant, entry.plant, entry.plant};
+        const RollupLevel tank = {entry.tank, entry.tank, entry.tank};
+        writeRollupEntry(out, entry.timestamp, plant, tank);
+    });
+    out.print("]}");
+}
+
+// Packed binary format (application/octet-stream), all integers little-endian:
+//
+//   header, 16 bytes
+//     0  u8   format version (1)
+//     1  u8   record size in bytes (8)
+//     2  u16  reserved (0)
+//     4  u32  seq of the first record in this reply
+//     8  u32  record count
+//    12  u32  oldest seq still stored on the device
+//   records, 8 bytes each
+//     0  u32  timestamp (epoch seconds)
+//     4  u16  plant level
+//     6  u16  tank level
+//
+// Record i has seq = start + i; the cursor for the next poll is start + count.
+// A record with timestamp 0 stands for a sample that was dropped on the device
+// while the reply was being sent.
+#define HISTORY_BINARY_VERSION 1
+#define HISTORY_BINARY_RECORD_SIZE 8
+
+inline void writeLE16(Print& out, uint16_t value) {
+    uint8_t bytes[2] = {static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8)};
+    out.write(bytes, sizeof(bytes));
+}
+
+inline void writeLE32(Print& out, uint32_t value) {
+    uint8_t bytes[4] = {static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8),
+                        static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 24)};
+    out.write(bytes, sizeof(bytes));
+}
+
+template <typename Store>
+uint32_t writeHistoryBinary(Print& out, const Store& history, uint32_t since, size_t limit) {
+    uint32_t firstSeq, nextSeq;
+    history.range(firstSeq, nextSeq);
+    uint32_t start = since;
+    if (static_cast<int32_t>(start - firstSeq) < 0) {
+        start = firstSeq;
+    }
+    uint32_t available = static_cast<int32_t>(nextSeq - start) > 0 ? nextSeq - start : 0;
+    uint32_t count = min(static_cast<size_t>(available), limit);
+
+    out.write(static_cast<uint8_t>(HISTORY_BINARY_VERSION));
+    out.write(static_cast<uint8_t>(HISTORY_BINARY_RECORD_SIZE));
+    writeLE16(out, 0);
+    writeLE32(out, start);
+    writeLE32(out, count);
+    writeLE32(out, firstSeq);
+
+    // The header promised count records from start, so pad any dropped meanwhile
+    const uint32_t end = start + count;
+    uint32_t expected = start;
+    forEachHistoryEntry(history, start, count, [&](const HistoryEntry& entry) {
+        for (; expected != entry.seq && expected != end; expected++) {
+            writeLE32(out, 0);
+            writeLE32(out, 0);
+        }
+        if (expected == end) {
+            return;
+        }
+        writeLE32(out, entry.timestamp);
+        writeLE16(out, entry.plant);
+        writeLE16(out, entry.tank);
+        expected++;
+    });
+    for (; expected != end; expected++) {
+        writeLE32(out, 0);
+        writeLE32(out, 0);
+    }
+    return end;
+}
+
+#endif // HISTORYSTREAM_H
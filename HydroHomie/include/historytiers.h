@@ -0,0 +1,253 @@
+#ifndef HISTORYTIERS_H
+#define HISTORYTIERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "seqlock.h"
+
+// min/avg/max of one channel over a bucket
+struct RollupLevel {
+    int min;
+    int avg;
+    int max;
+};
+
+// One closed bucket of a rollup tier
+struct RollupEntry {
+    uint32_t timestamp; // Bucket start, epoch seconds
+    RollupLevel tank;
+    RollupLevel plant;
+};
+
+// Running aggregate of the bucket that is still open. Tiers cascade by merging
+// the accumulator of a closed bucket into the next coarser tier, so the average
+// stays weighted by the real number of samples.
+struct RollupAccumulator {
+    uint32_t start = 0;
+    uint32_t count = 0;
+    int32_t tankSum = 0;
+    int32_t plantSum = 0;
+    int tankMin = 0;
+    int tankMax = 0;
+    int plantMin = 0;
+    int plantMax = 0;
+
+    void reset(uint32_t bucketStart) {
+        start = bucketStart;
+        count = 0;
+        tankSum = 0;
+        plantSum = 0;
+    }
+
+    void add(int tank, int plant) {
+        if (count == 0) {
+            tankMin = tankMax = tank;
+            plantMin = plantMax = plant;
+        } else {
+            if (tank < tankMin) tankMin = tank;
+            if (tank > tankMax) tankMax = tank;
+            if (plant < plantMin) plantMin = plant;
+            if (plant > plantMax) plantMax = plant;
+        }
+        tankSum += tank;
+        plantSum += plant;
+        count++;
+    }
+
+    void merge(const RollupAccumulator& other) {
+        if (other.count == 0) return;
+        if (count == 0) {
+            tankMin = other.tankMin;
+            tankMax = other.tankMax;
+            plantMin = other.plantMin;
+            plantMax = other.plantMax;
+        } else {
+            if (other.tankMin < tankMin) tankMin = other.tankMin;
+            if (other.tankMax > tankMax) tankMax = other.tankMax;
+            if (other.plantMin < plantMin) plantMin = other.plantMin;
+            if (other.plantMax > plantMax) plantMax = other.plantMax;
+        }
+        tankSum += other.tankSum;
+        plantSum += other.plantSum;
+        count += other.count;
+    }
+};
+
+// Fixed-size ring of closed buckets of one resolution. Each bucket costs 12 bytes:
+// the start time plus min/avg/max of both channels packed as 3x10 bits per channel.
+// Buckets are numbered by getWriteCount() at the time they closed; other tasks
+// read them by number through range() and read(), which are SeqLock protected.
+template <size_t CAPACITY>
+class RollupTier {
+public:
+    explicit RollupTier(uint32_t periodSeconds) : period(periodSeconds) {}
+
+    // Adds a sample to the open bucket. If the sample starts a new bucket, the
+    // previous one is stored and copied to closed so it can be cascaded; returns
+    // true in that case.
+    bool add(uint32_t timestamp, int tank, int plant, RollupAccumulator& closed) {
+        RollupAccumulator sample;
+        sample.reset(timestamp);
+        sample.add(tank, plant);
+        return merge(sample, closed);
+    }
+
+    // Same as add() but for a whole closed bucket of a finer tier
+    bool merge(const RollupAccumulator& bucket, RollupAccumulator& closed) {
+        uint32_t bucketStart = bucket.start - bucket.start % period;
+        bool didClose = false;
+        if (open.count > 0 && open.start != bucketStart) {
+            store(open);
+            closed = open;
+            didClose = true;
+        }
+        if (open.count == 0 || open.start != bucketStart) {
+            open.reset(bucketStart);
+        }
+        open.merge(bucket);
+        return didClose;
+    }
+
+    // Moves the buckets that start before `before` by offset, see HistoryStore::rebase().
+    // They keep their length, so they no longer line up with the period.
+    void rebase(uint32_t before, uint32_t offset) {
+        lock.writeBegin();
+        for (size_t i = 0; i < count; i++) {
+            uint32_t& start = starts[(head + i) % CAPACITY];
+            if (start < before) {
+                start += offset;
+            }
+        }
+        lock.writeEnd();
+        if (open.count > 0 && open.start < before) {
+            open.start += offset;
+        }
+    }
+
+    uint32_t getPeriod() const {
+        return period;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    static constexpr size_t capacity() {
+        return CAPACITY;
+    }
+
+    // Number of buckets ever closed, changes whenever the tier does
+    uint32_t getWriteCount() const {
+        return writeCount;
+    }
+
+    // Closed bucket by age, 0 is the oldest. Only for the task that adds samples.
+    RollupEntry at(size_t index) const {
+        return entryAt((head + index) % CAPACITY);
+    }
+
+    // Numbers of the oldest stored bucket and of the next one to close
+    void range(uint32_t& first, uint32_t& next) const {
+        uint32_t seq;
+        do {
+            seq = lock.readBegin();
+            first = writeCount - count;
+            next = writeCount;
+        } while (lock.readRetry(seq));
+    }
+
+    // Copies bucket number into entry. Returns false if it was never closed or has
+    // been overwritten since.
+    bool read(uint32_t number, RollupEntry& entry) const {
+        bool found;
+        uint32_t seq;
+        do {
+            seq = lock.readBegin();
+            uint32_t age = writeCount - number;
+            size_t stored = count < CAPACITY ? count : CAPACITY;
+            found = age >= 1 && age <= stored;
+            if (found) {
+                entry = entryAt((head + stored - age) % CAPACITY);
+            }
+        } while (lock.readRetry(seq));
+        return found;
+    }
+
+private:
+    const uint32_t period;
+    uint32_t starts[CAPACITY];
+    uint32_t tankLevels[CAPACITY];
+    uint32_t plantLevels[CAPACITY];
+    size_t head = 0;
+    size_t count = 0;
+    uint32_t writeCount = 0;
+    RollupAccumulator open;
+    SeqLock lock;
+
+    RollupEntry entryAt(size_t slot) const {
+        RollupEntry entry;
+        entry.timestamp = starts[slot];
+        entry.tank = unpack(tankLevels[slot]);
+        entry.plant = unpack(plantLevels[slot]);
+        return entry;
+    }
+
+    static uint32_t clamp(int level) {
+        return level < 0 ? 0 : (level > 1023 ? 1023 : level);
+    }
+
+    static uint32_t pack(int min, int avg, int max) {
+        return clamp(min) | (clamp(avg) << 10) | (clamp(max) << 20);
+    }
+
+    static RollupLevel unpack(uint32_t packed) {
+        RollupLevel level;
+        level.min = packed & 0x3FF;
+        level.avg = (packed >> 10) & 0x3FF;
+        level.max = (packed >> 20) & 0x3FF;
+        return level;
+    }
+
+    void store(const RollupAccumulator& bucket) {
+        lock.writeBegin();
+        size_t slot = (head + count) % CAPACITY;
+        if (count == CAPACITY) {
+            head = (head + 1) % CAPACITY;
+        } else {
+            count++;
+        }
+        starts[slot] = bucket.start;
+        tankLevels[slot] = pack(bucket.tankMin, bucket.tankSum / static_cast<int32_t>(bucket.count), bucket.tankMax);
+        plantLevels[slot] = pack(bucket.plantMin, bucket.plantSum / static_cast<int32_t>(bucket.count), bucket.plantMax);
+        writeCount++;
+        lock.writeEnd();
+    }
+};
+
+#define TIER_15M_LENGTH 672   // 15 min buckets, 7 days
+#define TIER_1H_LENGTH 744    // 1 h buckets, 31 days
+
+// Cascading 15 min -> 1 h rollups, ~17 KB per plant. Every sample costs O(1): it
+// lands in the open 15 min bucket, and only a bucket that just closed is merged
+// one tier up. The 1 min resolution is the regular SensorHistory. There is no
+// 10 s tier: polls are 10 s apart, so it would only repeat them.
+class HistoryTiers {
+public:
+    RollupTier<TIER_15M_LENGTH> quarterHour{15 * 60};
+    RollupTier<TIER_1H_LENGTH> hourly{60 * 60};
+
+    void rebase(uint32_t before, uint32_t offset) {
+        quarterHour.rebase(before, offset);
+        hourly.rebase(before, offset);
+    }
+
+    void add(uint32_t timestamp, int tank, int plant) {
+        RollupAccumulator closedQuarter;
+        RollupAccumulator closedHour;
+        if (quarterHour.add(timestamp, tank, plant, closedQuarter)) {
+            hourly.merge(closedQuarter, closedHour);
+        }
+    }
+};
+
+#endif // HISTORYTIERS_H
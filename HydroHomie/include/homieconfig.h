@@ -3,34 +3,164 @@
 
 #include <Preferences.h>
 #include <ArduinoJson.h> // Include the ArduinoJson library
-#define JSON_DOCUMENT_SIZE 1024
+#include <atomic>
+#include <mutex>
+#include "checksum.h"
+#include "board.h"
+#include "seqlock.h"
+#include "wateringschedule.h"
+#define JSON_DOCUMENT_SIZE 1536
 
+#define CONFIG_BLOB_KEY "cfg"
+#define CONFIG_BLOB_LAYOUT 1
+#define CONFIG_NAME_LENGTH 32
+#define CONFIG_HOST_LENGTH 63
+#define CONFIG_TIMEZONE_LENGTH 47 // POSIX TZ, e.g. CET-1CEST,M3.5.0,M10.5.0/3
+
+// Outcome of a JSON config update
+enum ConfigUpdate {
+    CONFIG_UPDATED,
+    CONFIG_UNCHANGED,   // Valid, but nothing differed, so nothing was written
+    CONFIG_BAD_JSON,
+    CONFIG_INVALID,     // A value failed validation, nothing was applied
+    CONFIG_WRITE_FAILED
+};
+
+// Device settings, cached in RAM and persisted as a single NVS blob:
+//   u16 layout, u16 size of the values, values (ConfigCache), u32 CRC-32 of all before it
+// One blob means one NVS write and commit per update, so an interrupted update
+// leaves either the old or the new settings, and a blob that fails its CRC is
+// ignored. Nothing is written when the values did not change. New fields are
+// appended to ConfigCache; a shorter blob from older firmware loads its prefix
+// and leaves the new fields at their defaults.
+//
+// The getters are safe from any task: the loop task reads the settings while
+// the httpd task applies a PATCH. Writers take writeLock, one at a time, and
+// change the cache inside cacheLock, so a getter never sees half a string.
 class HomieConfig {
 private:
     Preferences preferences;
     bool active = false;
     const String namespaceName = "homieConfig"; // Namespace for Preferences
-    // In-memory cache
+    // In-memory cache, also the persisted layout. Only 32-bit fields and string
+    // buffers of a multiple of 4 bytes, so there is no padding to compare.
     struct ConfigCache {
-        int watering_interval = 60*60;
-        int watering_duration = 10*60;
-        String name = "";
-        int water_tank_threshold = 250;
-        int plant_flood_buffer = 0;
+        int32_t watering_interval = 60*60;
+        int32_t watering_duration = 10*60;
+        int32_t water_tank_threshold = 250;
+        int32_t plant_flood_buffer = 0;
+        int32_t history_flush_interval = 15*60; // Seconds between flash log flushes
+        int32_t history_retention = 14;         // Days of history kept in the flash log
+        int32_t adc_median_window = 5;          // Spike rejector window in ADC conversions, 1 disables it
+        int32_t adc_iir_shift = 3;              // Low-pass strength, y += (x - y) / 2^shift, 0 disables it
+        int32_t plant_target_level = 400;       // Plants are watered up to this level
+        int32_t power_save = 0;                 // 1: light sleep between polls, probes powered only while sampling
+        char name[CONFIG_NAME_LENGTH + 4] = "";
+        int32_t telemetry_mode = 0;             // 0 off, 1 UDP collector, 2 MQTT broker
+        int32_t telemetry_port = 0;             // 0: the mode's default, 4210 or 1883
+        int32_t telemetry_flush_interval = 60;  // Longest a sample waits to be sent, seconds
+        int32_t telemetry_batch = 32;           // Samples and events that are sent at once
+        char telemetry_host[CONFIG_HOST_LENGTH + 1] = "";
+        char schedules[SCHEDULE_TEXT_LENGTH + 1] = "";    // See wateringschedule.h; empty: the interval above
+        char timezone[CONFIG_TIMEZONE_LENGTH + 1] = "";   // Local time of the cron schedules, empty: UTC
     } cache;
+    ConfigCache stored;       // What NVS holds, to skip writes that change nothing
+    bool storedValid = false; // Whether stored mirrors a blob in NVS at all
+    bool updating = false;    // Between beginUpdate() and commit()
+    std::atomic<uint32_t> version{0}; // Bumped whenever the cache changes, keys the /config response cache
+    std::mutex writeLock;     // Held by every writer of cache, stored and NVS
+    SeqLock cacheLock;        // Around every change of cache, for the getters
+
+    struct BlobHeader {
+        uint16_t layout;
+        uint16_t size;
+    };
+
+    // JSON key, field and accepted range of every numeric setting
+    struct IntField {
+        const char* key;
+        int32_t ConfigCache::*field;
+        int32_t min;
+        int32_t max;
+    };
+
+    static const IntField* intFields(size_t& count) {
+        static const IntField fields[] = {
+            {"watering_interval", &ConfigCache::watering_interval, 1, 7*24*60*60},
+            {"watering_duration", &ConfigCache::watering_duration, 0, 24*60*60},
+            {"water_tank_threshold", &ConfigCache::water_tank_threshold, 0, 1000},
+            {"plant_flood_buffer", &ConfigCache::plant_flood_buffer, 0, 1000},
+            {"history_flush_interval", &ConfigCache::history_flush_interval, 10, 24*60*60},
+            {"history_retention", &ConfigCache::history_retention, 1, 365},
+            {"adc_median_window", &ConfigCache::adc_median_window, 1, 9},
+            {"adc_iir_shift", &ConfigCache::adc_iir_shift, 0, 15},
+            {"plant_target_level", &ConfigCache::plant_target_level, 0, 1000},
+            {"power_save", &ConfigCache::power_save, 0, 1},
+            {"telemetry_mode", &ConfigCache::telemetry_mode, 0, 2},
+            {"telemetry_port", &ConfigCache::telemetry_port, 0, 65535},
+            {"telemetry_flush_interval", &ConfigCache::telemetry_flush_interval, 1, 24*60*60},
+            {"telemetry_batch", &ConfigCache::telemetry_batch, 1, 64},
+        };
+        count = sizeof(fields) / sizeof(fields[0]);
+        return fields;
+    }
+
+    // JSON key, offset and longest value of every string setting, and what
+    // else the value has to pass; the buffers are length + 1 rounded up to 4 bytes
+    struct StringField {
+        const char* key;
+        size_t offset;
+        size_t length;
+        bool (*validate)(const char* value, char* error, size_t errorSize);
+    };
+
+    static bool validateSchedules(const char* value, char* error, size_t errorSize) {
+        return WateringSchedule::validate(value, Board::PLANTS, error, errorSize);
+    }
+
+    static const StringField* stringFields(size_t& count) {
+        static const StringField fields[] = {
+            {"name", offsetof(ConfigCache, name), CONFIG_NAME_LENGTH, nullptr},
+            {"telemetry_host", offsetof(ConfigCache, telemetry_host), CONFIG_HOST_LENGTH, nullptr},
+            {"schedules", offsetof(ConfigCache, schedules), SCHEDULE_TEXT_LENGTH, validateSchedules},
+            {"timezone", offsetof(ConfigCache, timezone), CONFIG_TIMEZONE_LENGTH, nullptr},
+        };
+        count = sizeof(fields) / sizeof(fields[0]);
+        return fields;
+    }
+
+    static char* stringField(ConfigCache& values, const StringField& field) {
+        return reinterpret_cast<char*>(&values) + field.offset;
+    }
+
+    static const char* stringField(const ConfigCache& values, const StringField& field) {
+        return reinterpret_cast<const char*>(&values) + field.offset;
+    }
 
 public:
     HomieConfig() {}
 
     void begin() {
+        std::lock_guard<std::mutex> guard(writeLock);
         preferences.begin(namespaceName.c_str(), false); // Initialize Preferences with namespace. RW-mode (false).
         active = true;
-        // Load initial values into cache
-        cache.watering_interval = preferences.getInt("watering_int", cache.watering_interval);
-        cache.watering_duration = preferences.getInt("watering_dur", cache.watering_duration);
-        cache.name = preferences.getString("name", "");
-        cache.water_tank_threshold = preferences.getInt("w_tank_thr", cache.water_tank_threshold);
-        cache.plant_flood_buffer = preferences.getInt("plnt_fld_buff", cache.plant_flood_buffer);
+        cacheLock.writeBegin();
+        const bool loaded = loadBlob();
+        if (!loaded) {
+            // First boot after the switch to the blob: take over the per-key values once
+            loadLegacyKeys();
+        }
+        cacheLock.writeEnd();
+        if (!loaded) {
+            stored = ConfigCache{};
+            storedValid = false; // NVS has no blob yet, so store() writes
+            store();
+        }
+        version++;
+    }
+
+    uint32_t getVersion() const {
+        return version;
     }
 
     void end() {
@@ -38,85 +168,401 @@ public:
         active = false;
     }
 
+    // Setters between beginUpdate() and commit() are written as one blob at commit();
+    // outside of that every setter writes on its own
+    void beginUpdate() {
+        std::lock_guard<std::mutex> guard(writeLock);
+        updating = true;
+    }
+
+    bool commit() {
+        std::lock_guard<std::mutex> guard(writeLock);
+        updating = false;
+        return store();
+    }
+
     void setWateringInterval(int interval) {
-        cache.watering_interval = interval;
-        preferences.putInt("watering_int", interval);
+        setField(cache.watering_interval, interval);
     }
 
     int getWateringInterval() {
-        return cache.watering_interval;
+        return load(&ConfigCache::watering_interval);
     }
 
     void setWateringDuration(int duration) {
-        cache.watering_duration = duration;
-        preferences.putInt("watering_dur", duration);
+        setField(cache.watering_duration, duration);
     }
 
     int getWateringDuration() {
-        return cache.watering_duration;
+        return load(&ConfigCache::watering_duration);
     }
 
     void setName(const String& name) {
-        cache.name = name;
-        preferences.putString("name", name);
+        setString(cache.name, name.c_str(), CONFIG_NAME_LENGTH);
     }
 
     String getName() {
-        return cache.name;
+        return loadString(&ConfigCache::name);
     }
 
     void setWaterTankThreshold(int threshold) {
-        cache.water_tank_threshold = threshold;
-        preferences.putInt("w_tank_thr", threshold);
+        setField(cache.water_tank_threshold, threshold);
     }
 
     int getWaterTankThreshold() {
-        return cache.water_tank_threshold;
+        return load(&ConfigCache::water_tank_threshold);
     }
 
     void setPlantFloodBuffer(int buffer) {
-        cache.plant_flood_buffer = buffer;
-        preferences.putInt("plnt_fld_buff", buffer);
+        setField(cache.plant_flood_buffer, buffer);
     }
 
     int getPlantFloodBuffer() {
-        return cache.plant_flood_buffer;
+        return load(&ConfigCache::plant_flood_buffer);
     }
 
-    bool setConfigFromJson(const String& jsonConfig) {
-        if(!active) {
-            begin();
+    void setHistoryFlushInterval(int interval) {
+        setField(cache.history_flush_interval, interval);
+    }
+
+    int getHistoryFlushInterval() {
+        return load(&ConfigCache::history_flush_interval);
+    }
+
+    void setHistoryRetention(int days) {
+        setField(cache.history_retention, days);
+    }
+
+    int getHistoryRetention() {
+        return load(&ConfigCache::history_retention);
+    }
+
+    void setAdcMedianWindow(int window) {
+        setField(cache.adc_median_window, window);
+    }
+
+    int getAdcMedianWindow() {
+        return load(&ConfigCache::adc_median_window);
+    }
+
+    void setAdcIirShift(int shift) {
+        setField(cache.adc_iir_shift, shift);
+    }
+
+    int getAdcIirShift() {
+        return load(&ConfigCache::adc_iir_shift);
+    }
+
+    void setPlantTargetLevel(int level) {
+        setField(cache.plant_target_level, level);
+    }
+
+    int getPlantTargetLevel() {
+        return load(&ConfigCache::plant_target_level);
+    }
+
+    void setPowerSave(bool enabled) {
+        setField(cache.power_save, enabled ? 1 : 0);
+    }
+
+    bool getPowerSave() {
+        return load(&ConfigCache::power_save) != 0;
+    }
+
+    void setTelemetryMode(int mode) {
+        setField(cache.telemetry_mode, mode);
+    }
+
+    int getTelemetryMode() {
+        return load(&ConfigCache::telemetry_mode);
+    }
+
+    void setTelemetryHost(const String& host) {
+        setString(cache.telemetry_host, host.c_str(), CONFIG_HOST_LENGTH);
+    }
+
+    String getTelemetryHost() {
+        return loadString(&ConfigCache::telemetry_host);
+    }
+
+    void setTelemetryPort(int port) {
+        setField(cache.telemetry_port, port);
+    }
+
+    int getTelemetryPort() {
+        return load(&ConfigCache::telemetry_port);
+    }
+
+    void setTelemetryFlushInterval(int interval) {
+        setField(cache.telemetry_flush_interval, interval);
+    }
+
+    int getTelemetryFlushInterval() {
+        return load(&ConfigCache::telemetry_flush_interval);
+    }
+
+    void setTelemetryBatch(int batch) {
+        setField(cache.telemetry_batch, batch);
+    }
+
+    int getTelemetryBatch() {
+        return load(&ConfigCache::telemetry_batch);
+    }
+
+    // Takes only a setting that parses, see WateringSchedule::parse()
+    bool setSchedules(const String& schedules) {
+        char error[96];
+        if (!WateringSchedule::validate(schedules.c_str(), Board::PLANTS, error, sizeof(error))) {
+            return false;
         }
+        setString(cache.schedules, schedules.c_str(), SCHEDULE_TEXT_LENGTH);
+        return true;
+    }
+
+    String getSchedules() {
+        return loadString(&ConfigCache::schedules);
+    }
+
+    void setTimezone(const String& timezone) {
+        setString(cache.timezone, timezone.c_str(), CONFIG_TIMEZONE_LENGTH);
+    }
+
+    String getTimezone() {
+        return loadString(&ConfigCache::timezone);
+    }
+
+    // Applies the keys present in a JSON object and leaves the others alone (PATCH
+    // semantics). Every value is validated before anything is applied; on failure
+    // a message naming the key is written to error. Unknown keys are ignored.
+    ConfigUpdate applyJson(const char* json, size_t length, char* error, size_t errorSize) {
         StaticJsonDocument<JSON_DOCUMENT_SIZE> doc;
-        DeserializationError error = deserializeJson(doc, jsonConfig);
-        if (error) {
-            Serial.print(F("deserializeJson() failed: "));
-            Serial.println(error.c_str());
-            return false; // Add appropriate error handling
-        }
-        // Assuming all configuration keys are known and fixed
-        setName(doc["name"]);
-        setWateringInterval(doc["watering_interval"]);
-        setWateringDuration(doc["watering_duration"]);
-        setWaterTankThreshold(doc["water_tank_threshold"]);
-        setPlantFloodBuffer(doc["plant_flood_buffer"]);
-        end();
+        DeserializationError parseError = deserializeJson(doc, json, length);
+        if (parseError || !doc.is<JsonObject>()) {
+            snprintf(error, errorSize, "Expected a JSON object");
+            return CONFIG_BAD_JSON;
+        }
+
+        std::lock_guard<std::mutex> guard(writeLock);
+        ConfigCache next = cache;
+        JsonObject object = doc.as<JsonObject>();
+        size_t stringCount;
+        const StringField* strings = stringFields(stringCount);
+        for (size_t i = 0; i < stringCount; i++) {
+            if (!object.containsKey(strings[i].key)) {
+                continue;
+            }
+            JsonVariant value = object[strings[i].key];
+            if (!value.is<const char*>() || strlen(value.as<const char*>()) > strings[i].length) {
+                snprintf(error, errorSize, "%s must be a string of at most %u characters", strings[i].key,
+                         static_cast<unsigned>(strings[i].length));
+                return CONFIG_INVALID;
+            }
+            if (strings[i].validate && !strings[i].validate(value.as<const char*>(), error, errorSize)) {
+                return CONFIG_INVALID;
+            }
+            copyString(stringField(next, strings[i]), value.as<const char*>(), strings[i].length);
+        }
+        size_t fieldCount;
+        const IntField* fields = intFields(fieldCount);
+        for (size_t i = 0; i < fieldCount; i++) {
+            if (!object.containsKey(fields[i].key)) {
+                continue;
+            }
+            JsonVariant value = object[fields[i].key];
+            if (!value.is<int32_t>() || value.as<int32_t>() < fields[i].min || value.as<int32_t>() > fields[i].max) {
+                snprintf(error, errorSize, "%s must be an integer in %ld..%ld", fields[i].key,
+                         static_cast<long>(fields[i].min), static_cast<long>(fields[i].max));
+                return CONFIG_INVALID;
+            }
+            next.*(fields[i].field) = value.as<int32_t>();
+        }
+
+        if (memcmp(&next, &cache, sizeof(ConfigCache)) == 0) {
+            return CONFIG_UNCHANGED;
+        }
+        cacheLock.writeBegin();
+        cache = next;
+        cacheLock.writeEnd();
+        version++;
+        if (!store()) {
+            snprintf(error, errorSize, "Failed to write configuration");
+            return CONFIG_WRITE_FAILED;
+        }
+        return CONFIG_UPDATED;
+    }
+
+    bool setConfigFromJson(const String& jsonConfig) {
+        char error[96];
+        ConfigUpdate result = applyJson(jsonConfig.c_str(), jsonConfig.length(), error, sizeof(error));
+        if (result != CONFIG_UPDATED && result != CONFIG_UNCHANGED) {
+            Serial.print(F("Config update failed: "));
+            Serial.println(error);
+            return false;
+        }
         return true;
     }
 
     String getConfigAsJson() {
         StaticJsonDocument<JSON_DOCUMENT_SIZE> doc;
-
-        doc["name"] = cache.name;
-        doc["watering_interval"] = cache.watering_interval;
-        doc["watering_duration"] = cache.watering_duration;
-        doc["water_tank_threshold"] = cache.water_tank_threshold;
-        doc["plant_flood_buffer"] = cache.plant_flood_buffer;
+        fillJson(doc, loadCache());
 
         String output;
         serializeJson(doc, output);
         return output;
     }
+
+    // Serializes into a caller-provided buffer. Returns the length, or size if it did not fit.
+    size_t writeConfigJson(char* output, size_t size) {
+        StaticJsonDocument<JSON_DOCUMENT_SIZE> doc;
+        fillJson(doc, loadCache());
+        return measureJson(doc) < size ? serializeJson(doc, output, size) : size;
+    }
+
+private:
+    template <typename Document>
+    void fillJson(Document& doc, const ConfigCache& values) {
+        size_t stringCount;
+        const StringField* strings = stringFields(stringCount);
+        for (size_t i = 0; i < stringCount; i++) {
+            doc[strings[i].key] = stringField(values, strings[i]); // Copied, values is a temporary
+        }
+        size_t fieldCount;
+        const IntField* fields = intFields(fieldCount);
+        for (size_t i = 0; i < fieldCount; i++) {
+            doc[fields[i].key] = values.*(fields[i].field);
+        }
+    }
+
+    // One consistent copy of all settings, from any task
+    ConfigCache loadCache() const {
+        ConfigCache copy;
+        uint32_t seq;
+        do {
+            seq = cacheLock.readBegin();
+            copy = cache;
+        } while (cacheLock.readRetry(seq));
+        return copy;
+    }
+
+    int32_t load(const int32_t ConfigCache::*field) const {
+        int32_t value;
+        uint32_t seq;
+        do {
+            seq = cacheLock.readBegin();
+            value = cache.*field;
+        } while (cacheLock.readRetry(seq));
+        return value;
+    }
+
+    // The buffers keep a terminator past length whatever a writer does, so
+    // even a torn copy stays in bounds; the retry makes it whole
+    template <size_t N>
+    String loadString(const char (ConfigCache::*field)[N]) const {
+        char copy[N];
+        uint32_t seq;
+        do {
+            seq = cacheLock.readBegin();
+            memcpy(copy, cache.*field, N);
+        } while (cacheLock.readRetry(seq));
+        copy[N - 1] = '\0';
+        return String(copy);
+    }
+
+    // Zero-fills the whole buffer of a string of at most length characters, so
+    // equal strings compare equal with memcmp
+    static void copyString(char* buffer, const char* value, size_t length) {
+        memset(buffer, 0, (length + 4) & ~static_cast<size_t>(3));
+        strncpy(buffer, value, length);
+    }
+
+    void setField(int32_t& field, int value) {
+        std::lock_guard<std::mutex> guard(writeLock);
+        if (field == value) return;
+        cacheLock.writeBegin();
+        field = value;
+        cacheLock.writeEnd();
+        changed();
+    }
+
+    void setString(char* buffer, const char* value, size_t length) {
+        std::lock_guard<std::mutex> guard(writeLock);
+        if (strncmp(buffer, value, length + 1) == 0) return;
+        cacheLock.writeBegin();
+        copyString(buffer, value, length);
+        cacheLock.writeEnd();
+        changed();
+    }
+
+    void changed() {
+        version++;
+        if (!updating) {
+            store();
+        }
+    }
+
+    // Writes the cache as one blob if it differs from what NVS holds
+    bool store() {
+        if (storedValid && memcmp(&cache, &stored, sizeof(ConfigCache)) == 0) {
+            return true;
+        }
+        uint8_t blob[sizeof(BlobHeader) + sizeof(ConfigCache) + sizeof(uint32_t)];
+        const BlobHeader header = {CONFIG_BLOB_LAYOUT, sizeof(ConfigCache)};
+        memcpy(blob, &header, sizeof(header));
+        memcpy(blob + sizeof(header), &cache, sizeof(ConfigCache));
+        const uint32_t crc = crc32(blob, sizeof(header) + sizeof(ConfigCache));
+        memcpy(blob + sizeof(header) + sizeof(ConfigCache), &crc, sizeof(crc));
+
+        bool wasActive = active;
+        if (!wasActive) {
+            preferences.begin(namespaceName.c_str(), false);
+        }
+        bool ok = preferences.putBytes(CONFIG_BLOB_KEY, blob, sizeof(blob)) == sizeof(blob);
+        if (!wasActive) {
+            preferences.end();
+        }
+        if (ok) {
+            stored = cache;
+            storedValid = true;
+        }
+        return ok;
+    }
+
+    bool loadBlob() {
+        uint8_t blob[sizeof(BlobHeader) + sizeof(ConfigCache) + sizeof(uint32_t)];
+        size_t length = preferences.getBytesLength(CONFIG_BLOB_KEY);
+        if (length < sizeof(BlobHeader) + sizeof(uint32_t) || length > sizeof(blob)
+            || preferences.getBytes(CONFIG_BLOB_KEY, blob, length) != length) {
+            return false;
+        }
+        BlobHeader header;
+        memcpy(&header, blob, sizeof(header));
+        uint32_t crc;
+        memcpy(&crc, blob + length - sizeof(crc), sizeof(crc));
+        if (header.layout != CONFIG_BLOB_LAYOUT || sizeof(header) + header.size + sizeof(crc) != length
+            || crc != crc32(blob, length - sizeof(crc))) {
+            return false;
+        }
+        cache = ConfigCache();
+        memcpy(&cache, blob + sizeof(header), header.size);
+        cache.name[CONFIG_NAME_LENGTH] = '\0';
+        cache.telemetry_host[CONFIG_HOST_LENGTH] = '\0';
+        stored = cache;
+        storedValid = true;
+        return true;
+    }
+
+    // Settings as stored by firmware before the blob, one NVS key each
+    void loadLegacyKeys() {
+        cache.watering_interval = preferences.getInt("watering_int", cache.watering_interval);
+        cache.watering_duration = preferences.getInt("watering_dur", cache.watering_duration);
+        copyString(cache.name, preferences.getString("name", "").c_str(), CONFIG_NAME_LENGTH);
+        cache.water_tank_threshold = preferences.getInt("w_tank_thr", cache.water_tank_threshold);
+        cache.plant_flood_buffer = preferences.getInt("plnt_fld_buff", cache.plant_flood_buffer);
+        cache.history_flush_interval = preferences.getInt("hist_flush", cache.history_flush_interval);
+        cache.history_retention = preferences.getInt("hist_retain", cache.history_retention);
+        cache.adc_median_window = preferences.getInt("adc_median", cache.adc_median_window);
+        cache.adc_iir_shift = preferences.getInt("adc_iir", cache.adc_iir_shift);
+    }
 };
 
-#endif // HOMIECONFIG_H
\ No newline at end of file
+#endif // HOMIECONFIG_H
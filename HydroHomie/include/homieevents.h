@@ -0,0 +1,276 @@
+#ifndef HOMIEEVENTS_H
+#define HOMIEEVENTS_H
+
+#include <atomic>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include "HomieManager.h"
+
+#define EVENTS_MAX_CLIENTS 4
+#define EVENTS_MIN_INTERVAL 1000   // ms between pushes; changes in between are merged
+#define EVENTS_KEEPALIVE 15000     // ms of silence before a keepalive comment
+#define EVENTS_HISTORY_MAX 4       // Samples per plant and push, clients backfill larger gaps from /history
+#define EVENTS_FRAME_SIZE (160 + 232 * SensorManager::PLANTS) // A full status and EVENTS_HISTORY_MAX samples of every plant
+
+// Server-Sent Events stream on /events. Instead of polling /status and /history a
+// client gets:
+//   event: status   data: {"t":tank,"p":plant 0,"ps":[every plant],"w":0|1,"lw":lastWateringTime}
+//                   only the fields that changed since the previous push; the first
+//                   push to a client (and the first after it fell behind) has all of them.
+//                   "ps" only on boards with more than one plant, as plant_levels of /status
+//   event: history  data: [seq,ts,level,tank,plant index], one per new sample of each
+//                   plant's history. A client that sees a gap in a plant's seq
+//                   backfills with /history?plant=&since=
+//
+// PsychicEventSource only does the handshake. handle() runs on the loop task, reads
+// the published snapshots and builds the frames, then hands them to the httpd task
+// with httpd_queue_work(). The sends happen there, next to the open and close
+// callbacks, so a socket in the client table is always a live session and never a
+// closed fd that was reused. Sends are non-blocking, so a slow client never stalls
+// the server. Nothing is queued per client: a client whose socket buffer is full
+// skips pushes and gets the full status once it drains, and one that takes a
+// partial frame is disconnected. While one push is still queued the next is held
+// back and its changes are merged into the one after.
+class HomieEvents {
+public:
+    explicit HomieEvents(HomieManager* homieManager) : _homieManager(homieManager) {}
+
+    template <typename Filter>
+    void begin(PsychicHttpServer* server, Filter filter) {
+        _server = server;
+        _eventSource.setFilter(filter);
+        _eventSource.onOpen([this](PsychicEventSourceClient* client) {
+            if (!addClient(client->socket())) {
+                client->close();
+            }
+        });
+        _eventSource.onClose([this](PsychicEventSourceClient* client) {
+            removeClient(client->socket());
+        });
+        _server->on("/events", &_eventSource);
+
+        const SensorSnapshot sensors = _homieManager->getSensorManager()->getSnapshot();
+        const WateringSnapshot watering = _homieManager->getWateringSnapshot();
+        _sensorVersion = sensors.version;
+        _wateringVersion = watering.version;
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            uint32_t firstSeq;
+            _homieManager->getSensorManager()->getHistory(p).range(firstSeq, _historySeq[p]);
+        }
+    }
+
+    // Pushes whatever changed to every client; called from loop(), never blocks
+    void handle() {
+        if (_sending.load(std::memory_order_acquire)) {
+            return;
+        }
+        unsigned long now = millis();
+        const SensorSnapshot sensors = _homieManager->getSensorManager()->getSnapshot();
+        const WateringSnapshot watering = _homieManager->getWateringSnapshot();
+        uint32_t firstSeq[SensorManager::PLANTS], nextSeq[SensorManager::PLANTS];
+        bool historyChanged = false;
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            _homieManager->getSensorManager()->getHistory(p).range(firstSeq[p], nextSeq[p]);
+            historyChanged = historyChanged || nextSeq[p] != _historySeq[p];
+        }
+
+        if (clientCount() == 0) {
+            _sensorVersion = sensors.version;
+            _wateringVersion = watering.version;
+            memcpy(_historySeq, nextSeq, sizeof(_historySeq));
+            return;
+        }
+
+        bool sensorsChanged = sensors.version != _sensorVersion;
+        bool wateringChanged = watering.version != _wateringVersion;
+        bool anyNew = false;
+        for (Client& client : _clients) {
+            if (client.socket.load() >= 0 && client.needsFull.load()) {
+                anyNew = true;
+            }
+        }
+        // Watering transitions go out at once, sampling bursts are merged
+        bool due = wateringChanged || anyNew || now - _lastPush >= EVENTS_MIN_INTERVAL;
+        if (!due) {
+            return;
+        }
+        if (!sensorsChanged && !wateringChanged && !historyChanged && !anyNew) {
+            if (now - _lastPush >= EVENTS_KEEPALIVE) {
+                memcpy(_deltaFrame, ":\n\n", 4);
+                memcpy(_fullFrame, ":\n\n", 4);
+                if (queueBroadcast(3, 3)) {
+                    _lastPush = now;
+                }
+            }
+            return;
+        }
+
+        // Frames for clients that are up to date (delta) and for new or lagging ones (full)
+        size_t deltaLength = 0;
+        size_t fullLength = 0;
+        _eventId++;
+        if (sensorsChanged || wateringChanged) {
+            deltaLength = appendStatus(_deltaFrame, 0, sensors, watering, sensorsChanged, wateringChanged);
+        }
+        fullLength = appendStatus(_fullFrame, 0, sensors, watering, true, true);
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            if (nextSeq[p] == _historySeq[p]) {
+                continue;
+            }
+            uint32_t from = _historySeq[p];
+            if (static_cast<int32_t>(from - firstSeq[p]) < 0 || nextSeq[p] - from > EVENTS_HISTORY_MAX) {
+                from = nextSeq[p] - min(nextSeq[p] - firstSeq[p], static_cast<uint32_t>(EVENTS_HISTORY_MAX));
+            }
+            HistoryEntry entries[EVENTS_HISTORY_MAX];
+            size_t count = _homieManager->getSensorManager()->getHistory(p).read(from, entries, EVENTS_HISTORY_MAX);
+            for (size_t i = 0; i < count; i++) {
+                deltaLength = appendHistory(_deltaFrame, deltaLength, entries[i], p);
+                fullLength = appendHistory(_fullFrame, fullLength, entries[i], p);
+            }
+        }
+        if (!queueBroadcast(deltaLength, fullLength)) {
+            return; // The httpd queue is full, so the changes go out with the next push
+        }
+
+        _sensorVersion = sensors.version;
+        _wateringVersion = watering.version;
+        memcpy(_historySeq, nextSeq, sizeof(_historySeq));
+        _lastPush = now;
+    }
+
+    size_t clientCount() const {
+        size_t count = 0;
+        for (const Client& client : _clients) {
+            if (client.socket.load() >= 0) count++;
+        }
+        return count;
+    }
+
+private:
+    struct Client {
+        std::atomic<int> socket{-1};
+        std::atomic<bool> needsFull{false};
+    };
+
+    HomieManager* _homieManager;
+    PsychicHttpServer* _server = nullptr;
+    PsychicEventSource _eventSource;
+    Client _clients[EVENTS_MAX_CLIENTS];
+    uint32_t _sensorVersion = 0;
+    uint32_t _wateringVersion = 0;
+    uint32_t _historySeq[SensorManager::PLANTS] = {}; // Next sample of each plant's history to push
+    uint32_t _eventId = 0;
+    unsigned long _lastPush = 0;
+    // Owned by the httpd task while _sending is set
+    char _deltaFrame[EVENTS_FRAME_SIZE];
+    char _fullFrame[EVENTS_FRAME_SIZE];
+    size_t _deltaLength = 0;
+    size_t _fullLength = 0;
+    std::atomic<bool> _sending{false};
+
+    // Runs on the httpd task, the only one that fills slots
+    bool addClient(int socket) {
+        for (Client& client : _clients) {
+            if (client.socket.load() < 0) {
+                client.needsFull.store(true); // Before the slot becomes visible to handle()
+                client.socket.store(socket);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Runs on the httpd task
+    void removeClient(int socket) {
+        for (Client& client : _clients) {
+            int expected = socket;
+            client.socket.compare_exchange_strong(expected, -1);
+        }
+    }
+
+    size_t appendStatus(char* frame, size_t length, const SensorSnapshot& sensors, const WateringSnapshot& watering,
+                        bool withSensors, bool withWatering) {
+        length = appendFormat(frame, length, "id: %u\nevent: status\ndata: {", (unsigned)_eventId);
+        if (withSensors) {
+            length = appendFormat(frame, length, "\"t\":%d,\"p\":%d", sensors.tank, sensors.plants[0]);
+            if (SensorManager::PLANTS > 1) {
+                for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+                    length = appendFormat(frame, length, "%s%d", p ? "," : ",\"ps\":[", sensors.plants[p]);
+                }
+                length = appendFormat(frame, length, "]");
+            }
+            length = appendFormat(frame, length, "%s", withWatering ? "," : "");
+        }
+        if (withWatering) {
+            length = appendFormat(frame, length, "\"w\":%d,\"lw\":%lu", watering.watering ? 1 : 0, (unsigned long)watering.lastStart);
+        }
+        return appendFormat(frame, length, "}\n\n");
+    }
+
+    size_t appendHistory(char* frame, size_t length, const HistoryEntry& entry, size_t plant) {
+        return appendFormat(frame, length, "event: history\ndata: [%u,%u,%d,%d,%u]\n\n",
+                            (unsigned)entry.seq, (unsigned)entry.timestamp, entry.plant, entry.tank, (unsigned)plant);
+    }
+
+    // Appends if the whole text fits, so a frame never holds half an event
+    static size_t appendFormat(char* frame, size_t length, const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(frame + length, EVENTS_FRAME_SIZE - length, format, args);
+        va_end(args);
+        if (written < 0 || length + written >= EVENTS_FRAME_SIZE) {
+            frame[length] = '\0';
+            return length;
+        }
+        return length + written;
+    }
+
+    // Hands the frames to the httpd task; false if its queue is full
+    bool queueBroadcast(size_t deltaLength, size_t fullLength) {
+        _deltaLength = deltaLength;
+        _fullLength = fullLength;
+        _sending.store(true, std::memory_order_release);
+        if (httpd_queue_work(_server->server, sendWork, this) != ESP_OK) {
+            _sending.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    static void sendWork(void* arg) {
+        HomieEvents* events = static_cast<HomieEvents*>(arg);
+        events->broadcast();
+        events->_sending.store(false, std::memory_order_release);
+    }
+
+    // Runs on the httpd task, where the close callback has already emptied the
+    // slot of every session that went away
+    void broadcast() {
+        for (Client& client : _clients) {
+            int socket = client.socket.load();
+            if (socket < 0) {
+                continue;
+            }
+            bool resync = client.needsFull.load();
+            const char* frame = resync ? _fullFrame : _deltaFrame;
+            size_t length = resync ? _fullLength : _deltaLength;
+            if (length == 0) {
+                continue;
+            }
+            int sent = httpd_socket_send(_server->server, socket, frame, length, MSG_DONTWAIT);
+            if (sent == static_cast<int>(length)) {
+                client.needsFull.store(false);
+            } else if (sent == HTTPD_SOCK_ERR_TIMEOUT) {
+                // Socket buffer full, skip this push and resync once it drains
+                client.needsFull.store(true);
+            } else {
+                // Error, or part of a frame went out and the stream is unusable
+                httpd_sess_trigger_close(_server->server, socket);
+                int expected = socket;
+                client.socket.compare_exchange_strong(expected, -1);
+            }
+        }
+    }
+};
+
+#endif // HOMIEEVENTS_H
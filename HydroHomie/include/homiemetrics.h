@@ -0,0 +1,82 @@
+#ifndef HOMIEMETRICS_H
+#define HOMIEMETRICS_H
+
+#include "HomieManager.h"
+#include "metrics.h"
+
+// The /metrics series of the sampling and watering pipeline: uptime, loop()
+// and handle() latency, per-route latency and bytes, failed sensor reads,
+// per-plant pump on-time and the fires of every schedule entry. Shared by HomieServer, which adds the
+// heap, and the fleet simulator.
+inline void writeHomieMetrics(Print& out, HomieManager& homieManager, const LatencyHistogram* loopLatency,
+                              const RouteMetrics* routes, size_t routeCount) {
+    writeMetricHeader(out, "hydrohomie_uptime_seconds", "counter", "Time since boot");
+    writeMetricValue(out, "hydrohomie_uptime_seconds", nullptr, millis() / 1000);
+
+    writeMetricHeader(out, "hydrohomie_loop_duration_seconds", "histogram", "Duration of one loop() iteration");
+    writeHistogram(out, "hydrohomie_loop_duration_seconds", nullptr,
+                   loopLatency ? loopLatency->read() : LatencyCounts());
+    writeMetricHeader(out, "hydrohomie_handle_duration_seconds", "histogram", "Duration of HomieManager::handle()");
+    writeHistogram(out, "hydrohomie_handle_duration_seconds", nullptr, homieManager.getHandleLatency().read());
+
+    char labels[64];
+    writeMetricHeader(out, "hydrohomie_http_request_duration_seconds", "histogram", "Time to handle a request");
+    for (size_t i = 0; i < routeCount; i++) {
+        snprintf(labels, sizeof(labels), "route=\"%s\",method=\"%s\"", routes[i].path, routes[i].method);
+        writeHistogram(out, "hydrohomie_http_request_duration_seconds", labels, routes[i].latency.read());
+    }
+    writeMetricHeader(out, "hydrohomie_http_response_bytes_total", "counter", "Response body bytes sent");
+    for (size_t i = 0; i < routeCount; i++) {
+        snprintf(labels, sizeof(labels), "route=\"%s\",method=\"%s\"", routes[i].path, routes[i].method);
+        writeMetricValue(out, "hydrohomie_http_response_bytes_total", labels, routes[i].bytes);
+    }
+
+    writeMetricHeader(out, "hydrohomie_sensor_read_failures_total", "counter", "Sensor reads that returned nothing");
+    writeMetricValue(out, "hydrohomie_sensor_read_failures_total", nullptr,
+                     homieManager.getSensorManager()->getReadFailures());
+
+    // One series per plant, labelled plant="n"
+    const unsigned long now = millis();
+    PumpSnapshot pumps[SensorManager::PLANTS];
+    uint64_t pumpOnMillis[SensorManager::PLANTS];
+    char plantLabels[SensorManager::PLANTS][16];
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        pumps[p] = homieManager.getPumpSnapshot(p);
+        pumpOnMillis[p] = homieManager.getPumpOnMillis(now, p);
+        snprintf(plantLabels[p], sizeof(plantLabels[p]), "plant=\"%u\"", (unsigned)p);
+    }
+    writeMetricHeader(out, "hydrohomie_pump_on", "gauge", "1 while the pump relay is on");
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        writeMetricValue(out, "hydrohomie_pump_on", plantLabels[p], pumps[p].on ? 1 : 0);
+    }
+    writeMetricHeader(out, "hydrohomie_pump_starts_total", "counter", "Pump switch-ons");
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        writeMetricValue(out, "hydrohomie_pump_starts_total", plantLabels[p], pumps[p].starts);
+    }
+    writeMetricHeader(out, "hydrohomie_pump_on_seconds_total", "counter", "Pump on-time");
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        writeMetricValue(out, "hydrohomie_pump_on_seconds_total", plantLabels[p], pumpOnMillis[p] / 1000);
+    }
+    writeMetricHeader(out, "hydrohomie_pump_duty_cycle", "gauge", "Pump on-time / uptime since boot");
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        writeMetricRatio(out, "hydrohomie_pump_duty_cycle", plantLabels[p], pumpOnMillis[p], now);
+    }
+
+    // One series per schedule entry, labelled by its place in the schedules setting
+    const ScheduleSnapshot schedule = homieManager.getScheduleSnapshot();
+    writeMetricHeader(out, "hydrohomie_schedule_fires_total", "counter", "Waterings started by a schedule entry");
+    for (size_t i = 0; i < schedule.count; i++) {
+        snprintf(labels, sizeof(labels), "entry=\"%u\",kind=\"%s\"", (unsigned)i,
+                 scheduleKindName(schedule.entries[i].kind));
+        writeMetricValue(out, "hydrohomie_schedule_fires_total", labels, schedule.entries[i].fires);
+    }
+    writeMetricHeader(out, "hydrohomie_schedule_skipped_total", "counter",
+                      "Schedule fires dropped in quiet hours or stepped over by the clock");
+    for (size_t i = 0; i < schedule.count; i++) {
+        snprintf(labels, sizeof(labels), "entry=\"%u\",kind=\"%s\"", (unsigned)i,
+                 scheduleKindName(schedule.entries[i].kind));
+        writeMetricValue(out, "hydrohomie_schedule_skipped_total", labels, schedule.entries[i].skipped);
+    }
+}
+
+#endif // HOMIEMETRICS_H
@@ -2,29 +2,106 @@
 #define HOMIESERVER_H
 
 // #include <PsychicHttp.h>
-#include "HomieConfig.h"
+#include "homieconfig.h"
 #include "HomieManager.h"
+#include "chunkedwriter.h"
+#include "historystream.h"
+#include "homieevents.h"
+#include "responsecache.h"
+#include "heapstats.h"
+#include "statusjson.h"
+#include "homiemetrics.h"
+#include "powersave.h"
+#include "webassets.h"
+#include "telemetrypublisher.h"
+#include "bootmetrics.h"
+
+#define HTTP_CHUNK_SIZE 512
+#define HTTP_HEADER_VALUE_SIZE 128 // Longest Accept/If-None-Match value inspected
 
 class HomieServer {
 public:
     HomieServer(PsychicHttpServer* server, HomieConfig* config, HomieManager* homieManager)
-    : _server(server), _config(config), _homieManager(homieManager) {}
+    : _server(server), _config(config), _homieManager(homieManager), _events(homieManager) {
+        _statusHeap.route = "/status";
+        _configHeap.route = "/config";
+    }
 
     void begin() {
         // Setting CORS headers for all responses
         DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
-        DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
-        DefaultHeaders::Instance().addHeader("Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept");
+        DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods", "GET, POST, PATCH, OPTIONS");
+        DefaultHeaders::Instance().addHeader("Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept, If-None-Match");
+        DefaultHeaders::Instance().addHeader("Access-Control-Expose-Headers", "ETag");
+
+        // Counters restart at boot, so tag ETags with a per-boot id to keep them unique
+        _bootId = esp_random();
 
         // Set up handlers for specific routes
         setupHandlers();
 
     }
 
+    // Pushes changes to /events clients, call from loop()
+    void handle() {
+        _events.handle();
+    }
+
+    // loop() durations recorded by the caller, exported on /metrics
+    void setLoopLatency(const LatencyHistogram* loopLatency) {
+        _loopLatency = loopLatency;
+    }
+
+    // Duty cycle of loop(), served on /power and /metrics
+    void setPowerSave(const PowerSave* powerSave) {
+        _powerSave = powerSave;
+    }
+
+    // Pump trips, served on /interlock and /metrics
+    void setInterlock(const PumpInterlock* interlock) {
+        _interlock = interlock;
+    }
+
+    // Queue and delivery counters of the push telemetry, exported on /metrics
+    void setTelemetry(const TelemetryPublisher* telemetry) {
+        _telemetry = telemetry;
+    }
+
+    // Period jitter and missed deadlines of the sampling task, exported on /metrics
+    void setSampling(const SamplingTask* sampling) {
+        _sampling = sampling;
+    }
+
+    // Boot milestones, exported on /metrics; the first response is marked here
+    void setBootMetrics(BootMetrics* bootMetrics) {
+        _bootMetrics = bootMetrics;
+    }
+
 private:
     PsychicHttpServer* _server;
     HomieConfig* _config;
     HomieManager* _homieManager; // Assuming this class exists
+    uint8_t _chunkBuffer[HTTP_CHUNK_SIZE]; // Handlers run on the single httpd task, so one buffer is enough
+    uint32_t _bootId = 0;
+    HomieEvents _events;
+    // Pre-serialized bodies, rebuilt only when their version changes
+    CachedResponse<STATUS_CACHE_SIZE> _statusJson;
+    CachedResponse<STATUS_CACHE_SIZE> _statusMsgPack;
+    CachedResponse<CONFIG_CACHE_SIZE> _configJson;
+    CachedResponse<STATS_CACHE_SIZE> _statsJson;
+    char _statusEtag[40] = "";
+    char _statsEtag[40] = "";
+    HeapRouteStats _statusHeap;
+    HeapRouteStats _configHeap;
+    const LatencyHistogram* _loopLatency = nullptr;
+    const PowerSave* _powerSave = nullptr;
+    const PumpInterlock* _interlock = nullptr;
+    const TelemetryPublisher* _telemetry = nullptr;
+    const SamplingTask* _sampling = nullptr;
+    BootMetrics* _bootMetrics = nullptr;
+    RouteMetrics _routes[METRICS_MAX_ROUTES];
+    size_t _routeCount = 0;
+    size_t _replyBytes = 0; // Body bytes sent by the request being handled
 
     bool isLocalIPAddress(IPAddress ip) {
         IPAddress localSubnet(255, 255, 255, 0);  // Your subnet mask
@@ -34,46 +111,84 @@ private:
 
     esp_err_t handleIpFilter(PsychicRequest *request) {
         if (!isLocalIPAddress(request->client()->remoteIP())) {
-            return request->reply(403, "application/json", "{\"error\":\"Forbidden\"}");
+            return reply(request, 403, "application/json", "{\"error\":\"Forbidden\"}");
         }
         return ESP_OK;
     }
 
-    void setupHandlers() {
-        // Handler for OPTIONS on any URL (general preflight handling)
-        _server->on("/config", HTTP_OPTIONS, [this](PsychicRequest *request) {
+    static const char* methodName(http_method method) {
+        switch (method) {
+            case HTTP_GET: return "GET";
+            case HTTP_POST: return "POST";
+            case HTTP_PATCH: return "PATCH";
+            case HTTP_OPTIONS: return "OPTIONS";
+            default: return "OTHER";
+        }
+    }
+
+    // Registers a handler behind the IP filter and records its latency and reply
+    // size in the route's RouteMetrics
+    template <typename Handler>
+    void onRoute(const char* path, http_method method, Handler handler) {
+        _server->on(path, method, filtered(path, method, handler));
+    }
+
+    // handler wrapped in the IP filter and the metrics of path
+    template <typename Handler>
+    PsychicHttpRequestCallback filtered(const char* path, http_method method, Handler handler) {
+        RouteMetrics* metrics = nullptr;
+        if (_routeCount < METRICS_MAX_ROUTES) {
+            metrics = &_routes[_routeCount++];
+            metrics->path = path;
+            metrics->method = methodName(method);
+        }
+        return [this, metrics, handler](PsychicRequest *request) {
+            uint32_t start = micros();
+            _replyBytes = 0;
             auto res = handleIpFilter(request);
-            if (res != ESP_OK) {
-                return res;
+            if (res == ESP_OK) {
+                res = handler(request);
             }
-            return request->reply(204); // No Content, but headers should be sent
+            if (metrics) {
+                metrics->record(micros() - start, _replyBytes);
+            }
+            if (_bootMetrics) {
+                _bootMetrics->mark(BOOT_FIRST_HTTP_RESPONSE);
+            }
+            return res;
+        };
+    }
+
+    esp_err_t reply(PsychicRequest *request, int code) {
+        return request->reply(code);
+    }
+
+    esp_err_t reply(PsychicRequest *request, int code, const char* contentType, const char* body) {
+        _replyBytes += strlen(body);
+        return request->reply(code, contentType, body);
+    }
+
+    void setupHandlers() {
+        // Handler for OPTIONS on any URL (general preflight handling)
+        onRoute("/config", HTTP_OPTIONS, [this](PsychicRequest *request) {
+            return reply(request, 204); // No Content, but headers should be sent
         });
 
         // Handlers for specific routes
-        _server->on("/config", HTTP_GET, [this](PsychicRequest *request) {
-            auto res = handleIpFilter(request);
-            if (res != ESP_OK) {
-                return res;
-            }
-            return handleGetConfig(request);
+        onRoute("/config", HTTP_GET, [this](PsychicRequest *request) {
+            HeapAllocationCounter allocations;
+            esp_err_t res = handleGetConfig(request);
+            _configHeap.record(allocations.count());
+            return res;
         });
 
-        // // Send a POST request to <IP>/post with a form field message set to <message>
-        _server->on("/config", HTTP_POST, [this](PsychicRequest *request) {
-            auto res = handleIpFilter(request);
-            if (res != ESP_OK) {
-                return res;
-            }
-            if (request->body().length() > 0) {
-                // Update configuration using parsed JSON
-                if (_config->setConfigFromJson(request->body())) {
-                    return request->reply(200, "application/json", "{\"message\":\"Configuration updated successfully\"}");
-                } else {
-                    return request->reply(500, "application/json", "{\"error\":\"Failed to update configuration\"}");
-                }
-            } else {
-                return request->reply(400, "application/json", "{\"error\":\"No JSON payload\"}");
-            }
+        // POST and PATCH both update only the keys present in the body
+        onRoute("/config", HTTP_POST, [this](PsychicRequest *request) {
+            return handleUpdateConfig(request);
+        });
+
+        onRoute("/config", HTTP_PATCH, [this](PsychicRequest *request) {
+            return handleUpdateConfig(request);
         });
 
         // // Send a POST request to <IP>/post with a form field message set to <message>
@@ -111,74 +226,522 @@ private:
 
         
 
-        _server->on("/status", HTTP_GET, [this](PsychicRequest *request) {
-            auto res = handleIpFilter(request);
-            if (res != ESP_OK) {
-                return res;
-            }
-            return handleGetStatus(request);
+        onRoute("/status", HTTP_GET, [this](PsychicRequest *request) {
+            HeapAllocationCounter allocations;
+            esp_err_t res = handleGetStatus(request);
+            _statusHeap.record(allocations.count());
+            return res;
         });
 
-        _server->on("/history", HTTP_GET, [this](PsychicRequest *request) {
-            auto res = handleIpFilter(request);
-            if (res != ESP_OK) {
-                return res;
-            }
+        onRoute("/heap", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetHeap(request);
+        });
+
+        onRoute("/history", HTTP_GET, [this](PsychicRequest *request) {
             return handleGetHistory(request);
         });
 
-        _server->on("/water", HTTP_POST, [this](PsychicRequest *request) {
-            auto res = handleIpFilter(request);
-            if (res != ESP_OK) {
-                return res;
-            }
+        onRoute("/tasks", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetTasks(request);
+        });
+
+        onRoute("/metrics", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetMetrics(request);
+        });
+
+        onRoute("/power", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetPower(request);
+        });
+
+        onRoute("/stats", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetStats(request);
+        });
+
+        onRoute("/interlock", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetInterlock(request);
+        });
+
+        onRoute("/schedule", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetSchedule(request);
+        });
+
+        // Live status and history push, see homieevents.h
+        _events.begin(_server, [this](PsychicRequest *request) {
+            return isLocalIPAddress(request->client()->remoteIP());
+        });
+
+        onRoute("/water", HTTP_POST, [this](PsychicRequest *request) {
             _homieManager->forceStartWatering();
-            return request->reply(200, "application/json", "{\"message\":\"Watering started\"}");
+            return reply(request, 200, "application/json", "{\"message\":\"Watering started\"}");
         });
 
-        _server->on("/stop", HTTP_POST, [this](PsychicRequest *request) {
-            auto res = handleIpFilter(request);
-            if (res != ESP_OK) {
-                return res;
-            }
+        onRoute("/stop", HTTP_POST, [this](PsychicRequest *request) {
             _homieManager->forceStopWatering();
-            return request->reply(200, "application/json", "{\"message\":\"Watering started\"}");
+            return reply(request, 200, "application/json", "{\"message\":\"Watering started\"}");
+        });
+
+        // Fountain itself, if it was packed into the firmware; served from the
+        // same origin, its API calls need no CORS preflight
+        onRoute("/", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetAsset(request);
         });
+        _server->onNotFound(filtered("/*", HTTP_GET, [this](PsychicRequest *request) {
+            return handleGetAsset(request);
+        }));
+    }
+
+    // A file of the packed Fountain build, sent straight from flash. Hashed
+    // assets are immutable; index.html and the other unhashed files are
+    // revalidated by ETag on every load. Browsers only offer brotli over HTTPS,
+    // so everything compressible is gzip, which every client accepts.
+    esp_err_t handleGetAsset(PsychicRequest *request) {
+        httpd_req_t* req = request->request();
+        const WebAsset* asset = findWebAsset(req->uri);
+        if (!asset) {
+            if (strcmp(req->uri, "/") == 0) {
+                return reply(request, 200, "text/plain", "Hello, world"); // Built without the dashboard
+            }
+            return reply(request, 404, "application/json", "{\"error\":\"Not found\"}");
+        }
+        const char* cacheControl = asset->immutable ? "public, max-age=31536000, immutable" : "no-cache";
+        httpd_resp_set_hdr(req, "ETag", asset->etag);
+        httpd_resp_set_hdr(req, "Cache-Control", cacheControl);
+        if (isNotModified(request, asset->etag)) {
+            httpd_resp_set_status(req, "304 Not Modified");
+            return httpd_resp_send(req, nullptr, 0);
+        }
+        httpd_resp_set_type(req, asset->contentType);
+        if (asset->gzip) {
+            httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+            httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+        }
+        _replyBytes += asset->size;
+        return httpd_resp_send(req, reinterpret_cast<const char*>(asset->data), asset->size);
+    }
+
+    esp_err_t handleUpdateConfig(PsychicRequest *request) {
+        const String& body = request->body();
+        if (body.length() == 0) {
+            return reply(request, 400, "application/json", "{\"error\":\"No JSON payload\"}");
+        }
+        char error[96];
+        switch (_config->applyJson(body.c_str(), body.length(), error, sizeof(error))) {
+            case CONFIG_UPDATED:
+                _homieManager->configChanged();
+                return reply(request, 200, "application/json", "{\"message\":\"Configuration updated successfully\"}");
+            case CONFIG_UNCHANGED:
+                return reply(request, 200, "application/json", "{\"message\":\"Configuration unchanged\"}");
+            case CONFIG_WRITE_FAILED:
+                return reply(request, 500, "application/json", "{\"error\":\"Failed to update configuration\"}");
+            default: {
+                char message[128];
+                snprintf(message, sizeof(message), "{\"error\":\"%s\"}", error);
+                return reply(request, 400, "application/json", message);
+            }
+        }
     }
 
     esp_err_t handleGetConfig(PsychicRequest *request) {
-        String configJson = _config->getConfigAsJson();
-        return request->reply(200, "application/json", configJson.c_str());
+        _configJson.refresh(_config->getVersion(), [this](char* data, size_t size) {
+            return _config->writeConfigJson(data, size);
+        });
+        return sendCached(request, "200 OK", "application/json", nullptr, _configJson.data(), _configJson.size());
     }
 
 
     esp_err_t handleGetStatus(PsychicRequest *request) {
-        auto currentValues = _homieManager->getSensorManager()->getLastValue(); // Get the last sensor values
-        const auto [tank, plant, dig]  = currentValues;
+        // One consistent copy of each, loop() keeps updating them meanwhile
+        const SensorSnapshot sensors = _homieManager->getSensorManager()->getSnapshot();
+        const WateringSnapshot watering = _homieManager->getWateringSnapshot();
+        const uint64_t version = (static_cast<uint64_t>(sensors.version) << 32) | watering.version;
+        if (_statusJson.refresh(version, [&](char* data, size_t size) {
+                DynamicJsonDocument doc(256);
+                fillStatusJson(doc, sensors, watering);
+                _statusMsgPack.refresh(version, [&doc](char* packed, size_t packedSize) {
+                    return measureMsgPack(doc) < packedSize ? serializeMsgPack(doc, packed, packedSize) : packedSize;
+                });
+                return measureJson(doc) < size ? serializeJson(doc, data, size) : size;
+            })) {
+            snprintf(_statusEtag, sizeof(_statusEtag), "\"%08x-%x-%x\"", (unsigned)_bootId,
+                     (unsigned)sensors.version, (unsigned)watering.version);
+        }
+        if (isNotModified(request, _statusEtag)) {
+            return replyNotModified(request, _statusEtag);
+        }
+        if (accepts(request, "application/msgpack")) {
+            return sendCached(request, "200 OK", "application/msgpack", _statusEtag, _statusMsgPack.data(), _statusMsgPack.size());
+        }
+        return sendCached(request, "200 OK", "application/json", _statusEtag, _statusJson.data(), _statusJson.size());
+    }
 
-        DynamicJsonDocument doc(1024);
-        doc["current_plant_level"] = plant;
-        doc["current_water_level"] = tank;
-        doc["is_watering"] = _homieManager->isWateringActive();
-        doc["last_watering_time"] = _homieManager->getLastWateringStartTime();
+    // /stats[?plant=n]: rolling statistics of a plant and the tank, a few hundred
+    // bytes instead of the whole /history. Rebuilt once per poll at most.
+    esp_err_t handleGetStats(PsychicRequest *request) {
+        size_t plant;
+        if (!requestedPlant(request, plant)) {
+            return reply(request, 400, "application/json", "{\"error\":\"Unknown plant\"}");
+        }
+        const SensorManager* sensors = _homieManager->getSensorManager();
+        const RollingStats& stats = sensors->getStats(plant);
+        const uint32_t statsVersion = stats.getVersion();
+        const uint32_t configVersion = _config->getVersion();
+        const uint64_t version = (static_cast<uint64_t>(statsVersion) << 32) | (configVersion << 8) | plant;
+        if (_statsJson.refresh(version, [&](char* data, size_t size) {
+                DynamicJsonDocument doc(1536);
+                fillStatsJson(doc, plant, stats, sensors->getTankStats(), _config->getPlantTargetLevel(), WallClock::now());
+                return measureJson(doc) < size ? serializeJson(doc, data, size) : size;
+            })) {
+            snprintf(_statsEtag, sizeof(_statsEtag), "\"%08x-%u-%x-%x\"", (unsigned)_bootId, (unsigned)plant,
+                     (unsigned)statsVersion, (unsigned)configVersion);
+        }
+        if (isNotModified(request, _statsEtag)) {
+            return replyNotModified(request, _statsEtag);
+        }
+        return sendCached(request, "200 OK", "application/json", _statsEtag, _statsJson.data(), _statsJson.size());
+    }
+
+    // Free heap, fragmentation and per-request allocation counts of the cached routes
+    esp_err_t handleGetHeap(PsychicRequest *request) {
+        DynamicJsonDocument doc(512);
+        doc["free"] = ESP.getFreeHeap();
+        doc["min_free"] = ESP.getMinFreeHeap();
+        doc["largest_block"] = ESP.getMaxAllocHeap();
+        doc["alloc_counting"] = heapStatsEnabled();
+        JsonArray routes = doc.createNestedArray("routes");
+        for (const HeapRouteStats* stats : {&_statusHeap, &_configHeap}) {
+            JsonObject route = routes.createNestedObject();
+            route["route"] = stats->route;
+            route["requests"] = stats->requests;
+            route["last_allocs"] = stats->lastAllocations;
+            route["max_allocs"] = stats->maxAllocations;
+            route["total_allocs"] = stats->totalAllocations;
+        }
+        doc["status_builds"] = _statusJson.getBuilds();
+        doc["config_builds"] = _configJson.getBuilds();
         String output;
         serializeJson(doc, output);
-        return request->reply(200, "application/json", output.c_str());
+        return reply(request, 200, "application/json", output.c_str());
     }
 
-    esp_err_t handleGetHistory(PsychicRequest *request) {
-        auto history = _homieManager->getSensorManager()->getHistory();
-        DynamicJsonDocument doc(4096);
-        JsonArray array = doc.to<JsonArray>();
-        for (const auto& entry : history) {
-            JsonArray nestedArray = array.createNestedArray();
-            const auto [tank, plant, dig] = entry;
-            nestedArray.add(plant);
-            nestedArray.add(tank);
+    // Power mode and where loop()'s time went since boot. duty_cycle is the share
+    // spent working; loop_idle_ratio the share blocked until the next deadline.
+    // That is only the time the chip may light-sleep: httpd, Wi-Fi and the
+    // sampling task keep it awake for part of it, and real sleep time is not
+    // measured.
+    esp_err_t handleGetPower(PsychicRequest *request) {
+        const PowerStats stats = _powerSave ? _powerSave->getStats() : PowerStats{POWER_FULL, 0, 0, 0, 0};
+        const uint64_t total = stats.awakeMicros + stats.idleMicros;
+        DynamicJsonDocument doc(256);
+        doc["mode"] = powerModeName(stats.mode);
+        doc["duty_cycle"] = total ? static_cast<float>(stats.awakeMicros) / total : 1.0f;
+        doc["loop_idle_ratio"] = total ? static_cast<float>(stats.idleMicros) / total : 0.0f;
+        doc["awake_ms"] = stats.awakeMicros / 1000;
+        doc["idle_ms"] = stats.idleMicros / 1000;
+        doc["idles"] = stats.idles;
+        doc["wakeups"] = stats.wakeups;
+        doc["cpu_mhz"] = getCpuFrequencyMhz();
+        String output;
+        serializeJson(doc, output);
+        return reply(request, 200, "application/json", output.c_str());
+    }
+
+    // Which pumps the interlock holds off and its latest trips, oldest first
+    esp_err_t handleGetInterlock(PsychicRequest *request) {
+        if (!_interlock) {
+            return reply(request, 404, "application/json", "{\"error\":\"No interlock\"}");
+        }
+        PumpTrip trips[PUMP_INTERLOCK_TRIPS];
+        const size_t count = _interlock->readTrips(trips, PUMP_INTERLOCK_TRIPS);
+        DynamicJsonDocument doc(512 + count * 192);
+        JsonArray tripped = doc.createNestedArray("tripped");
+        for (size_t p = 0; p < PumpInterlock::PLANTS; p++) {
+            tripped.add(pumpTripReasonName(_interlock->getTrip(p)));
+        }
+        doc["trips_total"] = _interlock->getTripCount();
+        JsonArray list = doc.createNestedArray("trips");
+        for (size_t i = 0; i < count; i++) {
+            JsonObject trip = list.createNestedObject();
+            trip["seq"] = trips[i].seq;
+            trip["time"] = static_cast<unsigned long>(trips[i].timestamp);
+            trip["uptime_ms"] = trips[i].uptimeMillis;
+            trip["plant"] = trips[i].plant;
+            trip["reason"] = pumpTripReasonName(trips[i].reason);
+            trip["on_ms"] = trips[i].onMillis;
+            trip["tank"] = trips[i].tank;
+            trip["level"] = trips[i].level;
         }
         String output;
         serializeJson(doc, output);
-        return request->reply(200, "application/json", output.c_str());
+        return reply(request, 200, "application/json", output.c_str());
+    }
+
+    // The schedule entries and their upcoming fires
+    esp_err_t handleGetSchedule(PsychicRequest *request) {
+        const ScheduleSnapshot schedule = _homieManager->getScheduleSnapshot();
+        DynamicJsonDocument doc(256 + schedule.count * 256);
+        fillScheduleJson(doc, schedule, WallClock::now());
+        String output;
+        serializeJson(doc, output);
+        return reply(request, 200, "application/json", output.c_str());
+    }
+
+    // Per-task timing of the HomieManager scheduler plus handle() itself
+    esp_err_t handleGetTasks(PsychicRequest *request) {
+        DynamicJsonDocument doc(1024);
+        fillTasksJson(doc.to<JsonArray>(), *_homieManager);
+        String output;
+        serializeJson(doc, output);
+        return reply(request, 200, "application/json", output.c_str());
+    }
+
+    // Prometheus text format: the pipeline series from homiemetrics.h plus the
+    // heap. Histograms are copied out under their seqlocks, so scraping never
+    // stalls loop().
+    esp_err_t handleGetMetrics(PsychicRequest *request) {
+        return streamResponse(request, "text/plain; version=0.0.4", nullptr, [this](Print& out) {
+            writeHomieMetrics(out, *_homieManager, _loopLatency, _routes, _routeCount);
+
+            uint32_t freeHeap = ESP.getFreeHeap();
+            uint32_t largestBlock = ESP.getMaxAllocHeap();
+            writeMetricHeader(out, "hydrohomie_heap_free_bytes", "gauge", "Free heap");
+            writeMetricValue(out, "hydrohomie_heap_free_bytes", nullptr, freeHeap);
+            writeMetricHeader(out, "hydrohomie_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+            writeMetricValue(out, "hydrohomie_heap_min_free_bytes", nullptr, ESP.getMinFreeHeap());
+            writeMetricHeader(out, "hydrohomie_heap_largest_block_bytes", "gauge", "Largest allocatable block");
+            writeMetricValue(out, "hydrohomie_heap_largest_block_bytes", nullptr, largestBlock);
+            writeMetricHeader(out, "hydrohomie_heap_fragmentation_ratio", "gauge", "1 - largest block / free heap");
+            writeMetricRatio(out, "hydrohomie_heap_fragmentation_ratio", nullptr,
+                             freeHeap > largestBlock ? freeHeap - largestBlock : 0, freeHeap);
+
+            if (_powerSave) {
+                const PowerStats power = _powerSave->getStats();
+                writeMetricHeader(out, "hydrohomie_loop_awake_seconds_total", "counter", "Time loop() spent working");
+                out.print("hydrohomie_loop_awake_seconds_total ");
+                writeSeconds(out, power.awakeMicros);
+                out.print('\n');
+                writeMetricHeader(out, "hydrohomie_loop_idle_seconds_total", "counter", "Time loop() spent blocked until the next deadline");
+                out.print("hydrohomie_loop_idle_seconds_total ");
+                writeSeconds(out, power.idleMicros);
+                out.print('\n');
+            }
+
+            if (_interlock) {
+                writeMetricHeader(out, "hydrohomie_pump_trips_total", "counter", "Pumps switched off by the interlock");
+                for (uint8_t reason = TRIP_NONE + 1; reason < TRIP_REASONS; reason++) {
+                    char labels[32];
+                    snprintf(labels, sizeof(labels), "reason=\"%s\"", pumpTripReasonName(reason));
+                    writeMetricValue(out, "hydrohomie_pump_trips_total", labels, _interlock->getTripCount(reason));
+                }
+            }
+
+            if (_telemetry) {
+                const TelemetryStats telemetry = _telemetry->getStats();
+                writeMetricHeader(out, "hydrohomie_telemetry_connected", "gauge", "1 while the collector or broker is connected");
+                writeMetricValue(out, "hydrohomie_telemetry_connected", nullptr, telemetry.connected ? 1 : 0);
+                writeMetricHeader(out, "hydrohomie_telemetry_queued_records", "gauge", "Records waiting for an acknowledgement");
+                writeMetricValue(out, "hydrohomie_telemetry_queued_records", nullptr, telemetry.queued);
+                writeMetricHeader(out, "hydrohomie_telemetry_acked_records_total", "counter", "Records acknowledged");
+                writeMetricValue(out, "hydrohomie_telemetry_acked_records_total", nullptr, telemetry.acked);
+                writeMetricHeader(out, "hydrohomie_telemetry_dropped_records_total", "counter", "Records lost to a full queue");
+                writeMetricValue(out, "hydrohomie_telemetry_dropped_records_total", nullptr, telemetry.dropped);
+                writeMetricHeader(out, "hydrohomie_telemetry_batches_total", "counter", "Messages acknowledged");
+                writeMetricValue(out, "hydrohomie_telemetry_batches_total", nullptr, telemetry.batches);
+                writeMetricHeader(out, "hydrohomie_telemetry_sent_bytes_total", "counter", "Payload bytes of the acknowledged messages");
+                writeMetricValue(out, "hydrohomie_telemetry_sent_bytes_total", nullptr, telemetry.bytes);
+                writeMetricHeader(out, "hydrohomie_telemetry_failures_total", "counter", "Failed connects, sends and acknowledgements");
+                writeMetricValue(out, "hydrohomie_telemetry_failures_total", nullptr, telemetry.failures);
+            }
+
+            if (_sampling) {
+                const SamplingStats sampling = _sampling->getStats();
+                writeMetricHeader(out, "hydrohomie_sampling_jitter_seconds", "histogram", "How late the periodic polls started");
+                writeHistogram(out, "hydrohomie_sampling_jitter_seconds", nullptr, _sampling->getJitter().read());
+                writeMetricHeader(out, "hydrohomie_sampling_polls_total", "counter", "Polls of the sampling task");
+                writeMetricValue(out, "hydrohomie_sampling_polls_total", nullptr, sampling.polls);
+                writeMetricHeader(out, "hydrohomie_sampling_missed_deadlines_total", "counter", "Poll deadlines passed while the previous poll ran");
+                writeMetricValue(out, "hydrohomie_sampling_missed_deadlines_total", nullptr, sampling.missed);
+                writeMetricHeader(out, "hydrohomie_sampling_dropped_reads_total", "counter", "Reads lost while loop() did not take them in");
+                writeMetricValue(out, "hydrohomie_sampling_dropped_reads_total", nullptr, sampling.dropped);
+            }
+
+            if (_bootMetrics) {
+                writeMetricHeader(out, "hydrohomie_boot_milestone_seconds", "gauge", "Time from boot to each milestone reached");
+                for (uint8_t milestone = 0; milestone < BOOT_MILESTONES; milestone++) {
+                    const unsigned long at = _bootMetrics->getMillis(static_cast<BootMilestone>(milestone));
+                    if (at) {
+                        out.printf("hydrohomie_boot_milestone_seconds{milestone=\"%s\"} ", bootMilestoneName(milestone));
+                        writeSeconds(out, static_cast<uint64_t>(at) * 1000);
+                        out.print('\n');
+                    }
+                }
+            }
+        });
+    }
+
+    // ?plant=n selects a plant's history, plant 0 by default
+    bool requestedPlant(PsychicRequest *request, size_t& plant) {
+        plant = 0;
+        if (request->hasParam("plant")) {
+            char* end;
+            const char* value = request->getParam("plant")->value().c_str();
+            plant = strtoul(value, &end, 10);
+            return end != value && *end == '\0' && plant < SensorManager::PLANTS;
+        }
+        return true;
+    }
+
+    esp_err_t handleGetHistory(PsychicRequest *request) {
+        size_t plant;
+        if (!requestedPlant(request, plant)) {
+            return reply(request, 400, "application/json", "{\"error\":\"Unknown plant\"}");
+        }
+        const auto& history = _homieManager->getSensorManager()->getHistory(plant);
+        if (request->hasParam("resolution")) {
+            return handleGetRollup(request, plant);
+        }
+        const bool binary = accepts(request, "application/octet-stream");
+        const bool incremental = request->hasParam("since") || request->hasParam("limit");
+
+        // Incremental format: entries with seq >= since, at most limit of them.
+        // "cursor" is the since= value to use for the next poll.
+        uint32_t firstSeq, nextSeq;
+        history.range(firstSeq, nextSeq);
+        uint32_t since = firstSeq;
+        if (request->hasParam("since")) {
+            since = strtoul(request->getParam("since")->value().c_str(), nullptr, 10);
+            if (since > nextSeq) {
+                // Cursor from before a reboot, start over
+                since = firstSeq;
+            }
+        }
+        size_t limit = history.capacity();
+        if (request->hasParam("limit")) {
+            limit = strtoul(request->getParam("limit")->value().c_str(), nullptr, 10);
+        }
+
+        // The reply only changes when a sample is pushed
+        char etag[40];
+        snprintf(etag, sizeof(etag), "\"%08x-%u-%x%s\"", (unsigned)_bootId, (unsigned)plant, (unsigned)nextSeq, binary ? "b" : "j");
+        if (isNotModified(request, etag)) {
+            return replyNotModified(request, etag);
+        }
+
+        if (binary) {
+            return streamResponse(request, "application/octet-stream", etag, [&history, since, limit](Print& out) {
+                writeHistoryBinary(out, history, since, limit);
+            });
+        }
+        if (!incremental) {
+            // Legacy format: the whole buffer as [plant, tank] pairs
+            return streamResponse(request, "application/json", etag, [&history](Print& out) {
+                writeHistoryJson(out, history);
+            });
+        }
+        return streamResponse(request, "application/json", etag, [&history, since, limit](Print& out) {
+            writeHistoryJson(out, history, since, limit);
+        });
+    }
+
+    // /history?resolution=1m|15m|1h[&limit=n]: min/avg/max buckets of one tier
+    esp_err_t handleGetRollup(PsychicRequest *request, size_t plant) {
+        const auto& history = _homieManager->getSensorManager()->getHistory(plant);
+        const auto& tiers = _homieManager->getSensorManager()->getTiers(plant);
+        String resolution = request->getParam("resolution")->value();
+        size_t limit = SIZE_MAX;
+        if (request->hasParam("limit")) {
+            limit = strtoul(request->getParam("limit")->value().c_str(), nullptr, 10);
+        }
+
+        uint32_t version;
+        if (resolution == "1m") {
+            uint32_t firstSeq;
+            history.range(firstSeq, version);
+        } else if (resolution == "15m") {
+            version = tiers.quarterHour.getWriteCount();
+        } else if (resolution == "1h") {
+            version = tiers.hourly.getWriteCount();
+        } else {
+            return reply(request, 400, "application/json", "{\"error\":\"Unknown resolution\"}");
+        }
+
+        char etag[48];
+        snprintf(etag, sizeof(etag), "\"%08x-%u-%s-%x\"", (unsigned)_bootId, (unsigned)plant, resolution.c_str(), (unsigned)version);
+        if (isNotModified(request, etag)) {
+            return replyNotModified(request, etag);
+        }
+        return streamResponse(request, "application/json", etag, [&](Print& out) {
+            if (resolution == "1m") {
+                writeRollupJson(out, "1m", history, limit);
+            } else if (resolution == "15m") {
+                writeRollupJson(out, "15m", tiers.quarterHour, limit);
+            } else {
+                writeRollupJson(out, "1h", tiers.hourly, limit);
+            }
+        });
+    }
+
+    // Header lookups go straight to the httpd request into a stack buffer, so
+    // unlike PsychicRequest::header() they don't allocate a String
+    bool headerValue(PsychicRequest *request, const char* field, char* value, size_t size) {
+        return httpd_req_get_hdr_value_str(request->request(), field, value, size) == ESP_OK;
+    }
+
+    bool accepts(PsychicRequest *request, const char* contentType) {
+        char value[HTTP_HEADER_VALUE_SIZE];
+        return headerValue(request, "Accept", value, sizeof(value)) && strstr(value, contentType) != nullptr;
+    }
+
+    bool isNotModified(PsychicRequest *request, const char* etag) {
+        char value[HTTP_HEADER_VALUE_SIZE];
+        return headerValue(request, "If-None-Match", value, sizeof(value)) && strcmp(value, etag) == 0;
+    }
+
+    esp_err_t replyNotModified(PsychicRequest *request, const char* etag) {
+        return sendCached(request, "304 Not Modified", nullptr, etag, nullptr, 0);
+    }
+
+    // Sends a complete body with the httpd API directly. The headers only point at
+    // the strings passed in, so unlike PsychicResponse nothing is allocated.
+    esp_err_t sendCached(PsychicRequest *request, const char* status, const char* contentType, const char* etag,
+                         const char* body, size_t length) {
+        httpd_req_t* req = request->request();
+        httpd_resp_set_status(req, status);
+        if (contentType) {
+            httpd_resp_set_type(req, contentType);
+        }
+        for (const HTTPHeader& header : DefaultHeaders::Instance().getHeaders()) {
+            httpd_resp_set_hdr(req, header.field, header.value);
+        }
+        if (etag) {
+            httpd_resp_set_hdr(req, "ETag", etag);
+            httpd_resp_set_hdr(req, "Vary", "Accept");
+        }
+        _replyBytes += length;
+        return httpd_resp_send(req, body, length);
+    }
+
+    // Sends a body of unknown length with chunked transfer encoding, buffering
+    // at most HTTP_CHUNK_SIZE bytes at a time.
+    template <typename Body>
+    esp_err_t streamResponse(PsychicRequest *request, const char* contentType, const char* etag, Body body) {
+        PsychicResponse response(request);
+        response.setCode(200);
+        response.setContentType(contentType);
+        if (etag) {
+            response.addHeader("ETag", etag);
+            response.addHeader("Vary", "Accept");
+        }
+        response.sendHeaders();
+        ChunkedWriter writer(_chunkBuffer, sizeof(_chunkBuffer), [&response](const uint8_t* data, size_t len) {
+            return response.sendChunk(const_cast<uint8_t*>(data), len) == ESP_OK;
+        });
+        body(writer);
+        bool flushed = writer.sendBuffered();
+        _replyBytes += writer.bytesWritten();
+        if (!flushed) {
+            return ESP_FAIL;
+        }
+        return response.finishChunking();
     }
 };
 
@@ -0,0 +1,111 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+#include "seqlock.h"
+
+#define LATENCY_BUCKETS 12
+#define METRICS_MAX_ROUTES 20
+
+// Upper bounds of the latency buckets in microseconds; a last +Inf bucket is implicit
+static const uint32_t latencyBucketBounds[LATENCY_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 500000, 1000000
+};
+
+// Counts of a LatencyHistogram, copied out whole
+struct LatencyCounts {
+    uint64_t buckets[LATENCY_BUCKETS + 1] = {}; // Not cumulative, the last one is +Inf
+    uint64_t count = 0;
+    uint64_t sumMicros = 0;
+    uint32_t maxMicros = 0;
+};
+
+// Fixed-bucket latency histogram. record() is a bucket search and a few
+// increments, no allocation; it may only be called by one task, any task can
+// read() a consistent copy.
+class LatencyHistogram {
+public:
+    void record(uint32_t micros) {
+        size_t bucket = 0;
+        while (bucket < LATENCY_BUCKETS && micros > latencyBucketBounds[bucket]) {
+            bucket++;
+        }
+        lock.writeBegin();
+        counts.buckets[bucket]++;
+        counts.count++;
+        counts.sumMicros += micros;
+        if (micros > counts.maxMicros) counts.maxMicros = micros;
+        lock.writeEnd();
+    }
+
+    LatencyCounts read() const {
+        LatencyCounts copy;
+        uint32_t seq;
+        do {
+            seq = lock.readBegin();
+            copy = counts;
+        } while (lock.readRetry(seq));
+        return copy;
+    }
+
+private:
+    SeqLock lock;
+    LatencyCounts counts;
+};
+
+// Timing and reply size of one route, recorded by the task serving it
+struct RouteMetrics {
+    const char* path = "";
+    const char* method = "";
+    LatencyHistogram latency;
+    uint64_t bytes = 0;
+
+    void record(uint32_t micros, size_t replyBytes) {
+        latency.record(micros);
+        bytes += replyBytes;
+    }
+};
+
+// Prometheus text exposition format, version 0.0.4
+
+inline void writeMetricHeader(Print& out, const char* name, const char* type, const char* help) {
+    out.printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// One sample; labels is the text between the braces, e.g. route="/status", or null
+inline void writeMetricValue(Print& out, const char* name, const char* labels, uint64_t value) {
+    out.printf("%s%s%s%s %llu\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+               static_cast<unsigned long long>(value));
+}
+
+inline void writeMetricRatio(Print& out, const char* name, const char* labels, uint64_t numerator, uint64_t denominator) {
+    // Fixed point with 4 decimals, the float printf support is not always linked in
+    uint32_t ratio = denominator ? static_cast<uint32_t>(numerator * 10000 / denominator) : 0;
+    out.printf("%s%s%s%s %u.%04u\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "",
+               static_cast<unsigned>(ratio / 10000), static_cast<unsigned>(ratio % 10000));
+}
+
+// Microseconds printed as seconds, without floating point
+inline void writeSeconds(Print& out, uint64_t micros) {
+    out.printf("%llu.%06u", static_cast<unsigned long long>(micros / 1000000), static_cast<unsigned>(micros % 1000000));
+}
+
+// The _bucket, _sum and _count series of one histogram
+inline void writeHistogram(Print& out, const char* name, const char* labels, const LatencyCounts& counts) {
+    const char* separator = labels ? "," : "";
+    labels = labels ? labels : "";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        cumulative += counts.buckets[i];
+        out.printf("%s_bucket{%s%sle=\"", name, labels, separator);
+        writeSeconds(out, latencyBucketBounds[i]);
+        out.printf("\"} %llu\n", static_cast<unsigned long long>(cumulative));
+    }
+    out.printf("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator, static_cast<unsigned long long>(counts.count));
+    out.printf("%s_sum%s%s%s ", name, *labels ? "{" : "", labels, *labels ? "}" : "");
+    writeSeconds(out, counts.sumMicros);
+    out.printf("\n%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+               static_cast<unsigned long long>(counts.count));
+}
+
+#endif // METRICS_H
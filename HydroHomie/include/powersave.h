@@ -0,0 +1,115 @@
+#ifndef POWERSAVE_H
+#define POWERSAVE_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_pm.h>
+#include "seqlock.h"
+
+#define POWER_SAVE_MAX_IDLE_MS 1000 // Longest wait, so OTA and the Wi-Fi check in loop() still run every second
+#define POWER_SAVE_MIN_IDLE_MS 2    // Shorter waits aren't worth blocking for
+#define POWER_SAVE_MIN_MHZ 80       // Lowest CPU clock with Wi-Fi up
+
+enum PowerMode {
+    POWER_FULL,        // loop() spins at full clock
+    POWER_MODEM_SLEEP, // loop() blocks between deadlines, Wi-Fi modem sleep; the core lacks power management
+    POWER_LIGHT_SLEEP  // As above, and the chip light-sleeps whenever every task is blocked
+};
+
+// Where the loop task's time went, as published to other tasks
+struct PowerStats {
+    PowerMode mode;
+    uint64_t awakeMicros;  // In loop() doing work
+    uint64_t idleMicros;   // Blocked in idle(), free to sleep
+    uint32_t idles;
+    uint32_t wakeups;      // Idles cut short by wake()
+};
+
+// Duty cycling of loop(). When enabled, idle() blocks the loop task until the
+// next scheduler deadline instead of returning to spin; with the core's power
+// management (CONFIG_PM_ENABLE) the idle task then drops into automatic light
+// sleep with the Wi-Fi modem sleeping between DTIM beacons, so the httpd task
+// still wakes for every request. Other tasks end a wait early with wake().
+class PowerSave {
+public:
+    // Call from the loop task, so wake() knows whom to notify
+    void begin() {
+        loopTask = xTaskGetCurrentTaskHandle();
+        maxMhz = getCpuFrequencyMhz();
+        lastMark = micros();
+    }
+
+    PowerMode setEnabled(bool enabled) {
+        if (enabled == (stats.mode != POWER_FULL)) {
+            return stats.mode;
+        }
+        if (enabled) {
+            WiFi.setSleep(WIFI_PS_MIN_MODEM);
+            stats.mode = configureSleep(true) ? POWER_LIGHT_SLEEP : POWER_MODEM_SLEEP;
+        } else {
+            configureSleep(false);
+            stats.mode = POWER_FULL;
+        }
+        published.publish(stats);
+        return stats.mode;
+    }
+
+    // Ends one loop() iteration: blocks for up to ms, or until wake(), if
+    // enabled; otherwise only accounts the iteration as awake time
+    void idle(unsigned long ms) {
+        unsigned long now = micros();
+        stats.awakeMicros += now - lastMark;
+        if (stats.mode != POWER_FULL && ms >= POWER_SAVE_MIN_IDLE_MS) {
+            bool woken = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(min(ms, static_cast<unsigned long>(POWER_SAVE_MAX_IDLE_MS)))) > 0;
+            unsigned long end = micros();
+            stats.idleMicros += end - now;
+            stats.idles++;
+            stats.wakeups += woken;
+            now = end;
+        }
+        lastMark = now;
+        published.publish(stats);
+    }
+
+    // Safe from any task
+    void wake() {
+        if (loopTask) {
+            xTaskNotifyGive(loopTask);
+        }
+    }
+
+    PowerStats getStats() const {
+        return published.load();
+    }
+
+private:
+    TaskHandle_t loopTask = nullptr;
+    uint32_t maxMhz = 240;
+    unsigned long lastMark = 0;
+    PowerStats stats = {POWER_FULL, 0, 0, 0, 0};
+    Snapshot<PowerStats> published;
+
+    // Frequency scaling plus automatic light sleep; false if the core was built without them
+    bool configureSleep(bool lightSleep) {
+#if CONFIG_PM_ENABLE
+        esp_pm_config_esp32_t pm = {};
+        pm.max_freq_mhz = maxMhz;
+        pm.min_freq_mhz = lightSleep ? POWER_SAVE_MIN_MHZ : maxMhz;
+        pm.light_sleep_enable = lightSleep;
+        return esp_pm_configure(&pm) == ESP_OK && lightSleep;
+#else
+        (void)lightSleep;
+        return false;
+#endif
+    }
+};
+
+inline const char* powerModeName(PowerMode mode) {
+    switch (mode) {
+        case POWER_MODEM_SLEEP: return "modem_sleep";
+        case POWER_LIGHT_SLEEP: return "light_sleep";
+        default: return "full";
+    }
+}
+
+#endif // POWERSAVE_H
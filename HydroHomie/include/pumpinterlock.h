@@ -0,0 +1,302 @@
+#ifndef PUMPINTERLOCK_H
+#define PUMPINTERLOCK_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <mutex>
+#include <time.h>
+#include "sensormanager.h"
+#include "seqlock.h"
+#include "wallclock.h"
+#ifndef ESP_PLATFORM
+#include <chrono>
+#include <thread>
+#endif
+
+#define PUMP_INTERLOCK_PERIOD_MS 5             // Sampling period of the interlock task
+#define PUMP_INTERLOCK_CONFIRM 2               // Consecutive samples past a limit before it trips
+#define PUMP_INTERLOCK_HYSTERESIS 20           // Levels back inside a limit before a tripped pump is released
+#define PUMP_INTERLOCK_LEVEL_MARGIN 50         // Levels past the watering limits before it trips, so loop() stops routine waterings
+#define PUMP_INTERLOCK_SETTLE_MS 100           // Readings this soon after the probes power up are ignored
+#define PUMP_INTERLOCK_BLIND_MS 1000           // Longest a pump may run without a valid reading
+#define PUMP_INTERLOCK_MAX_ON_MARGIN_MS 2000   // On-time allowed past watering_duration
+#define PUMP_INTERLOCK_TRIPS 16                // Trips kept for /interlock
+#define PUMP_INTERLOCK_STACK 3072
+#define PUMP_INTERLOCK_PRIORITY (configMAX_PRIORITIES - 3) // Above loop(), httpd and lwIP, below the Wi-Fi task at configMAX_PRIORITIES - 2
+
+enum PumpTripReason {
+    TRIP_NONE,
+    TRIP_TANK_LOW,    // Tank at or below water_tank_threshold less the level margin
+    TRIP_PLANT_FULL,  // Plant above plant_target_level plus the level margin
+    TRIP_MAX_ON_TIME, // Ran longer than watering_duration plus the margin
+    TRIP_NO_READING,  // Ran without a valid reading for PUMP_INTERLOCK_BLIND_MS
+    TRIP_REASONS
+};
+
+struct PumpTrip {
+    uint32_t seq;           // Trip number since boot
+    time_t timestamp;
+    uint32_t uptimeMillis;
+    uint32_t onMillis;      // How long the pump had been running
+    uint8_t plant;
+    uint8_t reason;         // PumpTripReason
+    int16_t tank;           // Levels at the trip, -1 without a valid reading
+    int16_t level;
+};
+
+inline const char* pumpTripReasonName(uint8_t reason) {
+    switch (reason) {
+        case TRIP_TANK_LOW: return "tank_low";
+        case TRIP_PLANT_FULL: return "plant_full";
+        case TRIP_MAX_ON_TIME: return "max_on_time";
+        case TRIP_NO_READING: return "no_reading";
+        default: return "none";
+    }
+}
+
+// Safety interlock of the pump relays, independent of loop(). The loop task
+// switches pumps through setPump(); the interlock task samples the channels
+// every PUMP_INTERLOCK_PERIOD_MS and drops a relay as soon as the tank runs dry,
+// the plant is full, the pump ran too long or the probes stopped answering,
+// however long loop() is blocked (Wi-Fi reconnect, OTA). A tripped pump stays
+// off until its level is back by PUMP_INTERLOCK_HYSTERESIS, or for time and
+// reading trips, until loop() itself switches it off.
+class PumpInterlock {
+public:
+    static constexpr size_t PLANTS = SensorManager::PLANTS;
+
+    ~PumpInterlock() {
+        end();
+    }
+
+    // Starts the interlock task; sensors must outlive it
+    bool begin(SensorManager& sensorManager) {
+        sensors = &sensorManager;
+#ifdef ESP_PLATFORM
+        return task || xTaskCreate(run, "interlock", PUMP_INTERLOCK_STACK, this, PUMP_INTERLOCK_PRIORITY, &task) == pdPASS;
+#else
+        // Host builds: a thread on the creator's simulated board, its clock moving in real time
+        if (!running.exchange(true)) {
+            thread = std::thread([this, device = native::device, clock = native::clock]() {
+                native::device = device;
+                native::clock = clock;
+                const auto start = std::chrono::steady_clock::now();
+                auto next = start;
+                while (running) {
+                    native::clock.micros = clock.micros + std::chrono::duration_cast<std::chrono::microseconds>(
+                                                              std::chrono::steady_clock::now() - start).count();
+                    check(millis());
+                    next += std::chrono::milliseconds(PUMP_INTERLOCK_PERIOD_MS);
+                    std::this_thread::sleep_until(next);
+                }
+            });
+        }
+        return true;
+#endif
+    }
+
+    void end() {
+#ifdef ESP_PLATFORM
+        if (task) {
+            vTaskDelete(task);
+            task = nullptr;
+        }
+#else
+        if (running.exchange(false)) {
+            thread.join();
+        }
+#endif
+    }
+
+    // From the loop task, on every pump evaluation. The levels are the trip
+    // limits: the watering limits widened by PUMP_INTERLOCK_LEVEL_MARGIN.
+    void setLimits(int tankThreshold, int plantTarget, unsigned long maxOnMillis) {
+        tankLimit.store(tankThreshold, std::memory_order_relaxed);
+        plantLimit.store(plantTarget, std::memory_order_relaxed);
+        maxOn.store(maxOnMillis, std::memory_order_relaxed);
+    }
+
+    // Switches a plant's relay from the loop task. Returns whether it is on:
+    // false if on was asked but the interlock holds the pump off.
+    bool setPump(size_t plant, bool on) {
+        const int pin = Board::plants[plant].pumpPin;
+        std::lock_guard<std::mutex> guard(relayLock);
+        Pump& pump = pumps[plant];
+        const uint8_t trip = pump.tripped.load();
+        if (!on && (trip == TRIP_MAX_ON_TIME || trip == TRIP_NO_READING)) {
+            pump.tripped.store(TRIP_NONE); // loop() took note, the next watering may run
+        }
+        const bool allowed = on && trip == TRIP_NONE;
+        pump.requested.store(allowed);
+        digitalWrite(pin, allowed ? HIGH : LOW);
+#ifdef ESP_PLATFORM
+        if (on && task) {
+            xTaskNotifyGive(task); // Watch the running pump, or see whether a tripped one may be released
+        }
+#endif
+        return allowed;
+    }
+
+    uint8_t getTrip(size_t plant) const {
+        return pumps[plant < PLANTS ? plant : 0].tripped.load();
+    }
+
+    // Trips since boot, of one reason or all of them
+    uint32_t getTripCount(uint8_t reason = TRIP_NONE) const {
+        return reason == TRIP_NONE ? tripCount.load() : tripsByReason[reason < TRIP_REASONS ? reason : 0].load();
+    }
+
+    // Copies the latest trips, oldest first, into out; returns how many
+    size_t readTrips(PumpTrip* out, size_t max) const {
+        size_t count;
+        uint32_t seq;
+        do {
+            seq = lock.readBegin();
+            const uint32_t total = tripCount.load(std::memory_order_relaxed);
+            count = min(static_cast<size_t>(min(total, static_cast<uint32_t>(PUMP_INTERLOCK_TRIPS))), max);
+            for (size_t i = 0; i < count; i++) {
+                out[i] = trips[(total - count + i) % PUMP_INTERLOCK_TRIPS];
+            }
+        } while (lock.readRetry(seq));
+        for (size_t i = 0; i < count; i++) {
+            out[i].timestamp = WallClock::fix(out[i].timestamp);
+        }
+        return count;
+    }
+
+    // One pass of the interlock task, now in millis(). Returns whether a pump
+    // is running, i.e. whether the task has to keep sampling.
+    bool check(unsigned long now) {
+        const bool powered = sensors->isPowered();
+        if (powered && !wasPowered) {
+            poweredAt = now;
+        }
+        wasPowered = powered;
+        int raw[SensorManager::CHANNELS];
+        const bool valid = powered && now - poweredAt >= PUMP_INTERLOCK_SETTLE_MS && sensors->readRaw(raw);
+        const int tank = valid ? SensorManager::channel(0).level(raw[0]) : -1;
+        const int tankThreshold = tankLimit.load(std::memory_order_relaxed);
+        const int plantTarget = plantLimit.load(std::memory_order_relaxed);
+        bool active = false;
+
+        for (size_t p = 0; p < PLANTS; p++) {
+            if (Board::plants[p].pumpPin < 0) {
+                continue;
+            }
+            Pump& pump = pumps[p];
+            const int level = valid ? SensorManager::channel(p + 1).level(raw[p + 1]) : -1;
+            const uint8_t trip = pump.tripped.load();
+            if (trip != TRIP_NONE) {
+                // Released with hysteresis, so the pump doesn't chatter around the limit
+                if ((trip == TRIP_TANK_LOW && valid && tank >= tankThreshold + PUMP_INTERLOCK_HYSTERESIS) ||
+                    (trip == TRIP_PLANT_FULL && valid && level <= plantTarget - PUMP_INTERLOCK_HYSTERESIS)) {
+                    pump.tripped.store(TRIP_NONE);
+                }
+                pump.running = false;
+                continue;
+            }
+            if (!pump.requested.load()) {
+                pump.running = false;
+                continue;
+            }
+            active = true;
+            if (!pump.running) {
+                pump.running = true;
+                pump.onSince = now;
+                pump.lastValid = now;
+                pump.pastLimit = 0;
+            }
+            if (valid) {
+                pump.lastValid = now;
+                const bool dry = tank <= tankThreshold;
+                pump.pastLimit = dry || level > plantTarget ? pump.pastLimit + 1 : 0;
+                if (pump.pastLimit >= PUMP_INTERLOCK_CONFIRM) {
+                    tripPump(p, dry ? TRIP_TANK_LOW : TRIP_PLANT_FULL, now, tank, level);
+                    continue;
+                }
+            } else if (now - pump.lastValid >= PUMP_INTERLOCK_BLIND_MS) {
+                tripPump(p, TRIP_NO_READING, now, tank, level);
+                continue;
+            }
+            if (now - pump.onSince >= maxOn.load(std::memory_order_relaxed)) {
+                tripPump(p, TRIP_MAX_ON_TIME, now, tank, level);
+            }
+        }
+        return active;
+    }
+
+private:
+    struct Pump {
+        std::atomic<bool> requested{false}; // Set by loop() through setPump()
+        std::atomic<uint8_t> tripped{TRIP_NONE};
+        // Interlock task only
+        bool running = false;
+        unsigned long onSince = 0;
+        unsigned long lastValid = 0;
+        uint8_t pastLimit = 0;
+    };
+
+    SensorManager* sensors = nullptr;
+    Pump pumps[PLANTS];
+    std::mutex relayLock; // Orders setPump() and trips, so a trip can't be switched back on
+    std::atomic<int> tankLimit{LEVEL_FULL};
+    std::atomic<int> plantLimit{0};
+    std::atomic<unsigned long> maxOn{0};
+    bool wasPowered = false;
+    unsigned long poweredAt = 0;
+
+    PumpTrip trips[PUMP_INTERLOCK_TRIPS] = {};
+    std::atomic<uint32_t> tripCount{0};
+    std::atomic<uint32_t> tripsByReason[TRIP_REASONS] = {};
+    SeqLock lock;
+
+#ifdef ESP_PLATFORM
+    TaskHandle_t task = nullptr;
+
+    static void run(void* arg) {
+        PumpInterlock* self = static_cast<PumpInterlock*>(arg);
+        TickType_t wake = xTaskGetTickCount();
+        for (;;) {
+            if (self->check(millis())) {
+                vTaskDelayUntil(&wake, pdMS_TO_TICKS(PUMP_INTERLOCK_PERIOD_MS));
+            } else {
+                // No pump running: sleep until setPump() asks for one, so the
+                // chip can still light-sleep between waterings
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                wake = xTaskGetTickCount();
+            }
+        }
+    }
+#else
+    std::thread thread;
+    std::atomic<bool> running{false};
+#endif
+
+    void tripPump(size_t plant, PumpTripReason reason, unsigned long now, int tank, int level) {
+        Pump& pump = pumps[plant];
+        {
+            std::lock_guard<std::mutex> guard(relayLock);
+            digitalWrite(Board::plants[plant].pumpPin, LOW);
+            pump.tripped.store(reason);
+            pump.requested.store(false);
+        }
+        pump.running = false;
+
+        const uint32_t seq = tripCount.load(std::memory_order_relaxed);
+        PumpTrip& trip = trips[seq % PUMP_INTERLOCK_TRIPS];
+        lock.writeBegin();
+        trip.seq = seq;
+        trip.timestamp = WallClock::now();
+        trip.uptimeMillis = now;
+        trip.onMillis = now - pump.onSince;
+        trip.plant = plant;
+        trip.reason = reason;
+        trip.tank = tank;
+        trip.level = level;
+        tripCount.store(seq + 1, std::memory_order_relaxed);
+        lock.writeEnd();
+        tripsByReason[reason]++;
+    }
+};
+
+#endif // PUMPINTERLOCK_H
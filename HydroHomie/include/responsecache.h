@@ -0,0 +1,58 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STATUS_CACHE_SIZE 192 // Room for plant_levels of 7 plants
+#define CONFIG_CACHE_SIZE 1024 // Room for schedules and timezone at their longest
+#define STATS_CACHE_SIZE 1024 // One plant and the tank over three windows
+
+// A reply body serialized once into a fixed buffer and served as is until the
+// version it was built from changes. Only the task serving the route (httpd)
+// may touch it.
+template <size_t SIZE>
+class CachedResponse {
+public:
+    // Rebuilds the body if version differs from the one it was built for.
+    // build(char* data, size_t capacity) returns the body length, or capacity
+    // if the body does not fit: serializeJson() truncates to capacity - 1
+    // without saying so, so builders check measureJson() first.
+    // Returns true if it rebuilt.
+    template <typename Build>
+    bool refresh(uint64_t version, Build build) {
+        if (valid && version == builtVersion) {
+            return false;
+        }
+        length = build(body, SIZE);
+        if (length >= SIZE) {
+            length = 0; // Truncated, serve nothing rather than half a document
+        }
+        builtVersion = version;
+        valid = true;
+        builds++;
+        return true;
+    }
+
+    const char* data() const {
+        return body;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // Times the body was serialized, to compare against the request count
+    uint32_t getBuilds() const {
+        return builds;
+    }
+
+private:
+    char body[SIZE];
+    size_t length = 0;
+    uint64_t builtVersion = 0;
+    bool valid = false;
+    uint32_t builds = 0;
+};
+
+#endif // RESPONSECACHE_H
@@ -0,0 +1,210 @@
+#ifndef ROLLINGSTATS_H
+#define ROLLINGSTATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "seqlock.h"
+
+// Sums of the samples in one bucket of a rolling window. Times are kept as
+// seconds from the bucket start, so the sums stay small exact integers however
+// long the device has been up.
+struct StatsBucket {
+    uint32_t start;  // Bucket start, epoch seconds
+    uint32_t first;  // Timestamp of the first sample
+    uint32_t count;
+    int32_t sum;     // Σy
+    uint32_t sumT;   // Σt
+    int16_t min;
+    int16_t max;
+    int64_t sumTY;   // Σty
+    uint64_t sumSq;  // Σy²
+    uint64_t sumTT;  // Σt²
+
+    void reset(uint32_t bucketStart) {
+        start = bucketStart;
+        first = 0;
+        count = 0;
+        sum = 0;
+        sumT = 0;
+        sumTY = 0;
+        sumSq = 0;
+        sumTT = 0;
+    }
+
+    void add(uint32_t timestamp, int value) {
+        const uint32_t t = timestamp - start;
+        if (count == 0) {
+            first = timestamp;
+            min = max = value;
+        } else {
+            if (value < min) min = value;
+            if (value > max) max = value;
+        }
+        count++;
+        sum += value;
+        sumT += t;
+        sumTY += static_cast<int64_t>(t) * value;
+        sumSq += static_cast<uint64_t>(static_cast<int64_t>(value) * value);
+        sumTT += static_cast<uint64_t>(t) * t;
+    }
+};
+
+// Statistics of one window as read by another task
+struct WindowStats {
+    uint32_t count;
+    uint32_t span;   // Seconds from the first to the last sample
+    int last;        // Latest sample
+    int min;
+    int max;
+    float mean;
+    float variance;
+    float slope;     // Least-squares trend, level per hour
+};
+
+// Mean, min/max, variance and trend of the samples of roughly the last
+// BUCKETS * BUCKET_SECONDS. Samples are summed into the current bucket and the
+// oldest bucket is dropped whole as the window moves on, so adding a sample is
+// constant work and the window spans between BUCKETS - 1 and BUCKETS buckets.
+// read() combines the buckets and is SeqLock protected, for any task.
+template <size_t BUCKETS, uint32_t BUCKET_SECONDS>
+class RollingWindow {
+public:
+    static constexpr uint32_t SECONDS = BUCKETS * BUCKET_SECONDS;
+
+    void add(uint32_t timestamp, int value) {
+        const uint32_t start = timestamp - timestamp % BUCKET_SECONDS;
+        lock.writeBegin();
+        if (!started || start < buckets[head].start || start - buckets[head].start >= SECONDS) {
+            // First sample, the clock went back, or nothing in the window is recent
+            for (size_t i = 0; i < BUCKETS; i++) {
+                buckets[i].reset(0);
+            }
+            head = 0;
+            buckets[head].reset(start);
+            started = true;
+        }
+        while (buckets[head].start != start) {
+            // Every bucket boundary crossed since the last sample; at most BUCKETS
+            const uint32_t next = buckets[head].start + BUCKET_SECONDS;
+            head = (head + 1) % BUCKETS;
+            buckets[head].reset(next);
+        }
+        buckets[head].add(timestamp, value);
+        last = value;
+        lastTime = timestamp;
+        lock.writeEnd();
+    }
+
+    // The buckets that started after now - SECONDS
+    WindowStats read(uint32_t now) const {
+        WindowStats stats;
+        uint32_t seq;
+        do {
+            seq = lock.readBegin();
+            stats = combine(now);
+        } while (lock.readRetry(seq));
+        return stats;
+    }
+
+private:
+    StatsBucket buckets[BUCKETS] = {};
+    size_t head = 0;
+    bool started = false;
+    int last = 0;
+    uint32_t lastTime = 0;
+    SeqLock lock;
+
+    WindowStats combine(uint32_t now) const {
+        WindowStats stats = {0, 0, last, 0, 0, 0, 0, 0};
+        // Totals with times relative to the newest bucket start, in doubles:
+        // the window's Σt² no longer fits the bucket's integers
+        const uint32_t reference = buckets[head % BUCKETS].start;
+        double n = 0, sum = 0, sumSq = 0, sumT = 0, sumTT = 0, sumTY = 0;
+        uint32_t first = lastTime;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            const StatsBucket& bucket = buckets[(head + BUCKETS - i) % BUCKETS];
+            if (bucket.count == 0 || bucket.start + SECONDS <= now || bucket.start > reference) {
+                continue;
+            }
+            const double offset = -static_cast<double>(reference - bucket.start);
+            const double count = bucket.count;
+            if (stats.count == 0 || bucket.min < stats.min) stats.min = bucket.min;
+            if (stats.count == 0 || bucket.max > stats.max) stats.max = bucket.max;
+            stats.count += bucket.count;
+            first = bucket.first;
+            n += count;
+            sum += bucket.sum;
+            sumSq += bucket.sumSq;
+            sumT += bucket.sumT + count * offset;
+            sumTT += bucket.sumTT + 2 * offset * bucket.sumT + count * offset * offset;
+            sumTY += bucket.sumTY + offset * bucket.sum;
+        }
+        if (stats.count == 0) {
+            return stats;
+        }
+        stats.span = lastTime - first;
+        const double mean = sum / n;
+        const double meanT = sumT / n;
+        const double variance = sumSq / n - mean * mean;
+        const double varianceT = sumTT / n - meanT * meanT;
+        stats.mean = mean;
+        stats.variance = variance > 0 ? variance : 0;
+        stats.slope = varianceT > 0 ? (sumTY / n - meanT * mean) / varianceT * 3600 : 0;
+        return stats;
+    }
+};
+
+#define STATS_WINDOWS 3
+
+// The 1 h, 24 h and 7 d windows of one channel: 64 buckets, 3 KB
+class RollingStats {
+public:
+    void add(uint32_t timestamp, int value) {
+        hour.add(timestamp, value);
+        day.add(timestamp, value);
+        week.add(timestamp, value);
+        samples.fetch_add(1, std::memory_order_release);
+    }
+
+    WindowStats read(size_t window, uint32_t now) const {
+        switch (window) {
+            case 0: return hour.read(now);
+            case 1: return day.read(now);
+            default: return week.read(now);
+        }
+    }
+
+    static const char* windowName(size_t window) {
+        switch (window) {
+            case 0: return "1h";
+            case 1: return "24h";
+            default: return "7d";
+        }
+    }
+
+    // Samples added, changes whenever the statistics do
+    uint32_t getVersion() const {
+        return samples.load(std::memory_order_acquire);
+    }
+
+private:
+    RollingWindow<12, 5*60> hour;
+    RollingWindow<24, 60*60> day;
+    RollingWindow<28, 6*60*60> week;
+    std::atomic<uint32_t> samples{0};
+};
+
+// Seconds until a level falling at the given slope (per hour) reaches target:
+// 0 if it already has, -1 if it isn't falling
+inline long secondsUntilLevel(int level, float slopePerHour, int target) {
+    if (level <= target) {
+        return 0;
+    }
+    if (!(slopePerHour < 0)) {
+        return -1;
+    }
+    return static_cast<long>((level - target) / -slopePerHour * 3600);
+}
+
+#endif // ROLLINGSTATS_H
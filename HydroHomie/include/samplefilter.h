@@ -0,0 +1,162 @@
+#ifndef SAMPLEFILTER_H
+#define SAMPLEFILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SAMPLE_FILTER_MEDIAN_MAX 9   // Largest median window
+#define SAMPLE_FILTER_CHAIN_MAX 4    // Filters per chain
+
+// One stage of a filter chain over raw ADC counts. Filters are integer-only so
+// they can run on every DMA conversion without touching the FPU.
+class SampleFilter {
+public:
+    virtual ~SampleFilter() {}
+    virtual int apply(int raw) = 0;
+    virtual void reset() = 0;
+};
+
+// Spike rejector: the median of the last window samples. A single outlier, e.g.
+// a Wi-Fi TX burst coupling into the sensor line, never reaches the output as long
+// as it is shorter than half the window. A window of 1 passes samples through.
+class MedianFilter : public SampleFilter {
+public:
+    explicit MedianFilter(size_t window = 5) {
+        setWindow(window);
+    }
+
+    void setWindow(size_t size) {
+        if (size < 1) size = 1;
+        if (size > SAMPLE_FILTER_MEDIAN_MAX) size = SAMPLE_FILTER_MEDIAN_MAX;
+        if (size != window) {
+            window = size;
+            reset();
+        }
+    }
+
+    size_t getWindow() const {
+        return window;
+    }
+
+    int apply(int raw) override {
+        samples[next] = raw;
+        next = (next + 1) % window;
+        if (count < window) {
+            count++;
+        }
+        // Insertion sort of at most SAMPLE_FILTER_MEDIAN_MAX values, cheaper than
+        // keeping a sorted structure for windows this small
+        int sorted[SAMPLE_FILTER_MEDIAN_MAX];
+        for (size_t i = 0; i < count; i++) {
+            int value = samples[i];
+            size_t j = i;
+            while (j > 0 && sorted[j - 1] > value) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = value;
+        }
+        return sorted[count / 2];
+    }
+
+    void reset() override {
+        next = 0;
+        count = 0;
+    }
+
+private:
+    int samples[SAMPLE_FILTER_MEDIAN_MAX];
+    size_t window = 0;
+    size_t next = 0;
+    size_t count = 0;
+};
+
+// First order low-pass y += (x - y) / 2^shift in Q8 fixed point. The first sample
+// primes the state so the output doesn't ramp up from 0. A shift of 0 passes
+// samples through.
+class IirFilter : public SampleFilter {
+public:
+    static const int FRACTION_BITS = 8;
+
+    explicit IirFilter(uint8_t shift = 3) {
+        setShift(shift);
+    }
+
+    void setShift(uint8_t value) {
+        if (value > 15) value = 15;
+        shift = value;
+    }
+
+    uint8_t getShift() const {
+        return shift;
+    }
+
+    int apply(int raw) override {
+        int32_t input = static_cast<int32_t>(raw) << FRACTION_BITS;
+        if (!primed) {
+            state = input;
+            primed = true;
+        } else {
+            state += (input - state) >> shift;
+        }
+        return (state + (1 << (FRACTION_BITS - 1))) >> FRACTION_BITS;
+    }
+
+    void reset() override {
+        primed = false;
+        state = 0;
+    }
+
+private:
+    int32_t state = 0;
+    uint8_t shift = 0;
+    bool primed = false;
+};
+
+// Runs a sample through up to SAMPLE_FILTER_CHAIN_MAX filters in order and keeps
+// the last output. The chain does not own its filters.
+class FilterChain {
+public:
+    bool add(SampleFilter* filter) {
+        if (filterCount >= SAMPLE_FILTER_CHAIN_MAX || !filter) {
+            return false;
+        }
+        filters[filterCount++] = filter;
+        return true;
+    }
+
+    int apply(int raw) {
+        int value = raw;
+        for (size_t i = 0; i < filterCount; i++) {
+            value = filters[i]->apply(value);
+        }
+        output = value;
+        samples++;
+        return value;
+    }
+
+    void reset() {
+        for (size_t i = 0; i < filterCount; i++) {
+            filters[i]->reset();
+        }
+        samples = 0;
+    }
+
+    // Last filtered value, only meaningful once sampleCount() > 0
+    int value() const {
+        return output;
+    }
+
+    // Samples filtered since the last reset()
+    uint32_t sampleCount() const {
+        return samples;
+    }
+
+private:
+    SampleFilter* filters[SAMPLE_FILTER_CHAIN_MAX];
+    size_t filterCount = 0;
+    int output = 0;
+    uint32_t samples = 0;
+};
+
+#endif // SAMPLEFILTER_H
@@ -0,0 +1,184 @@
+#ifndef SAMPLINGTASK_H
+#define SAMPLINGTASK_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <functional>
+#include "sensormanager.h"
+#include "spscring.h"
+#include "metrics.h"
+#include "pumpinterlock.h"
+#ifdef ESP_PLATFORM
+#include <esp_timer.h>
+#endif
+
+#define SAMPLING_READS_PER_POLL 5      // Reads averaged into one poll
+#define SAMPLING_READ_SPACING_MS 5     // Between the reads of one poll
+#define SAMPLING_SETTLE_MS 100         // Probe output after power-up, before the first read
+#define SAMPLING_DEFAULT_PERIOD_MS 10000 // Until the HomieManager sets its poll interval
+#define SAMPLING_RING_LENGTH 64        // Reads on their way to the loop task, a power of two
+#define SAMPLING_STACK 3072
+#define SAMPLING_PRIORITY (PUMP_INTERLOCK_PRIORITY - 1) // Above loop() and httpd, strictly below the interlock
+#define SAMPLING_CORE 1                // The app core; the Wi-Fi stack runs on core 0
+
+// One read of every channel, tank first. A read that failed is still sent,
+// so the last read of a poll always arrives and ends it.
+struct SampleRecord {
+    unsigned long pollStart; // millis() the poll started
+    uint8_t read;            // 0 .. SAMPLING_READS_PER_POLL - 1
+    bool failed;             // The read returned nothing; levels are meaningless
+    int16_t levels[SensorManager::CHANNELS];
+};
+
+// Counters of the sampling task, safe from any task
+struct SamplingStats {
+    uint32_t polls;
+    uint32_t missed;  // Deadlines that passed before the previous poll was done
+    uint32_t dropped; // Reads lost to a full ring, i.e. the loop task stalled
+};
+
+// Periodic acquisition on its own task, pinned to the app core at a priority
+// above loop(): each poll powers the probes, lets them settle and takes
+// SAMPLING_READS_PER_POLL reads SAMPLING_READ_SPACING_MS apart. Polls start on
+// a fixed grid of deadlines, vTaskDelayUntil() style, so neither OTA, Wi-Fi
+// reconnects nor a slow loop() move them. pollNow(), e.g. for a watering
+// start, polls at once and restarts the grid from there.
+//
+// The reads go to the loop task through a lock-free single-producer ring;
+// HomieManager takes them from there into the averaging, history and control
+// logic. Lateness against the deadline is recorded in a histogram, and a poll
+// that starts after its successor was due counts as a missed deadline.
+//
+// Host builds have no sampling task: begin() fails and HomieManager samples
+// from its own scheduler, on the simulated clock.
+class SamplingTask {
+public:
+    explicit SamplingTask(SensorManager& sensorManager) : sensors(sensorManager) {}
+
+    bool begin() {
+#ifdef ESP_PLATFORM
+        return task || xTaskCreatePinnedToCore(run, "sampling", SAMPLING_STACK, this, SAMPLING_PRIORITY, &task,
+                                               SAMPLING_CORE) == pdPASS;
+#else
+        return false;
+#endif
+    }
+
+    // Called on the sampling task after every poll, e.g. to end a power-save wait
+    void onPoll(std::function<void()> callback) {
+        pollCallback = callback;
+    }
+
+    // Poll interval from the next deadline on; from any task
+    void setPeriod(unsigned long ms) {
+        periodMs.store(ms);
+    }
+
+    // Leave the probes powered after a poll, e.g. for the interlock while watering
+    void setKeepPowered(bool keep) {
+        keepPowered.store(keep);
+    }
+
+    // Polls at once instead of at the next deadline; from any task
+    void pollNow() {
+#ifdef ESP_PLATFORM
+        if (task) {
+            xTaskNotifyGive(task);
+        }
+#endif
+    }
+
+    // Consumer side, for the one task that takes the reads in
+    bool pop(SampleRecord& record) {
+        return ring.pop(record);
+    }
+
+    bool isEmpty() const {
+        return ring.isEmpty();
+    }
+
+    SamplingStats getStats() const {
+        return {polls.load(), missed.load(), ring.getDropped()};
+    }
+
+    // How late the periodic polls started
+    const LatencyHistogram& getJitter() const {
+        return jitter;
+    }
+
+private:
+    SensorManager& sensors;
+    SpscRing<SampleRecord, SAMPLING_RING_LENGTH> ring;
+    std::function<void()> pollCallback;
+    std::atomic<unsigned long> periodMs{SAMPLING_DEFAULT_PERIOD_MS};
+    std::atomic<bool> keepPowered{false};
+    std::atomic<uint32_t> polls{0};
+    std::atomic<uint32_t> missed{0};
+    LatencyHistogram jitter;
+
+#ifdef ESP_PLATFORM
+    TaskHandle_t task = nullptr;
+
+    static void run(void* arg) {
+        static_cast<SamplingTask*>(arg)->loop();
+    }
+
+    void loop() {
+        int64_t due = esp_timer_get_time();
+        for (;;) {
+            bool forced = false;
+            int64_t wait;
+            while (!forced && (wait = due - esp_timer_get_time()) > 0) {
+                // In whole ticks, at least one; waking early, it waits out the rest
+                const TickType_t ticks = pdMS_TO_TICKS(wait / 1000);
+                forced = ulTaskNotifyTake(pdTRUE, ticks ? ticks : 1) != 0;
+            }
+            const int64_t start = esp_timer_get_time();
+            if (forced) {
+                due = start;
+            } else {
+                jitter.record(static_cast<uint32_t>(start - due));
+            }
+            poll(millis());
+
+            const int64_t period = static_cast<int64_t>(periodMs.load()) * 1000;
+            const int64_t end = esp_timer_get_time();
+            due += period;
+            while (due <= end) {
+                // Overran the period: skip the deadlines that passed, keeping the grid
+                missed++;
+                due += period;
+            }
+        }
+    }
+
+    void poll(unsigned long pollStart) {
+        const bool wasPowered = sensors.isPowered();
+        sensors.activate();
+        vTaskDelay(pdMS_TO_TICKS(wasPowered ? SAMPLING_READ_SPACING_MS : SAMPLING_SETTLE_MS));
+        SampleRecord record;
+        record.pollStart = pollStart;
+        for (uint8_t read = 0; read < SAMPLING_READS_PER_POLL; read++) {
+            if (read > 0) {
+                vTaskDelay(pdMS_TO_TICKS(SAMPLING_READ_SPACING_MS));
+            }
+            int values[SensorManager::CHANNELS] = {};
+            record.read = read;
+            record.failed = !sensors.acquire(values);
+            for (size_t i = 0; i < SensorManager::CHANNELS; i++) {
+                record.levels[i] = values[i];
+            }
+            ring.push(record);
+        }
+        if (!keepPowered.load()) {
+            sensors.deactivate();
+        }
+        polls++;
+        if (pollCallback) {
+            pollCallback();
+        }
+    }
+#endif
+};
+
+#endif // SAMPLINGTASK_H
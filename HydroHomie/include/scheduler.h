@@ -0,0 +1,125 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+#include <functional>
+#include <limits.h>
+#include "seqlock.h"
+
+#define SCHEDULER_MAX_TASKS 8
+
+// Timing of one scheduled task
+struct TaskStats {
+    const char* name = "";
+    uint32_t runs = 0;
+    uint32_t lastMicros = 0;   // Duration of the last run
+    uint32_t maxMicros = 0;    // Longest run
+    uint64_t totalMicros = 0;
+    uint32_t maxLateMillis = 0; // Worst delay between the deadline and the actual start
+};
+
+// millis()-driven cooperative scheduler. A task is a function that does a short
+// slice of work and returns how many milliseconds until it wants to run again,
+// so waits become deadlines instead of delay() calls. run() starts due tasks in
+// deadline order and never blocks.
+class Scheduler {
+public:
+    typedef std::function<unsigned long(unsigned long now)> TaskFunction;
+
+    // Returns the task id, or -1 if the table is full
+    int add(const char* name, TaskFunction function, unsigned long firstDelay = 0) {
+        if (taskCount >= SCHEDULER_MAX_TASKS) {
+            return -1;
+        }
+        Task& task = tasks[taskCount];
+        task.function = function;
+        task.deadline = millis() + firstDelay;
+        task.stats = TaskStats();
+        task.stats.name = name;
+        task.published.publish(task.stats);
+        return taskCount++;
+    }
+
+    // Moves a task's deadline to now + delay if that is sooner
+    void wake(int id, unsigned long delay = 0) {
+        if (id < 0 || id >= static_cast<int>(taskCount)) {
+            return;
+        }
+        unsigned long deadline = millis() + delay;
+        if (static_cast<long>(deadline - tasks[id].deadline) < 0) {
+            tasks[id].deadline = deadline;
+        }
+    }
+
+    // Runs every task whose deadline has passed, earliest deadline first. Each task
+    // runs at most once per call so one that keeps returning 0 can't starve loop().
+    void run() {
+        uint32_t ran = 0;
+        while (true) {
+            unsigned long now = millis();
+            int next = -1;
+            for (size_t i = 0; i < taskCount; i++) {
+                if (!(ran & (1u << i)) && static_cast<long>(now - tasks[i].deadline) >= 0
+                    && (next < 0 || static_cast<long>(tasks[i].deadline - tasks[next].deadline) < 0)) {
+                    next = i;
+                }
+            }
+            if (next < 0) {
+                return;
+            }
+            ran |= 1u << next;
+            Task& task = tasks[next];
+            uint32_t late = now - task.deadline;
+            uint32_t start = micros();
+            unsigned long delay = task.function(now);
+            uint32_t elapsed = micros() - start;
+            // Delays count from when the task started, not from when it returned
+            task.deadline = now + delay;
+            recordRun(task.stats, elapsed, late);
+            task.published.publish(task.stats);
+        }
+    }
+
+    // Milliseconds until the earliest deadline, 0 if something is due
+    unsigned long timeUntilNext() const {
+        unsigned long now = millis();
+        long soonest = LONG_MAX;
+        for (size_t i = 0; i < taskCount; i++) {
+            long remaining = static_cast<long>(tasks[i].deadline - now);
+            if (remaining < soonest) {
+                soonest = remaining;
+            }
+        }
+        return soonest < 0 ? 0 : soonest;
+    }
+
+    size_t size() const {
+        return taskCount;
+    }
+
+    // A copy from any task; run() keeps updating the stats meanwhile
+    TaskStats getStats(size_t id) const {
+        return tasks[id].published.load();
+    }
+
+private:
+    struct Task {
+        TaskFunction function;
+        unsigned long deadline = 0;
+        TaskStats stats;
+        Snapshot<TaskStats> published; // stats for other tasks
+    };
+
+    Task tasks[SCHEDULER_MAX_TASKS];
+    size_t taskCount = 0;
+
+    static void recordRun(TaskStats& stats, uint32_t elapsed, uint32_t late) {
+        stats.runs++;
+        stats.lastMicros = elapsed;
+        stats.totalMicros += elapsed;
+        if (elapsed > stats.maxMicros) stats.maxMicros = elapsed;
+        if (late > stats.maxLateMillis) stats.maxLateMillis = late;
+    }
+};
+
+#endif // SCHEDULER_H
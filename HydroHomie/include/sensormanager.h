@@ -2,119 +2,332 @@
 #define SENSORMANAGER_H
 
 #include <Arduino.h>
-#include <utility>
-#include <numeric>
-#include <vector>
-#include <CircularBuffer.hpp>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include "board.h"
+#include "historystore.h"
+#include "historytiers.h"
+#include "historylog.h"
+#include "rollingstats.h"
+#include "telemetry.h"
+#include "wallclock.h"
+#include "adcsampler.h"
+#include "seqlock.h"
 
-#define HISTORY_LENGTH 1000
+#define HISTORY_BLOCKS 93        // 93 blocks of delta-coded samples, the ~12 KB per plant of the old 1000 tuples
+#define HISTORY_BLOCK_BYTES 128
 #define TEMP_BUFFER_LENGTH 10
 
-class SensorManager {
-private:
-    const int digitalSensorPin;
-    const int digitalSensorPowerPin;
-    const int analogSensor1PowerPin;
-    const int analogSensor1Pin;
-    const int analogSensorPin;
-    const int analogSensorPowerPin;
-    const bool keepSensorsPowered;
-
-    CircularBuffer<std::tuple<int, int, int>, HISTORY_LENGTH> history;
-    CircularBuffer<std::tuple<int, int, int>, TEMP_BUFFER_LENGTH> tempBuffer;
-    std::tuple<int, int, int> tmpar[TEMP_BUFFER_LENGTH];
-    std::tuple<int, int, int> last_value;
+typedef HistoryStore<HISTORY_BLOCKS, HISTORY_BLOCK_BYTES> SensorHistory;
+
+// Latest levels as published to other tasks
+template <size_t PLANTS>
+struct SensorReadings {
+    int tank;
+    int plants[PLANTS];
+    uint32_t version; // Bumped whenever a level changes
+};
 
+// Sampling, averaging and history of the tank sensor and every plant of a
+// board's channel table. Channel 0 is the tank, channel 1 + p is plant p.
+// Levels live in per-channel arrays, so the cost of a read grows by one
+// calibration and one ring slot per plant.
+//
+// Each plant has its own history, rollup tiers of (tank, plant) samples and
+// flash history log.
+template <typename BoardT>
+class SensorPipeline {
 public:
-    SensorManager(int digitalPin, int digitalPowerPin,int analogPin, int analogPowerPin, int analogPin1, int analogPowerPin1, bool keepSensorsPowered = false)
-    : digitalSensorPin(digitalPin), digitalSensorPowerPin(digitalPowerPin), 
-      analogSensorPin(analogPin), analogSensorPowerPin(analogPowerPin), analogSensor1Pin(analogPin1), analogSensor1PowerPin(analogPowerPin1), keepSensorsPowered(keepSensorsPowered) {
-        // pinMode(digitalSensorPin, INPUT);
-        // pinMode(digitalSensorPowerPin, OUTPUT);
-        pinMode(analogSensorPin, INPUT);
-        pinMode(analogSensorPowerPin, OUTPUT);
-        pinMode(analogSensor1Pin, INPUT);
-        pinMode(analogSensor1PowerPin, OUTPUT);
+    static constexpr size_t PLANTS = BoardT::PLANTS;
+    static constexpr size_t CHANNELS = PLANTS + 1;
+    typedef SensorReadings<PLANTS> Readings;
+
+    static_assert(PLANTS > 0, "A board needs at least one plant");
+    static_assert(CHANNELS <= ADC_MAX_CHANNELS, "More channels than ADC1 can sample");
+
+    explicit SensorPipeline(bool keepSensorsPowered = false)
+    : keepSensorsPowered(keepSensorsPowered), analogSampler(sensorPins(), CHANNELS) {
+        for (size_t i = 0; i < CHANNELS; i++) {
+            pinMode(channel(i).sensorPin, INPUT);
+            pinMode(channel(i).powerPin, OUTPUT);
+        }
         activate();
     }
 
+    static const SensorChannel& channel(size_t index) {
+        return index == 0 ? BoardT::tank : BoardT::plants[index - 1].sensor;
+    }
+
+    // Sensor pins in channel order, for the samplers
+    static const int* sensorPins() {
+        struct Pins {
+            int pins[CHANNELS];
+            Pins() {
+                for (size_t i = 0; i < CHANNELS; i++) {
+                    pins[i] = channel(i).sensorPin;
+                }
+            }
+        };
+        static const Pins table; // Filled once, even with several pipelines on several threads
+        return table.pins;
+    }
+
     void activate() {
         // Power on the sensors
-        // digitalWrite(digitalSensorPowerPin, HIGH);
-        digitalWrite(analogSensorPowerPin, HIGH);
-        digitalWrite(analogSensor1PowerPin, HIGH);
+        for (size_t i = 0; i < CHANNELS; i++) {
+            digitalWrite(channel(i).powerPin, HIGH);
+        }
+        std::lock_guard<std::mutex> guard(samplerLock);
+        sampler->restart(!powered);
+        powered = true;
     }
 
     void deactivate() {
         // Power off the sensors
         if(keepSensorsPowered) return;
-        // digitalWrite(digitalSensorPowerPin, LOW);
-        digitalWrite(analogSensorPowerPin, LOW);
-        digitalWrite(analogSensor1PowerPin, LOW);
+        std::lock_guard<std::mutex> guard(samplerLock);
+        for (size_t i = 0; i < CHANNELS; i++) {
+            digitalWrite(channel(i).powerPin, LOW);
+        }
+        powered = false;
+        // Nothing to convert until activate(); a running DMA sampler would keep the CPU out of light sleep
+        sampler->suspend();
     }
 
+    // Safe from any task
+    bool isPowered() const {
+        return powered;
+    }
+
+    // Off: the probes are only powered from activate() to deactivate(), i.e. for
+    // each poll's sampling window. Takes effect at the next deactivate().
+    void setKeepSensorsPowered(bool keep) {
+        keepSensorsPowered = keep;
+    }
+
+    // A read that fails is counted and still ends the poll if it was its
+    // last, see ingest()
     void readSensors(bool updateHistory = false, bool averageOut = false) {
-        // Read sensor values
-        int digitalValue = 0;//digitalRead(digitalSensorPin);
-        int analogValue = analogRead(analogSensorPin);
-        int analogValue1 = analogRead(analogSensor1Pin);
-
-        // Transform analog values to percentage
-        analogValue = min(max(1000-map(analogValue, 1350, 2000, 0, 1000), (long)0), (long)1000);
-        analogValue1 = min(max(1000-map(analogValue1, 1350, 2000, 0, 1000), (long)0), (long)1000);
-
-        auto values = std::make_tuple(analogValue, analogValue1, digitalValue);
-        // Always update temp buffers
-        tempBuffer.push(values);
+        int values[CHANNELS];
+        ingest(acquire(values) ? values : nullptr, updateHistory, averageOut);
+    }
+
+    // The acquisition half of readSensors(): one read of every channel as
+    // levels. Safe from any task, e.g. a sampling task.
+    bool acquire(int* values) {
+        int raw[CHANNELS];
+        if (!readRaw(raw)) {
+            return false;
+        }
+        for (size_t i = 0; i < CHANNELS; i++) {
+            values[i] = channel(i).level(raw[i]);
+        }
+        return true;
+    }
+
+    // The rest of readSensors(), on the one task that owns the history: the
+    // averaging, history, statistics and the published levels. levelsRead is
+    // nullptr for a read that failed: it is counted, and the poll still
+    // averages the reads that worked, or keeps the last levels if none did.
+    void ingest(const int* levelsRead, bool updateHistory = false, bool averageOut = false) {
+        int values[CHANNELS];
+        for (size_t i = 0; i < CHANNELS; i++) {
+            values[i] = levelsRead ? levelsRead[i] : levels[i];
+        }
+        if (levelsRead) {
+            pushRecent(values);
+        } else {
+            readFailures++;
+        }
+        if (!clockRebased && WallClock::isSynced()) {
+            rebaseClock();
+        }
+        const uint32_t now = WallClock::now();
         if (updateHistory) {
             // If it's time to update the history, calculate averages from temp buffers
-            if (averageOut){
-                std::tuple<int, int, int> tmpar[TEMP_BUFFER_LENGTH];
-                tempBuffer.copyToArray(tmpar);
-                values = calculateAverage(tmpar);
-                tempBuffer.clear();
-                clearTmpar();
+            if (averageOut) {
+                averageLevels(values);
+                clearRecent();
+            }
+            for (size_t p = 0; p < PLANTS; p++) {
+                histories[p].push(values[0], values[p + 1], 0, now);
+                if (historyLogs[p]) {
+                    historyLogs[p]->append(histories[p].last());
+                }
             }
-            history.push(values);
         }
-        last_value = values;
+        if (averageOut) {
+            // The last read of every poll feeds the rollup tiers and statistics
+            for (size_t p = 0; p < PLANTS; p++) {
+                tiers[p].add(now, values[0], values[p + 1]);
+                plantStats[p].add(now, values[p + 1]);
+            }
+            tankStats.add(now, values[0]);
+            if (telemetry) {
+                telemetry->push(TELEMETRY_SAMPLE, 0, false, values, now);
+            }
+        }
+        bool changed = false;
+        for (size_t i = 0; i < CHANNELS; i++) {
+            if (levels[i] != values[i]) {
+                levels[i] = values[i];
+                changed = true;
+            }
+        }
+        if (changed) {
+            valueVersion++;
+            Readings readings;
+            readings.tank = levels[0];
+            for (size_t p = 0; p < PLANTS; p++) {
+                readings.plants[p] = levels[p + 1];
+            }
+            readings.version = valueVersion;
+            published.publish(readings);
+        }
+    }
+
+    // Mean level of every channel over the reads in the temp buffer
+    void averageLevels(int* out) const {
+        for (size_t i = 0; i < CHANNELS; i++) {
+            out[i] = recentCount ? recentSum[i] / static_cast<int32_t>(recentCount) : levels[i];
+        }
     }
 
-    // Other public methods...
+    // Safe from any task, e.g. the httpd handlers
+    Readings getSnapshot() const {
+        return published.load();
+    }
 
-    std::tuple<int, int, int> getLastValue() const {
-        return last_value;
+    uint32_t getValueVersion() const {
+        return published.load().version;
     }
 
-private:
-    std::tuple<int, int, int> init = std::make_tuple(0, 0, 0);
+    const SensorHistory& getHistory(size_t plant = 0) const {
+        return histories[plant < PLANTS ? plant : 0];
+    }
+
+    const HistoryTiers& getTiers(size_t plant = 0) const {
+        return tiers[plant < PLANTS ? plant : 0];
+    }
+
+    // Rolling 1 h/24 h/7 d statistics of a plant's level, readable from any task
+    const RollingStats& getStats(size_t plant = 0) const {
+        return plantStats[plant < PLANTS ? plant : 0];
+    }
+
+    const RollingStats& getTankStats() const {
+        return tankStats;
+    }
 
-    std::tuple<int, int, int> calculateAverage(const std::tuple<int, int, int> buffer[]) {
-        std::tuple<int, int, int> result = std::accumulate(buffer, buffer + TEMP_BUFFER_LENGTH, init,
-        [](const std::tuple<int, int, int>& acc, const std::tuple<int, int, int>& val) {
-            const auto [acc_a1, acc_a2, acc_d] = acc;
-            const auto [val_a1, val_a2, val_d] = val;
-            return std::make_tuple(acc_a1 + val_a1, acc_a2 + val_a2, acc_d + val_d);
-        });
-        const auto [a1, a2, d] = result;
-        return {a1/TEMP_BUFFER_LENGTH, a2/TEMP_BUFFER_LENGTH, d>=TEMP_BUFFER_LENGTH/2 ? 1 : 0};
+    // Reads that returned nothing since boot, safe from any task
+    uint32_t getReadFailures() const {
+        return readFailures;
     }
 
-    void clearTmpar(){
-        for (int i = 0; i < TEMP_BUFFER_LENGTH; i++){
-            tmpar[i] = std::make_tuple(0, 0, 0);
+    // Restores a plant's history from its flash log and mirrors new samples into it
+    void attachHistoryLog(size_t plant, HistoryLog* log) {
+        historyLogs[plant] = log;
+        if (log) {
+            log->restore(histories[plant]);
         }
     }
 
-    // Optional: Method to retrieve history. Adjust based on your needs.
-public:
-    std::vector<std::tuple<int, int, int>> getHistory() const {
-        std::vector<std::tuple<int, int, int>> tmphistory(history.size());
-        history.copyToArray(tmphistory.data());
-        return tmphistory;
+    void attachHistoryLogs(PlantHistoryLogs<PLANTS>& logs) {
+        for (size_t p = 0; p < PLANTS; p++) {
+            attachHistoryLog(p, &logs[p]);
+        }
+    }
+
+    // Latest raw reading of every channel, e.g. for the pump interlock. The
+    // sampler is shared with readSensors(), so other tasks take turns with it.
+    bool readRaw(int* raw) {
+        std::lock_guard<std::mutex> guard(samplerLock);
+        return sampler->read(raw, CHANNELS);
+    }
+
+    void setFilter(size_t medianWindow, uint8_t iirShift) {
+        std::lock_guard<std::mutex> guard(samplerLock);
+        sampler->setFilter(medianWindow, iirShift);
+    }
+
+    // Queues the averaged levels of every poll for the telemetry publisher
+    void attachTelemetry(TelemetryQueue* queue) {
+        telemetry = queue;
     }
 
+    // Replaces the analogRead() sampling, e.g. with a ContinuousAdcSampler.
+    // nullptr goes back to analogRead().
+    void attachSampler(AdcSampler* adcSampler) {
+        std::lock_guard<std::mutex> guard(samplerLock);
+        sampler = adcSampler ? adcSampler : &analogSampler;
+        sampler->restart(true);
+    }
+
+private:
+    std::atomic<bool> keepSensorsPowered;
+    std::atomic<bool> powered{false};
+
+    AnalogReadSampler analogSampler;
+    AdcSampler* sampler = &analogSampler;
+    std::mutex samplerLock; // Held for every sampler call, which the loop task and the interlock share
+    SensorHistory histories[PLANTS];
+    HistoryTiers tiers[PLANTS];
+    RollingStats plantStats[PLANTS];
+    RollingStats tankStats;
+    HistoryLog* historyLogs[PLANTS] = {};
+    TelemetryQueue* telemetry = nullptr;
+    bool clockRebased = false;
+    std::atomic<uint32_t> readFailures{0};
+
+    // The last TEMP_BUFFER_LENGTH levels of every channel and their running sums
+    int16_t recent[CHANNELS][TEMP_BUFFER_LENGTH] = {};
+    int32_t recentSum[CHANNELS] = {};
+    uint8_t recentHead = 0;
+    uint8_t recentCount = 0;
+
+    int levels[CHANNELS] = {};
+    uint32_t valueVersion = 0; // Bumped whenever levels change
+    Snapshot<Readings> published; // levels and valueVersion for other tasks
+
+    void pushRecent(const int* values) {
+        for (size_t i = 0; i < CHANNELS; i++) {
+            if (recentCount == TEMP_BUFFER_LENGTH) {
+                recentSum[i] -= recent[i][recentHead];
+            }
+            recent[i][recentHead] = values[i];
+            recentSum[i] += values[i];
+        }
+        recentHead = (recentHead + 1) % TEMP_BUFFER_LENGTH;
+        if (recentCount < TEMP_BUFFER_LENGTH) {
+            recentCount++;
+        }
+    }
+
+    // Moves the samples taken before the clock was set to epoch time. The
+    // rolling statistics start over at the step instead, see RollingWindow::add().
+    void rebaseClock() {
+        const uint32_t offset = WallClock::getOffset();
+        for (size_t p = 0; p < PLANTS; p++) {
+            histories[p].rebase(WALLCLOCK_VALID_EPOCH, offset);
+            tiers[p].rebase(WALLCLOCK_VALID_EPOCH, offset);
+            if (historyLogs[p]) {
+                historyLogs[p]->rebase(WALLCLOCK_VALID_EPOCH, offset);
+            }
+        }
+        clockRebased = true;
+    }
+
+    void clearRecent() {
+        for (size_t i = 0; i < CHANNELS; i++) {
+            recentSum[i] = 0;
+        }
+        recentHead = 0;
+        recentCount = 0;
+    }
 };
 
+typedef SensorPipeline<Board> SensorManager;
+typedef SensorManager::Readings SensorSnapshot;
 
-#endif // !SENSORMANAGER_H
\ No newline at end of file
+#endif // !SENSORMANAGER_H
@@ -0,0 +1,99 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include <atomic>
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <thread>
+#endif
+
+#define SEQLOCK_SPINS_BEFORE_YIELD 64 // A write still in progress after this many reads has been preempted
+
+// Sequence lock for one writer and any number of readers on any core. The writer
+// never waits; a reader that overlapped a write notices the changed sequence and
+// retries, so it can spin briefly but never blocks the writer. A reader that
+// preempted the writer mid-write on the same core would spin forever, so after
+// SEQLOCK_SPINS_BEFORE_YIELD reads it sleeps a tick to let the writer finish.
+//
+//   writer:  lock.writeBegin(); ...modify...; lock.writeEnd();
+//   reader:  do { s = lock.readBegin(); ...copy out...; } while (lock.readRetry(s));
+//
+// Readers must only copy data out inside the loop and must not trust anything
+// they read (indices, counts) until readRetry() returned false, so the copy has
+// to stay in bounds even on torn values.
+class SeqLock {
+public:
+    void writeBegin() {
+        uint32_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void writeEnd() {
+        sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Waits out a write in progress and returns the sequence to validate against
+    uint32_t readBegin() const {
+        uint32_t seq;
+        unsigned spins = 0;
+        while ((seq = sequence.load(std::memory_order_acquire)) & 1u) {
+            if (++spins == SEQLOCK_SPINS_BEFORE_YIELD) {
+                spins = 0;
+                yieldToWriter();
+            }
+        }
+        return seq;
+    }
+
+    // True if a write overlapped the read started with readBegin()
+    bool readRetry(uint32_t seq) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return sequence.load(std::memory_order_relaxed) != seq;
+    }
+
+private:
+    std::atomic<uint32_t> sequence{0};
+
+    // The writer may have a lower priority than the reader, which taskYIELD()
+    // would not give the core to, so block for a tick instead
+    static void yieldToWriter() {
+#ifdef ESP_PLATFORM
+        vTaskDelay(1);
+#else
+        std::this_thread::yield();
+#endif
+    }
+};
+
+// Value published by one task and read whole by others, e.g. the latest sensor
+// reading written by loop() and read by the httpd task. T must be trivially
+// copyable.
+template <typename T>
+class Snapshot {
+public:
+    void publish(const T& value) {
+        lock.writeBegin();
+        data = value;
+        lock.writeEnd();
+    }
+
+    T load() const {
+        T copy;
+        uint32_t seq;
+        do {
+            seq = lock.readBegin();
+            copy = data;
+        } while (lock.readRetry(seq));
+        return copy;
+    }
+
+private:
+    SeqLock lock;
+    T data{};
+};
+
+#endif // SEQLOCK_H
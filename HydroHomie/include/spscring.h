@@ -0,0 +1,58 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Lock-free ring between exactly one producer task and one consumer task, on
+// any cores. Neither side ever waits: push() into a full ring drops the new
+// item and counts it, pop() from an empty one returns false. The indices run
+// freely and wrap at 2^32, so N has to be a power of two.
+//
+//   producer:  ring.push(item);
+//   consumer:  while (ring.pop(item)) { ... }
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "The ring length must be a power of two");
+
+public:
+    bool push(const T& item) {
+        const uint32_t write = writeIndex.load(std::memory_order_relaxed);
+        if (write - readIndex.load(std::memory_order_acquire) == N) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        items[write % N] = item;
+        writeIndex.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        const uint32_t read = readIndex.load(std::memory_order_relaxed);
+        if (read == writeIndex.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[read % N];
+        readIndex.store(read + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Either side; exact only on the calling side's end
+    bool isEmpty() const {
+        return readIndex.load(std::memory_order_acquire) == writeIndex.load(std::memory_order_acquire);
+    }
+
+    // Items refused because the ring was full
+    uint32_t getDropped() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    T items[N];
+    std::atomic<uint32_t> writeIndex{0};
+    std::atomic<uint32_t> readIndex{0};
+    std::atomic<uint32_t> dropped{0};
+};
+
+#endif // SPSCRING_H
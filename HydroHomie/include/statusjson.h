@@ -0,0 +1,130 @@
+#ifndef STATUSJSON_H
+#define STATUSJSON_H
+
+#include <math.h>
+#include "HomieManager.h"
+
+// The /status document, shared by the server, the native benchmarks and the
+// fleet simulator.
+// current_plant_level is plant 0; boards with more plants add plant_levels.
+template <typename Document>
+void fillStatusJson(Document& doc, const SensorSnapshot& sensors, const WateringSnapshot& watering) {
+    doc["current_plant_level"] = sensors.plants[0];
+    doc["current_water_level"] = sensors.tank;
+    doc["is_watering"] = watering.watering;
+    doc["last_watering_time"] = static_cast<unsigned long>(watering.lastStart);
+    if (SensorManager::PLANTS > 1) {
+        JsonArray levels = doc.createNestedArray("plant_levels");
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            levels.add(sensors.plants[p]);
+        }
+    }
+}
+
+// One window of the /stats document, fractions rounded to hundredths
+inline void fillWindowJson(JsonObject object, const WindowStats& stats) {
+    object["n"] = stats.count;
+    if (stats.count == 0) {
+        return;
+    }
+    object["span_s"] = stats.span;
+    object["mean"] = roundf(stats.mean * 100) / 100;
+    object["min"] = stats.min;
+    object["max"] = stats.max;
+    object["variance"] = roundf(stats.variance * 100) / 100;
+    object["slope_per_h"] = roundf(stats.slope * 100) / 100;
+}
+
+// The /stats document of one plant: its level and the tank's over every
+// rolling window, and the seconds until the plant falls to target_level at the
+// last hour's drain rate (absent while it isn't drying)
+template <typename Document>
+void fillStatsJson(Document& doc, size_t plant, const RollingStats& plantStats, const RollingStats& tankStats,
+                   int targetLevel, uint32_t now) {
+    doc["plant"] = static_cast<unsigned>(plant);
+    doc["target_level"] = targetLevel;
+    const WindowStats lastHour = plantStats.read(0, now);
+    if (lastHour.count > 0) {
+        const long until = secondsUntilLevel(lastHour.last, lastHour.slope, targetLevel);
+        if (until >= 0) {
+            doc["until_watering_s"] = until;
+        }
+    }
+    const char* names[] = {"plant_level", "tank_level"};
+    const RollingStats* channels[] = {&plantStats, &tankStats};
+    for (size_t c = 0; c < 2; c++) {
+        JsonObject channel = doc.createNestedObject(names[c]);
+        for (size_t w = 0; w < STATS_WINDOWS; w++) {
+            const WindowStats stats = channels[c]->read(w, now);
+            if (w == 0 && stats.count > 0) {
+                channel["last"] = stats.last;
+            }
+            fillWindowJson(channel.createNestedObject(RollingStats::windowName(w)), stats);
+        }
+    }
+}
+
+// The /tasks document: timing of every scheduler task, then of handle() itself
+inline void fillTasksJson(JsonArray array, const HomieManager& homieManager) {
+    const Scheduler& scheduler = homieManager.getScheduler();
+    for (size_t i = 0; i <= scheduler.size(); i++) {
+        const TaskStats stats = i < scheduler.size() ? scheduler.getStats(i) : homieManager.getHandleStats();
+        JsonObject task = array.createNestedObject();
+        task["name"] = stats.name;
+        task["runs"] = stats.runs;
+        task["avg_us"] = stats.runs ? static_cast<uint32_t>(stats.totalMicros / stats.runs) : 0;
+        task["last_us"] = stats.lastMicros;
+        task["max_us"] = stats.maxMicros;
+        task["max_late_ms"] = stats.maxLateMillis;
+    }
+}
+
+// The /schedule document: every entry with its plants, duration, last and
+// next fire, then the upcoming fires in order. now is WallClock seconds; times
+// stay seconds since boot until NTP has set the clock, see "synced".
+template <typename Document>
+void fillScheduleJson(Document& doc, const ScheduleSnapshot& schedule, uint32_t now) {
+    doc["now"] = now;
+    doc["synced"] = WallClock::isSynced() || !WallClock::isProvisional(now);
+    JsonArray entries = doc.createNestedArray("entries");
+    uint8_t order[SCHEDULE_MAX_ENTRIES];
+    size_t upcoming = 0;
+    for (size_t i = 0; i < schedule.count; i++) {
+        const ScheduleEntryState& state = schedule.entries[i];
+        JsonObject entry = entries.createNestedObject();
+        entry["id"] = static_cast<unsigned>(i);
+        entry["kind"] = scheduleKindName(state.kind);
+        JsonArray plants = entry.createNestedArray("plants");
+        for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+            if (state.plants & (1u << p)) {
+                plants.add(static_cast<unsigned>(p));
+            }
+        }
+        entry["duration_s"] = state.duration;
+        if (state.kind == SCHEDULE_DRY) {
+            entry["armed"] = state.armed;
+        }
+        if (state.next) {
+            entry["next"] = state.next;
+            // Insertion sort, there are at most SCHEDULE_MAX_ENTRIES
+            size_t at = upcoming++;
+            for (; at > 0 && schedule.entries[order[at - 1]].next > state.next; at--) {
+                order[at] = order[at - 1];
+            }
+            order[at] = i;
+        }
+        if (state.last) {
+            entry["last"] = state.last;
+        }
+        entry["fires"] = state.fires;
+        entry["skipped"] = state.skipped;
+    }
+    JsonArray next = doc.createNestedArray("upcoming");
+    for (size_t u = 0; u < upcoming; u++) {
+        JsonObject fire = next.createNestedObject();
+        fire["id"] = order[u];
+        fire["at"] = schedule.entries[order[u]].next;
+    }
+}
+
+#endif // STATUSJSON_H
@@ -0,0 +1,308 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "board.h"
+#include "wallclock.h"
+
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_QUEUE_LENGTH 512   // Records buffered while offline, ~80 min of polls at 10 s
+#define TELEMETRY_BATCH_MAX 64       // Records per message, the top of the telemetry_batch range
+#define TELEMETRY_ID_LENGTH 32       // Longest device id sent
+#define TELEMETRY_PAYLOAD_SIZE 1280  // Fits a full batch of the largest records
+
+enum TelemetryKind {
+    TELEMETRY_SAMPLE,   // Averaged levels of one poll
+    TELEMETRY_WATERING, // Watering started (on) or stopped
+    TELEMETRY_PUMP      // A plant's pump switched on or off
+};
+
+// One sample or event. Levels are channel order, tank first; events carry the
+// levels at the time of the event.
+struct TelemetryRecord {
+    static constexpr size_t CHANNELS = Board::PLANTS + 1;
+
+    uint32_t timestamp;
+    uint8_t kind;   // TelemetryKind
+    uint8_t plant;  // TELEMETRY_PUMP
+    bool on;
+    int16_t levels[CHANNELS];
+};
+
+// Header of a decoded batch
+struct TelemetryBatch {
+    uint32_t bootId;
+    uint32_t firstSeq;
+    uint8_t count;
+    uint8_t channels;
+    char deviceId[TELEMETRY_ID_LENGTH + 1];
+};
+
+// Wire format of a batch, integers little-endian; varints are unsigned LEB128
+// of zigzag-encoded deltas, so a steady sample costs about four bytes:
+//
+//   u8 version, u8 channels, u32 boot id, u32 first seq, u8 count,
+//   u8 id length, id bytes, then count records with seqs first, first + 1, ...:
+//     varint timestamp - previous timestamp (previous of the first: 0)
+//     u8 kind | plant << 2 | on << 7
+//     channels x varint level - previous level of the channel (first: 0)
+//
+// The boot id is random per boot; with it a collector tells a restarted
+// sequence from a replayed one.
+namespace telemetrywire {
+inline size_t putVarint(uint8_t* out, int32_t value) {
+    uint32_t zigzag = (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    size_t length = 0;
+    do {
+        uint8_t byte = zigzag & 0x7F;
+        zigzag >>= 7;
+        out[length++] = byte | (zigzag ? 0x80 : 0);
+    } while (zigzag);
+    return length;
+}
+
+inline bool getVarint(const uint8_t* data, size_t length, size_t& offset, int32_t& value) {
+    uint32_t zigzag = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (offset >= length) {
+            return false;
+        }
+        const uint8_t byte = data[offset++];
+        zigzag |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            value = static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void putU32(uint8_t* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+inline uint32_t getU32(const uint8_t* data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | static_cast<uint32_t>(data[3]) << 24;
+}
+
+const size_t HEADER_SIZE = 12;
+const size_t MAX_CHANNELS = 32; // Decoded from other boards
+const size_t RECORD_MAX = 5 + 1 + 5 * TelemetryRecord::CHANNELS;
+} // namespace telemetrywire
+
+// Encodes up to count records, seqs from firstSeq, as far as they fit into
+// size. Returns the length, 0 if not even one record fits; encoded is set to
+// the number of records in it.
+inline size_t encodeTelemetryBatch(const TelemetryRecord* records, size_t count, uint32_t firstSeq, uint32_t bootId,
+                                   const char* deviceId, uint8_t* out, size_t size, size_t& encoded) {
+    using namespace telemetrywire;
+    const size_t idLength = min(strlen(deviceId), static_cast<size_t>(TELEMETRY_ID_LENGTH));
+    encoded = 0;
+    if (size < HEADER_SIZE + idLength + RECORD_MAX) {
+        return 0;
+    }
+    out[0] = TELEMETRY_VERSION;
+    out[1] = TelemetryRecord::CHANNELS;
+    putU32(out + 2, bootId);
+    putU32(out + 6, firstSeq);
+    out[11] = idLength;
+    memcpy(out + HEADER_SIZE, deviceId, idLength);
+    size_t length = HEADER_SIZE + idLength;
+
+    uint32_t timestamp = 0;
+    int16_t levels[TelemetryRecord::CHANNELS] = {};
+    count = min(count, static_cast<size_t>(UINT8_MAX));
+    while (encoded < count && length + RECORD_MAX <= size) {
+        const TelemetryRecord& record = records[encoded++];
+        length += putVarint(out + length, static_cast<int32_t>(record.timestamp - timestamp));
+        out[length++] = (record.kind & 0x03) | (record.plant & 0x1F) << 2 | (record.on ? 0x80 : 0);
+        for (size_t i = 0; i < TelemetryRecord::CHANNELS; i++) {
+            length += putVarint(out + length, record.levels[i] - levels[i]);
+            levels[i] = record.levels[i];
+        }
+        timestamp = record.timestamp;
+    }
+    out[10] = encoded;
+    return length;
+}
+
+// Decodes a batch into out, up to max records. Returns false on a malformed
+// batch or one of another version. Levels of channels past
+// TelemetryRecord::CHANNELS are skipped.
+inline bool decodeTelemetryBatch(const uint8_t* data, size_t length, TelemetryBatch& batch,
+                                 TelemetryRecord* out, size_t max) {
+    using namespace telemetrywire;
+    if (length < HEADER_SIZE || data[0] != TELEMETRY_VERSION || data[1] > MAX_CHANNELS) {
+        return false;
+    }
+    batch.channels = data[1];
+    batch.bootId = getU32(data + 2);
+    batch.firstSeq = getU32(data + 6);
+    batch.count = data[10];
+    const size_t idLength = data[11];
+    if (idLength > TELEMETRY_ID_LENGTH || HEADER_SIZE + idLength > length || batch.count > max) {
+        return false;
+    }
+    memcpy(batch.deviceId, data + HEADER_SIZE, idLength);
+    batch.deviceId[idLength] = '\0';
+
+    size_t offset = HEADER_SIZE + idLength;
+    int32_t timestamp = 0;
+    int32_t levels[MAX_CHANNELS] = {};
+    for (size_t r = 0; r < batch.count; r++) {
+        TelemetryRecord& record = out[r];
+        int32_t delta;
+        if (!getVarint(data, length, offset, delta) || offset >= length) {
+            return false;
+        }
+        timestamp += delta;
+        record.timestamp = timestamp;
+        const uint8_t flags = data[offset++];
+        record.kind = flags & 0x03;
+        record.plant = (flags >> 2) & 0x1F;
+        record.on = flags & 0x80;
+        for (size_t i = 0; i < batch.channels; i++) {
+            if (!getVarint(data, length, offset, delta)) {
+                return false;
+            }
+            levels[i] += delta;
+            if (i < TelemetryRecord::CHANNELS) {
+                record.levels[i] = levels[i];
+            }
+        }
+        for (size_t i = batch.channels; i < TelemetryRecord::CHANNELS; i++) {
+            record.levels[i] = 0;
+        }
+    }
+    return offset == length;
+}
+
+// Samples and events on their way out, numbered in order. The loop task pushes;
+// the publisher takes batches from the oldest unacknowledged record and drops
+// them once acknowledged, so after an outage it resumes from the last ack.
+// Full, the oldest record makes room and counts as dropped.
+class TelemetryQueue {
+public:
+    // Disabled, push() does nothing; disabling drops what is queued
+    void setEnabled(bool enabled) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!enabled) {
+            firstSeq += count;
+            head = (head + count) % TELEMETRY_QUEUE_LENGTH;
+            count = 0;
+        }
+        this->enabled = enabled;
+    }
+
+    // From the loop task; levels in channel order
+    void push(TelemetryKind kind, uint8_t plant, bool on, const int* levels, uint32_t timestamp) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!enabled) {
+                return;
+            }
+            if (count == TELEMETRY_QUEUE_LENGTH) {
+                head = (head + 1) % TELEMETRY_QUEUE_LENGTH;
+                firstSeq++;
+                count--;
+                dropped++;
+            }
+            TelemetryRecord& record = records[(head + count) % TELEMETRY_QUEUE_LENGTH];
+            record.timestamp = timestamp;
+            record.kind = kind;
+            record.plant = plant;
+            record.on = on;
+            for (size_t i = 0; i < TelemetryRecord::CHANNELS; i++) {
+                record.levels[i] = levels[i];
+            }
+            count++;
+            if (count < wakeAt) {
+                return;
+            }
+        }
+        changed.notify_one();
+    }
+
+    // Copies up to max of the oldest records; returns how many, with the seq of
+    // the first. Timestamps from before the clock was set come out in epoch time
+    // once it is.
+    size_t peek(TelemetryRecord* out, size_t max, uint32_t& seq) const {
+        std::lock_guard<std::mutex> guard(lock);
+        const size_t n = min(count, max);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = records[(head + i) % TELEMETRY_QUEUE_LENGTH];
+            out[i].timestamp = WallClock::fix(out[i].timestamp);
+        }
+        seq = firstSeq;
+        return n;
+    }
+
+    // Drops the records up to and including seq
+    void ack(uint32_t seq) {
+        std::lock_guard<std::mutex> guard(lock);
+        const uint32_t n = seq - firstSeq + 1;
+        if (n > count) {
+            return; // Before the queue, or past it: a stale or bogus ack
+        }
+        head = (head + n) % TELEMETRY_QUEUE_LENGTH;
+        firstSeq += n;
+        count -= n;
+        acked += n;
+    }
+
+    // Blocks until at least records are queued, interrupt(), or timeoutMs
+    void wait(size_t records, unsigned long timeoutMs) {
+        std::unique_lock<std::mutex> guard(lock);
+        wakeAt = records;
+        const uint32_t interrupts = interrupted;
+        changed.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+                         [&]() { return count >= records || interrupted != interrupts; });
+        wakeAt = SIZE_MAX;
+    }
+
+    // Ends a wait() early, e.g. for a settings change
+    void interrupt() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            interrupted++;
+        }
+        changed.notify_one();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return count;
+    }
+
+    // Records acknowledged and dropped since boot
+    uint32_t getAcked() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return acked;
+    }
+
+    uint32_t getDropped() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return dropped;
+    }
+
+private:
+    TelemetryRecord records[TELEMETRY_QUEUE_LENGTH];
+    size_t head = 0;
+    size_t count = 0;
+    uint32_t firstSeq = 1; // Seq of records[head]
+    uint32_t acked = 0;
+    uint32_t dropped = 0;
+    uint32_t interrupted = 0;
+    size_t wakeAt = SIZE_MAX;
+    bool enabled = false;
+    mutable std::mutex lock;
+    std::condition_variable changed;
+};
+
+#endif // TELEMETRY_H
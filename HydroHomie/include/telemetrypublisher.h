@@ -0,0 +1,543 @@
+#ifndef TELEMETRYPUBLISHER_H
+#define TELEMETRYPUBLISHER_H
+
+#include <Arduino.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include "telemetry.h"
+#include "seqlock.h"
+#ifdef ESP_PLATFORM
+#include <esp_random.h>
+#else
+#include <random>
+#include <thread>
+#endif
+
+#define TELEMETRY_HOST_LENGTH 63
+#define TELEMETRY_MQTT_PORT 1883
+#define TELEMETRY_UDP_PORT 4210
+#define TELEMETRY_TIMEOUT_MS 3000        // Connect, send and acknowledgement timeout
+#define TELEMETRY_RETRY_MIN_MS 2000      // Backoff after a failure, doubled per failure
+#define TELEMETRY_RETRY_MAX_MS 60000
+#define TELEMETRY_STACK 6144
+#define TELEMETRY_PRIORITY 1             // Same as loop(); it only waits on the network
+
+enum TelemetryMode {
+    TELEMETRY_OFF,
+    TELEMETRY_UDP,  // Datagrams to a collector, which acknowledges each
+    TELEMETRY_MQTT, // QoS 1 publishes to a broker, acknowledged by PUBACK
+    TELEMETRY_MODES
+};
+
+inline const char* telemetryModeName(uint8_t mode) {
+    switch (mode) {
+        case TELEMETRY_UDP: return "udp";
+        case TELEMETRY_MQTT: return "mqtt";
+        default: return "off";
+    }
+}
+
+// Milliseconds of real time: millis() on the device; on host builds, where
+// millis() follows the simulated clock, the steady clock
+inline unsigned long telemetryMillis() {
+#ifdef ESP_PLATFORM
+    return millis();
+#else
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct TelemetrySettings {
+    uint8_t mode = TELEMETRY_OFF;
+    char host[TELEMETRY_HOST_LENGTH + 1] = "";
+    uint16_t port = 0;                // 0: the mode's default
+    uint32_t flushIntervalMs = 60000; // Longest a record waits for a batch to fill
+    uint8_t batch = 32;               // Records that trigger a flush
+    char deviceId[TELEMETRY_ID_LENGTH + 1] = "";
+
+    bool operator==(const TelemetrySettings& other) const {
+        return mode == other.mode && !strcmp(host, other.host) && port == other.port
+            && flushIntervalMs == other.flushIntervalMs && batch == other.batch && !strcmp(deviceId, other.deviceId);
+    }
+};
+
+// The publisher's counters as published to other tasks
+struct TelemetryStats {
+    uint8_t mode;
+    bool connected;
+    uint32_t queued;       // Records waiting, not yet acknowledged
+    uint32_t acked;        // Records acknowledged since boot
+    uint32_t dropped;      // Records lost to a full queue
+    uint32_t batches;      // Messages acknowledged
+    uint32_t failures;     // Connects, sends and acknowledgements that failed
+    uint32_t bytes;        // Payload bytes of the acknowledged messages
+};
+
+// Where batches go. connect() and publish() block for up to
+// TELEMETRY_TIMEOUT_MS; they only run on the publisher's task.
+class TelemetryTransport {
+public:
+    virtual ~TelemetryTransport() {
+        close();
+    }
+
+    virtual bool connect(const TelemetrySettings& settings) = 0;
+
+    // Sends one batch of records firstSeq..lastSeq. On success acked is the
+    // highest seq the other end confirmed, which may be short of lastSeq.
+    virtual bool publish(const uint8_t* data, size_t length, uint32_t bootId, uint32_t firstSeq, uint32_t lastSeq,
+                         uint32_t& acked) = 0;
+
+    // Keeps an idle connection open, if it needs that
+    virtual bool keepAlive() {
+        return true;
+    }
+
+    bool isConnected() const {
+        return socket >= 0;
+    }
+
+    void close() {
+        if (socket >= 0) {
+            ::close(socket);
+            socket = -1;
+        }
+    }
+
+protected:
+    int socket = -1;
+
+    // Resolves host and connects a socket of type to it, within TELEMETRY_TIMEOUT_MS
+    bool open(const TelemetrySettings& settings, int type, uint16_t defaultPort) {
+        close();
+        char port[8];
+        snprintf(port, sizeof(port), "%u", settings.port ? settings.port : defaultPort);
+        struct addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = type;
+        struct addrinfo* address = nullptr;
+        if (!settings.host[0] || getaddrinfo(settings.host, port, &hints, &address) != 0 || !address) {
+            return false;
+        }
+        socket = ::socket(address->ai_family, address->ai_socktype, 0);
+        bool ok = socket >= 0 && connectWithin(address);
+        freeaddrinfo(address);
+        if (ok) {
+            struct timeval timeout = {TELEMETRY_TIMEOUT_MS / 1000, (TELEMETRY_TIMEOUT_MS % 1000) * 1000};
+            ok = setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0
+                && setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0;
+        }
+        if (!ok) {
+            close();
+        }
+        return ok;
+    }
+
+    bool sendAll(const uint8_t* data, size_t length) {
+        while (length > 0) {
+            const ssize_t sent = ::send(socket, data, length, 0);
+            if (sent <= 0) {
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    bool receiveAll(uint8_t* data, size_t length) {
+        while (length > 0) {
+            const ssize_t received = ::recv(socket, data, length, 0);
+            if (received <= 0) {
+                return false;
+            }
+            data += received;
+            length -= received;
+        }
+        return true;
+    }
+
+private:
+    // A blocking connect() can hang for the stack's full SYN retry time
+    bool connectWithin(const struct addrinfo* address) {
+        const int flags = fcntl(socket, F_GETFL, 0);
+        fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+        int result = ::connect(socket, address->ai_addr, address->ai_addrlen);
+        if (result != 0 && errno == EINPROGRESS) {
+            fd_set writable;
+            FD_ZERO(&writable);
+            FD_SET(socket, &writable);
+            struct timeval timeout = {TELEMETRY_TIMEOUT_MS / 1000, (TELEMETRY_TIMEOUT_MS % 1000) * 1000};
+            int error = 0;
+            socklen_t size = sizeof(error);
+            result = select(socket + 1, nullptr, &writable, nullptr, &timeout) == 1
+                && getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &size) == 0 && error == 0 ? 0 : -1;
+        }
+        fcntl(socket, F_SETFL, flags);
+        return result == 0;
+    }
+};
+
+// One datagram per batch to a collector, which answers every batch with the
+// highest seq it has of that boot:
+//   u32 boot id, u32 seq, little-endian
+// Batches come in seq order and only unacknowledged records are resent, so the
+// collector keeps the records past its highest seq and skips the rest as
+// repeats. See Dummy/telemetry_collector.py.
+class UdpTelemetry : public TelemetryTransport {
+public:
+    bool connect(const TelemetrySettings& settings) override {
+        return open(settings, SOCK_DGRAM, TELEMETRY_UDP_PORT);
+    }
+
+    bool publish(const uint8_t* data, size_t length, uint32_t bootId, uint32_t firstSeq, uint32_t lastSeq,
+                 uint32_t& acked) override {
+        if (::send(socket, data, length, 0) != static_cast<ssize_t>(length)) {
+            return false;
+        }
+        // Acknowledgements of earlier, retried datagrams may still be in flight; wait for this one's
+        uint8_t reply[8];
+        while (::recv(socket, reply, sizeof(reply), 0) == sizeof(reply)) {
+            acked = telemetrywire::getU32(reply + 4);
+            if (telemetrywire::getU32(reply) == bootId && acked - firstSeq <= lastSeq - firstSeq) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Minimal MQTT 3.1.1 client for QoS 1 publishes: CONNECT with a clean session,
+// PUBLISH to hydrohomie/<device id>/telemetry, and the PUBACK is the
+// acknowledgement of the whole batch. Nothing is subscribed. A batch whose
+// PUBACK was lost is published again; the payload carries the boot id and
+// first seq (see telemetry.h), so subscribers drop the repeat as the UDP
+// collector does.
+class MqttTelemetry : public TelemetryTransport {
+public:
+    bool connect(const TelemetrySettings& settings) override {
+        if (!open(settings, SOCK_STREAM, TELEMETRY_MQTT_PORT)) {
+            return false;
+        }
+        snprintf(topic, sizeof(topic), "hydrohomie/%s/telemetry", settings.deviceId);
+        // The broker drops us after 1.5 keepalives without a packet; keepAlive() pings in between
+        keepAliveSeconds = min(settings.flushIntervalMs / 1000 * 2 + 30, static_cast<uint32_t>(UINT16_MAX));
+        uint8_t packet[16 + TELEMETRY_ID_LENGTH];
+        const size_t idLength = strlen(settings.deviceId);
+        size_t length = 0;
+        packet[length++] = 0x10; // CONNECT
+        packet[length++] = 10 + 2 + idLength;
+        const uint8_t variableHeader[] = {0, 4, 'M', 'Q', 'T', 'T', 4, 0x02,
+                                          static_cast<uint8_t>(keepAliveSeconds >> 8), static_cast<uint8_t>(keepAliveSeconds)};
+        memcpy(packet + length, variableHeader, sizeof(variableHeader));
+        length += sizeof(variableHeader);
+        packet[length++] = idLength >> 8;
+        packet[length++] = idLength;
+        memcpy(packet + length, settings.deviceId, idLength);
+        length += idLength;
+
+        uint8_t connack[4];
+        if (!sendAll(packet, length) || !receiveAll(connack, sizeof(connack))
+            || connack[0] != 0x20 || connack[1] != 2 || connack[3] != 0) {
+            close();
+            return false;
+        }
+        lastPacket = telemetryMillis();
+        return true;
+    }
+
+    bool publish(const uint8_t* data, size_t length, uint32_t /* bootId */, uint32_t /* firstSeq */, uint32_t lastSeq,
+                 uint32_t& acked) override {
+        packetId = packetId == UINT16_MAX ? 1 : packetId + 1;
+        const size_t topicLength = strlen(topic);
+        uint8_t header[8 + sizeof(topic)];
+        size_t headerLength = 0;
+        header[headerLength++] = 0x32; // PUBLISH, QoS 1
+        size_t remaining = 2 + topicLength + 2 + length;
+        do {
+            header[headerLength++] = (remaining & 0x7F) | (remaining > 0x7F ? 0x80 : 0);
+            remaining >>= 7;
+        } while (remaining);
+        header[headerLength++] = topicLength >> 8;
+        header[headerLength++] = topicLength;
+        memcpy(header + headerLength, topic, topicLength);
+        headerLength += topicLength;
+        header[headerLength++] = packetId >> 8;
+        header[headerLength++] = packetId;
+        if (!sendAll(header, headerLength) || !sendAll(data, length)) {
+            close();
+            return false;
+        }
+        lastPacket = telemetryMillis();
+        if (!awaitPacket(0x40, packetId)) {
+            close();
+            return false;
+        }
+        acked = lastSeq;
+        return true;
+    }
+
+    bool keepAlive() override {
+        if (telemetryMillis() - lastPacket < keepAliveSeconds * 500UL) {
+            return true;
+        }
+        const uint8_t ping[] = {0xC0, 0};
+        lastPacket = telemetryMillis();
+        if (!sendAll(ping, sizeof(ping)) || !awaitPacket(0xD0, 0)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+private:
+    char topic[24 + TELEMETRY_ID_LENGTH];
+    uint16_t packetId = 0;
+    uint32_t keepAliveSeconds = 0;
+    unsigned long lastPacket = 0;
+
+    // Reads packets until one of type (PUBACK with id, PINGRESP); others are skipped
+    bool awaitPacket(uint8_t type, uint16_t id) {
+        for (;;) {
+            uint8_t fixed;
+            if (!receiveAll(&fixed, 1)) {
+                return false;
+            }
+            size_t remaining = 0;
+            for (int shift = 0;; shift += 7) {
+                uint8_t byte;
+                if (shift > 21 || !receiveAll(&byte, 1)) {
+                    return false;
+                }
+                remaining |= static_cast<size_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            uint8_t body[4];
+            const size_t kept = min(remaining, sizeof(body));
+            if (!receiveAll(body, kept)) {
+                return false;
+            }
+            for (size_t skipped = kept; skipped < remaining; skipped++) {
+                uint8_t byte;
+                if (!receiveAll(&byte, 1)) {
+                    return false;
+                }
+            }
+            if ((fixed & 0xF0) == type && (type != 0x40 || (kept == 2 && (body[0] << 8 | body[1]) == id))) {
+                return true;
+            }
+        }
+    }
+};
+
+// Pushes the telemetry queue to a UDP collector or an MQTT broker from its own
+// task: a batch goes out once telemetry_batch records are queued or the oldest
+// has waited a flush interval, and leaves the queue only when acknowledged.
+// While the other end is unreachable records pile up in the bounded queue,
+// retried with backoff from the last acknowledged one.
+class TelemetryPublisher {
+public:
+    ~TelemetryPublisher() {
+        end();
+    }
+
+    // Settings may be configured before or after
+    bool begin(TelemetryQueue& telemetryQueue) {
+        queue = &telemetryQueue;
+        {
+            std::lock_guard<std::mutex> guard(settingsLock);
+            queue->setEnabled(settings.mode != TELEMETRY_OFF);
+        }
+#ifdef ESP_PLATFORM
+        bootId = esp_random();
+#else
+        bootId = std::random_device()();
+#endif
+        running = true;
+#ifdef ESP_PLATFORM
+        return task || xTaskCreate(run, "telemetry", TELEMETRY_STACK, this, TELEMETRY_PRIORITY, &task) == pdPASS;
+#else
+        if (!thread.joinable()) {
+            thread = std::thread([this]() { loop(); });
+        }
+        return true;
+#endif
+    }
+
+    void end() {
+        if (!running.exchange(false)) {
+            return;
+        }
+        queue->interrupt();
+#ifdef ESP_PLATFORM
+        // The task sees running and deletes itself after its current step
+        while (task) {
+            delay(10);
+        }
+#else
+        thread.join();
+#endif
+    }
+
+    // From any task; takes effect at once. Off, nothing is queued.
+    void configure(const TelemetrySettings& next) {
+        {
+            std::lock_guard<std::mutex> guard(settingsLock);
+            if (next == settings) {
+                return;
+            }
+            settings = next;
+            settings.batch = constrain(settings.batch, 1, TELEMETRY_BATCH_MAX);
+            settingsVersion++;
+            if (queue) {
+                queue->setEnabled(settings.mode != TELEMETRY_OFF);
+            }
+        }
+        if (queue) {
+            queue->interrupt();
+        }
+    }
+
+    uint32_t getBootId() const {
+        return bootId;
+    }
+
+    TelemetryStats getStats() const {
+        TelemetryStats stats = published.load();
+        if (queue) {
+            stats.queued = queue->size();
+            stats.acked = queue->getAcked();
+            stats.dropped = queue->getDropped();
+        }
+        return stats;
+    }
+
+private:
+    TelemetryQueue* queue = nullptr;
+    uint32_t bootId = 0;
+    std::atomic<bool> running{false};
+    std::mutex settingsLock;
+    TelemetrySettings settings;
+    uint32_t settingsVersion = 0;
+    Snapshot<TelemetryStats> published;
+
+    // Publisher task only
+    UdpTelemetry udp;
+    MqttTelemetry mqtt;
+    TelemetryTransport* transport = nullptr;
+    TelemetryStats stats = {};
+    TelemetryRecord batch[TELEMETRY_BATCH_MAX];
+    uint8_t payload[TELEMETRY_PAYLOAD_SIZE];
+
+#ifdef ESP_PLATFORM
+    TaskHandle_t task = nullptr;
+
+    static void run(void* arg) {
+        TelemetryPublisher* self = static_cast<TelemetryPublisher*>(arg);
+        self->loop();
+        self->task = nullptr;
+        vTaskDelete(nullptr);
+    }
+#else
+    std::thread thread;
+#endif
+
+    void loop() {
+        TelemetrySettings current;
+        uint32_t currentVersion = UINT32_MAX;
+        unsigned long backoffMs = 0;
+        unsigned long lastFlush = telemetryMillis();
+        while (running) {
+            {
+                std::lock_guard<std::mutex> guard(settingsLock);
+                if (settingsVersion != currentVersion) {
+                    current = settings;
+                    currentVersion = settingsVersion;
+                    udp.close();
+                    mqtt.close();
+                    transport = current.mode == TELEMETRY_UDP ? static_cast<TelemetryTransport*>(&udp)
+                              : current.mode == TELEMETRY_MQTT ? static_cast<TelemetryTransport*>(&mqtt) : nullptr;
+                    stats.mode = current.mode;
+                    backoffMs = 0;
+                }
+            }
+            publish(false);
+            if (!transport) {
+                queue->wait(SIZE_MAX, TELEMETRY_RETRY_MAX_MS);
+                continue;
+            }
+
+            // Records from before the clock was set wait for it, to go out in epoch time
+            TelemetryRecord oldest;
+            uint32_t oldestSeq;
+            if (queue->peek(&oldest, 1, oldestSeq) && WallClock::isProvisional(oldest.timestamp)) {
+                queue->wait(SIZE_MAX, TELEMETRY_RETRY_MIN_MS);
+                continue;
+            }
+
+            // Wait for a full batch or the flush interval; a backlog goes out at once
+            const unsigned long waited = telemetryMillis() - lastFlush;
+            if (queue->size() < current.batch && waited < current.flushIntervalMs) {
+                queue->wait(current.batch, current.flushIntervalMs - waited);
+                continue;
+            }
+            if ((transport->isConnected() || transport->connect(current)) && flush(current)) {
+                lastFlush = telemetryMillis();
+                backoffMs = 0;
+                continue;
+            }
+            transport->close();
+            stats.failures++;
+            publish(false);
+            // Only a settings change ends the backoff early; then the backlog is retried at once
+            backoffMs = backoffMs ? min(backoffMs * 2, static_cast<unsigned long>(TELEMETRY_RETRY_MAX_MS))
+                                  : TELEMETRY_RETRY_MIN_MS;
+            queue->wait(SIZE_MAX, backoffMs);
+        }
+        udp.close();
+        mqtt.close();
+        publish(false);
+    }
+
+    // Sends batches until the queue is down to less than one; false on a failure
+    bool flush(const TelemetrySettings& current) {
+        for (;;) {
+            uint32_t firstSeq;
+            const size_t count = queue->peek(batch, current.batch, firstSeq);
+            if (count == 0) {
+                return transport->keepAlive();
+            }
+            size_t encoded;
+            const size_t length = encodeTelemetryBatch(batch, count, firstSeq, bootId, current.deviceId,
+                                                       payload, sizeof(payload), encoded);
+            uint32_t acked;
+            if (!transport->publish(payload, length, bootId, firstSeq, firstSeq + encoded - 1, acked)) {
+                return false;
+            }
+            queue->ack(acked);
+            stats.batches++;
+            stats.bytes += length;
+            publish(true);
+            if (count < current.batch || !running) {
+                return true;
+            }
+        }
+    }
+
+    void publish(bool connected) {
+        stats.connected = connected || (transport && transport->isConnected());
+        published.publish(stats);
+    }
+};
+
+#endif // TELEMETRYPUBLISHER_H
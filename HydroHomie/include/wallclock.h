@@ -0,0 +1,58 @@
+#ifndef WALLCLOCK_H
+#define WALLCLOCK_H
+
+#include <Arduino.h>
+#include <time.h>
+#include <atomic>
+
+#define WALLCLOCK_VALID_EPOCH 1577836800UL // 2020-01-01; time() before it was never set by NTP
+
+// Timestamps of samples and events. Once NTP has set the clock they are epoch
+// seconds. Until then they are seconds since boot from millis(), which never
+// jumps, so sampling and watering don't wait for the network; such provisional
+// timestamps are below WALLCLOCK_VALID_EPOCH. The first sync fixes the offset
+// between the two, and whoever keeps timestamps then moves its provisional
+// ones by it: on its own task once isSynced(), or with fix() as it reads them.
+class WallClock {
+public:
+    // Epoch seconds, or seconds since boot until the clock is set
+    static uint32_t now() {
+        const time_t t = time(nullptr);
+        return t >= static_cast<time_t>(WALLCLOCK_VALID_EPOCH) ? static_cast<uint32_t>(t) : millis() / 1000;
+    }
+
+    static bool isProvisional(uint32_t timestamp) {
+        return timestamp < WALLCLOCK_VALID_EPOCH;
+    }
+
+    // From the SNTP callback, after the clock was set. Only the first sync
+    // counts: later ones adjust a clock that was already right.
+    static void synced() {
+        const time_t t = time(nullptr);
+        if (clockSet.load() || t < static_cast<time_t>(WALLCLOCK_VALID_EPOCH)) {
+            return;
+        }
+        offset.store(static_cast<uint32_t>(t) - millis() / 1000, std::memory_order_relaxed);
+        clockSet.store(true);
+    }
+
+    static bool isSynced() {
+        return clockSet.load();
+    }
+
+    // Added to a provisional timestamp to make it epoch seconds; 0 before the sync
+    static uint32_t getOffset() {
+        return clockSet.load() ? offset.load(std::memory_order_relaxed) : 0;
+    }
+
+    // timestamp in epoch seconds where that is known yet
+    static uint32_t fix(uint32_t timestamp) {
+        return isProvisional(timestamp) ? timestamp + getOffset() : timestamp;
+    }
+
+private:
+    static inline std::atomic<bool> clockSet{false};
+    static inline std::atomic<uint32_t> offset{0};
+};
+
+#endif // WALLCLOCK_H
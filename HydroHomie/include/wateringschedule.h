@@ -0,0 +1,828 @@
+#ifndef WATERINGSCHEDULE_H
+#define WATERINGSCHEDULE_H
+
+#include <Arduino.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include "seqlock.h"
+#include "wallclock.h"
+
+#define SCHEDULE_MAX_ENTRIES 16
+#define SCHEDULE_TEXT_LENGTH 255          // The schedules setting, all entries
+#define SCHEDULE_MAX_INTERVAL (7*24*60*60) // Longest every and cooldown, seconds
+#define SCHEDULE_MAX_DURATION (24*60*60)
+#define SCHEDULE_CRON_HORIZON_S 3600      // Cron entries look at the wall clock at least this often
+#define SCHEDULE_MISFIRE_GRACE_S 900      // A cron time the clock stepped over still fires this late
+#define SCHEDULE_STEP_TOLERANCE_S 2       // The wall clock moving against millis() by more is a step
+#define SCHEDULE_SEARCH_DAYS (5*366)      // Cron times further out, e.g. 30 2 (Feb 30), never fire
+
+enum ScheduleKind : uint8_t {
+    SCHEDULE_CRON,  // Local times of day, cron fields
+    SCHEDULE_EVERY, // Fixed interval on millis(), from the last fire or manual start
+    SCHEDULE_DRY,   // A plant's level below a threshold, then a cooldown
+    SCHEDULE_QUIET  // A daily window in which nothing starts
+};
+
+inline const char* scheduleKindName(uint8_t kind) {
+    switch (kind) {
+        case SCHEDULE_CRON: return "cron";
+        case SCHEDULE_EVERY: return "every";
+        case SCHEDULE_DRY: return "dry";
+        case SCHEDULE_QUIET: return "quiet";
+        default: return "unknown";
+    }
+}
+
+// One parsed entry of the schedules setting. Zero plants, duration or period
+// leave them to the defaults that configure() is given.
+struct ScheduleRule {
+    ScheduleKind kind;
+    uint8_t plant;       // dry: whose level triggers
+    uint32_t plants;     // Bit per plant watered, 0: all (dry: its own plant)
+    uint32_t duration;   // Seconds of watering
+    uint32_t period;     // every: interval, dry: cooldown; seconds
+    int32_t level;       // dry: fires below this level
+    uint64_t minutes;    // cron: bit per minute 0-59
+    uint32_t hours;      // cron: bit per hour 0-23
+    uint32_t days;       // cron: bit per day of the month 1-31
+    uint16_t months;     // cron: bit per month 1-12
+    uint8_t weekdays;    // cron: bit per weekday, 0 Sunday
+    bool anyDay;         // cron: day of month was *, so only the weekday restricts
+    bool anyWeekday;     // cron: weekday was *, so only the day of month restricts
+    uint16_t quietStart; // quiet: minutes after local midnight
+    uint16_t quietEnd;
+};
+
+// A fire of an entry: start watering plants for duration seconds
+struct ScheduleFire {
+    uint8_t entry;
+    uint32_t plants;
+    uint32_t duration;
+};
+
+// State of one entry as published to other tasks. Times are WallClock seconds.
+struct ScheduleEntryState {
+    uint8_t kind;
+    bool armed;        // dry: out of its cooldown, fires on the next dry poll
+    uint32_t plants;
+    uint32_t duration;
+    uint32_t next;     // Next fire, 0 if it depends on the levels or the time is not known yet
+    uint32_t last;     // Last fire, 0 if none
+    uint32_t fires;
+    uint32_t skipped;  // Fell into quiet hours, or the clock stepped past them
+};
+
+struct ScheduleSnapshot {
+    uint8_t count;
+    ScheduleEntryState entries[SCHEDULE_MAX_ENTRIES];
+};
+
+// The watering schedule: any number of entries, up to SCHEDULE_MAX_ENTRIES,
+// from the schedules setting, entries separated by ';' or new lines:
+//
+//   cron MIN HOUR DOM MON DOW [for D] [plants P,..]   e.g. cron 30 6 * * 1-5 for 10m
+//   every D [for D] [plants P,..]                     e.g. every 6h for 2m plants 1
+//   dry PLANT below LEVEL [cooldown D] [for D] [plants P,..]
+//   quiet HH:MM-HH:MM                                 e.g. quiet 22:00-07:00
+//
+// D is seconds, or a number with s, m, h or d. Cron fields take *, lists,
+// ranges and steps; when both the day of month and the weekday are
+// restricted either matching is enough, as in Vixie cron. A setting without
+// watering entries, e.g. empty, is the legacy schedule: every
+// watering_interval for watering_duration on all plants.
+//
+// Entries wait in a min-heap on millis() deadlines, so a loop that finds
+// nothing due costs one comparison whatever the number of entries; the dry
+// rules are looked at once per poll. Intervals and cooldowns run on millis()
+// and ignore the wall clock. Cron times are local, in the TZ the firmware set:
+// a time in the spring-forward gap fires that much later (02:30 at 03:30), a
+// time in the repeated hour of the fall-back fires once. Cron entries wait
+// until NTP has set the clock, and handle steps of it: a time stepped over
+// still fires within SCHEDULE_MISFIRE_GRACE_S, a step back does not fire a
+// time again.
+//
+// Everything but getSnapshot() belongs to the one task that runs the schedule.
+class WateringSchedule {
+public:
+    // Parses the schedules setting for a board of plants plants. False, with a
+    // message naming the entry, if it does not parse.
+    static bool parse(const char* text, size_t plants, ScheduleRule* rules, size_t& count, char* error,
+                      size_t errorSize) {
+        count = 0;
+        if (strlen(text) > SCHEDULE_TEXT_LENGTH) {
+            snprintf(error, errorSize, "schedules: at most %u characters", SCHEDULE_TEXT_LENGTH);
+            return false;
+        }
+        char buffer[SCHEDULE_TEXT_LENGTH + 1];
+        strcpy(buffer, text);
+        char* entrySave;
+        unsigned index = 0;
+        for (char* entry = strtok_r(buffer, ";\n", &entrySave); entry; entry = strtok_r(nullptr, ";\n", &entrySave)) {
+            ScheduleRule rule;
+            const char* message = parseEntry(entry, plants, rule);
+            if (message && !*message) {
+                continue; // Blank
+            }
+            if (!message && count == SCHEDULE_MAX_ENTRIES) {
+                message = "too many entries";
+            }
+            if (message) {
+                snprintf(error, errorSize, "schedules entry %u: %s", index, message);
+                return false;
+            }
+            rules[count++] = rule;
+            index++;
+        }
+        return true;
+    }
+
+    // Whether the setting parses, e.g. before it is stored
+    static bool validate(const char* text, size_t plants, char* error, size_t errorSize) {
+        ScheduleRule rules[SCHEDULE_MAX_ENTRIES];
+        size_t count;
+        return parse(text, plants, rules, count, error, errorSize);
+    }
+
+    // Takes the entries of the schedules setting, with interval, cooldown and
+    // duration defaults in seconds. An entry that keeps its place and kind
+    // keeps its state: an interval still counts from its last fire, a cron
+    // time that fired does not fire again. Without any watering entry, or if
+    // text does not parse (false), this is the legacy schedule.
+    bool configure(const char* text, size_t plants, uint32_t interval, uint32_t duration, unsigned long now) {
+        ScheduleRule rules[SCHEDULE_MAX_ENTRIES];
+        size_t count = 0;
+        char error[96];
+        const bool ok = parse(text, plants, rules, count, error, sizeof(error));
+        if (!ok) {
+            count = 0;
+        }
+        size_t watering = 0;
+        for (size_t r = 0; r < count; r++) {
+            watering += rules[r].kind != SCHEDULE_QUIET;
+        }
+        if (watering == 0 && count < SCHEDULE_MAX_ENTRIES) {
+            rules[count] = ScheduleRule();
+            rules[count++].kind = SCHEDULE_EVERY;
+        }
+        const uint32_t allPlants = plants >= 32 ? UINT32_MAX : (1u << plants) - 1;
+        heapSize = 0;
+        quietCount = 0;
+        longestDuration = 0;
+        size_t kept = 0;
+        for (size_t r = 0; r < count; r++) {
+            const ScheduleRule& rule = rules[r];
+            if (rule.kind == SCHEDULE_QUIET) {
+                quiet[quietCount++] = rule;
+                continue;
+            }
+            Entry& entry = entries[kept];
+            if (kept >= entryCount || entry.rule.kind != rule.kind) {
+                entry = Entry();
+                entry.anchor = now;
+            }
+            entry.rule = rule;
+            entry.plants = rule.plants ? rule.plants
+                                       : (rule.kind == SCHEDULE_DRY ? 1u << rule.plant : allPlants);
+            entry.duration = rule.duration ? rule.duration : duration;
+            entry.period = rule.period ? rule.period : interval;
+            entry.fireAt = 0;
+            longestDuration = max(longestDuration, entry.duration);
+            kept++;
+        }
+        entryCount = kept;
+
+        const uint32_t wall = WallClock::now();
+        clockOffset = offsetOf(wall, now);
+        for (size_t i = 0; i < entryCount; i++) {
+            Entry& entry = entries[i];
+            entry.position = NOT_QUEUED;
+            switch (entry.rule.kind) {
+                case SCHEDULE_EVERY:
+                    entry.deadline = entry.anchor + entry.period * 1000UL;
+                    if (before(entry.deadline, now)) {
+                        entry.deadline = now;
+                    }
+                    push(i);
+                    break;
+                case SCHEDULE_CRON:
+                    planCron(entry, wall, now);
+                    push(i);
+                    break;
+                case SCHEDULE_DRY:
+                    if (entry.cooling) {
+                        entry.deadline = entry.anchor + entry.period * 1000UL;
+                        push(i);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        publish(wall, now);
+        return ok;
+    }
+
+    // A manual start on all plants: the intervals count from now
+    void restart(unsigned long now) {
+        for (size_t i = 0; i < entryCount; i++) {
+            if (entries[i].rule.kind == SCHEDULE_EVERY) {
+                entries[i].anchor = now;
+                entries[i].deadline = now + entries[i].period * 1000UL;
+                update(i);
+            }
+        }
+        publish(WallClock::now(), now);
+    }
+
+    // Whether the wall clock stepped against millis(), e.g. the first NTP
+    // sync; the cron entries then need due() at once
+    bool clockStepped() const {
+        return stepped(WallClock::now(), millis());
+    }
+
+    // Milliseconds until due() has something to do without a poll
+    unsigned long timeUntilNext(unsigned long now) const {
+        if (heapSize == 0) {
+            return ULONG_MAX;
+        }
+        const long remaining = static_cast<long>(entries[heap[0]].deadline - now);
+        return remaining < 0 ? 0 : remaining;
+    }
+
+    // Whether due() wants the levels of every poll
+    bool hasDryRules() const {
+        return dryCount() > 0;
+    }
+
+    // Fires the entries that are due into fires, which holds
+    // SCHEDULE_MAX_ENTRIES; levels are the plant levels of a poll since the
+    // last call, nullptr if there was none. Returns the number of fires.
+    size_t due(unsigned long now, const int* levels, ScheduleFire* fires) {
+        const uint32_t wall = WallClock::now();
+        size_t count = 0;
+        bool changed = false;
+        if (stepped(wall, now)) {
+            resync(wall, now);
+            changed = true;
+        }
+        while (heapSize > 0 && !before(now, entries[heap[0]].deadline)) {
+            const uint8_t i = heap[0];
+            Entry& entry = entries[i];
+            changed = true;
+            switch (entry.rule.kind) {
+                case SCHEDULE_EVERY:
+                    fire(i, wall, fires, count);
+                    entry.anchor = now;
+                    entry.deadline = now + entry.period * 1000UL;
+                    update(i);
+                    break;
+                case SCHEDULE_CRON:
+                    if (entry.fireAt && !WallClock::isProvisional(wall) && wall >= entry.fireAt) {
+                        if (wall - entry.fireAt <= SCHEDULE_MISFIRE_GRACE_S) {
+                            fire(i, wall, fires, count);
+                        } else {
+                            entry.skipped++;
+                        }
+                        entry.lastKey = minuteKey(entry.fireAt);
+                    }
+                    planCron(entry, wall, now);
+                    update(i);
+                    break;
+                default:
+                    // A dry rule's cooldown is over
+                    entry.cooling = false;
+                    remove(i);
+                    break;
+            }
+        }
+        if (levels) {
+            for (size_t i = 0; i < entryCount; i++) {
+                Entry& entry = entries[i];
+                if (entry.rule.kind != SCHEDULE_DRY || entry.cooling || levels[entry.rule.plant] >= entry.rule.level
+                    || isQuiet(wall)) {
+                    continue; // Waits through quiet hours without counting skips
+                }
+                fire(i, wall, fires, count);
+                entry.cooling = true;
+                entry.anchor = now;
+                entry.deadline = now + entry.period * 1000UL;
+                push(i);
+                changed = true;
+            }
+        }
+        // A poll alone changes nothing the snapshot shows: next is the same
+        // time however it is counted, until an entry fires or the clock steps
+        if (changed) {
+            publish(wall, now);
+        }
+        return count;
+    }
+
+    // Longest watering of any entry, seconds; kept by configure()
+    uint32_t getLongestDuration() const {
+        return longestDuration;
+    }
+
+    size_t size() const {
+        return entryCount;
+    }
+
+    // Safe from any task; provisional times are fixed where the offset is known
+    ScheduleSnapshot getSnapshot() const {
+        ScheduleSnapshot snapshot = published.load();
+        for (size_t i = 0; i < snapshot.count && i < SCHEDULE_MAX_ENTRIES; i++) {
+            if (snapshot.entries[i].next) {
+                snapshot.entries[i].next = WallClock::fix(snapshot.entries[i].next);
+            }
+            if (snapshot.entries[i].last) {
+                snapshot.entries[i].last = WallClock::fix(snapshot.entries[i].last);
+            }
+        }
+        return snapshot;
+    }
+
+private:
+    static const uint8_t NOT_QUEUED = 0xFF;
+
+    struct Entry {
+        ScheduleRule rule = ScheduleRule();
+        uint32_t plants = 0;
+        uint32_t duration = 0;
+        uint32_t period = 0;
+        unsigned long anchor = 0;   // every: millis() the interval counts from; dry: of the last fire
+        unsigned long deadline = 0; // millis() the heap hands the entry back
+        uint32_t fireAt = 0;        // cron: wall seconds of the next fire, 0 until known
+        int32_t lastKey = -1;       // cron: local minute of the last fire, see minuteKey()
+        bool cooling = false;       // dry: fired less than a cooldown ago
+        uint32_t last = 0;
+        uint32_t fires = 0;
+        uint32_t skipped = 0;
+        uint8_t position = NOT_QUEUED;
+    };
+
+    Entry entries[SCHEDULE_MAX_ENTRIES];
+    size_t entryCount = 0;
+    uint32_t longestDuration = 0;
+    ScheduleRule quiet[SCHEDULE_MAX_ENTRIES];
+    size_t quietCount = 0;
+    uint8_t heap[SCHEDULE_MAX_ENTRIES]; // Entry indices, earliest deadline first
+    size_t heapSize = 0;
+    int64_t clockOffset = 0;            // Wall seconds - millis() seconds at the last look
+    Snapshot<ScheduleSnapshot> published;
+
+    // millis() comparison that survives the wrap
+    static bool before(unsigned long a, unsigned long b) {
+        return static_cast<long>(a - b) < 0;
+    }
+
+    // Min-heap on the entries' deadlines
+    void push(size_t i) {
+        entries[i].position = heapSize;
+        heap[heapSize++] = i;
+        siftUp(entries[i].position);
+    }
+
+    void remove(size_t i) {
+        const size_t at = entries[i].position;
+        entries[i].position = NOT_QUEUED;
+        if (--heapSize == at) {
+            return;
+        }
+        heap[at] = heap[heapSize];
+        entries[heap[at]].position = at;
+        siftDown(siftUp(at));
+    }
+
+    // After the deadline of a queued entry changed
+    void update(size_t i) {
+        siftDown(siftUp(entries[i].position));
+    }
+
+    size_t siftUp(size_t at) {
+        while (at > 0) {
+            const size_t parent = (at - 1) / 2;
+            if (!before(entries[heap[at]].deadline, entries[heap[parent]].deadline)) {
+                break;
+            }
+            swap(at, parent);
+            at = parent;
+        }
+        return at;
+    }
+
+    void siftDown(size_t at) {
+        for (;;) {
+            size_t earliest = at;
+            for (size_t child = 2 * at + 1; child <= 2 * at + 2 && child < heapSize; child++) {
+                if (before(entries[heap[child]].deadline, entries[heap[earliest]].deadline)) {
+                    earliest = child;
+                }
+            }
+            if (earliest == at) {
+                return;
+            }
+            swap(at, earliest);
+            at = earliest;
+        }
+    }
+
+    void swap(size_t a, size_t b) {
+        const uint8_t entry = heap[a];
+        heap[a] = heap[b];
+        heap[b] = entry;
+        entries[heap[a]].position = a;
+        entries[heap[b]].position = b;
+    }
+
+    size_t dryCount() const {
+        size_t count = 0;
+        for (size_t i = 0; i < entryCount; i++) {
+            count += entries[i].rule.kind == SCHEDULE_DRY;
+        }
+        return count;
+    }
+
+    void fire(uint8_t i, uint32_t wall, ScheduleFire* fires, size_t& count) {
+        Entry& entry = entries[i];
+        if (isQuiet(wall)) {
+            entry.skipped++;
+            return;
+        }
+        entry.fires++;
+        entry.last = wall;
+        fires[count++] = {i, entry.plants, entry.duration};
+    }
+
+    // Whether wall falls into a quiet window; never before the clock is set
+    bool isQuiet(uint32_t wall) const {
+        if (quietCount == 0 || WallClock::isProvisional(wall)) {
+            return false;
+        }
+        const time_t t = wall;
+        struct tm local;
+        localtime_r(&t, &local);
+        const int minute = local.tm_hour * 60 + local.tm_min;
+        for (size_t q = 0; q < quietCount; q++) {
+            const int start = quiet[q].quietStart;
+            const int end = quiet[q].quietEnd;
+            if (start < end ? minute >= start && minute < end : minute >= start || minute < end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static int64_t offsetOf(uint32_t wall, unsigned long now) {
+        return static_cast<int64_t>(wall) - static_cast<int64_t>(now / 1000);
+    }
+
+    bool stepped(uint32_t wall, unsigned long now) const {
+        const int64_t drift = offsetOf(wall, now) - clockOffset;
+        return drift > SCHEDULE_STEP_TOLERANCE_S || drift < -SCHEDULE_STEP_TOLERANCE_S;
+    }
+
+    // After a step: a cron time stepped over is due now, the others are planned again
+    void resync(uint32_t wall, unsigned long now) {
+        clockOffset = offsetOf(wall, now);
+        for (size_t i = 0; i < entryCount; i++) {
+            Entry& entry = entries[i];
+            if (entry.rule.kind != SCHEDULE_CRON) {
+                continue;
+            }
+            if (entry.fireAt && !WallClock::isProvisional(wall) && wall >= entry.fireAt) {
+                entry.deadline = now;
+            } else {
+                entry.fireAt = 0;
+                planCron(entry, wall, now);
+            }
+            update(i);
+        }
+    }
+
+    // The next fire of a cron entry once the clock is set, and the deadline to
+    // look at it again
+    void planCron(Entry& entry, uint32_t wall, unsigned long now) {
+        if (WallClock::isProvisional(wall)) {
+            entry.fireAt = 0;
+            entry.deadline = now + SCHEDULE_CRON_HORIZON_S * 1000UL;
+            return;
+        }
+        if (!entry.fireAt || wall >= entry.fireAt) {
+            entry.fireAt = nextCron(entry, max(wall, entry.fireAt));
+        }
+        const uint32_t wait = entry.fireAt ? min(entry.fireAt - wall, static_cast<uint32_t>(SCHEDULE_CRON_HORIZON_S))
+                                           : SCHEDULE_CRON_HORIZON_S;
+        entry.deadline = now + wait * 1000UL;
+    }
+
+    // Local minute as a number that orders like the time:
+    // ((year * 12 + month) * 31 + day - 1) * 1440 + minute of the day
+    static int32_t minuteKey(int year, int month, int day, int minute) {
+        return ((year * 12 + month) * 31 + day - 1) * 1440 + minute;
+    }
+
+    static int32_t minuteKey(uint32_t wall) {
+        const time_t t = wall;
+        struct tm local;
+        localtime_r(&t, &local);
+        return minuteKey(local.tm_year, local.tm_mon, local.tm_mday, local.tm_hour * 60 + local.tm_min);
+    }
+
+    // Days since 1970-01-01 of a proleptic Gregorian date, month 0-11
+    static int32_t daysFromCivil(int year, int month, int day) {
+        year -= month < 2;
+        const int era = (year >= 0 ? year : year - 399) / 400;
+        const int yearOfEra = year - era * 400;
+        const int dayOfYear = (153 * ((month + 10) % 12) + 2) / 5 + day - 1;
+        const int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + dayOfEra - 719468;
+    }
+
+    static void civilFromDays(int32_t days, int& year, int& month, int& day) {
+        days += 719468;
+        const int era = (days >= 0 ? days : days - 146096) / 146097;
+        const int dayOfEra = days - era * 146097;
+        const int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        const int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        const int shifted = (5 * dayOfYear + 2) / 153;
+        day = dayOfYear - (153 * shifted + 2) / 5 + 1;
+        month = (shifted + 2) % 12;
+        year = yearOfEra + era * 400 + (month < 2);
+    }
+
+    // The earliest instant after after at which the local clock shows the
+    // given minute: of the standard and daylight readings the earliest that
+    // really occurs, the later one in a spring-forward gap. 0 if none.
+    static uint32_t toWall(int year, int month, int day, int minute, uint32_t after) {
+        uint32_t best = 0;
+        uint32_t gap = 0;
+        for (int dst = 0; dst <= 1; dst++) {
+            struct tm local = {};
+            local.tm_year = year - 1900;
+            local.tm_mon = month;
+            local.tm_mday = day;
+            local.tm_hour = minute / 60;
+            local.tm_min = minute % 60;
+            local.tm_isdst = dst;
+            const time_t t = mktime(&local);
+            if (t == static_cast<time_t>(-1) || t <= static_cast<time_t>(after)) {
+                continue;
+            }
+            if (local.tm_hour * 60 + local.tm_min == minute && local.tm_mday == day) {
+                if (!best || static_cast<uint32_t>(t) < best) {
+                    best = t;
+                }
+            } else if (static_cast<uint32_t>(t) > gap) {
+                gap = t;
+            }
+        }
+        return best ? best : gap;
+    }
+
+    static bool cronDay(const ScheduleRule& rule, int month, int day, int weekday) {
+        if (!(rule.months & (1u << (month + 1)))) {
+            return false;
+        }
+        const bool dayOk = rule.days & (1u << day);
+        const bool weekdayOk = rule.weekdays & (1u << weekday);
+        if (rule.anyDay || rule.anyWeekday) {
+            return dayOk && weekdayOk;
+        }
+        return dayOk || weekdayOk;
+    }
+
+    // The next cron time after after, and after the minute that last fired
+    static uint32_t nextCron(const Entry& entry, uint32_t after) {
+        const ScheduleRule& rule = entry.rule;
+        int32_t from = max(minuteKey(after), entry.lastKey);
+        const int fromMinute = from % 1440;
+        from /= 1440;
+        const int fromDay = from % 31 + 1;
+        from /= 31;
+        const int32_t firstDay = daysFromCivil(from / 12 + 1900, from % 12, fromDay);
+        for (int32_t d = 0; d < SCHEDULE_SEARCH_DAYS; d++) {
+            int year, month, day;
+            civilFromDays(firstDay + d, year, month, day);
+            const int weekday = ((firstDay + d) % 7 + 11) % 7; // 1970-01-01 was a Thursday
+            if (!cronDay(rule, month, day, weekday)) {
+                continue;
+            }
+            for (int minute = d == 0 ? fromMinute + 1 : 0; minute < 1440; minute++) {
+                if (!(rule.hours & (1u << (minute / 60)))) {
+                    minute += 59 - minute % 60;
+                    continue;
+                }
+                if (!(rule.minutes & (1ULL << (minute % 60)))) {
+                    continue;
+                }
+                const uint32_t wall = toWall(year, month, day, minute, after);
+                if (wall) {
+                    return wall;
+                }
+            }
+        }
+        return 0;
+    }
+
+    void publish(uint32_t wall, unsigned long now) {
+        ScheduleSnapshot snapshot = {};
+        snapshot.count = entryCount;
+        for (size_t i = 0; i < entryCount; i++) {
+            const Entry& entry = entries[i];
+            ScheduleEntryState& state = snapshot.entries[i];
+            state.kind = entry.rule.kind;
+            state.armed = entry.rule.kind == SCHEDULE_DRY && !entry.cooling;
+            state.plants = entry.plants;
+            state.duration = entry.duration;
+            if (entry.rule.kind == SCHEDULE_CRON) {
+                state.next = entry.fireAt;
+            } else if (entry.position != NOT_QUEUED) {
+                const long remaining = static_cast<long>(entry.deadline - now);
+                state.next = wall + (remaining > 0 ? (remaining + 999) / 1000 : 0);
+            }
+            state.last = entry.last;
+            state.fires = entry.fires;
+            state.skipped = entry.skipped;
+        }
+        published.publish(snapshot);
+    }
+
+    // Parsing; each returns nullptr or what is wrong
+    static const char* parseEntry(char* text, size_t plants, ScheduleRule& rule) {
+        rule = ScheduleRule();
+        char* save;
+        const char* word = strtok_r(text, " \t\r", &save);
+        if (!word) {
+            return "";
+        }
+        if (!strcmp(word, "cron")) {
+            rule.kind = SCHEDULE_CRON;
+            char* fields[5];
+            for (size_t f = 0; f < 5; f++) {
+                fields[f] = strtok_r(nullptr, " \t\r", &save);
+                if (!fields[f]) {
+                    return "cron needs minute, hour, day, month and weekday";
+                }
+            }
+            rule.anyDay = fields[2][0] == '*';
+            rule.anyWeekday = fields[4][0] == '*';
+            uint64_t bits[5];
+            const int low[] = {0, 0, 1, 1, 0};
+            const int high[] = {59, 23, 31, 12, 7};
+            for (size_t f = 0; f < 5; f++) {
+                if (!parseCronField(fields[f], low[f], high[f], bits[f])) {
+                    return "bad cron field";
+                }
+            }
+            rule.minutes = bits[0];
+            rule.hours = bits[1];
+            rule.days = bits[2];
+            rule.months = bits[3];
+            rule.weekdays = (bits[4] | bits[4] >> 7) & 0x7F; // 7 is Sunday too
+        } else if (!strcmp(word, "every")) {
+            rule.kind = SCHEDULE_EVERY;
+            if (!parseSeconds(strtok_r(nullptr, " \t\r", &save), SCHEDULE_MAX_INTERVAL, rule.period)) {
+                return "every needs an interval";
+            }
+        } else if (!strcmp(word, "dry")) {
+            rule.kind = SCHEDULE_DRY;
+            int32_t plant;
+            const char* below;
+            if (!parseNumber(strtok_r(nullptr, " \t\r", &save), 0, plants - 1, plant)
+                || !(below = strtok_r(nullptr, " \t\r", &save)) || strcmp(below, "below")
+                || !parseNumber(strtok_r(nullptr, " \t\r", &save), 1, 1000, rule.level)) {
+                return "dry needs PLANT below LEVEL";
+            }
+            rule.plant = plant;
+        } else if (!strcmp(word, "quiet")) {
+            rule.kind = SCHEDULE_QUIET;
+            const char* window = strtok_r(nullptr, " \t\r", &save);
+            int h1, m1, h2, m2;
+            char end;
+            if (!window || sscanf(window, "%d:%d-%d:%d%c", &h1, &m1, &h2, &m2, &end) != 4 || h1 < 0 || h1 > 23
+                || m1 < 0 || m1 > 59 || h2 < 0 || h2 > 23 || m2 < 0 || m2 > 59 || h1 * 60 + m1 == h2 * 60 + m2) {
+                return "quiet needs HH:MM-HH:MM";
+            }
+            rule.quietStart = h1 * 60 + m1;
+            rule.quietEnd = h2 * 60 + m2;
+            return strtok_r(nullptr, " \t\r", &save) ? "quiet takes no options" : nullptr;
+        } else {
+            return "unknown kind, expected cron, every, dry or quiet";
+        }
+
+        while ((word = strtok_r(nullptr, " \t\r", &save))) {
+            char* value = strtok_r(nullptr, " \t\r", &save);
+            if (!strcmp(word, "for")) {
+                if (!parseSeconds(value, SCHEDULE_MAX_DURATION, rule.duration)) {
+                    return "bad duration after for";
+                }
+            } else if (!strcmp(word, "cooldown") && rule.kind == SCHEDULE_DRY) {
+                if (!parseSeconds(value, SCHEDULE_MAX_INTERVAL, rule.period)) {
+                    return "bad cooldown";
+                }
+            } else if (!strcmp(word, "plants")) {
+                if (!parsePlants(value, plants, rule.plants)) {
+                    return "bad plants";
+                }
+            } else {
+                return "unknown option";
+            }
+        }
+        return nullptr;
+    }
+
+    static bool parseNumber(const char* text, long low, long high, int32_t& value) {
+        if (!text || !*text) {
+            return false;
+        }
+        char* end;
+        const long parsed = strtol(text, &end, 10);
+        if (*end || parsed < low || parsed > high) {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+
+    // Seconds, or a number with s, m, h or d; 1 .. most
+    static bool parseSeconds(const char* text, uint32_t most, uint32_t& seconds) {
+        if (!text || !*text) {
+            return false;
+        }
+        char* end;
+        const long parsed = strtol(text, &end, 10);
+        long unit = 1;
+        if (*end) {
+            switch (*end) {
+                case 's': unit = 1; break;
+                case 'm': unit = 60; break;
+                case 'h': unit = 60 * 60; break;
+                case 'd': unit = 24 * 60 * 60; break;
+                default: return false;
+            }
+            if (end[1]) {
+                return false;
+            }
+        }
+        if (end == text || parsed < 1 || parsed > static_cast<long>(most / unit)) {
+            return false;
+        }
+        seconds = parsed * unit;
+        return true;
+    }
+
+    static bool parsePlants(char* text, size_t plants, uint32_t& mask) {
+        if (!text) {
+            return false;
+        }
+        mask = 0;
+        char* save;
+        for (char* item = strtok_r(text, ",", &save); item; item = strtok_r(nullptr, ",", &save)) {
+            int32_t plant;
+            if (!parseNumber(item, 0, plants - 1, plant)) {
+                return false;
+            }
+            mask |= 1u << plant;
+        }
+        return mask != 0;
+    }
+
+    // One cron field: *, N, N-M, each optionally /STEP, separated by commas
+    static bool parseCronField(char* text, int low, int high, uint64_t& bits) {
+        bits = 0;
+        char* save;
+        for (char* item = strtok_r(text, ",", &save); item; item = strtok_r(nullptr, ",", &save)) {
+            int32_t from = low, to = high, step = 1;
+            char* slash = strchr(item, '/');
+            if (slash) {
+                *slash = '\0';
+                if (!parseNumber(slash + 1, 1, high - low + 1, step)) {
+                    return false;
+                }
+            }
+            if (strcmp(item, "*")) {
+                char* dash = strchr(item, '-');
+                if (dash) {
+                    *dash = '\0';
+                }
+                if (!parseNumber(item, low, high, from)) {
+                    return false;
+                }
+                to = from;
+                if (dash && !parseNumber(dash + 1, from, high, to)) {
+                    return false;
+                }
+                if (slash && !dash) {
+                    to = high; // N/STEP runs from N to the end, as in Vixie cron
+                }
+            }
+            for (int32_t value = from; value <= to; value += step) {
+                bits |= 1ULL << value;
+            }
+        }
+        return bits != 0;
+    }
+};
+
+#endif // WATERINGSCHEDULE_H
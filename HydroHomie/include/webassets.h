@@ -0,0 +1,42 @@
+#ifndef WEBASSETS_H
+#define WEBASSETS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// One file of the Fountain build, packed into flash by scripts/pack_fountain.py
+struct WebAsset {
+    const char* path;
+    const char* contentType;
+    const char* etag;
+    const uint8_t* data;  // Const, so it stays in memory-mapped flash and is sent from there
+    size_t size;
+    bool gzip;            // data is gzip-compressed
+    bool immutable;       // Content-hashed name, cacheable forever
+};
+
+#ifdef WEB_ASSETS_PACKED
+#include "webassets_data.h"
+#else
+// Built without the dashboard
+static const WebAsset* const WEB_ASSETS = nullptr;
+#define WEB_ASSET_COUNT 0
+#endif
+
+// The asset for a request URI, query string ignored; "/" is index.html
+inline const WebAsset* findWebAsset(const char* uri) {
+    size_t length = strcspn(uri, "?");
+    if (length == 1 && uri[0] == '/') {
+        uri = "/index.html";
+        length = strlen(uri);
+    }
+    for (size_t i = 0; i < WEB_ASSET_COUNT; i++) {
+        if (strncmp(WEB_ASSETS[i].path, uri, length) == 0 && WEB_ASSETS[i].path[length] == '\0') {
+            return &WEB_ASSETS[i];
+        }
+    }
+    return nullptr;
+}
+
+#endif // WEBASSETS_H
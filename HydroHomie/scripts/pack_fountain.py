@@ -0,0 +1,96 @@
+# Packs the Fountain build (Fountain/dist, from `npm run build:device`) into the
+# firmware: every file gzip-compressed into a const array in flash, plus a table
+# of path, type, ETag and cache policy that include/webassets.h serves from.
+#
+# Runs before every esp32dev build (extra_scripts in platformio.ini). Without a
+# dist directory the firmware is built without the dashboard. Standalone:
+#   python scripts/pack_fountain.py ../Fountain/dist out_dir
+import gzip
+import hashlib
+import mimetypes
+import os
+import re
+import sys
+
+HEADER = "webassets_data.h"
+
+# Vite puts content-hashed files in assets/, e.g. assets/index-BRvCz3X1.js;
+# those never change and are cached for good, the rest is revalidated
+HASHED = re.compile(r"^assets/.+-[A-Za-z0-9_-]{8,}\.[a-z0-9]+$")
+
+TYPES = {
+    ".html": "text/html",
+    ".js": "text/javascript",
+    ".css": "text/css",
+    ".svg": "image/svg+xml",
+    ".json": "application/json",
+    ".ico": "image/x-icon",
+    ".woff2": "font/woff2",
+}
+
+
+def content_type(path):
+    extension = os.path.splitext(path)[1].lower()
+    return TYPES.get(extension) or mimetypes.guess_type(path)[0] or "application/octet-stream"
+
+
+def pack(dist, out_dir):
+    files = []
+    for root, _, names in os.walk(dist):
+        for name in names:
+            files.append(os.path.relpath(os.path.join(root, name), dist).replace(os.sep, "/"))
+    files.sort()
+
+    arrays = []
+    entries = []
+    raw_total = packed_total = 0
+    for index, path in enumerate(files):
+        with open(os.path.join(dist, path), "rb") as f:
+            raw = f.read()
+        # mtime=0 keeps the image reproducible; already compressed files stay as they are
+        compressed = gzip.compress(raw, compresslevel=9, mtime=0)
+        use_gzip = len(compressed) < len(raw) * 0.9
+        data = compressed if use_gzip else raw
+        raw_total += len(raw)
+        packed_total += len(data)
+
+        body = ",".join("0x%02x" % b for b in data)
+        lines = [body[i:i + 120] for i in range(0, len(body), 120)]
+        arrays.append("static const uint8_t WEB_ASSET_%d[] = {\n    %s\n};\n" % (index, "\n    ".join(lines)))
+        etag = '\\"%s\\"' % hashlib.sha1(raw).hexdigest()[:16]
+        entries.append('    {"/%s", "%s", "%s", WEB_ASSET_%d, %d, %s, %s},'
+                       % (path, content_type(path), etag, index, len(data),
+                          "true" if use_gzip else "false", "true" if HASHED.match(path) else "false"))
+
+    text = ("// Generated by scripts/pack_fountain.py from the Fountain build, do not edit\n"
+            "#ifndef WEBASSETS_DATA_H\n#define WEBASSETS_DATA_H\n\n"
+            + "\n".join(arrays)
+            + "\nstatic const WebAsset WEB_ASSETS[] = {\n" + "\n".join(entries) + "\n};\n\n"
+            + "#define WEB_ASSET_COUNT %d\n\n#endif // WEBASSETS_DATA_H\n" % len(files))
+
+    os.makedirs(out_dir, exist_ok=True)
+    header = os.path.join(out_dir, HEADER)
+    # Only rewrite on changes, so unchanged builds don't recompile the server
+    if not os.path.exists(header) or open(header).read() != text:
+        with open(header, "w") as f:
+            f.write(text)
+    print("Fountain: %d files, %d bytes packed from %d" % (len(files), packed_total, raw_total))
+
+
+def fountain_dist(project_dir):
+    return os.environ.get("FOUNTAIN_DIST") or os.path.join(project_dir, "..", "Fountain", "dist")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("usage: pack_fountain.py DIST OUT_DIR")
+    pack(sys.argv[1], sys.argv[2])
+else:
+    Import("env")  # noqa: F821, provided by PlatformIO
+    dist = fountain_dist(env.subst("$PROJECT_DIR"))  # noqa: F821
+    if os.path.isfile(os.path.join(dist, "index.html")):
+        out_dir = os.path.join(env.subst("$BUILD_DIR"), "webassets")  # noqa: F821
+        pack(dist, out_dir)
+        env.Append(CPPPATH=[out_dir], CPPDEFINES=["WEB_ASSETS_PACKED"])  # noqa: F821
+    else:
+        print("Fountain: no build in %s, the firmware won't serve the dashboard" % os.path.normpath(dist))
@@ -0,0 +1,66 @@
+#include <Arduino.h>
+#include <atomic>
+#include "heapstats.h"
+
+#ifdef HEAP_STATS
+// Built with -Wl,--wrap=malloc etc., so every call to malloc() lands in
+// __wrap_malloc() and the real allocator is __real_malloc()
+static std::atomic<uint32_t> allocations{0};
+static TaskHandle_t volatile measuredTask = nullptr;
+
+static inline void countAllocation() {
+    if (measuredTask && xTaskGetCurrentTaskHandle() == measuredTask) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    countAllocation();
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    countAllocation();
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+    countAllocation();
+    return __real_realloc(pointer, size);
+}
+}
+
+HeapAllocationCounter::HeapAllocationCounter() {
+    measuredTask = xTaskGetCurrentTaskHandle();
+    start = allocations.load();
+}
+
+HeapAllocationCounter::~HeapAllocationCounter() {
+    measuredTask = nullptr;
+}
+
+uint32_t HeapAllocationCounter::count() const {
+    return allocations.load() - start;
+}
+
+bool heapStatsEnabled() {
+    return true;
+}
+#else
+HeapAllocationCounter::HeapAllocationCounter() : start(0) {}
+
+HeapAllocationCounter::~HeapAllocationCounter() {}
+
+uint32_t HeapAllocationCounter::count() const {
+    return 0;
+}
+
+bool heapStatsEnabled() {
+    return false;
+}
+#endif
@@ -1,8 +1,6 @@
 #include <Arduino.h>
 #include <WiFi.h>
-#include <WiFiManager.h> // https://github.com/tzapu/WiFiManager
 #include <PsychicHttp.h>
-#include <time.h>
 #include <ArduinoOTA.h>
 #include <CircularBuffer.hpp>
 
@@ -10,35 +8,62 @@
 #include "homieserver.h"
 #include "sensormanager.h"
 #include "HomieManager.h"
+#include "historylog.h"
+#include "adcsampler.h"
+#include "powersave.h"
+#include "pumpinterlock.h"
+#include "samplingtask.h"
+#include "telemetrypublisher.h"
+#include "connectivity.h"
+#include "bootmetrics.h"
 #include "secrets.h"
 
-#define RESISTIVE_SENSOR_PIN 21  // GPIO pin connected to the resistive water sensor
-#define CAPACITIVE_SENSOR_PIN 35 // GPIO pin connected to the capacitive water sensor
-#define CAPACITIVE_SENSOR1_PIN 34 // GPIO pin connected to the capacitive water sensor
-#define CAPACITIVE_OUTPUT_PIN 19 // GPIO pin connected to the capacitive water sensor output
-#define RESISTIVE_OUTPUT_PIN 22  // GPIO pin connected to the resistive water sensor output
-
-#define PUMP_RELAY_PIN 23        // GPIO pin connected to the relay controlling the pump
+// Sensor, power and pump pins are in the channel table in board.h
 
 PsychicHttpServer server; // HTTP server on port 80
 HomieConfig config;
-WiFiManager wifiManager;
-SensorManager sensorManager(RESISTIVE_SENSOR_PIN, RESISTIVE_OUTPUT_PIN, 
-CAPACITIVE_SENSOR_PIN, CAPACITIVE_OUTPUT_PIN,
-CAPACITIVE_SENSOR1_PIN, CAPACITIVE_OUTPUT_PIN, true);
-HomieManager homieManager(sensorManager, config, PUMP_RELAY_PIN);
+Connectivity connectivity; // Wi-Fi, NTP and the servers come up in the background
+BootMetrics bootMetrics;
+SensorManager sensorManager(true);
+HomieManager homieManager(sensorManager, config);
+PartitionFlash historyFlash;
+PlantHistoryLogs<SensorManager::PLANTS> historyLogs(historyFlash, config); // One per plant, each on its share of the partition
+ContinuousAdcSampler adcSampler(SensorManager::sensorPins(), SensorManager::CHANNELS);
 HomieServer homieServer(&server, &config, &homieManager);
+LatencyHistogram loopLatency; // Iteration times of loop(), served on /metrics
+PowerSave powerSave;
+PumpInterlock pumpInterlock; // Drops the pump relays on its own task, whatever loop() is doing
+SamplingTask samplingTask(sensorManager); // Polls the sensors on a fixed grid, pinned to the app core
+TelemetryQueue telemetryQueue;
+TelemetryPublisher telemetry; // Pushes samples and events to a collector or broker, if configured
+uint32_t appliedConfigVersion = 0;
+RTC_NOINIT_ATTR HistoryLog::PendingPage retainedHistory[SensorManager::PLANTS]; // Unflushed samples, kept over resets
+
+// power_save: loop() sleeps between deadlines and the probes are only powered while sampling
+void applyPowerSave() {
+  bool enabled = config.getPowerSave();
+  powerSave.setEnabled(enabled);
+  sensorManager.setKeepSensorsPowered(!enabled);
+}
+
+String getAPName();
+
+// telemetry_*: where the publisher sends to; the device id is the AP name
+void applyTelemetry() {
+  TelemetrySettings settings;
+  settings.mode = config.getTelemetryMode();
+  strncpy(settings.host, config.getTelemetryHost().c_str(), TELEMETRY_HOST_LENGTH);
+  settings.port = config.getTelemetryPort();
+  settings.flushIntervalMs = static_cast<uint32_t>(config.getTelemetryFlushInterval()) * 1000;
+  settings.batch = config.getTelemetryBatch();
+  strncpy(settings.deviceId, getAPName().c_str(), TELEMETRY_ID_LENGTH);
+  telemetry.configure(settings);
+}
 
-void initializeTime() {
-    configTime(0, 0, "pool.ntp.org", "time.nist.gov");
-    // If you need to set a timezone, you can do it with configTime
-    // Example for GMT+1: configTime(3600, 3600, "pool.ntp.org");
-    Serial.println("Waiting for time");
-    while (!time(nullptr)) {
-        Serial.print(".");
-        delay(1000);
-    }
-    Serial.println("Time synchronized");
+void applyConfig() {
+  applyPowerSave();
+  applyTelemetry();
+  appliedConfigVersion = config.getVersion();
 }
 
 String getAPName(){
@@ -56,49 +81,90 @@ void setup() {
   config.begin();
   config.end();
 
+  // Restore the history saved before the last reboot/OTA
+  historyLogs.retainPending(retainedHistory);
+  if (historyFlash.begin() && historyLogs.begin()) {
+    sensorManager.attachHistoryLogs(historyLogs);
+  }
 
-  wifiManager.setWiFiAutoReconnect(true);
-  wifiManager.setConnectTimeout(60);
-  wifiManager.setConnectRetries(5);
-  wifiManager.setConfigPortalTimeout(180);
-  wifiManager.autoConnect(getAPName().c_str());
-  Serial.println("connected...let's hydrate!");
-  initializeTime();
-  server.listen(80); // Start the HTTP server on port 80
-  server.on("/",  HTTP_GET, [](PsychicRequest *request) {
-    return request->reply(200, "text/plain", "Hello, world");
-  });
-
-  // construct homieserver
-  homieServer.begin();
-
-
-  // // Example of adding CORS headers
-  // DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
-  // DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
-  // DefaultHeaders::Instance().addHeader("Access-Control-Allow-Headers", "Content-Type");
-  // // ESPAsyncElegantOTA
-  // ElegantOTA.begin(&server); // Start ElegantOTA
-  Serial.println("HTTP server started");  
+  // Sample all sensors by DMA; analogRead() stays in use if the driver won't start
+  adcSampler.setFilter(config.getAdcMedianWindow(), config.getAdcIirShift());
+  if (adcSampler.begin()) {
+    sensorManager.attachSampler(&adcSampler);
+  } else {
+    Serial.println("Continuous ADC unavailable, using analogRead");
+  }
 
-  // Initialize OTA
-  ArduinoOTA.setPassword(otapwd);
-  ArduinoOTA.begin();
+  // Pumps only run through the interlock, started before anything waits on the network
+  if (pumpInterlock.begin(sensorManager)) {
+    homieManager.attachInterlock(&pumpInterlock);
+    homieServer.setInterlock(&pumpInterlock);
+  } else {
+    Serial.println("Pump interlock unavailable");
+  }
 
-  
+  // Forced waterings and config updates from the HTTP server end a power-save wait,
+  // and so does every poll, for loop() to take the reads in
+  powerSave.begin();
+  homieManager.onCommand([]() { powerSave.wake(); });
+  samplingTask.onPoll([]() { powerSave.wake(); });
+  if (samplingTask.begin()) {
+    homieManager.attachSampling(&samplingTask);
+    homieServer.setSampling(&samplingTask);
+  } else {
+    Serial.println("Sampling task unavailable, sampling from loop()");
+  }
+  homieManager.attachTelemetry(&telemetryQueue);
+  telemetry.begin(telemetryQueue);
+  applyConfig();
+
+  homieServer.setLoopLatency(&loopLatency);
+  homieServer.setPowerSave(&powerSave);
+  homieServer.setTelemetry(&telemetry);
+  homieServer.setBootMetrics(&bootMetrics);
+
+  // Sampling and watering run from the first loop(); the servers start with
+  // the first address, once the Wi-Fi portal, if any, has closed
+  connectivity.onReady([]() {
+    server.listen(80); // Start the HTTP server on port 80; HomieServer serves "/" and Fountain
+    homieServer.begin();
+    bootMetrics.mark(BOOT_HTTP_LISTENING);
+    Serial.println("HTTP server started");
+
+    // // Example of adding CORS headers
+    // DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
+    // DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+    // DefaultHeaders::Instance().addHeader("Access-Control-Allow-Headers", "Content-Type");
+    // // ESPAsyncElegantOTA
+    // ElegantOTA.begin(&server); // Start ElegantOTA
+
+    // Initialize OTA
+    ArduinoOTA.setPassword(otapwd);
+    ArduinoOTA.onStart([]() {
+      historyLogs.flush(); // Don't lose the unwritten samples to the OTA reboot
+    });
+    ArduinoOTA.begin();
+  });
+  // Wi-Fi and NTP events end a power-save wait, so loop() acts on them at once
+  connectivity.onChange([]() { powerSave.wake(); });
+  connectivity.begin(getAPName().c_str(), &bootMetrics);
 }
 
 void loop() {
-  if (WiFi.status() != WL_CONNECTED) {
-     if (wifiManager.getWiFiIsSaved()) 
-      wifiManager.setEnableConfigPortal(false);
-    wifiManager.setConnectTimeout(10);
-    wifiManager.setConnectRetries(1);
-    wifiManager.autoConnect(getAPName().c_str());
-    if (WiFi.status() == WL_CONNECTED){
-      initializeTime();
-    }
+  uint32_t loopStart = micros();
+  connectivity.handle();
+  if (connectivity.isReady()) {
+    ArduinoOTA.handle();  // Listen for OTA events
   }
-  ArduinoOTA.handle();  // Listen for OTA events
   homieManager.handle();
+  if (homieManager.getPollCount() > 0) {
+    bootMetrics.mark(BOOT_FIRST_SAMPLE);
+  }
+  historyLogs.handle();
+  homieServer.handle();
+  if (config.getVersion() != appliedConfigVersion) {
+    applyConfig();
+  }
+  loopLatency.record(micros() - loopStart);
+  powerSave.idle(min(homieManager.timeUntilNext(), connectivity.timeUntilNext()));
 }
\ No newline at end of file
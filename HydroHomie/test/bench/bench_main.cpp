@@ -0,0 +1,343 @@
+// Host benchmarks of the sampling and serialization hot paths, built by the
+// native environment: pio run -e native && .pio/build/native/program
+#include <Arduino.h>
+#include <CircularBuffer.hpp>
+#include <tuple>
+#include <vector>
+#include "benchmark.h"
+#include "HomieManager.h"
+#include "historystream.h"
+#include "metrics.h"
+#include "responsecache.h"
+#include "statusjson.h"
+
+#define TANK_PIN Board::tank.sensorPin
+#define PLANT_PIN Board::plants[0].sensor.sensorPin
+
+// Counts what would go out on the socket and drops it
+class NullPrint : public Print {
+public:
+    size_t bytes = 0;
+
+    size_t write(uint8_t c) override {
+        (void)c;
+        bytes++;
+        return 1;
+    }
+
+    size_t write(const uint8_t* data, size_t length) override {
+        (void)data;
+        bytes += length;
+        return length;
+    }
+};
+
+static HomieConfig& benchConfig() {
+    static HomieConfig config;
+    static bool started = false;
+    if (!started) {
+        config.begin();
+        started = true;
+    }
+    return config;
+}
+
+static SensorManager& benchSensors() {
+    static SensorManager sensors(true);
+    return sensors;
+}
+
+// One-minute samples of a plant drying over two days, with a count of jitter now and then
+static void dryingSample(uint32_t minute, int& tank, int& plant) {
+    tank = 800 - static_cast<int>(minute / 2880) * 3 - ((minute * 3) % 11 == 0);
+    plant = 700 - static_cast<int>(minute % 2880 * 350 / 2880) + ((minute * 7) % 5 == 0);
+}
+
+// A history with every block used
+static const SensorHistory& fullHistory() {
+    static SensorHistory history;
+    for (uint32_t minute = 0; history.firstSeq() == 0; minute++) {
+        int tank, plant;
+        dryingSample(minute, tank, plant);
+        history.push(tank, plant, 0, 1700000000 + minute * 60);
+    }
+    return history;
+}
+
+typedef CircularBuffer<std::tuple<int, int, int>, 1000> LegacyHistory;
+
+static void BM_HistoryPush(bench::State& state) {
+    static SensorHistory history;
+    uint32_t minute = 0;
+    for (auto _ : state) {
+        int tank, plant;
+        dryingSample(minute, tank, plant);
+        history.push(tank, plant, 0, 1700000000 + minute * 60);
+        minute++;
+    }
+    bench::DoNotOptimize(history.last());
+}
+BENCHMARK(BM_HistoryPush);
+
+// The tuple CircularBuffer the history store replaced
+static void BM_LegacyHistoryPush(bench::State& state) {
+    static LegacyHistory history;
+    uint32_t minute = 0;
+    for (auto _ : state) {
+        int tank, plant;
+        dryingSample(minute, tank, plant);
+        history.push(std::make_tuple(plant, tank, 0));
+        minute++;
+    }
+    bench::DoNotOptimize(history.size());
+}
+BENCHMARK(BM_LegacyHistoryPush);
+
+// Walking the whole store in place, per sample
+static void BM_HistoryIterate(bench::State& state) {
+    const SensorHistory& history = fullHistory();
+    int sum = 0;
+    size_t samples = 0;
+    for (auto _ : state) {
+        for (SensorHistory::const_iterator it = history.begin(); it != history.end(); ++it) {
+            sum += (*it).plant;
+        }
+        samples += history.size();
+    }
+    bench::DoNotOptimize(sum);
+    state.setBytesProcessed(samples * sizeof(HistoryEntry));
+}
+BENCHMARK(BM_HistoryIterate);
+
+// What the old getHistory() did for every reader: copy the buffer into a vector
+static void BM_LegacyHistoryCopy(bench::State& state) {
+    static LegacyHistory history;
+    for (uint32_t minute = 0; history.size() < 1000; minute++) {
+        int tank, plant;
+        dryingSample(minute, tank, plant);
+        history.push(std::make_tuple(plant, tank, 0));
+    }
+    int sum = 0;
+    size_t samples = 0;
+    for (auto _ : state) {
+        std::vector<std::tuple<int, int, int>> copy(history.size());
+        history.copyToArray(copy.data());
+        for (const std::tuple<int, int, int>& sample : copy) {
+            sum += std::get<0>(sample);
+        }
+        samples += copy.size();
+    }
+    bench::DoNotOptimize(sum);
+    state.setBytesProcessed(samples * sizeof(std::tuple<int, int, int>));
+}
+BENCHMARK(BM_LegacyHistoryCopy);
+
+static void BM_ReadSensors(bench::State& state) {
+    SensorManager& sensors = benchSensors();
+    int raw = 1400;
+    for (auto _ : state) {
+        native::device->analogValues[TANK_PIN] = raw;
+        native::device->analogValues[PLANT_PIN] = 3400 - raw;
+        raw = raw < 2000 ? raw + 1 : 1400;
+        sensors.readSensors();
+    }
+    bench::DoNotOptimize(sensors.getSnapshot());
+}
+BENCHMARK(BM_ReadSensors);
+
+// The last read of a poll: average, history push and rollup
+static void BM_ReadSensorsAveraged(bench::State& state) {
+    SensorManager& sensors = benchSensors();
+    int raw = 1400;
+    for (auto _ : state) {
+        native::device->analogValues[TANK_PIN] = raw;
+        native::device->analogValues[PLANT_PIN] = 3400 - raw;
+        raw = raw < 2000 ? raw + 7 : 1400;
+        sensors.readSensors(true, true);
+    }
+    bench::DoNotOptimize(sensors.getSnapshot());
+}
+BENCHMARK(BM_ReadSensorsAveraged);
+
+static void BM_AverageLevels(bench::State& state) {
+    SensorManager& sensors = benchSensors();
+    int levels[SensorManager::CHANNELS];
+    for (auto _ : state) {
+        bench::ClobberMemory();
+        sensors.averageLevels(levels);
+        bench::DoNotOptimize(levels);
+    }
+}
+BENCHMARK(BM_AverageLevels);
+
+// The copy every history reader makes out of the seqlocked store
+static void BM_HistoryCopy(bench::State& state) {
+    const SensorHistory& history = fullHistory();
+    uint32_t firstSeq, nextSeq;
+    history.range(firstSeq, nextSeq);
+    HistoryEntry entries[HISTORY_READ_BATCH];
+    size_t copied = 0;
+    for (auto _ : state) {
+        for (uint32_t seq = firstSeq; seq != nextSeq;) {
+            size_t count = history.read(seq, entries, HISTORY_READ_BATCH);
+            if (count == 0) break;
+            seq = entries[count - 1].seq + 1;
+            copied += count;
+        }
+        bench::DoNotOptimize(entries);
+    }
+    state.setBytesProcessed(copied * sizeof(HistoryEntry));
+}
+BENCHMARK(BM_HistoryCopy);
+
+static void BM_HistoryJsonLegacy(bench::State& state) {
+    const SensorHistory& history = fullHistory();
+    NullPrint out;
+    for (auto _ : state) {
+        writeHistoryJson(out, history);
+    }
+    state.setBytesProcessed(out.bytes);
+}
+BENCHMARK(BM_HistoryJsonLegacy);
+
+static void BM_HistoryJsonPage(bench::State& state) {
+    const SensorHistory& history = fullHistory();
+    uint32_t firstSeq, nextSeq;
+    history.range(firstSeq, nextSeq);
+    NullPrint out;
+    for (auto _ : state) {
+        bench::DoNotOptimize(writeHistoryJson(out, history, nextSeq - 100, 100));
+    }
+    state.setBytesProcessed(out.bytes);
+}
+BENCHMARK(BM_HistoryJsonPage);
+
+static void BM_HistoryBinary(bench::State& state) {
+    const SensorHistory& history = fullHistory();
+    uint32_t firstSeq, nextSeq;
+    history.range(firstSeq, nextSeq);
+    NullPrint out;
+    for (auto _ : state) {
+        bench::DoNotOptimize(writeHistoryBinary(out, history, firstSeq, SIZE_MAX));
+    }
+    state.setBytesProcessed(out.bytes);
+}
+BENCHMARK(BM_HistoryBinary);
+
+static void BM_StatusJson(bench::State& state) {
+    SensorSnapshot sensors = {};
+    sensors.tank = 512;
+    sensors.plants[0] = 734;
+    sensors.version = 42;
+    const WateringSnapshot watering = {false, 1700000000, 7};
+    char body[STATUS_CACHE_SIZE];
+    size_t bytes = 0;
+    for (auto _ : state) {
+        DynamicJsonDocument doc(256);
+        fillStatusJson(doc, sensors, watering);
+        bytes += serializeJson(doc, body, sizeof(body));
+    }
+    bench::DoNotOptimize(body);
+    state.setBytesProcessed(bytes);
+}
+BENCHMARK(BM_StatusJson);
+
+// What every poll pays to keep the 1 h/24 h/7 d statistics of one channel
+static void BM_RollingStatsAdd(bench::State& state) {
+    static RollingStats stats;
+    uint32_t timestamp = 1700000000;
+    int level = 0;
+    for (auto _ : state) {
+        stats.add(timestamp, 400 + level);
+        timestamp += 10;
+        level = (level + 7) % 300;
+    }
+    bench::DoNotOptimize(stats.getVersion());
+}
+BENCHMARK(BM_RollingStatsAdd);
+
+// A week of 10 s polls, then the /stats document over it
+static void BM_StatsJson(bench::State& state) {
+    static RollingStats plant, tank;
+    const uint32_t start = 1700000000, end = start + 7*24*60*60;
+    if (plant.getVersion() == 0) {
+        for (uint32_t timestamp = start; timestamp < end; timestamp += 10) {
+            plant.add(timestamp, 700 - (timestamp - start) / 1000);
+            tank.add(timestamp, 900 - (timestamp - start) / 2000);
+        }
+    }
+    char body[STATS_CACHE_SIZE];
+    size_t bytes = 0;
+    for (auto _ : state) {
+        DynamicJsonDocument doc(1536);
+        fillStatsJson(doc, 0, plant, tank, 400, end);
+        bytes += serializeJson(doc, body, sizeof(body));
+    }
+    bench::DoNotOptimize(body);
+    state.setBytesProcessed(bytes);
+}
+BENCHMARK(BM_StatsJson);
+
+static void BM_ConfigJson(bench::State& state) {
+    HomieConfig& config = benchConfig();
+    char body[CONFIG_CACHE_SIZE];
+    size_t bytes = 0;
+    for (auto _ : state) {
+        bytes += config.writeConfigJson(body, sizeof(body));
+    }
+    bench::DoNotOptimize(body);
+    state.setBytesProcessed(bytes);
+}
+BENCHMARK(BM_ConfigJson);
+
+// Parse and validate a partial update that changes nothing, so nothing is stored
+static void BM_ConfigApplyJson(bench::State& state) {
+    HomieConfig& config = benchConfig();
+    char body[CONFIG_CACHE_SIZE];
+    snprintf(body, sizeof(body), "{\"watering_interval\":%d,\"water_tank_threshold\":%d}",
+             config.getWateringInterval(), config.getWaterTankThreshold());
+    const size_t length = strlen(body);
+    char error[64];
+    for (auto _ : state) {
+        bench::DoNotOptimize(config.applyJson(body, length, error, sizeof(error)));
+    }
+}
+BENCHMARK(BM_ConfigApplyJson);
+
+// One loop() turn with the clock moving 1 ms per call, polls and watering included
+static void BM_HomieManagerHandle(bench::State& state) {
+    static HomieManager homieManager(benchSensors(), benchConfig());
+    for (auto _ : state) {
+        native::clock.advanceMillis(1);
+        homieManager.handle();
+    }
+    bench::DoNotOptimize(homieManager.getHandleStats());
+}
+BENCHMARK(BM_HomieManagerHandle);
+
+// What every loop() iteration and request pays for its latency histogram
+static void BM_LatencyRecord(bench::State& state) {
+    static LatencyHistogram histogram;
+    uint32_t micros = 0;
+    for (auto _ : state) {
+        histogram.record(micros);
+        micros = (micros + 997) % 2000000;
+    }
+    bench::DoNotOptimize(histogram.read());
+}
+BENCHMARK(BM_LatencyRecord);
+
+static void BM_MetricsHistogramText(bench::State& state) {
+    LatencyHistogram histogram;
+    for (uint32_t micros = 0; micros < 2000000; micros += 997) {
+        histogram.record(micros);
+    }
+    NullPrint out;
+    for (auto _ : state) {
+        writeHistogram(out, "hydrohomie_http_request_duration_seconds", "route=\"/status\",method=\"GET\"", histogram.read());
+    }
+    state.setBytesProcessed(out.bytes);
+}
+BENCHMARK(BM_MetricsHistogramText);
+
+BENCHMARK_MAIN();
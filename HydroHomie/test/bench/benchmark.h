@@ -0,0 +1,260 @@
+#ifndef BENCH_BENCHMARK_H
+#define BENCH_BENCHMARK_H
+
+// A small stand-in for Google Benchmark, enough for the native benchmarks and
+// with the same shape:
+//
+//   static void BM_Thing(bench::State& state) {
+//       // setup
+//       for (auto _ : state) {
+//           bench::DoNotOptimize(doThing());
+//       }
+//   }
+//   BENCHMARK(BM_Thing);
+//
+// Every benchmark is calibrated until a run takes at least --min_time seconds,
+// then run --benchmark_repetitions times in all and reported by the median run.
+// The results go to stdout and, with --benchmark_out=FILE, to FILE as JSON in
+// the Google Benchmark layout. --baseline=FILE compares against an earlier
+// output and fails when a benchmark got slower by more than --tolerance percent.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+class State {
+public:
+    explicit State(uint64_t iterations) : total(iterations) {}
+
+    // What the range-for hands out; non-trivial so an unused loop variable is not warned about
+    struct Value {
+        ~Value() {}
+    };
+
+    struct Iterator {
+        uint64_t remaining;
+
+        bool operator!=(const Iterator& other) const {
+            (void)other;
+            return remaining != 0;
+        }
+
+        void operator++() {
+            remaining--;
+        }
+
+        Value operator*() const {
+            return Value();
+        }
+    };
+
+    Iterator begin() {
+        start = Clock::now();
+        return Iterator{total};
+    }
+
+    Iterator end() {
+        return Iterator{0};
+    }
+
+    uint64_t iterations() const {
+        return total;
+    }
+
+    // Time since begin(), read once the loop is done
+    double elapsedNs() const {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    }
+
+    void setBytesProcessed(uint64_t bytes) {
+        bytesProcessed = bytes;
+    }
+
+    uint64_t getBytesProcessed() const {
+        return bytesProcessed;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t total;
+    uint64_t bytesProcessed = 0;
+    Clock::time_point start;
+};
+
+// Keeps the compiler from dropping a computation whose result is unused
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void ClobberMemory() {
+    asm volatile("" : : : "memory");
+}
+
+typedef void (*Function)(State&);
+
+struct Registration {
+    const char* name;
+    Function function;
+};
+
+inline std::vector<Registration>& registry() {
+    static std::vector<Registration> benchmarks;
+    return benchmarks;
+}
+
+inline int registerBenchmark(const char* name, Function function) {
+    registry().push_back({name, function});
+    return 0;
+}
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    double nsPerIteration;
+    uint64_t bytesProcessed;
+};
+
+// Reads the ns per iteration of every benchmark from an output written earlier
+inline std::map<std::string, double> readBaseline(const char* path) {
+    std::map<std::string, double> baseline;
+    std::ifstream file(path);
+    std::stringstream content;
+    content << file.rdbuf();
+    const std::string text = content.str();
+    size_t position = 0;
+    while ((position = text.find("\"name\": \"", position)) != std::string::npos) {
+        position += 9;
+        size_t nameEnd = text.find('"', position);
+        size_t time = text.find("\"cpu_time\": ", nameEnd);
+        if (nameEnd == std::string::npos || time == std::string::npos) {
+            break;
+        }
+        baseline[text.substr(position, nameEnd - position)] = atof(text.c_str() + time + 12);
+        position = time;
+    }
+    return baseline;
+}
+
+inline void writeJson(const char* path, const std::vector<Result>& results) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return;
+    }
+    fprintf(file, "{\n  \"context\": {\"library_build_type\": \"release\"},\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"iterations\": %llu, \"real_time\": %.3f, \"cpu_time\": %.3f, "
+                      "\"time_unit\": \"ns\", \"bytes_per_second\": %.0f}%s\n",
+                result.name.c_str(), (unsigned long long)result.iterations, result.nsPerIteration,
+                result.nsPerIteration, result.bytesProcessed * 1e9 / (result.nsPerIteration * result.iterations),
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+inline const char* option(const char* arg, const char* name) {
+    size_t length = strlen(name);
+    return strncmp(arg, name, length) == 0 && arg[length] == '=' ? arg + length + 1 : nullptr;
+}
+
+inline int run(int argc, char** argv) {
+    const char* filter = "";
+    const char* outPath = nullptr;
+    const char* baselinePath = nullptr;
+    double minTime = 0.2;
+    int repetitions = 1;
+    double tolerance = 25.0;
+    for (int i = 1; i < argc; i++) {
+        if (const char* value = option(argv[i], "--benchmark_filter")) filter = value;
+        else if (const char* value = option(argv[i], "--benchmark_min_time")) minTime = atof(value);
+        else if (const char* value = option(argv[i], "--benchmark_repetitions")) repetitions = std::max(atoi(value), 1);
+        else if (const char* value = option(argv[i], "--benchmark_out")) outPath = value;
+        else if (const char* value = option(argv[i], "--baseline")) baselinePath = value;
+        else if (const char* value = option(argv[i], "--tolerance")) tolerance = atof(value);
+        else {
+            fprintf(stderr, "usage: %s [--benchmark_filter=TEXT] [--benchmark_min_time=SECONDS] "
+                            "[--benchmark_repetitions=N] [--benchmark_out=FILE] [--baseline=FILE] "
+                            "[--tolerance=PERCENT]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<Result> results;
+    printf("%-40s %14s %14s\n", "Benchmark", "Time (ns)", "Iterations");
+    for (const Registration& benchmark : registry()) {
+        if (!strstr(benchmark.name, filter)) {
+            continue;
+        }
+        uint64_t iterations = 1;
+        for (;;) {
+            State state(iterations);
+            benchmark.function(state);
+            double elapsed = state.elapsedNs();
+            if (elapsed >= minTime * 1e9 || iterations >= (1ull << 40)) {
+                // The calibrated run is the first repetition; the median shrugs off a noisy neighbour
+                std::vector<double> times(1, elapsed / iterations);
+                while (static_cast<int>(times.size()) < repetitions) {
+                    State repeat(iterations);
+                    benchmark.function(repeat);
+                    times.push_back(repeat.elapsedNs() / iterations);
+                }
+                std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+                results.push_back({benchmark.name, iterations, times[times.size() / 2], state.getBytesProcessed()});
+                break;
+            }
+            // Aim a bit past the minimum time, growing at most 10x per round
+            double scale = elapsed > 0 ? minTime * 1.4e9 / elapsed : 10;
+            iterations = static_cast<uint64_t>(iterations * (scale > 10 ? 10 : scale)) + 1;
+        }
+        printf("%-40s %14.1f %14llu\n", results.back().name.c_str(), results.back().nsPerIteration,
+               (unsigned long long)results.back().iterations);
+    }
+
+    if (outPath) {
+        writeJson(outPath, results);
+    }
+
+    int regressions = 0;
+    if (baselinePath) {
+        std::map<std::string, double> baseline = readBaseline(baselinePath);
+        for (const Result& result : results) {
+            auto previous = baseline.find(result.name);
+            if (previous == baseline.end() || previous->second <= 0) {
+                continue;
+            }
+            double change = (result.nsPerIteration / previous->second - 1) * 100;
+            if (change > tolerance) {
+                printf("REGRESSION %s: %.1f ns -> %.1f ns (+%.0f%%)\n", result.name.c_str(), previous->second,
+                       result.nsPerIteration, change);
+                regressions++;
+            }
+        }
+    }
+    return regressions ? 1 : 0;
+}
+
+} // namespace bench
+
+#define BENCHMARK_CONCAT2(a, b) a##b
+#define BENCHMARK_CONCAT(a, b) BENCHMARK_CONCAT2(a, b)
+#define BENCHMARK(function) \
+    static int BENCHMARK_CONCAT(benchmark_registration_, __LINE__) = bench::registerBenchmark(#function, function)
+
+#define BENCHMARK_MAIN() \
+    int main(int argc, char** argv) { return bench::run(argc, argv); }
+
+#endif // BENCH_BENCHMARK_H
@@ -0,0 +1,186 @@
+// The sample filter kernels on the raw traces of traces.h: the median against
+// a sorted reference for every window, the fixed-point IIR against a
+// floating-point one, and the default chain of both rejecting Wi-Fi spikes,
+// smoothing conversion noise and following a watering step. Then failed
+// reads in SensorManager: the poll still ends with the reads that worked.
+//
+//   filter
+
+#include <Arduino.h>
+#include <testcheck.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "adcsampler.h"
+#include "samplefilter.h"
+#include "sensormanager.h"
+#include "traces.h"
+
+#define TRACE_LENGTH(trace) (sizeof(trace) / sizeof(trace[0]))
+
+static std::vector<int> run(SampleFilter& filter, const int16_t* trace, size_t length) {
+    std::vector<int> out;
+    for (size_t i = 0; i < length; i++) {
+        out.push_back(filter.apply(trace[i]));
+    }
+    return out;
+}
+
+static std::vector<int> runChain(const int16_t* trace, size_t length) {
+    MedianFilter median(ADC_MEDIAN_WINDOW);
+    IirFilter iir(ADC_IIR_SHIFT);
+    FilterChain chain;
+    chain.add(&median);
+    chain.add(&iir);
+    std::vector<int> out;
+    for (size_t i = 0; i < length; i++) {
+        out.push_back(chain.apply(trace[i]));
+    }
+    return out;
+}
+
+static double deviation(const std::vector<int>& values, size_t from, double level) {
+    double sum = 0;
+    for (size_t i = from; i < values.size(); i++) {
+        sum += (values[i] - level) * (values[i] - level);
+    }
+    return std::sqrt(sum / (values.size() - from));
+}
+
+static void testMedian() {
+    bool exact = true;
+    for (size_t window = 1; window <= SAMPLE_FILTER_MEDIAN_MAX; window++) {
+        MedianFilter median(window);
+        const std::vector<int> out = run(median, SPIKE_TRACE, TRACE_LENGTH(SPIKE_TRACE));
+        for (size_t i = 0; i < out.size(); i++) {
+            const size_t count = min(i + 1, window);
+            std::vector<int> last(SPIKE_TRACE + i + 1 - count, SPIKE_TRACE + i + 1);
+            std::sort(last.begin(), last.end());
+            exact = exact && out[i] == last[count / 2];
+        }
+    }
+    check(exact, "median: sorted reference for windows 1..9");
+
+    MedianFilter median(ADC_MEDIAN_WINDOW);
+    const std::vector<int> out = run(median, SPIKE_TRACE, TRACE_LENGTH(SPIKE_TRACE));
+    int worst = 0;
+    for (int value : out) {
+        worst = max(worst, abs(value - SPIKE_TRACE_LEVEL));
+    }
+    check(worst <= 8, "median: single and double spikes never pass");
+
+    MedianFilter clamped(50);
+    check(clamped.getWindow() == SAMPLE_FILTER_MEDIAN_MAX && MedianFilter(0).getWindow() == 1,
+          "median: window clamped to 1..SAMPLE_FILTER_MEDIAN_MAX");
+}
+
+static void testIir() {
+    for (uint8_t shift : {1, 3, 6}) {
+        IirFilter iir(shift);
+        const std::vector<int> out = run(iir, STEP_TRACE, TRACE_LENGTH(STEP_TRACE));
+        double reference = STEP_TRACE[0];
+        int worst = 0;
+        for (size_t i = 0; i < out.size(); i++) {
+            if (i > 0) {
+                reference += (STEP_TRACE[i] - reference) / (1 << shift);
+            }
+            worst = max(worst, static_cast<int>(std::lround(std::fabs(out[i] - reference))));
+        }
+        char what[64];
+        snprintf(what, sizeof(what), "iir: shift %u within a count of floating point", shift);
+        check(worst <= 1, what);
+    }
+    IirFilter pass(0);
+    check(run(pass, NOISE_TRACE, TRACE_LENGTH(NOISE_TRACE))
+              == std::vector<int>(NOISE_TRACE, NOISE_TRACE + TRACE_LENGTH(NOISE_TRACE)),
+          "iir: shift 0 passes samples through");
+    IirFilter primed(ADC_IIR_SHIFT);
+    primed.apply(4000);
+    primed.reset();
+    check(primed.apply(1000) == 1000, "iir: reset() primes on the next sample");
+}
+
+static void testChain() {
+    const std::vector<int> spikes = runChain(SPIKE_TRACE, TRACE_LENGTH(SPIKE_TRACE));
+    int worst = 0;
+    for (int value : spikes) {
+        worst = max(worst, abs(value - SPIKE_TRACE_LEVEL));
+    }
+    printf("spike trace: worst output %d counts off the level\n", worst);
+    check(worst <= 5, "chain: spikes rejected");
+
+    const std::vector<int> noise = runChain(NOISE_TRACE, TRACE_LENGTH(NOISE_TRACE));
+    std::vector<int> raw(NOISE_TRACE, NOISE_TRACE + TRACE_LENGTH(NOISE_TRACE));
+    const double in = deviation(raw, 16, SPIKE_TRACE_LEVEL), out = deviation(noise, 16, SPIKE_TRACE_LEVEL);
+    printf("noise trace: %.2f counts rms in, %.2f out\n", in, out);
+    check(out < in / 2, "chain: conversion noise halved");
+
+    // The watering step: settled within 1% of the drop, and never past the new level
+    const std::vector<int> step = runChain(STEP_TRACE, TRACE_LENGTH(STEP_TRACE));
+    const int band = (STEP_TRACE_BEFORE - STEP_TRACE_AFTER) / 100;
+    size_t settled = 0;
+    int lowest = INT32_MAX;
+    for (size_t i = STEP_TRACE_START; i < step.size(); i++) {
+        if (abs(step[i] - STEP_TRACE_AFTER) > band) {
+            settled = i + 1 - STEP_TRACE_START;
+        }
+        lowest = min(lowest, step[i]);
+    }
+    printf("step trace: settled %zu samples after the drop began\n", settled);
+    check(settled <= 48 && lowest >= STEP_TRACE_AFTER - 10, "chain: follows a watering step");
+}
+
+// Hands out a scripted sequence of reads; a level of -1 fails the read
+class ScriptedSampler : public AdcSampler {
+public:
+    std::vector<int> script;
+    size_t next = 0;
+
+    bool read(int* raw, size_t count) override {
+        const int level = next < script.size() ? script[next++] : -1;
+        if (level < 0) {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            const SensorChannel& sensor = SensorManager::channel(i);
+            raw[i] = sensor.rawEmpty + level * (sensor.rawFull - sensor.rawEmpty) / LEVEL_FULL;
+        }
+        return true;
+    }
+
+    const char* name() const override {
+        return "scripted";
+    }
+};
+
+// Polls of three reads, the last averaging out into the history
+static void poll(SensorManager& sensors) {
+    for (int read = 0; read < 3; read++) {
+        sensors.readSensors(read == 2, read == 2);
+    }
+}
+
+static void testFailedReads() {
+    SensorManager sensors(true);
+    ScriptedSampler sampler;
+    sensors.attachSampler(&sampler);
+    sampler.script = {400, 400, 400, 500, 600, -1, -1, -1, -1};
+    poll(sensors);
+    poll(sensors);
+    const SensorHistory& history = sensors.getHistory();
+    check(history.size() == 2 && abs(history.last().plant - 550) <= 1 && sensors.getReadFailures() == 1,
+          "failed reads: the last read fails, the poll averages the rest");
+    poll(sensors);
+    check(history.size() == 3 && history.last().plant == sensors.getSnapshot().plants[0]
+              && sensors.getReadFailures() == 4,
+          "failed reads: all fail, the poll keeps the last levels");
+    sensors.attachSampler(nullptr);
+}
+
+int main() {
+    testMedian();
+    testIir();
+    testChain();
+    testFailedReads();
+    return testResult();
+}
@@ -0,0 +1,74 @@
+#ifndef FILTER_TRACES_H
+#define FILTER_TRACES_H
+
+#include <stdint.h>
+
+// Raw ADC1 counts of one capacitive probe, one conversion per sample, in the
+// shapes the filter chain has to handle. They are generated, not captured:
+// noise of about 2.5 counts around a settled level, the single and double
+// conversion spikes a Wi-Fi TX burst couples into the sensor line, and the
+// drop of a probe in soil that is being watered. A capture from a board can
+// replace any of them as is.
+
+// Settled at about 1850, with single and double spikes of 500 to 900 counts
+static const int16_t SPIKE_TRACE[] = {
+    1849, 1851, 1849, 1849, 1848, 1849, 1853, 1851, 1853, 1851, 1851, 1850, 1846, 1852, 1851, 1851,
+    1846, 1846, 1848, 1849, 2491, 1850, 1851, 1848, 1851, 1851, 1848, 1854, 1851, 1853, 1848, 1848,
+    1849, 1850, 1852, 1851, 1849, 1848, 1849, 1853, 1848, 1851, 1851, 1846, 1850, 1853, 1845, 939,
+    1850, 1848, 1851, 1850, 1846, 1852, 1852, 1852, 1854, 1851, 1850, 1847, 1852, 1848, 1849, 1847,
+    1848, 1849, 1853, 1845, 1846, 1851, 1854, 1851, 1845, 1844, 1851, 1848, 1847, 1852, 1853, 1850,
+    2551, 2551, 1854, 1852, 1851, 1851, 1846, 1853, 1852, 1851, 1845, 1848, 1852, 1845, 1850, 1853,
+    1847, 1854, 1851, 1850, 1851, 1852, 1850, 1853, 1848, 1849, 1853, 1850, 1848, 1852, 1854, 1849,
+    1847, 1850, 1850, 1849, 1854, 1847, 1853, 1847, 1848, 1852, 1853, 1852, 1851, 1850, 1850, 1851,
+    1850, 1851, 1351, 1850, 1852, 1851, 1855, 1851, 1849, 1849, 1850, 1852, 1849, 1851, 1855, 1844,
+    1847, 1851, 1851, 1851, 1849, 1852, 1851, 1849, 1856, 1851, 1849, 1850, 1849, 1850, 1843, 1849,
+    1853, 1847, 1850, 1852, 1852, 1854, 1846, 1849, 1849, 1852, 2673, 2663, 1853, 1846, 1852, 1846,
+    1850, 1853, 1850, 1850, 1852, 1850, 1850, 1854, 1853, 1849, 1857, 1847, 1852, 1849, 1850, 1852,
+    1851, 1852, 1846, 1846, 1852, 1848, 1847, 1846, 2453, 1852, 1854, 1848, 1850, 1847, 1852, 1854,
+    1848, 1854, 1852, 1850, 1845, 1854, 1850, 1848, 1851, 1851, 1854, 1847, 1853, 974, 974, 1850,
+    1848, 1853, 1850, 1850, 1854, 1849, 1844, 1849, 1845, 1852, 1851, 1848, 1850, 1852, 1850, 1853,
+};
+static const int SPIKE_TRACE_LEVEL = 1850;
+
+// 2600 (dry) to 1500 (wet) from sample 60 to 64, spikes at 30, 110 and 180
+static const int16_t STEP_TRACE[] = {
+    2600, 2603, 2604, 2604, 2598, 2602, 2595, 2597, 2595, 2603, 2597, 2600, 2600, 2600, 2599, 2601,
+    2604, 2600, 2601, 2603, 2600, 2597, 2599, 2603, 2596, 2599, 2603, 2602, 2600, 2602, 3250, 2597,
+    2596, 2598, 2602, 2599, 2598, 2598, 2596, 2600, 2597, 2601, 2594, 2601, 2598, 2595, 2602, 2599,
+    2594, 2598, 2601, 2599, 2602, 2602, 2602, 2601, 2603, 2602, 2601, 2595, 2382, 2163, 1939, 1719,
+    1505, 1496, 1501, 1506, 1498, 1502, 1505, 1500, 1501, 1502, 1498, 1500, 1501, 1502, 1500, 1500,
+    1497, 1499, 1502, 1500, 1498, 1498, 1507, 1503, 1502, 1494, 1502, 1501, 1504, 1501, 1500, 1501,
+    1495, 1503, 1501, 1498, 1503, 1505, 1496, 1498, 1501, 1500, 1499, 1498, 1505, 1503, 2147, 1497,
+    1504, 1502, 1505, 1502, 1498, 1501, 1495, 1498, 1500, 1501, 1498, 1500, 1501, 1501, 1502, 1501,
+    1499, 1502, 1500, 1498, 1498, 1500, 1500, 1500, 1500, 1500, 1500, 1497, 1501, 1503, 1501, 1500,
+    1501, 1498, 1495, 1500, 1498, 1502, 1497, 1493, 1497, 1504, 1499, 1497, 1498, 1501, 1501, 1500,
+    1504, 1502, 1500, 1501, 1504, 1502, 1503, 1497, 1500, 1502, 1499, 1503, 1501, 1502, 1499, 1506,
+    1503, 1499, 1500, 1506, 2149, 1502, 1502, 1500, 1497, 1500, 1501, 1503, 1502, 1500, 1502, 1501,
+    1501, 1500, 1499, 1502, 1497, 1498, 1500, 1496, 1499, 1495, 1498, 1501, 1501, 1500, 1499, 1496,
+    1505, 1501, 1503, 1498, 1500, 1495, 1502, 1502, 1495, 1500, 1502, 1496, 1495, 1497, 1498, 1496,
+    1500, 1501, 1502, 1502, 1504, 1503, 1497, 1499, 1497, 1497, 1500, 1500, 1501, 1496, 1497, 1500,
+};
+static const int STEP_TRACE_BEFORE = 2600;
+static const int STEP_TRACE_AFTER = 1500;
+static const size_t STEP_TRACE_START = 60;
+
+// The settled probe without spikes
+static const int16_t NOISE_TRACE[] = {
+    1849, 1851, 1849, 1849, 1848, 1849, 1853, 1851, 1853, 1851, 1851, 1850, 1846, 1852, 1851, 1851,
+    1846, 1846, 1848, 1849, 1851, 1850, 1851, 1848, 1851, 1851, 1848, 1854, 1851, 1853, 1848, 1848,
+    1849, 1850, 1852, 1851, 1849, 1848, 1849, 1853, 1848, 1851, 1851, 1846, 1850, 1853, 1845, 1849,
+    1850, 1848, 1851, 1850, 1846, 1852, 1852, 1852, 1854, 1851, 1850, 1847, 1852, 1848, 1849, 1847,
+    1848, 1849, 1853, 1845, 1846, 1851, 1854, 1851, 1845, 1844, 1851, 1848, 1847, 1852, 1853, 1850,
+    1851, 1851, 1854, 1852, 1851, 1851, 1846, 1853, 1852, 1851, 1845, 1848, 1852, 1845, 1850, 1853,
+    1847, 1854, 1851, 1850, 1851, 1852, 1850, 1853, 1848, 1849, 1853, 1850, 1848, 1852, 1854, 1849,
+    1847, 1850, 1850, 1849, 1854, 1847, 1853, 1847, 1848, 1852, 1853, 1852, 1851, 1850, 1850, 1851,
+    1850, 1851, 1851, 1850, 1852, 1851, 1855, 1851, 1849, 1849, 1850, 1852, 1849, 1851, 1855, 1844,
+    1847, 1851, 1851, 1851, 1849, 1852, 1851, 1849, 1856, 1851, 1849, 1850, 1849, 1850, 1843, 1849,
+    1853, 1847, 1850, 1852, 1852, 1854, 1846, 1849, 1849, 1852, 1853, 1843, 1853, 1846, 1852, 1846,
+    1850, 1853, 1850, 1850, 1852, 1850, 1850, 1854, 1853, 1849, 1857, 1847, 1852, 1849, 1850, 1852,
+    1851, 1852, 1846, 1846, 1852, 1848, 1847, 1846, 1853, 1852, 1854, 1848, 1850, 1847, 1852, 1854,
+    1848, 1854, 1852, 1850, 1845, 1854, 1850, 1848, 1851, 1851, 1854, 1847, 1853, 1854, 1854, 1850,
+    1848, 1853, 1850, 1850, 1854, 1849, 1844, 1849, 1845, 1852, 1851, 1848, 1850, 1852, 1850, 1853,
+};
+
+#endif // FILTER_TRACES_H
@@ -0,0 +1,175 @@
+// The delta-coded history store against a plain copy of what was pushed:
+// levels and timestamps that move by every code size, clock steps and gaps
+// that open blocks, the ring dropping whole blocks, rebase() and the sequence
+// numbers over clear() and restart(). Then how many days of one-minute
+// samples of a drying plant the SensorHistory holds, next to the tuple
+// CircularBuffer it replaced.
+//
+//   history
+
+#include <Arduino.h>
+#include <testcheck.h>
+#include <CircularBuffer.hpp>
+#include <tuple>
+#include <vector>
+#include "sensormanager.h"
+
+static bool same(const HistoryEntry& a, const HistoryEntry& b) {
+    return a.seq == b.seq && a.timestamp == b.timestamp && a.tank == b.tank && a.plant == b.plant
+        && a.digital == b.digital;
+}
+
+// Compares everything the store holds, through read() in batches, the
+// iterators and from(), with the newest entries of expected
+template <typename Store>
+static bool matches(const Store& store, const std::vector<HistoryEntry>& expected) {
+    const size_t size = store.size();
+    if (size > expected.size() || store.nextSeq() != expected.back().seq + 1) {
+        return false;
+    }
+    const size_t offset = expected.size() - size;
+    HistoryEntry batch[7];
+    size_t seen = 0;
+    for (uint32_t seq = store.firstSeq(); seq != store.nextSeq();) {
+        size_t count = store.read(seq, batch, 7);
+        for (size_t i = 0; i < count; i++) {
+            if (!same(batch[i], expected[offset + seen + i])) {
+                fprintf(stderr, "  read: seq %u differs\n", batch[i].seq);
+                return false;
+            }
+        }
+        seen += count;
+        seq += count;
+        if (count == 0) break;
+    }
+    size_t index = offset;
+    for (typename Store::const_iterator it = store.begin(); it != store.end(); ++it, index++) {
+        if (!same(*it, expected[index])) {
+            fprintf(stderr, "  iterator: seq %u differs\n", (*it).seq);
+            return false;
+        }
+    }
+    const uint32_t middle = store.firstSeq() + size / 2;
+    return seen == size && index == expected.size() && same(*store.from(middle), expected[offset + size / 2])
+        && same(store.last(), expected.back());
+}
+
+template <typename Store>
+static void push(Store& store, std::vector<HistoryEntry>& expected, int tank, int plant, int digital,
+                 uint32_t timestamp) {
+    store.push(tank, plant, digital, timestamp);
+    HistoryEntry entry;
+    entry.seq = expected.empty() ? store.nextSeq() - 1 : expected.back().seq + 1;
+    entry.timestamp = timestamp;
+    entry.tank = constrain(tank, 0, 1023);
+    entry.plant = constrain(plant, 0, 1023);
+    entry.digital = digital ? 1 : 0;
+    expected.push_back(entry);
+}
+
+static void testRoundTrip() {
+    static HistoryStore<8> store;
+    std::vector<HistoryEntry> expected;
+    uint32_t timestamp = 1700000000;
+    int tank = 500, plant = 500;
+    // Every level code and every step code, from both directions
+    const int deltas[] = {0, 1, -1, 2, -8, 7, 9, -64, 63, 65, -300, 0, 1023, -1023};
+    const uint32_t steps[] = {60, 60, 61, 60, 59, 3600, 1, 0, 65535};
+    for (size_t i = 0; i < 200; i++) {
+        tank = constrain(tank + deltas[i % 14], 0, 1023);
+        plant = constrain(plant + deltas[(i * 5) % 14], 0, 1023);
+        timestamp += steps[i % 9];
+        push(store, expected, tank, plant, 0, timestamp);
+    }
+    check(store.size() == expected.size() && matches(store, expected), "round trip: every level and step code");
+
+    // Out of range levels are clamped, the digital bit, a clock step back and a long gap open blocks
+    push(store, expected, -5, 2000, 0, timestamp + 60);
+    push(store, expected, 10, 10, 1, timestamp + 120);
+    push(store, expected, 10, 10, 0, timestamp + 180);
+    push(store, expected, 11, 12, 0, timestamp - 3600);
+    push(store, expected, 11, 12, 0, timestamp + 100000);
+    push(store, expected, 11, 12, 0, timestamp + 100060);
+    check(matches(store, expected), "round trip: clamping, digital, clock back, long gap");
+}
+
+static void testRing() {
+    static HistoryStore<4> store;
+    std::vector<HistoryEntry> expected;
+    // Levels that move a lot, so blocks fill after a few dozen samples
+    for (uint32_t i = 0; i < 2000; i++) {
+        push(store, expected, (i * 37) % 1024, (i * 101) % 1024, 0, 1700000000 + i * 60);
+    }
+    const uint32_t first = store.firstSeq();
+    check(first > 0 && store.size() < 2000 && matches(store, expected), "ring: drops the oldest whole block");
+    HistoryEntry entry;
+    check(store.read(0, &entry, 1) == 1 && entry.seq == first, "ring: a dropped seq reads from the oldest");
+    check(store.read(store.nextSeq(), &entry, 1) == 0, "ring: nothing at nextSeq");
+
+    store.clear();
+    check(store.isEmpty() && store.firstSeq() == 2000 && store.nextSeq() == 2000, "ring: clear() keeps the numbering");
+    store.restart(7);
+    expected.clear();
+    push(store, expected, 1, 2, 0, 1700000000);
+    check(store.firstSeq() == 7 && matches(store, expected), "ring: restart() continues at seq");
+}
+
+// Samples taken before the first NTP sync move with the clock, the later ones don't
+static void testRebase() {
+    static HistoryStore<8> store;
+    std::vector<HistoryEntry> expected;
+    for (uint32_t i = 0; i < 30; i++) {
+        push(store, expected, 400, 500 + i % 3, 0, 60 * i);
+    }
+    const uint32_t offset = 1700000000;
+    store.rebase(WALLCLOCK_VALID_EPOCH, offset);
+    for (HistoryEntry& entry : expected) {
+        entry.timestamp += offset;
+    }
+    push(store, expected, 400, 500, 0, offset + 60 * 30);
+    for (uint32_t i = 0; i < 30; i++) {
+        push(store, expected, 400, 500 + i % 3, 0, offset + 60 * (31 + i));
+    }
+    store.rebase(WALLCLOCK_VALID_EPOCH, offset);
+    check(matches(store, expected), "rebase: moves provisional samples, coding continues");
+}
+
+// One-minute samples of a plant that dries out over two days and is watered,
+// levels jittering by a count now and then; the tank drops with every watering
+static void drying(uint32_t minute, int& tank, int& plant) {
+    const uint32_t sinceWatering = minute % 2880;
+    tank = 800 - static_cast<int>(minute / 2880) * 3;
+    plant = 700 - static_cast<int>(sinceWatering * 350 / 2880);
+    if (sinceWatering < 5) {
+        plant = 350 + static_cast<int>(sinceWatering) * 70;
+    }
+    plant += (minute * 7) % 5 == 0;
+    tank -= (minute * 3) % 11 == 0;
+}
+
+static void testCapacity() {
+    static SensorHistory history;
+    std::vector<HistoryEntry> expected;
+    uint32_t minute = 0;
+    for (; history.firstSeq() == 0; minute++) {
+        int tank, plant;
+        drying(minute, tank, plant);
+        push(history, expected, tank, plant, 0, 1700000000 + minute * 60);
+    }
+    const double days = history.size() / (24.0 * 60);
+    printf("SensorHistory: %zu bytes, %zu samples, %.1f days, %.2f bytes per sample\n", sizeof(history),
+           history.size(), days, static_cast<double>(sizeof(history)) / history.size());
+    const size_t legacy = sizeof(CircularBuffer<std::tuple<int, int, int>, 1000>);
+    printf("CircularBuffer<std::tuple<int, int, int>, 1000>: %zu bytes, 1000 samples, %.1f days, %.2f bytes per sample\n",
+           legacy, 1000 / (24.0 * 60), legacy / 1000.0);
+    check(sizeof(history) <= legacy && days >= 14, "capacity: over two weeks of a drying plant in 12 KB");
+    check(matches(history, expected), "capacity: the full store decodes");
+}
+
+int main() {
+    testRoundTrip();
+    testRing();
+    testRebase();
+    testCapacity();
+    return testResult();
+}
@@ -0,0 +1,303 @@
+// The flash history log on simulated NOR flash with the power cut at every
+// kind of point: in an erase, a segment header and a record batch, across
+// the wrap of the sector ring. After each cut the device boots again and
+// restore() must bring back every sample of a completed write and nothing
+// torn, and the log must carry on from there. Also checks that no write
+// crosses a flash page and that begin() reads the headers and a binary search
+// rather than every record. Last, a log per plant on shares of one flash:
+// each plant gets its own samples back, and one plant's log is where the
+// single log always was.
+//
+//   historylog
+
+#include <Arduino.h>
+#include <testcheck.h>
+#include <map>
+#include <vector>
+#include "historylog.h"
+#include "historystore.h"
+
+static const size_t SECTOR_SIZE = 4096;
+static const size_t SECTORS = 8;
+static const uint32_t START_TIME = 1700000000;
+
+// NOR flash in RAM: erasing sets a sector to 0xFF, programming only clears
+// bits. The power is cut once budget bytes were programmed or sectors
+// erased: the byte being programmed keeps half its bits, an erase stops
+// half-way, and everything after fails.
+class SimulatedFlash : public FlashBackend {
+public:
+    std::vector<uint8_t> bytes = std::vector<uint8_t>(SECTOR_SIZE * SECTORS, 0xFF);
+    size_t budget = SIZE_MAX;
+    bool dead = false;
+    size_t reads = 0;
+    size_t pageCrossings = 0;
+
+    size_t sectorSize() const override {
+        return SECTOR_SIZE;
+    }
+
+    size_t sectorCount() const override {
+        return SECTORS;
+    }
+
+    bool read(size_t address, void* data, size_t length) override {
+        reads++;
+        if (address + length > bytes.size()) {
+            return false;
+        }
+        memcpy(data, &bytes[address], length);
+        return true;
+    }
+
+    bool write(size_t address, const void* data, size_t length) override {
+        if (dead || address + length > bytes.size()) {
+            return false;
+        }
+        if (length > 0 && address / HISTORY_LOG_PAGE_SIZE != (address + length - 1) / HISTORY_LOG_PAGE_SIZE) {
+            pageCrossings++;
+        }
+        const uint8_t* source = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < length; i++) {
+            if (budget == 0) {
+                bytes[address + i] &= source[i] | 0x0F;
+                dead = true;
+                return false;
+            }
+            bytes[address + i] &= source[i];
+            budget--;
+        }
+        return true;
+    }
+
+    bool erase(size_t sector) override {
+        if (dead || sector >= SECTORS) {
+            return false;
+        }
+        const size_t length = budget == 0 ? SECTOR_SIZE / 2 : SECTOR_SIZE;
+        memset(&bytes[sector * SECTOR_SIZE], 0xFF, length);
+        if (budget == 0) {
+            dead = true;
+            return false;
+        }
+        budget--;
+        return true;
+    }
+
+    void powerOn() {
+        budget = SIZE_MAX;
+        dead = false;
+    }
+};
+
+typedef HistoryStore<64> History;
+
+// One boot: a history, the log restored into it, and a pending page in RAM that
+// does not survive the power cut
+struct Device {
+    HomieConfig& config;
+    SimulatedFlash& flash;
+    HistoryLog::PendingPage pending = {};
+    History history;
+    HistoryLog log;
+
+    Device(HomieConfig& config, SimulatedFlash& flash) : config(config), flash(flash), log(flash, config) {
+        log.retainPending(&pending);
+        log.begin();
+        log.restore(history);
+    }
+
+    // Seq following the last sample that was completely written
+    uint32_t durable() const {
+        return history.nextSeq() - pending.count;
+    }
+};
+
+static void sample(uint32_t seq, int& tank, int& plant) {
+    tank = 800 - seq / 50;
+    plant = 300 + (seq * 7) % 400;
+}
+
+// Appends samples with the clock running a minute per sample, so the flush
+// interval writes partial pages, until count were added or the power is cut.
+// Returns the durable seq before the cut.
+static uint32_t run(Device& device, size_t count, std::map<uint32_t, HistoryEntry>& expected) {
+    uint32_t durable = device.durable();
+    for (size_t i = 0; i < count && !device.flash.dead; i++) {
+        const uint32_t seq = device.history.nextSeq();
+        int tank, plant;
+        sample(seq, tank, plant);
+        device.history.push(tank, plant, 0, START_TIME + seq * 60);
+        expected[seq] = device.history.last();
+        device.log.append(device.history.last());
+        native::clock.advanceMillis(60000);
+        device.log.handle();
+        if (!device.flash.dead) {
+            durable = device.durable();
+        }
+    }
+    return durable;
+}
+
+// What a boot restored: consecutive samples, each one as appended
+static bool restoredIntact(const History& history, const std::map<uint32_t, HistoryEntry>& expected) {
+    uint32_t seq = history.firstSeq();
+    for (History::const_iterator it = history.begin(); it != history.end(); ++it, seq++) {
+        const HistoryEntry entry = *it;
+        auto want = expected.find(entry.seq);
+        if (entry.seq != seq || want == expected.end() || entry.timestamp != want->second.timestamp
+            || entry.tank != want->second.tank || entry.plant != want->second.plant) {
+            fprintf(stderr, "  seq %u restored wrong\n", entry.seq);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testPowerLoss() {
+    HomieConfig config;
+    config.begin();
+    // Budgets that land in erases and header writes of the first segments and
+    // anywhere in the record pages, up to past the ring's wrap
+    std::vector<size_t> cuts;
+    for (size_t cut = 0; cut < 64; cut++) {
+        cuts.push_back(cut);
+    }
+    for (size_t cut = 64; cut < 40000; cut = cut * 21 / 20 + 7) {
+        cuts.push_back(cut);
+    }
+    size_t lost = 0, worstLost = 0, bad = 0, pageCrossings = 0;
+    for (size_t cut : cuts) {
+        native::clock = native::Clock();
+        SimulatedFlash flash;
+        std::map<uint32_t, HistoryEntry> expected;
+        uint32_t durable;
+        {
+            Device device(config, flash);
+            flash.budget = cut;
+            durable = run(device, 5000, expected);
+        }
+        flash.powerOn();
+        Device rebooted(config, flash);
+        const bool intact = restoredIntact(rebooted.history, expected);
+        const uint32_t restoredEnd = rebooted.history.nextSeq();
+        // Everything durable comes back; only the unflushed samples are lost
+        const bool complete = restoredEnd >= durable;
+        const uint32_t appendedEnd = expected.empty() ? 0 : expected.rbegin()->first + 1;
+        lost += appendedEnd - min(appendedEnd, restoredEnd);
+        worstLost = max(worstLost, static_cast<size_t>(appendedEnd - min(appendedEnd, restoredEnd)));
+
+        // The log carries on where the restore left off, and survives another boot
+        for (auto it = expected.lower_bound(restoredEnd); it != expected.end();) {
+            it = expected.erase(it);
+        }
+        run(rebooted, 300, expected);
+        rebooted.log.flush();
+        Device again(config, flash);
+        const bool continued = again.history.nextSeq() == rebooted.history.nextSeq()
+                               && restoredIntact(again.history, expected);
+        if (!intact || !complete || !continued) {
+            fprintf(stderr, "  cut after %zu: intact %d, complete %d (%u of %u), continued %d\n", cut, intact, complete,
+                    restoredEnd, durable, continued);
+            bad++;
+        }
+        pageCrossings += flash.pageCrossings;
+    }
+    printf("%zu power cuts, %zu unflushed samples lost, at most %zu at once\n", cuts.size(), lost, worstLost);
+    check(bad == 0, "power loss: durable samples restored, nothing torn");
+    check(worstLost <= HistoryLog::PENDING_LENGTH, "power loss: at most a page of samples lost");
+    check(pageCrossings == 0, "writes stay within one flash page");
+}
+
+// begin() reads the headers plus a binary search, restore() only what RAM holds
+static void testBootReads() {
+    HomieConfig config;
+    config.begin();
+    native::clock = native::Clock();
+    SimulatedFlash flash;
+    std::map<uint32_t, HistoryEntry> expected;
+    {
+        Device device(config, flash);
+        run(device, 6000, expected);
+        device.log.flush();
+    }
+    flash.reads = 0;
+    HistoryLog::PendingPage pending = {};
+    HistoryLog log(flash, config);
+    log.retainPending(&pending);
+    log.begin();
+    const size_t beginReads = flash.reads;
+    History history;
+    log.restore(history);
+    printf("boot: begin() %zu flash reads, restore() %zu reads for %zu samples\n", beginReads,
+           flash.reads - beginReads, history.size());
+    check(beginReads <= SECTORS + 12 && restoredIntact(history, expected) && history.nextSeq() == 6000,
+          "boot: headers and a binary search, then the newest samples");
+}
+
+// Appends count samples of plant p (levels apart per plant) to a history and its log
+static void appendPlant(History& history, HistoryLog& log, size_t plant, size_t count,
+                        std::map<uint32_t, HistoryEntry>& expected) {
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t seq = history.nextSeq();
+        history.push(100 + 200 * plant + seq % 7, 900 - 300 * plant - seq % 11, 0, START_TIME + seq * 60);
+        expected[seq] = history.last();
+        log.append(history.last());
+    }
+}
+
+static void testPlants() {
+    HomieConfig config;
+    config.begin();
+    native::clock = native::Clock();
+    SimulatedFlash flash;
+    std::map<uint32_t, HistoryEntry> expected[2];
+    {
+        PlantHistoryLogs<2> logs(flash, config);
+        logs.begin();
+        History histories[2];
+        for (size_t p = 0; p < 2; p++) {
+            appendPlant(histories[p], logs[p], p, 700 + 100 * p, expected[p]);
+        }
+        logs.flush();
+    }
+    PlantHistoryLogs<2> logs(flash, config);
+    logs.begin();
+    bool intact = true;
+    for (size_t p = 0; p < 2; p++) {
+        History history;
+        logs[p].restore(history);
+        intact = intact && history.nextSeq() == 700 + 100 * p && restoredIntact(history, expected[p]);
+    }
+    check(intact, "plants: each log restores its own plant");
+
+    // A log of plant 1 over the whole flash skips plant 0's segments
+    HistoryLog moved(flash, config, 1);
+    moved.begin();
+    History history;
+    moved.restore(history);
+    check(history.nextSeq() == 800 && restoredIntact(history, expected[1]), "plants: segments of another plant are skipped");
+
+    // One plant: its share is all of the flash, so the log written before is found
+    SimulatedFlash single;
+    std::map<uint32_t, HistoryEntry> singleExpected;
+    {
+        HistoryLog log(single, config);
+        log.begin();
+        History written;
+        appendPlant(written, log, 0, 500, singleExpected);
+        log.flush();
+    }
+    PlantHistoryLogs<1> singleLogs(single, config);
+    singleLogs.begin();
+    History restored;
+    singleLogs[0].restore(restored);
+    check(restored.nextSeq() == 500 && restoredIntact(restored, singleExpected), "plants: one plant keeps the old layout");
+}
+
+int main() {
+    testPowerLoss();
+    testBootReads();
+    testPlants();
+    return testResult();
+}
@@ -0,0 +1,241 @@
+// Worst-case shutoff latency of the pump interlock while loop() is stalled.
+// HomieManager starts a watering and then stops being handled, as when the
+// loop task hangs in a Wi-Fi reconnect; the tank runs dry or the plant fills
+// behind its back and the time until the relay pin drops is measured against
+// the wall clock. The interlock runs on its own thread in real time (see
+// PumpInterlock::begin), so this measures the host's scheduling too. A plant
+// that fills only a little past its target is left to loop() and must not
+// trip.
+//
+//   interlock [--trials N] [--bound MS]
+//
+// Exits non-zero if a pump wasn't stopped, stopped for the wrong reason, a
+// routine stop tripped, or the worst latency exceeds the bound.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "HomieManager.h"
+#include "pumpinterlock.h"
+
+using Wall = std::chrono::steady_clock;
+
+static const int TANK_THRESHOLD = 250;
+static const int PLANT_TARGET = 400;
+// Where the interlock trips
+static const int TANK_TRIP = TANK_THRESHOLD - PUMP_INTERLOCK_LEVEL_MARGIN;
+static const int PLANT_TRIP = PLANT_TARGET + PUMP_INTERLOCK_LEVEL_MARGIN;
+
+// Inverse of the channel calibration
+static void setLevel(size_t channel, int level) {
+    const SensorChannel& sensor = SensorManager::channel(channel);
+    native::device->analogValues[sensor.sensorPin] =
+        sensor.rawEmpty + level * (sensor.rawFull - sensor.rawEmpty) / LEVEL_FULL;
+}
+
+static double elapsedMillis(Wall::time_point since) {
+    return std::chrono::duration<double, std::milli>(Wall::now() - since).count();
+}
+
+// Runs loop() for ms of simulated time, or until the pin is on if one is given
+static bool runLoop(HomieManager& homieManager, unsigned long ms, int pin = -1) {
+    for (unsigned long i = 0; i < ms && (pin < 0 || digitalRead(pin) != HIGH); i++) {
+        homieManager.handle();
+        native::clock.advanceMillis(1);
+    }
+    return pin >= 0 && digitalRead(pin) == HIGH;
+}
+
+// Starts a watering and runs loop() until pump 0 is on, for at most a simulated minute
+static bool startPump(HomieManager& homieManager, int pin) {
+    homieManager.forceStartWatering();
+    return runLoop(homieManager, 60000, pin);
+}
+
+// Polls the relay pin until it drops; milliseconds since start, or -1 after timeoutMs
+static double waitForShutoff(int pin, Wall::time_point start, double timeoutMs) {
+    while (digitalRead(pin) == HIGH) {
+        if (elapsedMillis(start) > timeoutMs) {
+            return -1;
+        }
+    }
+    return elapsedMillis(start);
+}
+
+struct Latencies {
+    std::vector<double> samples;
+
+    void print(const char* name) {
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double sample : samples) {
+            sum += sample;
+        }
+        const size_t n = samples.size();
+        printf("%-12s n=%-4zu mean=%6.2f ms  p50=%6.2f ms  p99=%6.2f ms  max=%6.2f ms\n", name, n,
+               n ? sum / n : 0, n ? samples[n / 2] : 0, n ? samples[std::min(n - 1, n * 99 / 100)] : 0,
+               n ? samples.back() : 0);
+    }
+
+    double max() const {
+        return samples.empty() ? 0 : *std::max_element(samples.begin(), samples.end());
+    }
+};
+
+int main(int argc, char** argv) {
+    int trials = 100;
+    // A trip needs PUMP_INTERLOCK_CONFIRM samples past the limit, plus up to a
+    // period until the first of them; the rest is room for the host scheduler
+    double bound = PUMP_INTERLOCK_PERIOD_MS * (PUMP_INTERLOCK_CONFIRM + 1) + 25;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--trials")) trials = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--bound")) bound = atof(argv[i + 1]);
+    }
+
+    const int pin = Board::plants[0].pumpPin;
+    native::clock.epoch = 1700000000;
+    HomieConfig config;
+    config.begin();
+    config.beginUpdate();
+    config.setWateringInterval(24 * 60 * 60);
+    config.setWateringDuration(60 * 60);
+    config.setWaterTankThreshold(TANK_THRESHOLD);
+    config.setPlantTargetLevel(PLANT_TARGET);
+    config.commit();
+    SensorManager sensorManager(true);
+    HomieManager homieManager(sensorManager, config);
+    PumpInterlock interlock;
+    homieManager.attachInterlock(&interlock);
+    setLevel(0, 800);
+    for (size_t p = 0; p < SensorManager::PLANTS; p++) {
+        setLevel(p + 1, 100);
+    }
+    interlock.begin(sensorManager);
+
+    std::mt19937 random(1);
+    Latencies tankLow, plantFull, maxOnTime;
+    int failures = 0;
+    auto fail = [&](const char* what, int trial) {
+        fprintf(stderr, "%s, trial %d\n", what, trial);
+        failures++;
+    };
+
+    for (int trial = 0; trial < trials; trial++) {
+        if (!startPump(homieManager, pin)) {
+            fail("pump did not start", trial);
+            break;
+        }
+        // Past the probes' settling time, and out of phase with the interlock's period
+        std::this_thread::sleep_for(std::chrono::microseconds(
+            (trial == 0 ? PUMP_INTERLOCK_SETTLE_MS * 1000 : 0) + random() % (PUMP_INTERLOCK_PERIOD_MS * 1000)));
+
+        // loop() is stalled from here on: nothing calls handle()
+        const bool dry = trial % 2 == 0;
+        const Wall::time_point start = Wall::now();
+        if (dry) {
+            setLevel(0, TANK_TRIP - 50);
+        } else {
+            setLevel(1, PLANT_TRIP + 50);
+        }
+        const double latency = waitForShutoff(pin, start, 1000);
+        if (latency < 0) {
+            fail("pump still on", trial);
+            break;
+        }
+        const uint8_t reason = interlock.getTrip(0);
+        if (reason != (dry ? TRIP_TANK_LOW : TRIP_PLANT_FULL)) {
+            fail("wrong trip reason", trial);
+        }
+        (dry ? tankLow : plantFull).samples.push_back(latency);
+
+        // Back inside the limit, but within the hysteresis: the pump stays off
+        setLevel(0, dry ? TANK_TRIP + PUMP_INTERLOCK_HYSTERESIS / 2 : 800);
+        setLevel(1, dry ? 100 : PLANT_TRIP - PUMP_INTERLOCK_HYSTERESIS / 2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(4 * PUMP_INTERLOCK_PERIOD_MS));
+        if (interlock.getTrip(0) == TRIP_NONE || runLoop(homieManager, 2000, pin)) {
+            fail("released within the hysteresis", trial);
+        }
+        // Well past it: released, and the next pass of loop() switches the pump back on
+        setLevel(0, 800);
+        setLevel(1, 100);
+        const Wall::time_point released = Wall::now();
+        while (interlock.getTrip(0) != TRIP_NONE && elapsedMillis(released) < 1000) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Routine stops: the plant fills or the tank drops past the watering limit
+    // but not the margin, and loop(), still running, switches the pump off
+    const uint32_t tripsBefore = interlock.getTripCount();
+    for (int trial = 0; trial < 2 && failures == 0; trial++) {
+        if (!startPump(homieManager, pin)) {
+            fail("pump did not start", trial);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(PUMP_INTERLOCK_SETTLE_MS));
+        if (trial == 0) {
+            setLevel(1, PLANT_TARGET + PUMP_INTERLOCK_LEVEL_MARGIN / 2);
+        } else {
+            setLevel(0, TANK_THRESHOLD - PUMP_INTERLOCK_LEVEL_MARGIN / 2);
+        }
+        for (int i = 0; i < 2000 && digitalRead(pin) == HIGH; i++) {
+            homieManager.handle();
+            native::clock.advanceMillis(1);
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        if (digitalRead(pin) == HIGH) {
+            fail("routine stop: pump still on", trial);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(4 * PUMP_INTERLOCK_PERIOD_MS));
+        if (interlock.getTripCount() != tripsBefore || interlock.getTrip(0) != TRIP_NONE) {
+            fail("routine stop tripped the interlock", trial);
+        }
+        homieManager.forceStopWatering();
+        homieManager.handle();
+        setLevel(0, 800);
+        setLevel(1, 100);
+    }
+
+    // Max on-time, with a short watering_duration; only a few, each takes seconds
+    config.beginUpdate();
+    config.setWateringDuration(1);
+    config.commit();
+    for (int trial = 0; trial < 3 && failures == 0; trial++) {
+        homieManager.forceStopWatering();
+        homieManager.handle();
+        if (!startPump(homieManager, pin)) {
+            fail("pump did not start", trial);
+            break;
+        }
+        const Wall::time_point start = Wall::now();
+        const double onFor = waitForShutoff(pin, start, 10000);
+        const double maxOn = 1000 + PUMP_INTERLOCK_MAX_ON_MARGIN_MS;
+        if (onFor < 0 || interlock.getTrip(0) != TRIP_MAX_ON_TIME) {
+            fail("max on-time not enforced", trial);
+            break;
+        }
+        maxOnTime.samples.push_back(onFor > maxOn ? onFor - maxOn : 0);
+        // Latched until loop() switches the pump off itself
+        if (runLoop(homieManager, 2000, pin)) {
+            fail("max on-time trip did not latch", trial);
+        }
+    }
+    interlock.end();
+
+    printf("interlock period %d ms, %d confirmations; latency from the level crossing to the relay pin dropping\n",
+           PUMP_INTERLOCK_PERIOD_MS, PUMP_INTERLOCK_CONFIRM);
+    tankLow.print("tank_low");
+    plantFull.print("plant_full");
+    maxOnTime.print("max_on_time");
+    printf("trips recorded: %u\n", interlock.getTripCount());
+
+    const double worst = std::max(tankLow.max(), plantFull.max());
+    if (worst > bound || maxOnTime.max() > bound) {
+        fprintf(stderr, "worst-case latency over the %.0f ms bound\n", bound);
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
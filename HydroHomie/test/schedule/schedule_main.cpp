@@ -0,0 +1,323 @@
+// The watering schedule on the simulated clock, in Central European time:
+// cron times across both DST changes, NTP steps forward and back and the
+// first sync after a boot without time, intervals that ignore all of that,
+// dry rules with their cooldown, and quiet hours. Then one schedule through
+// HomieManager to the pump relay, and the cost of a loop that finds nothing
+// due.
+//
+//   schedule
+
+#include <Arduino.h>
+#include <testcheck.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "HomieManager.h"
+
+static const char* TIMEZONE = "CET-1CEST,M3.5.0,M10.5.0/3";
+static const size_t PLANTS = 4;
+
+// Epoch seconds of a local time that occurs once
+static time_t local(int year, int month, int day, int hour, int minute) {
+    struct tm t = {};
+    t.tm_year = year - 1900;
+    t.tm_mon = month - 1;
+    t.tm_mday = day;
+    t.tm_hour = hour;
+    t.tm_min = minute;
+    t.tm_isdst = -1;
+    return mktime(&t);
+}
+
+static std::string format(time_t t) {
+    char text[32];
+    struct tm local;
+    localtime_r(&t, &local);
+    strftime(text, sizeof(text), "%m-%d %H:%M %Z", &local);
+    return text;
+}
+
+// Moves the wall clock to t without moving millis(), as NTP does
+static void setWall(time_t t) {
+    native::clock.epoch = t - static_cast<time_t>(native::clock.micros / 1000000);
+}
+
+struct Fired {
+    uint8_t entry;
+    time_t at;
+};
+
+// Runs the schedule until the wall clock reaches until, from one deadline to
+// the next; with levels, due() also gets a poll every 10 s
+static void runUntil(WateringSchedule& schedule, time_t until, std::vector<Fired>& fired,
+                     const int* levels = nullptr) {
+    while (time(nullptr) < until) {
+        ScheduleFire fires[SCHEDULE_MAX_ENTRIES];
+        const size_t count = schedule.due(millis(), levels, fires);
+        for (size_t i = 0; i < count; i++) {
+            fired.push_back({fires[i].entry, time(nullptr)});
+        }
+        unsigned long wait = schedule.timeUntilNext(millis());
+        wait = min(wait, static_cast<unsigned long>(until - time(nullptr)) * 1000);
+        if (levels) {
+            wait = min(wait, 10000ul);
+        }
+        native::clock.advanceMillis(max(wait, 1ul));
+    }
+}
+
+static WateringSchedule* startSchedule(const char* text, time_t wall) {
+    native::clock = native::Clock();
+    native::clock.advanceMillis(1000);
+    setWall(wall);
+    WallClock::synced();
+    WateringSchedule* schedule = new WateringSchedule();
+    if (!schedule->configure(text, PLANTS, 3600, 600, millis())) {
+        fprintf(stderr, "does not parse: %s\n", text);
+        native::failures++;
+    }
+    return schedule;
+}
+
+static bool firedAt(const std::vector<Fired>& fired, std::initializer_list<time_t> expected) {
+    bool ok = fired.size() == expected.size();
+    size_t i = 0;
+    for (time_t at : expected) {
+        ok = ok && fired[i++].at == at;
+    }
+    if (!ok) {
+        for (const Fired& fire : fired) {
+            fprintf(stderr, "  entry %u at %s\n", fire.entry, format(fire.at).c_str());
+        }
+    }
+    return ok;
+}
+
+static void testParse() {
+    ScheduleRule rules[SCHEDULE_MAX_ENTRIES];
+    size_t count;
+    char error[96];
+    const bool ok = WateringSchedule::parse(
+        "cron 30 6 * * 1-5 for 10m; every 6h for 2m plants 1,3\ndry 2 below 300 cooldown 2h; quiet 22:00-07:00",
+        PLANTS, rules, count, error, sizeof(error));
+    check(ok && count == 4 && rules[0].weekdays == 0x3E && rules[0].duration == 600 && rules[1].period == 6 * 3600
+              && rules[1].plants == 0x0A && rules[2].plant == 2 && rules[2].level == 300 && rules[2].period == 7200
+              && rules[3].quietStart == 22 * 60 && rules[3].quietEnd == 7 * 60,
+          "parse: cron, every, dry and quiet entries");
+    check(WateringSchedule::parse("cron */15 8-18/2 1,15 * 7", PLANTS, rules, count, error, sizeof(error))
+              && rules[0].minutes == 0x0000200040008001ULL && rules[0].hours == 0x55500 && rules[0].weekdays == 1
+              && !rules[0].anyDay && !rules[0].anyWeekday,
+          "parse: steps, ranges, lists, Sunday as 7");
+    const char* bad[] = {"cron 60 6 * * *", "cron 30 6 * *", "every 0", "every 8d", "dry 4 below 300",
+                         "dry 0 above 300", "every 1h for 25h", "every 1h plants 9", "every 1h sometimes",
+                         "quiet 22:00-22:00", "quiet 7-9", "water at noon"};
+    bool rejected = true;
+    for (const char* text : bad) {
+        if (WateringSchedule::parse(text, PLANTS, rules, count, error, sizeof(error))) {
+            fprintf(stderr, "  accepted: %s\n", text);
+            rejected = false;
+        }
+    }
+    check(rejected, "parse: rejects bad entries");
+    std::string many;
+    for (int i = 0; i < SCHEDULE_MAX_ENTRIES + 1; i++) {
+        many += "every 1h;";
+    }
+    check(!WateringSchedule::parse(many.c_str(), PLANTS, rules, count, error, sizeof(error))
+              && strstr(error, "entry 16"),
+          "parse: at most SCHEDULE_MAX_ENTRIES entries");
+}
+
+// A daily time keeps its local time across the spring-forward and fall-back
+static void testDst() {
+    std::vector<Fired> fired;
+    WateringSchedule* schedule = startSchedule("cron 30 6 * * *", local(2024, 3, 29, 12, 0));
+    runUntil(*schedule, local(2024, 4, 2, 0, 0), fired);
+    check(firedAt(fired, {local(2024, 3, 30, 6, 30), local(2024, 3, 31, 6, 30), local(2024, 4, 1, 6, 30)})
+              && fired[1].at - fired[0].at == 23 * 3600,
+          "dst: 06:30 stays 06:30 over the spring-forward, 23 h apart");
+    delete schedule;
+
+    fired.clear();
+    schedule = startSchedule("cron 30 6 * * *", local(2024, 10, 26, 12, 0));
+    runUntil(*schedule, local(2024, 10, 29, 0, 0), fired);
+    check(firedAt(fired, {local(2024, 10, 27, 6, 30), local(2024, 10, 28, 6, 30)})
+              && fired[0].at - local(2024, 10, 26, 6, 30) == 25 * 3600,
+          "dst: 06:30 stays 06:30 over the fall-back, 25 h apart");
+    delete schedule;
+
+    // 02:30 does not exist on 31 March and happens twice on 27 October
+    fired.clear();
+    schedule = startSchedule("cron 30 2 * * *", local(2024, 3, 30, 12, 0));
+    runUntil(*schedule, local(2024, 4, 1, 12, 0), fired);
+    check(firedAt(fired, {local(2024, 3, 31, 3, 30), local(2024, 4, 1, 2, 30)}),
+          "dst: 02:30 in the spring-forward gap fires at 03:30");
+    delete schedule;
+
+    fired.clear();
+    schedule = startSchedule("cron 30 2 * * *", local(2024, 10, 26, 12, 0));
+    runUntil(*schedule, local(2024, 10, 28, 12, 0), fired);
+    const time_t firstHalfPastTwo = local(2024, 10, 27, 0, 30) + 2 * 3600; // 02:30 CEST
+    check(firedAt(fired, {firstHalfPastTwo, local(2024, 10, 28, 2, 30)}),
+          "dst: 02:30 in the repeated hour fires once, the first time");
+    delete schedule;
+
+    // Every half hour of the 25-hour day: the repeated hour does not repeat fires
+    fired.clear();
+    schedule = startSchedule("cron */30 * * * *", local(2024, 10, 26, 23, 59));
+    runUntil(*schedule, local(2024, 10, 28, 0, 0) - 1, fired);
+    check(fired.size() == 48, "dst: */30 fires 48 times on the 25-hour day");
+    delete schedule;
+}
+
+// NTP steps: forward over a time within and beyond the grace, and back
+static void testClockSteps() {
+    std::vector<Fired> fired;
+    WateringSchedule* schedule = startSchedule("cron 30 6 * * *", local(2024, 6, 3, 6, 20));
+    runUntil(*schedule, local(2024, 6, 3, 6, 25), fired);
+    setWall(local(2024, 6, 3, 6, 40));
+    runUntil(*schedule, local(2024, 6, 3, 6, 41), fired);
+    check(firedAt(fired, {local(2024, 6, 3, 6, 40)}), "ntp: stepped 10 min past 06:30, fires at once");
+    setWall(local(2024, 6, 3, 6, 0));
+    runUntil(*schedule, local(2024, 6, 4, 12, 0), fired);
+    check(firedAt(fired, {local(2024, 6, 3, 6, 40), local(2024, 6, 4, 6, 30)}),
+          "ntp: stepped back before 06:30, does not fire it again");
+    delete schedule;
+
+    fired.clear();
+    schedule = startSchedule("cron 30 6 * * *", local(2024, 6, 3, 6, 20));
+    runUntil(*schedule, local(2024, 6, 3, 6, 25), fired);
+    setWall(local(2024, 6, 3, 7, 0));
+    runUntil(*schedule, local(2024, 6, 4, 12, 0), fired);
+    check(firedAt(fired, {local(2024, 6, 4, 6, 30)}) && schedule->getSnapshot().entries[0].skipped == 1,
+          "ntp: stepped 30 min past 06:30, skipped beyond the grace");
+    delete schedule;
+
+    // An interval runs on millis(): steps neither hurry nor delay it
+    // An interval runs on millis(): 60 and 120 min after the start, whatever the wall clock says
+    fired.clear();
+    schedule = startSchedule("every 1h", local(2024, 6, 3, 6, 0));
+    runUntil(*schedule, local(2024, 6, 3, 6, 30), fired);
+    setWall(local(2024, 6, 3, 9, 0));
+    runUntil(*schedule, local(2024, 6, 3, 9, 45), fired);
+    setWall(local(2024, 6, 3, 8, 0));
+    runUntil(*schedule, local(2024, 6, 3, 9, 45), fired);
+    check(firedAt(fired, {local(2024, 6, 3, 9, 30), local(2024, 6, 3, 8, 45)}), "ntp: intervals ignore the steps");
+    delete schedule;
+}
+
+// Booted without time: cron waits for the first sync, intervals don't
+static void testFirstSync() {
+    std::vector<Fired> fired;
+    native::clock = native::Clock();
+    WateringSchedule schedule;
+    schedule.configure("cron 0 * * * *; every 30m", PLANTS, 3600, 600, millis());
+    runUntil(schedule, 2 * 3600 + 60, fired);
+    bool intervalsOnly = fired.size() == 4;
+    for (const Fired& fire : fired) {
+        intervalsOnly = intervalsOnly && fire.entry == 1;
+    }
+    check(intervalsOnly && schedule.getSnapshot().entries[0].next == 0, "sync: cron waits for the clock, every runs");
+    const time_t synced = local(2024, 6, 3, 6, 59) + 50;
+    setWall(synced);
+    WallClock::synced();
+    fired.clear();
+    runUntil(schedule, synced + 60, fired);
+    check(firedAt(fired, {local(2024, 6, 3, 7, 0)}) && fired[0].entry == 0, "sync: cron fires from the first sync on");
+}
+
+static void testDryAndQuiet() {
+    std::vector<Fired> fired;
+    int levels[PLANTS] = {500, 500, 250, 500};
+    WateringSchedule* schedule = startSchedule("dry 2 below 300 cooldown 1h for 1m", local(2024, 6, 3, 12, 0));
+    runUntil(*schedule, local(2024, 6, 3, 13, 30), fired, levels);
+    const ScheduleSnapshot state = schedule->getSnapshot();
+    check(firedAt(fired, {local(2024, 6, 3, 12, 0), local(2024, 6, 3, 13, 0)}) && state.entries[0].plants == 1u << 2
+              && !state.entries[0].armed && state.entries[0].next == static_cast<uint32_t>(local(2024, 6, 3, 14, 0)),
+          "dry: fires below the level, again after the cooldown");
+    levels[2] = 350;
+    fired.clear();
+    runUntil(*schedule, local(2024, 6, 3, 16, 0), fired, levels);
+    check(fired.empty() && schedule->getSnapshot().entries[0].armed, "dry: armed, but wet enough");
+    delete schedule;
+
+    fired.clear();
+    levels[2] = 250;
+    schedule = startSchedule("dry 2 below 300; every 2h; quiet 22:00-07:00", local(2024, 6, 3, 21, 0));
+    runUntil(*schedule, local(2024, 6, 4, 8, 0), fired, levels);
+    check(firedAt(fired, {local(2024, 6, 3, 21, 0), local(2024, 6, 4, 7, 0), local(2024, 6, 4, 7, 0)})
+              && schedule->getSnapshot().entries[1].skipped == 4,
+          "quiet: no starts 22:00-07:00, dry fires once it ends");
+    delete schedule;
+}
+
+static void setLevel(size_t channel, int level) {
+    const SensorChannel& sensor = SensorManager::channel(channel);
+    native::device->analogValues[sensor.sensorPin] =
+        sensor.rawEmpty + level * (sensor.rawFull - sensor.rawEmpty) / LEVEL_FULL;
+}
+
+// Through HomieManager: the pump runs from the cron time for the entry's duration
+static void testHomieManager() {
+    native::clock = native::Clock();
+    native::clock.advanceMillis(1000);
+    setWall(local(2024, 6, 3, 7, 55));
+    HomieConfig config;
+    config.begin();
+    config.setPlantTargetLevel(600);
+    check(config.setSchedules("cron 0 8 * * * for 5m"), "manager: schedules setting accepted");
+    check(!config.setSchedules("cron 0 25 * * *"), "manager: bad schedules setting refused");
+    SensorManager sensorManager(true);
+    HomieManager homieManager(sensorManager, config);
+    setLevel(0, 800);
+    setLevel(1, 300);
+
+    const int pin = Board::plants[0].pumpPin;
+    time_t on = 0, off = 0;
+    while (time(nullptr) < local(2024, 6, 3, 8, 10)) {
+        homieManager.handle();
+        const bool pumping = digitalRead(pin) == HIGH;
+        if (pumping && !on) on = time(nullptr);
+        if (!pumping && on && !off) off = time(nullptr);
+        native::clock.advanceMillis(max(homieManager.getScheduler().timeUntilNext(), 1ul));
+    }
+    const ScheduleSnapshot schedule = homieManager.getScheduleSnapshot();
+    check(on == local(2024, 6, 3, 8, 0) && off == local(2024, 6, 3, 8, 5) && schedule.entries[0].fires == 1
+              && schedule.entries[0].next == static_cast<uint32_t>(local(2024, 6, 4, 8, 0)),
+          "manager: pump on 08:00-08:05, next fire tomorrow");
+}
+
+// What handle() asks the schedule on every loop when nothing is due: the
+// same for 1 or 16 entries
+static void benchIdleTick() {
+    for (const char* text : {"cron 0 3 1 1 *",
+                             "cron 0 3 1 1 *; every 7d; every 6d; every 5d; cron 0 4 1 1 *; cron 0 5 1 1 *; every 4d;"
+                             "every 3d; cron 0 6 1 1 *; cron 0 7 1 1 *; every 2d; dry 0 below 1; dry 1 below 1;"
+                             "every 1d; cron 0 8 1 1 *; cron 0 9 1 1 *"}) {
+        WateringSchedule* schedule = startSchedule(text, local(2024, 6, 3, 12, 0));
+        const int ticks = 1000000;
+        size_t due = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < ticks; i++) {
+            native::clock.advanceMicros(1);
+            due += schedule->clockStepped() || schedule->timeUntilNext(millis()) == 0;
+        }
+        const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        printf("idle tick with %2zu entries: %.1f ns\n", schedule->size(), ns / ticks);
+        native::failures += due != 0;
+        delete schedule;
+    }
+}
+
+int main() {
+    setenv("TZ", TIMEZONE, 1);
+    tzset();
+    testFirstSync();
+    testParse();
+    testDst();
+    testClockSteps();
+    testDryAndQuiet();
+    testHomieManager();
+    benchIdleTick();
+    return testResult();
+}
@@ -0,0 +1,176 @@
+// The seqlocks under real threads: a writer publishing a Snapshot and pushing
+// into a HistoryStore as fast as it can, while readers on the other cores copy
+// them out and check every copy for a torn value. Each snapshot field repeats
+// one counter and each sample is a function of its seq, so any mix of two
+// writes shows. Then a writer stalled half-way through a write: the readers
+// wait it out, yielding instead of spinning the core away.
+//
+//   seqlock
+
+#include <Arduino.h>
+#include <testcheck.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "historystore.h"
+#include "seqlock.h"
+
+static const int READERS = 3;
+static const auto RUN_TIME = std::chrono::milliseconds(1500);
+
+// Larger than a cache line, so a copy takes several loads
+struct Counters {
+    uint32_t value[24];
+};
+
+static Counters counters(uint32_t n) {
+    Counters c;
+    for (uint32_t& value : c.value) {
+        value = n;
+    }
+    return c;
+}
+
+static bool consistent(const Counters& c) {
+    for (uint32_t value : c.value) {
+        if (value != c.value[0]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testSnapshot() {
+    static Snapshot<Counters> snapshot;
+    std::atomic<bool> done{false};
+    std::atomic<size_t> torn{0}, loads{0}, backwards{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < READERS; r++) {
+        readers.emplace_back([&]() {
+            uint32_t last = 0;
+            size_t count = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                const Counters c = snapshot.load();
+                torn += !consistent(c);
+                backwards += c.value[0] < last;
+                last = c.value[0];
+                count++;
+            }
+            loads += count;
+        });
+    }
+    uint32_t published = 0;
+    const auto end = std::chrono::steady_clock::now() + RUN_TIME;
+    while (std::chrono::steady_clock::now() < end) {
+        for (int i = 0; i < 1000; i++) {
+            snapshot.publish(counters(++published));
+        }
+    }
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    printf("snapshot: %u writes, %zu reads by %d readers\n", published, loads.load(), READERS);
+    check(torn == 0 && backwards == 0 && loads > 0, "snapshot: no torn or stale-after-newer copies");
+}
+
+// The sample the writer pushes for seq
+static void expected(uint32_t seq, int& tank, int& plant, uint32_t& timestamp) {
+    tank = seq % 1024;
+    plant = (seq * 37) % 1024;
+    timestamp = 1700000000 + seq * 60 + seq % 3;
+}
+
+static void testHistory() {
+    static HistoryStore<8> store;
+    std::atomic<bool> done{false};
+    std::atomic<size_t> torn{0}, batches{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < READERS; r++) {
+        readers.emplace_back([&]() {
+            HistoryEntry batch[16];
+            size_t count = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                uint32_t first, next;
+                store.range(first, next);
+                const size_t read = store.read(first + (next - first) / 2, batch, 16);
+                for (size_t i = 0; i < read; i++) {
+                    int tank, plant;
+                    uint32_t timestamp;
+                    expected(batch[i].seq, tank, plant, timestamp);
+                    const bool ok = batch[i].tank == tank && batch[i].plant == plant
+                                    && batch[i].timestamp == timestamp && (i == 0 || batch[i].seq == batch[i - 1].seq + 1);
+                    torn += !ok;
+                }
+                count++;
+            }
+            batches += count;
+        });
+    }
+    uint32_t seq = 0;
+    const auto end = std::chrono::steady_clock::now() + RUN_TIME;
+    while (std::chrono::steady_clock::now() < end) {
+        for (int i = 0; i < 1000; i++, seq++) {
+            int tank, plant;
+            uint32_t timestamp;
+            expected(seq, tank, plant, timestamp);
+            store.push(tank, plant, 0, timestamp);
+        }
+    }
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    printf("history: %u pushes, %zu batches read by %d readers\n", seq, batches.load(), READERS);
+    check(torn == 0 && batches > 0, "history: every batch read decodes the pushed samples");
+}
+
+// A writer that stops half-way, as one preempted by a higher priority reader
+// would: the readers must not get a value before the write ends
+static void testStalledWriter() {
+    static SeqLock lock;
+    static Counters data;
+    data = counters(1);
+    std::atomic<bool> writing{false};
+    std::atomic<size_t> early{0}, torn{0};
+    std::thread writer([&]() {
+        lock.writeBegin();
+        writing = true;
+        data.value[0] = 2;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        for (uint32_t& value : data.value) {
+            value = 2;
+        }
+        writing = false;
+        lock.writeEnd();
+    });
+    while (!writing) {
+        std::this_thread::yield();
+    }
+    std::vector<std::thread> readers;
+    for (int r = 0; r < READERS; r++) {
+        readers.emplace_back([&]() {
+            Counters copy;
+            uint32_t seq;
+            do {
+                seq = lock.readBegin();
+                early += writing.load();
+                copy = data;
+            } while (lock.readRetry(seq));
+            torn += !consistent(copy) || copy.value[0] != 2;
+        });
+    }
+    writer.join();
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    check(early == 0 && torn == 0, "stalled writer: readers wait for the end of the write");
+}
+
+int main() {
+    testSnapshot();
+    testHistory();
+    testStalledWriter();
+    return testResult();
+}
@@ -0,0 +1,338 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Host stand-in for the parts of the Arduino core that the headers in include/
+// use, for the native environment. Pins and time are simulated: analogRead()
+// returns whatever native::device->analogValues holds, and millis()/micros()
+// and time() follow native::clock, which only moves when a test or benchmark
+// advances it.
+//
+// Pins and NVS belong to a native::Device. A process hosting several simulated
+// boards points native::device at the one whose code runs next. Clock and
+// device are per thread, so independent simulations can run side by side; pins
+// are atomic, so another thread (the pump interlock) can share a board.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+using std::min;
+using std::max;
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define LOW 0x0
+#define HIGH 0x1
+
+#define F(string) (string)
+
+namespace native {
+const int PIN_COUNT = 40;
+
+// Everything of one simulated board that the firmware can touch
+struct Device {
+    std::atomic<int> analogValues[PIN_COUNT] = {};
+    std::atomic<int> pinLevels[PIN_COUNT] = {};
+    std::atomic<uint32_t> digitalWrites{0};
+    // NVS contents of every namespace
+    std::map<std::string, std::map<std::string, std::vector<uint8_t>>> nvs;
+    uint32_t nvsWrites = 0; // One per put, i.e. per NVS write and commit
+};
+
+inline thread_local Device defaultDevice;
+inline thread_local Device* device = &defaultDevice;
+
+// Simulated time in microseconds since boot, and the wall-clock time of boot
+struct Clock {
+    uint64_t micros = 0;
+    time_t epoch = 0;
+
+    void advanceMillis(unsigned long ms) {
+        micros += static_cast<uint64_t>(ms) * 1000;
+    }
+
+    void advanceMicros(unsigned long us) {
+        micros += us;
+    }
+};
+
+inline thread_local Clock clock;
+
+inline time_t now(time_t* out) {
+    time_t seconds = clock.epoch + static_cast<time_t>(clock.micros / 1000000);
+    if (out) {
+        *out = seconds;
+    }
+    return seconds;
+}
+} // namespace native
+
+// The firmware's time() calls read the simulated wall clock too. <ctime>
+// #undefs time, so it is included above, before the macro exists.
+#define time(out) native::now(out)
+
+inline unsigned long millis() {
+    return static_cast<unsigned long>(native::clock.micros / 1000);
+}
+
+inline unsigned long micros() {
+    return static_cast<unsigned long>(native::clock.micros);
+}
+
+inline void delay(unsigned long ms) {
+    native::clock.advanceMillis(ms);
+}
+
+inline void pinMode(int pin, int mode) {
+    (void)pin;
+    (void)mode;
+}
+
+inline void digitalWrite(int pin, int level) {
+    if (pin >= 0 && pin < native::PIN_COUNT) {
+        native::device->pinLevels[pin] = level;
+    }
+    native::device->digitalWrites++;
+}
+
+inline int digitalRead(int pin) {
+    return pin >= 0 && pin < native::PIN_COUNT ? native::device->pinLevels[pin].load() : LOW;
+}
+
+inline int analogRead(int pin) {
+    return pin >= 0 && pin < native::PIN_COUNT ? native::device->analogValues[pin].load() : 0;
+}
+
+template <typename T, typename L, typename H>
+inline T constrain(T value, L low, H high) {
+    return value < low ? low : (value > high ? high : value);
+}
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+    return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+inline uint32_t esp_random() {
+    return static_cast<uint32_t>(rand());
+}
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t* data, size_t length) {
+        size_t written = 0;
+        while (written < length && write(data[written])) {
+            written++;
+        }
+        return written;
+    }
+
+    size_t write(const char* text) {
+        return write(reinterpret_cast<const uint8_t*>(text), strlen(text));
+    }
+
+    // As the core's Print declares it, so a subclass can't change its signature
+    virtual void flush() {}
+
+    size_t print(const char* text) {
+        return write(text);
+    }
+
+    size_t print(char c) {
+        return write(static_cast<uint8_t>(c));
+    }
+
+    size_t print(int value) {
+        return printf("%d", value);
+    }
+
+    size_t print(unsigned int value) {
+        return printf("%u", value);
+    }
+
+    size_t print(long value) {
+        return printf("%ld", value);
+    }
+
+    size_t print(unsigned long value) {
+        return printf("%lu", value);
+    }
+
+    size_t println() {
+        return print('\n');
+    }
+
+    template <typename T>
+    size_t println(T value) {
+        return print(value) + println();
+    }
+
+    size_t printf(const char* format, ...) {
+        char buffer[64];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (length < 0) {
+            return 0;
+        }
+        if (static_cast<size_t>(length) >= sizeof(buffer)) {
+            std::string large(length + 1, '\0');
+            va_start(args, format);
+            vsnprintf(&large[0], large.size(), format, args);
+            va_end(args);
+            return write(reinterpret_cast<const uint8_t*>(large.data()), length);
+        }
+        return write(reinterpret_cast<const uint8_t*>(buffer), length);
+    }
+};
+
+// Serial output goes to stdout only when enabled, so benchmarks stay quiet
+class NativeSerial : public Print {
+public:
+    bool enabled = false;
+
+    void begin(unsigned long baud) {
+        (void)baud;
+    }
+
+    using Print::write;
+
+    size_t write(uint8_t c) override {
+        if (enabled) {
+            putchar(c);
+        }
+        return 1;
+    }
+};
+
+inline NativeSerial Serial;
+
+// Arduino String on top of std::string, enough for the headers and ArduinoJson
+class String {
+public:
+    String(const char* text = "") : value(text ? text : "") {}
+    String(const std::string& text) : value(text) {}
+    explicit String(int number) : value(std::to_string(number)) {}
+    explicit String(unsigned int number) : value(std::to_string(number)) {}
+    explicit String(long number) : value(std::to_string(number)) {}
+    explicit String(unsigned long number) : value(std::to_string(number)) {}
+
+    String& operator=(const char* text) {
+        value = text ? text : "";
+        return *this;
+    }
+
+    const char* c_str() const {
+        return value.c_str();
+    }
+
+    unsigned int length() const {
+        return value.size();
+    }
+
+    bool reserve(unsigned int size) {
+        value.reserve(size);
+        return true;
+    }
+
+    bool concat(const char* text) {
+        value += text;
+        return true;
+    }
+
+    bool concat(const char* text, unsigned int length) {
+        value.append(text, length);
+        return true;
+    }
+
+    bool concat(char c) {
+        value += c;
+        return true;
+    }
+
+    bool concat(const String& other) {
+        value += other.value;
+        return true;
+    }
+
+    String& operator+=(const String& other) {
+        value += other.value;
+        return *this;
+    }
+
+    String& operator+=(const char* text) {
+        value += text;
+        return *this;
+    }
+
+    String& operator+=(char c) {
+        value += c;
+        return *this;
+    }
+
+    int indexOf(const char* text) const {
+        size_t position = value.find(text);
+        return position == std::string::npos ? -1 : static_cast<int>(position);
+    }
+
+    String substring(unsigned int from, unsigned int to) const {
+        return String(value.substr(from, to - from));
+    }
+
+    void replace(const char* find, const char* replacement) {
+        size_t findLength = strlen(find);
+        if (findLength == 0) return;
+        for (size_t position = value.find(find); position != std::string::npos;
+             position = value.find(find, position + strlen(replacement))) {
+            value.replace(position, findLength, replacement);
+        }
+    }
+
+    char operator[](unsigned int index) const {
+        return index < value.size() ? value[index] : '\0';
+    }
+
+    bool operator==(const String& other) const {
+        return value == other.value;
+    }
+
+    bool operator==(const char* text) const {
+        return value == (text ? text : "");
+    }
+
+    bool operator!=(const String& other) const {
+        return !(*this == other);
+    }
+
+    bool operator!=(const char* text) const {
+        return !(*this == text);
+    }
+
+    friend String operator+(const String& left, const String& right) {
+        return String(left.value + right.value);
+    }
+
+private:
+    std::string value;
+};
+
+// ArduinoJson's String adapter names this type as well
+class StringSumHelper : public String {
+public:
+    using String::String;
+};
+
+#endif // NATIVE_ARDUINO_H
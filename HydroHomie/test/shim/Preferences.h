@@ -0,0 +1,81 @@
+#ifndef NATIVE_PREFERENCES_H
+#define NATIVE_PREFERENCES_H
+
+#include <Arduino.h>
+
+// In-memory Preferences on the NVS of native::device at the time of begin().
+// Every put counts as one NVS write and commit in the device's nvsWrites, so
+// benchmarks can show how much a code path writes.
+class Preferences {
+public:
+    bool begin(const char* name, bool readOnly = false, const char* partition = nullptr) {
+        (void)partition;
+        space = &native::device->nvs[name];
+        device = native::device;
+        this->readOnly = readOnly;
+        return true;
+    }
+
+    void end() {
+        space = nullptr;
+    }
+
+    bool remove(const char* key) {
+        return space && !readOnly && space->erase(key) > 0;
+    }
+
+    bool isKey(const char* key) {
+        return space && space->count(key) > 0;
+    }
+
+    size_t putInt(const char* key, int32_t value) {
+        return putBytes(key, &value, sizeof(value));
+    }
+
+    int32_t getInt(const char* key, int32_t defaultValue = 0) {
+        int32_t value = defaultValue;
+        return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+    }
+
+    size_t putString(const char* key, const String& value) {
+        return putBytes(key, value.c_str(), value.length() + 1);
+    }
+
+    String getString(const char* key, const String defaultValue = String()) {
+        if (!space || !space->count(key)) {
+            return defaultValue;
+        }
+        const std::vector<uint8_t>& bytes = (*space)[key];
+        return String(std::string(bytes.begin(), bytes.end()).c_str());
+    }
+
+    size_t putBytes(const char* key, const void* value, size_t length) {
+        if (!space || readOnly) {
+            return 0;
+        }
+        const uint8_t* bytes = static_cast<const uint8_t*>(value);
+        (*space)[key].assign(bytes, bytes + length);
+        device->nvsWrites++;
+        return length;
+    }
+
+    size_t getBytesLength(const char* key) {
+        return space && space->count(key) ? (*space)[key].size() : 0;
+    }
+
+    size_t getBytes(const char* key, void* buffer, size_t maxLength) {
+        size_t length = getBytesLength(key);
+        if (length == 0 || length > maxLength) {
+            return 0;
+        }
+        memcpy(buffer, (*space)[key].data(), length);
+        return length;
+    }
+
+private:
+    std::map<std::string, std::vector<uint8_t>>* space = nullptr;
+    native::Device* device = nullptr;
+    bool readOnly = false;
+};
+
+#endif // NATIVE_PREFERENCES_H
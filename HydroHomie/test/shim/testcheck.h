@@ -0,0 +1,23 @@
+#ifndef NATIVE_TESTCHECK_H
+#define NATIVE_TESTCHECK_H
+
+// Pass/fail reporting of the host tests in test/: one aligned line per check,
+// and main() returns testResult() so that CI fails on any FAILED line. Setup
+// errors that aren't a check of their own count through native::failures.
+
+#include <stdio.h>
+
+namespace native {
+inline int failures = 0;
+}
+
+inline void check(bool ok, const char* what) {
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    native::failures += !ok;
+}
+
+inline int testResult() {
+    return native::failures ? 1 : 0;
+}
+
+#endif // NATIVE_TESTCHECK_H
@@ -0,0 +1,182 @@
+// /history as streamed through the fixed chunk buffer, against reference JSON
+// built from a plain copy of the samples: the legacy and incremental formats
+// for an empty, short and full history, chunk sizes, a socket that fails
+// midway, and the heap the streaming takes. Allocations are counted through
+// the global operator new, which is what std::function, String and friends
+// would end up in.
+//
+//   stream
+
+#include <Arduino.h>
+#include <testcheck.h>
+#include <new>
+#include <string>
+#include <vector>
+#include "chunkedwriter.h"
+#include "historystream.h"
+#include "sensormanager.h"
+
+static const size_t CHUNK_SIZE = 512; // HTTP_CHUNK_SIZE of homieserver.h
+
+static size_t liveBytes = 0;
+static size_t peakBytes = 0;
+
+void* operator new(size_t size) {
+    size_t* block = static_cast<size_t*>(malloc(size + sizeof(size_t)));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    *block = size;
+    liveBytes += size;
+    peakBytes = max(peakBytes, liveBytes);
+    return block + 1;
+}
+
+void operator delete(void* pointer) noexcept {
+    if (pointer) {
+        size_t* block = static_cast<size_t*>(pointer) - 1;
+        liveBytes -= *block;
+        free(block);
+    }
+}
+
+void operator delete(void* pointer, size_t size) noexcept {
+    (void)size;
+    operator delete(pointer);
+}
+
+// What went out on the socket, chunk by chunk
+struct Socket {
+    std::string body;
+    std::vector<size_t> chunks;
+    size_t failAfter = SIZE_MAX; // Chunks accepted before the socket breaks
+    size_t counted = 0;          // What the writer's bytesWritten() claims went out
+};
+
+// Streams like HomieServer::streamResponse and returns the peak heap it took
+template <typename Fn>
+static size_t stream(Socket& socket, Fn write) {
+    socket.body.reserve(1 << 20); // The socket's memory is not the encoder's
+    socket.chunks.reserve(4096);
+    uint8_t buffer[CHUNK_SIZE];
+    const size_t before = liveBytes;
+    peakBytes = liveBytes;
+    {
+        ChunkedWriter out(buffer, sizeof(buffer), [&socket](const uint8_t* data, size_t length) {
+            if (socket.chunks.size() == socket.failAfter) {
+                return false;
+            }
+            socket.body.append(reinterpret_cast<const char*>(data), length);
+            socket.chunks.push_back(length);
+            return true;
+        });
+        write(out);
+        out.sendBuffered();
+        socket.counted = out.bytesWritten();
+    }
+    return peakBytes - before;
+}
+
+static std::string legacyReference(const std::vector<HistoryEntry>& samples) {
+    std::string json = "[";
+    for (const HistoryEntry& sample : samples) {
+        json += (json.size() > 1 ? ",[" : "[") + std::to_string(sample.plant) + "," + std::to_string(sample.tank) + "]";
+    }
+    return json + "]";
+}
+
+static std::string incrementalReference(const std::vector<HistoryEntry>& samples, uint32_t first, uint32_t since,
+                                        size_t limit) {
+    std::string json = "{\"first\":" + std::to_string(first) + ",\"history\":[";
+    uint32_t cursor = since;
+    size_t count = 0;
+    for (const HistoryEntry& sample : samples) {
+        if (sample.seq < since || count == limit) {
+            continue;
+        }
+        json += (count++ ? ",[" : "[") + std::to_string(sample.seq) + "," + std::to_string(sample.timestamp) + ","
+                + std::to_string(sample.plant) + "," + std::to_string(sample.tank) + "]";
+        cursor = sample.seq + 1;
+    }
+    return json + "],\"cursor\":" + std::to_string(cursor) + "}";
+}
+
+static bool chunked(const Socket& socket) {
+    for (size_t i = 0; i + 1 < socket.chunks.size(); i++) {
+        if (socket.chunks[i] != CHUNK_SIZE) {
+            return false;
+        }
+    }
+    return socket.chunks.empty() || socket.chunks.back() <= CHUNK_SIZE;
+}
+
+// Fills history with count one-minute samples and returns what it holds
+static std::vector<HistoryEntry> fill(SensorHistory& history, size_t count) {
+    history.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        history.push(800 - i / 1000, 700 - i % 2880 / 8 + (i % 5 == 0), 0, 1700000000 + i * 60);
+    }
+    std::vector<HistoryEntry> samples;
+    for (SensorHistory::const_iterator it = history.begin(); it != history.end(); ++it) {
+        samples.push_back(*it);
+    }
+    return samples;
+}
+
+static void testFormats() {
+    static SensorHistory history;
+    size_t peaks[4];
+    size_t lengths[4];
+    const size_t counts[4] = {0, 1, 1000, SensorHistory::capacity()};
+    for (int i = 0; i < 4; i++) {
+        const std::vector<HistoryEntry> samples = fill(history, counts[i]);
+        Socket legacy;
+        peaks[i] = stream(legacy, [](Print& out) { writeHistoryJson(out, history); });
+        lengths[i] = legacy.body.size();
+        const bool ok = legacy.body == legacyReference(samples) && chunked(legacy);
+
+        Socket page;
+        const uint32_t since = history.firstSeq() + samples.size() / 3;
+        uint32_t cursor = 0;
+        const size_t pagePeak = stream(page, [&](Print& out) { cursor = writeHistoryJson(out, history, since, 100); });
+        const bool pageOk = page.body == incrementalReference(samples, history.firstSeq(), since, 100)
+                            && cursor == min(since + 100, history.nextSeq()) && chunked(page) && pagePeak == peaks[i];
+
+        char what[80];
+        snprintf(what, sizeof(what), "legacy and incremental, %zu samples", samples.size());
+        check(ok && pageOk, what);
+        printf("  %zu bytes of JSON in %zu chunks, peak heap %zu bytes\n", lengths[i], legacy.chunks.size(), peaks[i]);
+    }
+    check(peaks[3] == peaks[0] && peaks[3] <= CHUNK_SIZE && lengths[3] > 100 * CHUNK_SIZE,
+          "peak heap the same for any history length");
+
+    // The full history rendered into one String first, as the handler did before
+    const size_t before = liveBytes;
+    peakBytes = liveBytes;
+    {
+        String body;
+        forEachHistoryEntry(history, history.firstSeq(), SIZE_MAX, [&body](const HistoryEntry& entry) {
+            body += String(entry.plant);
+            body += ',';
+        });
+    }
+    printf("  the same history buffered in a String: peak heap %zu bytes\n", peakBytes - before);
+    check(peakBytes - before > lengths[3] / 2, "the allocation count sees a buffered body");
+}
+
+// A client that goes away: the encoder finishes without writing anywhere
+static void testBrokenSocket() {
+    static SensorHistory history;
+    fill(history, 5000);
+    Socket socket;
+    socket.failAfter = 3;
+    stream(socket, [](Print& out) { writeHistoryJson(out, history); });
+    check(socket.chunks.size() == 3 && socket.body.size() == 3 * CHUNK_SIZE, "broken socket: output stops");
+    check(socket.counted == socket.body.size(), "broken socket: only bytes sent are counted");
+}
+
+int main() {
+    testFormats();
+    testBrokenSocket();
+    return testResult();
+}
@@ -0,0 +1,326 @@
+// The push telemetry end to end on loopback: a TelemetryPublisher on its own
+// thread sends to a UDP collector in this process, which goes offline, loses
+// acknowledgements and comes back, while records are queued. Every record has
+// to arrive exactly once, in order and intact, and a queue overrun has to cost
+// exactly the overflowing records.
+//
+//   telemetry [--mqtt HOST[:PORT]]
+//
+// With --mqtt the same records also go to a broker (e.g. a local mosquitto)
+// and are read back through a subscription.
+
+#include <Arduino.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "telemetrypublisher.h"
+
+using Wall = std::chrono::steady_clock;
+
+static const char* DEVICE_ID = "HydroHomie-test";
+
+// Records as received, by seq; repeats are counted, not stored
+struct Received {
+    std::mutex lock;
+    std::map<uint32_t, TelemetryRecord> records;
+    uint32_t repeats = 0;
+    uint32_t batches = 0;
+
+    // Stores a batch; returns the highest seq held
+    uint32_t add(const uint8_t* data, size_t length) {
+        TelemetryBatch batch;
+        TelemetryRecord decoded[UINT8_MAX];
+        std::lock_guard<std::mutex> guard(lock);
+        if (!decodeTelemetryBatch(data, length, batch, decoded, UINT8_MAX) || strcmp(batch.deviceId, DEVICE_ID)) {
+            fprintf(stderr, "malformed batch of %zu bytes\n", length);
+            return 0;
+        }
+        batches++;
+        for (size_t i = 0; i < batch.count; i++) {
+            if (!records.emplace(batch.firstSeq + i, decoded[i]).second) {
+                repeats++;
+            }
+        }
+        return records.empty() ? 0 : records.rbegin()->first;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return records.size();
+    }
+};
+
+// The loopback collector of Dummy/telemetry_collector.py
+class Collector {
+public:
+    enum Mode { ONLINE, OFFLINE, LOSE_ACKS };
+    std::atomic<int> mode{ONLINE};
+    Received received;
+
+    uint16_t begin() {
+        socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        socklen_t size = sizeof(address);
+        getsockname(socket, reinterpret_cast<sockaddr*>(&address), &size);
+        struct timeval timeout = {0, 100000};
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        thread = std::thread([this]() { run(); });
+        return ntohs(address.sin_port);
+    }
+
+    void end() {
+        running = false;
+        thread.join();
+        close(socket);
+    }
+
+private:
+    int socket = -1;
+    std::atomic<bool> running{true};
+    std::thread thread;
+
+    void run() {
+        uint8_t datagram[2048];
+        while (running) {
+            sockaddr_in from;
+            socklen_t size = sizeof(from);
+            const ssize_t length = recvfrom(socket, datagram, sizeof(datagram), 0, reinterpret_cast<sockaddr*>(&from), &size);
+            if (length <= 0 || mode == OFFLINE) {
+                continue;
+            }
+            const uint32_t highest = received.add(datagram, length);
+            if (mode == LOSE_ACKS) {
+                continue;
+            }
+            uint8_t ack[8];
+            telemetrywire::putU32(ack, telemetrywire::getU32(datagram + 2));
+            telemetrywire::putU32(ack + 4, highest);
+            sendto(socket, ack, sizeof(ack), 0, reinterpret_cast<sockaddr*>(&from), size);
+        }
+    }
+};
+
+// Subscribes to the device's topic with QoS 0 and stores what the broker forwards
+class MqttReader : public MqttTelemetry {
+public:
+    Received received;
+
+    bool begin(const TelemetrySettings& settings) {
+        TelemetrySettings reader = settings;
+        snprintf(reader.deviceId, sizeof(reader.deviceId), "%.24s-reader", settings.deviceId);
+        if (!MqttTelemetry::connect(reader)) {
+            return false;
+        }
+        char topic[64];
+        const size_t topicLength = snprintf(topic, sizeof(topic), "hydrohomie/%s/telemetry", settings.deviceId);
+        uint8_t packet[80] = {0x82, static_cast<uint8_t>(2 + 2 + topicLength + 1), 0, 1, 0, static_cast<uint8_t>(topicLength)};
+        memcpy(packet + 6, topic, topicLength);
+        packet[6 + topicLength] = 0; // QoS 0
+        uint8_t suback[5];
+        if (!sendAll(packet, 7 + topicLength) || !receiveAll(suback, sizeof(suback)) || suback[0] != 0x90) {
+            return false;
+        }
+        thread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    void end() {
+        running = false;
+        thread.join();
+        close();
+    }
+
+private:
+    std::atomic<bool> running{true};
+    std::thread thread;
+
+    void run() {
+        std::vector<uint8_t> body;
+        while (running) {
+            uint8_t fixed;
+            if (!receiveAll(&fixed, 1)) {
+                continue; // Receive timeout
+            }
+            size_t remaining = 0;
+            for (int shift = 0;; shift += 7) {
+                uint8_t byte;
+                receiveAll(&byte, 1);
+                remaining |= static_cast<size_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            body.resize(remaining);
+            if (!receiveAll(body.data(), remaining) || (fixed & 0xF0) != 0x30 || remaining < 2) {
+                continue;
+            }
+            const size_t topicLength = body[0] << 8 | body[1];
+            const size_t header = 2 + topicLength + ((fixed & 0x06) ? 2 : 0);
+            received.add(body.data() + header, remaining - header);
+        }
+    }
+};
+
+static TelemetryRecord makeRecord(uint32_t seq) {
+    TelemetryRecord record = {};
+    record.timestamp = 1700000000 + seq * 10;
+    record.kind = seq % 7 == 0 ? TELEMETRY_PUMP : TELEMETRY_SAMPLE;
+    record.plant = 0;
+    record.on = seq % 14 == 0;
+    for (size_t i = 0; i < TelemetryRecord::CHANNELS; i++) {
+        record.levels[i] = static_cast<int16_t>((seq * 37 + i * 101) % (LEVEL_FULL + 1));
+    }
+    return record;
+}
+
+static uint32_t pushed = 0;
+
+static void push(TelemetryQueue& queue, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const TelemetryRecord record = makeRecord(++pushed);
+        int levels[TelemetryRecord::CHANNELS];
+        for (size_t c = 0; c < TelemetryRecord::CHANNELS; c++) {
+            levels[c] = record.levels[c];
+        }
+        queue.push(static_cast<TelemetryKind>(record.kind), record.plant, record.on, levels, record.timestamp);
+    }
+}
+
+// Waits until nothing is queued or timeoutMs passed
+static bool drain(const TelemetryPublisher& publisher, unsigned long timeoutMs) {
+    const Wall::time_point start = Wall::now();
+    while (publisher.getStats().queued > 0) {
+        if (Wall::now() - start > std::chrono::milliseconds(timeoutMs)) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+// Every seq pushed from first on except the lost ones, each intact
+static int verify(const char* name, Received& received, uint32_t first, uint32_t lostFrom, uint32_t lostTo) {
+    std::lock_guard<std::mutex> guard(received.lock);
+    int errors = 0;
+    for (uint32_t seq = first; seq <= pushed; seq++) {
+        const bool lost = seq >= lostFrom && seq <= lostTo;
+        auto found = received.records.find(seq);
+        if (lost != (found == received.records.end())) {
+            if (errors++ < 5) {
+                fprintf(stderr, "%s: seq %u %s\n", name, seq, lost ? "should have been dropped" : "missing");
+            }
+            continue;
+        }
+        const TelemetryRecord expected = makeRecord(seq);
+        if (!lost && (found->second.timestamp != expected.timestamp || found->second.kind != expected.kind
+                      || found->second.on != expected.on
+                      || memcmp(found->second.levels, expected.levels, sizeof(expected.levels)))) {
+            if (errors++ < 5) {
+                fprintf(stderr, "%s: seq %u differs\n", name, seq);
+            }
+        }
+    }
+    printf("%-5s %zu records in %u batches, %u repeats\n", name, received.records.size(), received.batches,
+           received.repeats);
+    return errors;
+}
+
+int main(int argc, char** argv) {
+    const char* mqttHost = nullptr;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--mqtt")) mqttHost = argv[i + 1];
+    }
+
+    Collector collector;
+    TelemetrySettings settings;
+    settings.mode = TELEMETRY_UDP;
+    strcpy(settings.host, "127.0.0.1");
+    settings.port = collector.begin();
+    settings.flushIntervalMs = 200;
+    settings.batch = 16;
+    strcpy(settings.deviceId, DEVICE_ID);
+
+    TelemetryQueue queue;
+    TelemetryPublisher publisher;
+    publisher.configure(settings);
+    publisher.begin(queue);
+    int failures = 0;
+    auto check = [&](bool ok, const char* what) {
+        if (!ok) {
+            fprintf(stderr, "%s\n", what);
+            failures++;
+        }
+    };
+
+    // Online: batches of 16, and the last few after the flush interval
+    push(queue, 200);
+    check(drain(publisher, 5000), "online: not delivered");
+
+    // Offline: held in the queue and retried with backoff
+    collector.mode = Collector::OFFLINE;
+    push(queue, 300);
+    std::this_thread::sleep_for(std::chrono::milliseconds(TELEMETRY_TIMEOUT_MS + 500));
+    check(publisher.getStats().failures > 0, "offline: no failure counted");
+    check(publisher.getStats().queued == 300, "offline: records left the queue");
+    collector.mode = Collector::ONLINE;
+    check(drain(publisher, 2 * TELEMETRY_TIMEOUT_MS + TELEMETRY_RETRY_MIN_MS * 4), "offline: backlog not delivered");
+
+    // Acknowledgements lost: the batch is resent, and the repeats are skipped
+    collector.mode = Collector::LOSE_ACKS;
+    push(queue, 16);
+    std::this_thread::sleep_for(std::chrono::milliseconds(TELEMETRY_TIMEOUT_MS + 500));
+    collector.mode = Collector::ONLINE;
+    check(drain(publisher, 2 * TELEMETRY_TIMEOUT_MS + TELEMETRY_RETRY_MIN_MS * 4), "lost acks: not delivered");
+    check(collector.received.repeats > 0, "lost acks: nothing resent");
+
+    // Overrun while offline: the oldest records make room
+    collector.mode = Collector::OFFLINE;
+    const uint32_t droppedBefore = publisher.getStats().dropped;
+    const uint32_t overrunFrom = pushed + 1;
+    push(queue, TELEMETRY_QUEUE_LENGTH + 100);
+    check(publisher.getStats().dropped - droppedBefore == 100, "overrun: not exactly the overflow dropped");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500)); // The batch sent before the overrun is lost too
+    collector.mode = Collector::ONLINE;
+    check(drain(publisher, 4 * TELEMETRY_TIMEOUT_MS + TELEMETRY_RETRY_MAX_MS), "overrun: backlog not delivered");
+
+    const TelemetryStats stats = publisher.getStats();
+    failures += verify("udp", collector.received, 1, overrunFrom, overrunFrom + 99);
+    printf("      %u acked, %u dropped, %u failures, %.1f bytes per record\n", stats.acked, stats.dropped,
+           stats.failures, static_cast<double>(stats.bytes) / stats.acked);
+
+    if (mqttHost) {
+        // The same records once more, through the broker
+        TelemetrySettings mqtt = settings;
+        mqtt.mode = TELEMETRY_MQTT;
+        snprintf(mqtt.host, sizeof(mqtt.host), "%s", mqttHost);
+        char* port = strchr(mqtt.host, ':');
+        mqtt.port = port ? atoi(port + 1) : 0;
+        if (port) {
+            *port = '\0';
+        }
+        MqttReader reader;
+        if (!reader.begin(mqtt)) {
+            fprintf(stderr, "mqtt: cannot subscribe at %s\n", mqttHost);
+            failures++;
+        } else {
+            publisher.configure(mqtt);
+            const uint32_t first = pushed + 1;
+            push(queue, 500);
+            check(drain(publisher, 10000), "mqtt: not delivered");
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            reader.end();
+            failures += verify("mqtt", reader.received, first, 1, 0);
+        }
+    }
+
+    publisher.end();
+    collector.end();
+    return failures ? 1 : 0;
+}